@@ -1,7 +1,7 @@
 /* $Id: asyncsendto.c,v 1.12 2020/11/11 12:13:26 nanard Exp $ */
 /* MiniUPnP project
  * http://miniupnp.free.fr/ or http://miniupnp.tuxfamily.org/
- * (c) 2006-2020 Thomas Bernard
+ * (c) 2006-2026 Thomas Bernard
  * This software is subject to the conditions detailed
  * in the LICENCE file provided within the distribution */
 
@@ -9,7 +9,6 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
-#include <sys/queue.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -22,7 +21,7 @@
 #include "asyncsendto.h"
 #include "upnputils.h"
 
-enum send_state {ESCHEDULED=1, EWAITREADY=2, ESENDNOW=3} state;
+enum send_state {ESCHEDULED=1, EWAITREADY=2, ESENDNOW=3};
 
 /* state diagram for a packet :
  *
@@ -32,11 +31,18 @@ enum send_state {ESCHEDULED=1, EWAITREADY=2, ESENDNOW=3} state;
  *                    ^  |
  *                    |  V
  *                EWAITREADY -> sent
+ *
+ * ESCHEDULED packets are kept in a binary min-heap ordered by send time,
+ * ESENDNOW packets in a FIFO and EWAITREADY packets in one FIFO per
+ * socket waiting to be writable. So scheduling and picking the packets
+ * to send are O(log n) instead of walking the whole queue.
  */
 struct scheduled_send {
-	LIST_ENTRY(scheduled_send) entries;
+	struct scheduled_send * next;	/* FIFO or free slots list */
 	struct timeval ts;
+	unsigned int seq;	/* keep the scheduling order for equal ts */
 	enum send_state state;
+	int from_slab;
 	int sockfd;
 	const void * buf;
 	size_t len;
@@ -47,7 +53,271 @@ struct scheduled_send {
 	char data[];
 };
 
-static LIST_HEAD(listhead, scheduled_send) send_list = { NULL };
+/* ESCHEDULED packets */
+static struct scheduled_send * * heap = NULL;
+static int heap_len = 0;
+static int heap_size = 0;
+static unsigned int heap_seq = 0;
+
+/* ESENDNOW packets */
+static struct scheduled_send * ready_first = NULL;
+static struct scheduled_send * * ready_last = &ready_first;
+static int ready_count = 0;
+
+/* EWAITREADY packets, by socket */
+struct waiting_socket {
+	int sockfd;
+	struct scheduled_send * first;
+	struct scheduled_send * * last;
+};
+static struct waiting_socket * waiting = NULL;
+static int waiting_count = 0;	/* sockets */
+static int waiting_size = 0;
+static int waiting_packets = 0;
+
+/* packets are allocated from slabs of fixed size slots.
+ * A slot is large enough for a SSDP or PCP packet and its addresses.
+ * Larger packets, or packets queued once all the slabs are used,
+ * are allocated with malloc() */
+#define SEND_SLOT_DATA_LEN	(1280)
+#define SEND_SLOT_SIZE	((sizeof(struct scheduled_send) + SEND_SLOT_DATA_LEN + 15) & ~(size_t)15)
+#define SEND_SLAB_SLOTS	(32)
+#define SEND_SLAB_MAX	(32)
+
+static char * slabs[SEND_SLAB_MAX];
+static int slab_count = 0;
+static struct scheduled_send * free_slots = NULL;
+
+static struct scheduled_send *
+alloc_send(size_t data_len)
+{
+	struct scheduled_send * elt;
+	size_t alloc_len;
+	int i;
+
+	if(data_len <= SEND_SLOT_DATA_LEN) {
+		if(free_slots == NULL && slab_count < SEND_SLAB_MAX) {
+			char * slab = malloc(SEND_SLAB_SLOTS * SEND_SLOT_SIZE);
+			if(slab != NULL) {
+				slabs[slab_count++] = slab;
+				for(i = SEND_SLAB_SLOTS - 1; i >= 0; i--) {
+					elt = (struct scheduled_send *)(slab + i * SEND_SLOT_SIZE);
+					elt->next = free_slots;
+					free_slots = elt;
+				}
+			}
+		}
+		if(free_slots != NULL) {
+			elt = free_slots;
+			free_slots = elt->next;
+			elt->from_slab = 1;
+			return elt;
+		}
+	}
+	alloc_len = sizeof(struct scheduled_send) + data_len;
+	elt = malloc(alloc_len);
+	if(elt == NULL) {
+		syslog(LOG_ERR, "malloc failed to allocate %u bytes",
+		       (unsigned)alloc_len);
+		return NULL;
+	}
+	elt->from_slab = 0;
+	return elt;
+}
+
+static void
+free_send(struct scheduled_send * elt)
+{
+	if(elt->from_slab) {
+		elt->next = free_slots;
+		free_slots = elt;
+	} else {
+		free(elt);
+	}
+}
+
+/* is a to be sent before b ? */
+static int
+send_before(const struct scheduled_send * a, const struct scheduled_send * b)
+{
+	if(a->ts.tv_sec != b->ts.tv_sec)
+		return a->ts.tv_sec < b->ts.tv_sec;
+	if(a->ts.tv_usec != b->ts.tv_usec)
+		return a->ts.tv_usec < b->ts.tv_usec;
+	return (int)(a->seq - b->seq) < 0;
+}
+
+static int
+heap_push(struct scheduled_send * elt)
+{
+	int i, parent;
+
+	if(heap_len >= heap_size) {
+		int new_size = (heap_size > 0) ? heap_size * 2 : 64;
+		struct scheduled_send * * tmp;
+		tmp = realloc(heap, new_size * sizeof(struct scheduled_send *));
+		if(tmp == NULL) {
+			syslog(LOG_ERR, "realloc failed to allocate %u bytes",
+			       (unsigned)(new_size * sizeof(struct scheduled_send *)));
+			return -1;
+		}
+		heap = tmp;
+		heap_size = new_size;
+	}
+	elt->state = ESCHEDULED;
+	elt->seq = heap_seq++;
+	/* sift up */
+	for(i = heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if(!send_before(elt, heap[parent]))
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = elt;
+	return 0;
+}
+
+static struct scheduled_send *
+heap_pop(void)
+{
+	struct scheduled_send * top;
+	struct scheduled_send * last;
+	int i, child;
+
+	if(heap_len == 0)
+		return NULL;
+	top = heap[0];
+	last = heap[--heap_len];
+	/* sift down */
+	for(i = 0; (child = 2 * i + 1) < heap_len; i = child) {
+		if(child + 1 < heap_len && send_before(heap[child + 1], heap[child]))
+			child++;
+		if(!send_before(heap[child], last))
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+	return top;
+}
+
+static void
+ready_append(struct scheduled_send * elt)
+{
+	elt->state = ESENDNOW;
+	elt->next = NULL;
+	*ready_last = elt;
+	ready_last = &elt->next;
+	ready_count++;
+}
+
+static int
+waiting_find(int sockfd)
+{
+	int i;
+	for(i = 0; i < waiting_count; i++) {
+		if(waiting[i].sockfd == sockfd)
+			return i;
+	}
+	return -1;
+}
+
+/* queue the packet until its socket is writable.
+ * the packet is freed in case of error */
+static int
+waiting_append(struct scheduled_send * elt)
+{
+	int i;
+
+	i = waiting_find(elt->sockfd);
+	if(i < 0) {
+		if(waiting_count >= waiting_size) {
+			int new_size = (waiting_size > 0) ? waiting_size * 2 : 8;
+			struct waiting_socket * tmp;
+			tmp = realloc(waiting, new_size * sizeof(struct waiting_socket));
+			if(tmp == NULL) {
+				syslog(LOG_ERR, "realloc failed to allocate %u bytes",
+				       (unsigned)(new_size * sizeof(struct waiting_socket)));
+				free_send(elt);
+				return -1;
+			}
+			waiting = tmp;
+			waiting_size = new_size;
+		}
+		i = waiting_count++;
+		waiting[i].sockfd = elt->sockfd;
+		waiting[i].first = NULL;
+		waiting[i].last = &waiting[i].first;
+	}
+	elt->state = EWAITREADY;
+	elt->next = NULL;
+	*waiting[i].last = elt;
+	waiting[i].last = &elt->next;
+	waiting_packets++;
+	return 0;
+}
+
+/* remove the socket from the waiting set and return its packets */
+static struct scheduled_send *
+waiting_remove(int i)
+{
+	struct scheduled_send * list;
+	struct scheduled_send * elt;
+
+	list = waiting[i].first;
+	for(elt = list; elt != NULL; elt = elt->next)
+		waiting_packets--;
+	waiting_count--;
+	if(i < waiting_count) {
+		waiting[i] = waiting[waiting_count];
+		if(waiting[i].first == NULL)
+			waiting[i].last = &waiting[i].first;
+	}
+	return list;
+}
+
+#if defined(IPV6_PKTINFO) || defined(HAVE_SENDMMSG)
+#ifdef IPV6_PKTINFO
+#define PKTINFO_CMSG_SPACE	CMSG_SPACE(sizeof(struct in6_pktinfo))
+#else
+#define PKTINFO_CMSG_SPACE	1
+#endif
+
+/* prepare msg for sendmsg()/sendmmsg().
+ * When src_addr is not NULL, the IPV6_PKTINFO control message
+ * is written in control (PKTINFO_CMSG_SPACE bytes) */
+static void
+fill_msghdr(struct msghdr * msg, struct iovec * iov, uint8_t * control,
+            const void *buf, size_t len,
+            const struct sockaddr_in6 *src_addr,
+            const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	iov->iov_base = (void *)buf;
+	iov->iov_len = len;
+	memset(msg, 0, sizeof(struct msghdr));
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_name = (void *)dest_addr;
+	msg->msg_namelen = addrlen;
+#ifdef IPV6_PKTINFO
+	if(src_addr) {
+		struct in6_pktinfo ipi6;
+		struct cmsghdr* cmsg;
+
+		ipi6.ipi6_addr = src_addr->sin6_addr;
+		ipi6.ipi6_ifindex = src_addr->sin6_scope_id;
+		msg->msg_control = control;
+		msg->msg_controllen = PKTINFO_CMSG_SPACE;
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(ipi6));
+		memcpy(CMSG_DATA(cmsg), &ipi6, sizeof(ipi6));
+	}
+#else
+	(void)control; (void)src_addr;
+#endif /* IPV6_PKTINFO */
+}
+#endif /* defined(IPV6_PKTINFO) || defined(HAVE_SENDMMSG) */
 
 /*
  * ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
@@ -61,27 +331,10 @@ send_from_to(int sockfd, const void *buf, size_t len, int flags,
 #ifdef IPV6_PKTINFO
 	if(src_addr) {
 		struct iovec iov;
-		struct in6_pktinfo ipi6;
-		uint8_t c[CMSG_SPACE(sizeof(ipi6))];
+		uint8_t c[PKTINFO_CMSG_SPACE];
 		struct msghdr msg;
-		struct cmsghdr* cmsg;
 
-		iov.iov_base = (void *)buf;
-		iov.iov_len = len;
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_iov = &iov;
-		msg.msg_iovlen = 1;
-		ipi6.ipi6_addr = src_addr->sin6_addr;
-		ipi6.ipi6_ifindex = src_addr->sin6_scope_id;
-		msg.msg_control = c;
-		msg.msg_controllen = sizeof(c);
-		cmsg = CMSG_FIRSTHDR(&msg);
-		cmsg->cmsg_level = IPPROTO_IPV6;
-		cmsg->cmsg_type = IPV6_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(ipi6));
-		memcpy(CMSG_DATA(cmsg), &ipi6, sizeof(ipi6));
-		msg.msg_name = (void *)dest_addr;
-		msg.msg_namelen = addrlen;
+		fill_msghdr(&msg, &iov, c, buf, len, src_addr, dest_addr, addrlen);
 		return sendmsg(sockfd, &msg, flags);
 	} else {
 #endif /* IPV6_PKTINFO */
@@ -100,23 +353,28 @@ sendto_schedule2(int sockfd, const void *buf, size_t len, int flags,
 {
 	enum send_state state;
 	ssize_t n;
-	size_t alloc_len;
+	size_t data_len;
 	struct timeval tv;
 	struct scheduled_send * elt;
 
 	if(delay == 0) {
-		/* first try to send at once */
-		n = send_from_to(sockfd, buf, len, flags, src_addr, dest_addr, addrlen);
-		if(n >= 0)
-			return n;
-		else if(errno == EAGAIN || errno == EWOULDBLOCK) {
-			/* use select() on this socket */
+		/* first try to send at once, unless packets are already
+		 * waiting for this socket to be writable */
+		if(waiting_find(sockfd) >= 0) {
 			state = EWAITREADY;
-		} else if(errno == EINTR) {
-			state = ESENDNOW;
 		} else {
-			/* uncatched error */
-			return n;
+			n = send_from_to(sockfd, buf, len, flags, src_addr, dest_addr, addrlen);
+			if(n >= 0)
+				return n;
+			else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* use select() on this socket */
+				state = EWAITREADY;
+			} else if(errno == EINTR) {
+				state = ESENDNOW;
+			} else {
+				/* uncatched error */
+				return n;
+			}
 		}
 	} else {
 		state = ESCHEDULED;
@@ -127,20 +385,16 @@ sendto_schedule2(int sockfd, const void *buf, size_t len, int flags,
 		return -1;
 	}
 	/* allocate enough space for structure + buffers */
-	alloc_len = sizeof(struct scheduled_send) + len + addrlen;
+	data_len = len + addrlen;
 	if(src_addr)
-		alloc_len += sizeof(struct sockaddr_in6);
-	elt = malloc(alloc_len);
-	if(elt == NULL) {
-		syslog(LOG_ERR, "malloc failed to allocate %u bytes",
-		       (unsigned)alloc_len);
+		data_len += sizeof(struct sockaddr_in6);
+	elt = alloc_send(data_len);
+	if(elt == NULL)
 		return -1;
-	}
-	elt->state = state;
 	/* time the packet should be sent */
 	elt->ts.tv_sec = tv.tv_sec + (delay / 1000);
 	elt->ts.tv_usec = tv.tv_usec + (delay % 1000) * 1000;
-	if(elt->ts.tv_usec > 1000000) {
+	if(elt->ts.tv_usec >= 1000000) {
 		elt->ts.tv_sec++;
 		elt->ts.tv_usec -= 1000000;
 	}
@@ -160,7 +414,21 @@ sendto_schedule2(int sockfd, const void *buf, size_t len, int flags,
 	elt->len = len;
 	memcpy((void *)elt->buf, buf, len);
 	/* insert */
-	LIST_INSERT_HEAD( &send_list, elt, entries);
+	switch(state) {
+	case ESCHEDULED:
+		if(heap_push(elt) < 0) {
+			free_send(elt);
+			return -1;
+		}
+		break;
+	case EWAITREADY:
+		if(waiting_append(elt) < 0)
+			return -1;
+		break;
+	case ESENDNOW:
+		ready_append(elt);
+		break;
+	}
 	return 0;
 }
 
@@ -183,92 +451,235 @@ sendto_or_schedule2(int sockfd, const void *buf, size_t len, int flags,
 /* get_next_scheduled_send() return number of scheduled send in list */
 int get_next_scheduled_send(struct timeval * next_send)
 {
-	int n = 0;
-	struct scheduled_send * elt;
+	const struct scheduled_send * elt;
 	if(next_send == NULL)
 		return -1;
-	for(elt = send_list.lh_first; elt != NULL; elt = elt->entries.le_next) {
-		if(n == 0 || (elt->ts.tv_sec < next_send->tv_sec) ||
-		   (elt->ts.tv_sec == next_send->tv_sec && elt->ts.tv_usec < next_send->tv_usec)) {
-			next_send->tv_sec = elt->ts.tv_sec;
-			next_send->tv_usec = elt->ts.tv_usec;
-		}
-		n++;
-	}
-	return n;
+	/* packets waiting for their socket are only considered when
+	 * there is nothing else : their socket is in writefds */
+	if(ready_first != NULL)
+		elt = ready_first;
+	else if(heap_len > 0)
+		elt = heap[0];
+	else if(waiting_count > 0)
+		elt = waiting[0].first;
+	else
+		return 0;
+	next_send->tv_sec = elt->ts.tv_sec;
+	next_send->tv_usec = elt->ts.tv_usec;
+	return heap_len + ready_count + waiting_packets;
 }
 
 /* update writefds for select() call
  * return the number of packets to try to send at once */
 int get_sendto_fds(fd_set * writefds, int * max_fd, const struct timeval * now)
 {
-	int n = 0;
+	int i;
 	struct scheduled_send * elt;
-	for(elt = send_list.lh_first; elt != NULL; elt = elt->entries.le_next) {
-		if(elt->state == EWAITREADY) {
-			/* last sendto() call returned EAGAIN/EWOULDBLOCK */
-			FD_SET(elt->sockfd, writefds);
-			if(elt->sockfd > *max_fd)
-				*max_fd = elt->sockfd;
-			n++;
-		} else if((elt->ts.tv_sec < now->tv_sec) ||
-		          (elt->ts.tv_sec == now->tv_sec && elt->ts.tv_usec <= now->tv_usec)) {
-			/* we waited long enough, now send ! */
-			elt->state = ESENDNOW;
-			n++;
+
+	while(heap_len > 0) {
+		elt = heap[0];
+		if((elt->ts.tv_sec > now->tv_sec) ||
+		   (elt->ts.tv_sec == now->tv_sec && elt->ts.tv_usec > now->tv_usec))
+			break;
+		/* we waited long enough, now send ! */
+		ready_append(heap_pop());
+	}
+	for(i = 0; i < waiting_count; i++) {
+		/* last sendto() call returned EAGAIN/EWOULDBLOCK */
+		FD_SET(waiting[i].sockfd, writefds);
+		if(waiting[i].sockfd > *max_fd)
+			*max_fd = waiting[i].sockfd;
+	}
+	return ready_count;
+}
+
+/* process the result of the sendto() of a queued packet.
+ * The packet is freed, unless it has to be sent again.
+ * return -1 in case of an uncatched error, 0 otherwise */
+static int
+sent_or_retry(struct scheduled_send * elt, ssize_t n)
+{
+	if(n < 0) {
+		if(errno == EINTR) {
+			/* retry at once */
+			ready_append(elt);
+			return 0;
+		} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			/* retry once the socket is ready for writing */
+			waiting_append(elt);
+			return 0;
+		} else {
+			char addr_str[64];
+			/* uncatched error */
+			if(sockaddr_to_string(elt->dest_addr, addr_str, sizeof(addr_str)) <= 0)
+				addr_str[0] = '\0';
+			syslog(LOG_ERR, "%s(sock=%d, len=%u, dest=%s): sendto: %m",
+			       "try_sendto", elt->sockfd, (unsigned)elt->len,
+			       addr_str);
 		}
+	} else if((int)n != (int)elt->len) {
+		syslog(LOG_WARNING, "%s: %d bytes sent out of %d",
+		       "try_sendto", (int)n, (int)elt->len);
 	}
-	return n;
+	free_send(elt);
+	return (n < 0) ? -1 : 0;
 }
 
-/* executed sendto() when needed */
-int try_sendto(fd_set * writefds)
+#ifdef HAVE_SENDMMSG
+/* maximum number of packets sent with one sendmmsg() call */
+#define SENDMMSG_BATCH	(32)
+
+/* send packets queued for the same socket, with the same flags,
+ * using sendmmsg().
+ * return the number of uncatched errors */
+static int
+send_batch(struct scheduled_send * * batch, int count)
 {
-	int ret = 0;
-	ssize_t n;
+	struct mmsghdr msgs[SENDMMSG_BATCH];
+	struct iovec iovs[SENDMMSG_BATCH];
+	uint8_t controls[SENDMMSG_BATCH][PKTINFO_CMSG_SPACE];
+	int i, k, r;
+	int errors = 0;
+
+	for(i = 0; i < count; i++) {
+		fill_msghdr(&msgs[i].msg_hdr, &iovs[i], controls[i],
+		            batch[i]->buf, batch[i]->len, batch[i]->src_addr,
+		            batch[i]->dest_addr, batch[i]->addrlen);
+		msgs[i].msg_len = 0;
+	}
+	i = 0;
+	while(i < count) {
+		r = sendmmsg(batch[i]->sockfd, msgs + i, count - i, batch[i]->flags);
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* socket buffer full : wait for the socket to be writable */
+			for(; i < count; i++)
+				waiting_append(batch[i]);
+			break;
+		} else if(r <= 0) {
+			/* the error is for the first packet */
+			if(sent_or_retry(batch[i], -1) < 0)
+				errors++;
+			i++;
+			continue;
+		}
+		for(k = 0; k < r; k++, i++)
+			sent_or_retry(batch[i], (ssize_t)msgs[i].msg_len);
+	}
+	return errors;
+}
+#endif /* HAVE_SENDMMSG */
+
+/* send the packets of the list, in order.
+ * Packets for a socket which is waiting to be writable
+ * are queued after the packets already waiting.
+ * With sendmmsg(), consecutive packets of the list for the same
+ * socket are sent with one system call.
+ * return the number of uncatched errors */
+static int
+send_packets(struct scheduled_send * list)
+{
+	int errors = 0;
 	struct scheduled_send * elt;
-	struct scheduled_send * next;
-	for(elt = send_list.lh_first; elt != NULL; elt = next) {
-		next = elt->entries.le_next;
-		if((elt->state == ESENDNOW) ||
-		   (elt->state == EWAITREADY && FD_ISSET(elt->sockfd, writefds))) {
+#ifdef HAVE_SENDMMSG
+	struct scheduled_send * batch[SENDMMSG_BATCH];
+	int count = 0;
+#else
+	ssize_t n;
+#endif /* HAVE_SENDMMSG */
+
+	while((elt = list) != NULL) {
+		list = elt->next;
+		elt->next = NULL;
+#ifdef HAVE_SENDMMSG
+		if(count > 0 && (count >= SENDMMSG_BATCH ||
+		                 batch[0]->sockfd != elt->sockfd ||
+		                 batch[0]->flags != elt->flags)) {
+			errors += send_batch(batch, count);
+			count = 0;
+		}
+#endif /* HAVE_SENDMMSG */
+		if(waiting_find(elt->sockfd) >= 0) {
+			waiting_append(elt);
+			continue;
+		}
 #ifdef DEBUG
-			syslog(LOG_DEBUG, "%s: %d bytes on socket %d",
-			       "try_sendto", (int)elt->len, elt->sockfd);
+		syslog(LOG_DEBUG, "%s: %d bytes on socket %d",
+		       "try_sendto", (int)elt->len, elt->sockfd);
 #endif
-			n = send_from_to(elt->sockfd, elt->buf, elt->len, elt->flags,
-			                 elt->src_addr, elt->dest_addr, elt->addrlen);
-			/*n = sendto(elt->sockfd, elt->buf, elt->len, elt->flags,
-			           elt->dest_addr, elt->addrlen);*/
-			if(n < 0) {
-				if(errno == EINTR) {
-					/* retry at once */
-					elt->state = ESENDNOW;
-					continue;
-				} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
-					/* retry once the socket is ready for writing */
-					elt->state = EWAITREADY;
-					continue;
-				} else {
-					char addr_str[64];
-					/* uncatched error */
-					if(sockaddr_to_string(elt->dest_addr, addr_str, sizeof(addr_str)) <= 0)
-						addr_str[0] = '\0';
-					syslog(LOG_ERR, "%s(sock=%d, len=%u, dest=%s): sendto: %m",
-					       "try_sendto", elt->sockfd, (unsigned)elt->len,
-					       addr_str);
-					ret--;
-				}
-			} else if((int)n != (int)elt->len) {
-				syslog(LOG_WARNING, "%s: %d bytes sent out of %d",
-				       "try_sendto", (int)n, (int)elt->len);
-			}
-			/* remove from the list */
-			LIST_REMOVE(elt, entries);
-			free(elt);
+#ifdef HAVE_SENDMMSG
+		batch[count++] = elt;
+#else /* HAVE_SENDMMSG */
+		n = send_from_to(elt->sockfd, elt->buf, elt->len, elt->flags,
+		                 elt->src_addr, elt->dest_addr, elt->addrlen);
+		if(sent_or_retry(elt, n) < 0)
+			errors++;
+#endif /* HAVE_SENDMMSG */
+	}
+#ifdef HAVE_SENDMMSG
+	if(count > 0)
+		errors += send_batch(batch, count);
+#endif /* HAVE_SENDMMSG */
+	return errors;
+}
+
+/* executed sendto() when needed */
+int try_sendto(fd_set * writefds)
+{
+	int i;
+	struct scheduled_send * list = NULL;
+	struct scheduled_send * * last = &list;
+
+	/* packets waiting for a socket which is now writable */
+	for(i = 0; i < waiting_count; ) {
+		if(FD_ISSET(waiting[i].sockfd, writefds)) {
+			*last = waiting[i].first;
+			last = waiting[i].last;
+			waiting_remove(i);
+		} else {
+			i++;
 		}
 	}
-	return ret;
+	/* packets which are due */
+	*last = ready_first;
+	ready_first = NULL;
+	ready_last = &ready_first;
+	ready_count = 0;
+	return -send_packets(list);
+}
+
+/* free all the queued packets and the memory used by the queues */
+static void
+free_all(void)
+{
+	struct scheduled_send * elt;
+	int i;
+
+	while((elt = heap_pop()) != NULL)
+		free_send(elt);
+	while((elt = ready_first) != NULL) {
+		ready_first = elt->next;
+		free_send(elt);
+	}
+	ready_last = &ready_first;
+	ready_count = 0;
+	while(waiting_count > 0) {
+		elt = waiting_remove(waiting_count - 1);
+		while(elt != NULL) {
+			struct scheduled_send * next = elt->next;
+			free_send(elt);
+			elt = next;
+		}
+	}
+	free(heap);
+	heap = NULL;
+	heap_size = 0;
+	free(waiting);
+	waiting = NULL;
+	waiting_size = 0;
+	free_slots = NULL;
+	for(i = 0; i < slab_count; i++)
+		free(slabs[i]);
+	slab_count = 0;
 }
 
 /* maximum execution time for finalize_sendto() in milliseconds */
@@ -277,9 +688,7 @@ int try_sendto(fd_set * writefds)
 /* empty the list */
 void finalize_sendto(void)
 {
-	ssize_t n;
-	struct scheduled_send * elt;
-	struct scheduled_send * next;
+	int i;
 	fd_set writefds;
 	struct timeval deadline;
 	struct timeval now;
@@ -288,50 +697,37 @@ void finalize_sendto(void)
 
 	if(upnp_gettimeofday(&deadline) < 0) {
 		syslog(LOG_ERR, "gettimeofday: %m");
+		free_all();
 		return;
 	}
 	deadline.tv_usec += FINALIZE_SENDTO_DELAY*1000;
-	if(deadline.tv_usec > 1000000) {
+	if(deadline.tv_usec >= 1000000) {
 		deadline.tv_sec++;
 		deadline.tv_usec -= 1000000;
 	}
-	while(send_list.lh_first) {
-		FD_ZERO(&writefds);
-		max_fd = -1;
-		for(elt = send_list.lh_first; elt != NULL; elt = next) {
-			next = elt->entries.le_next;
-			syslog(LOG_DEBUG, "finalize_sendto(): %d bytes on socket %d",
-			       (int)elt->len, elt->sockfd);
-			n = send_from_to(elt->sockfd, elt->buf, elt->len, elt->flags,
-			                 elt->src_addr, elt->dest_addr, elt->addrlen);
-			/*n = sendto(elt->sockfd, elt->buf, elt->len, elt->flags,
-			           elt->dest_addr, elt->addrlen);*/
-			if(n < 0) {
-				if(errno==EAGAIN || errno==EWOULDBLOCK) {
-					FD_SET(elt->sockfd, &writefds);
-					if(elt->sockfd > max_fd)
-						max_fd = elt->sockfd;
-					continue;
-				}
-				syslog(LOG_WARNING, "finalize_sendto(): socket=%d sendto: %m", elt->sockfd);
-			}
-			/* remove from the list */
-			LIST_REMOVE(elt, entries);
-			free(elt);
-		}
+	/* do not wait for the scheduled time */
+	while(heap_len > 0)
+		ready_append(heap_pop());
+	syslog(LOG_DEBUG, "finalize_sendto(): %d packets",
+	       ready_count + waiting_packets);
+	/* first try every socket, even the ones which were waiting */
+	FD_ZERO(&writefds);
+	max_fd = -1;
+	get_sendto_fds(&writefds, &max_fd, &deadline);
+	for(;;) {
+		if(try_sendto(&writefds) < 0)
+			syslog(LOG_WARNING, "finalize_sendto(): sendto failed");
+		if(ready_count + waiting_packets == 0)
+			break;
 		/* check deadline */
 		if(upnp_gettimeofday(&now) < 0) {
 			syslog(LOG_ERR, "gettimeofday: %m");
-			return;
+			break;
 		}
 		if(now.tv_sec > deadline.tv_sec ||
 		   (now.tv_sec == deadline.tv_sec && now.tv_usec > deadline.tv_usec)) {
 			/* deadline ! */
-			while((elt = send_list.lh_first) != NULL) {
-				LIST_REMOVE(elt, entries);
-				free(elt);
-			}
-			return;
+			break;
 		}
 		/* compute timeout value */
 		timeout.tv_sec = deadline.tv_sec - now.tv_sec;
@@ -340,11 +736,19 @@ void finalize_sendto(void)
 			timeout.tv_sec--;
 			timeout.tv_usec += 1000000;
 		}
+		FD_ZERO(&writefds);
+		max_fd = -1;
+		for(i = 0; i < waiting_count; i++) {
+			FD_SET(waiting[i].sockfd, &writefds);
+			if(waiting[i].sockfd > max_fd)
+				max_fd = waiting[i].sockfd;
+		}
 		if(max_fd >= 0) {
 			if(select(max_fd + 1, NULL, &writefds, NULL, &timeout) < 0) {
 				syslog(LOG_ERR, "select: %m");
-				return;
+				break;
 			}
 		}
 	}
+	free_all();
 }
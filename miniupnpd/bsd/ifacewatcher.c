@@ -10,8 +10,10 @@
 #include <sys/socket.h>
 #include <net/if.h>
 #include <net/route.h>
+#include <netinet/in.h>
 #include <syslog.h>
 #include <signal.h>
+#include <errno.h>
 
 #define	SALIGN	(sizeof(long) - 1)
 #define	SA_RLEN(sa)	(SA_LEN(sa) ? ((SA_LEN(sa) + SALIGN) & ~SALIGN) : (SALIGN + 1))
@@ -20,9 +22,104 @@
 
 #include "../upnputils.h"
 #include "../upnpglobalvars.h"
+#include "../getifaddr.h"
 
 extern volatile sig_atomic_t should_send_public_address_change_notif;
 
+/* the changes of the external interface are applied when no change
+ * happened for IFACEWATCH_DEBOUNCE_MS milliseconds, or at most
+ * IFACEWATCH_MAX_DELAY_MS milliseconds after the first change. */
+#define IFACEWATCH_DEBOUNCE_MS	(500)
+#define IFACEWATCH_MAX_DELAY_MS	(2000)
+
+static int pending = 0;
+static struct timeval pending_first;
+static struct timeval pending_last;
+
+/* last known external IPv4 address */
+static int ext_addr_known = 0;
+static struct in_addr ext_addr;
+
+static void
+get_ext_addr(int * known, struct in_addr * addr)
+{
+	*known = (ext_if_name != NULL
+	          && getifaddr(ext_if_name, NULL, 0, addr, NULL) >= 0);
+	if(!*known)
+		addr->s_addr = 0;
+}
+
+static void
+add_pending_change(void)
+{
+	upnp_gettimeofday(&pending_last);
+	if(!pending) {
+		pending = 1;
+		pending_first = pending_last;
+	}
+}
+
+static long
+ms_since(const struct timeval * now, const struct timeval * t)
+{
+	return (now->tv_sec - t->tv_sec) * 1000
+	       + (now->tv_usec - t->tv_usec) / 1000;
+}
+
+/* milliseconds before the changes are applied */
+static long
+pending_delay(const struct timeval * now)
+{
+	long delay, max_delay;
+
+	delay = IFACEWATCH_DEBOUNCE_MS - ms_since(now, &pending_last);
+	max_delay = IFACEWATCH_MAX_DELAY_MS - ms_since(now, &pending_first);
+	if(max_delay < delay)
+		delay = max_delay;
+	return (delay < 0) ? 0 : delay;
+}
+
+void
+UpdateInterfaceWatchTimeout(struct timeval * timeout)
+{
+	struct timeval now;
+	long delay;
+
+	if(!pending)
+		return;
+	if(upnp_gettimeofday(&now) < 0)
+		return;
+	delay = pending_delay(&now);
+	if(timeout->tv_sec > delay / 1000
+	   || (timeout->tv_sec == delay / 1000 && timeout->tv_usec > (delay % 1000) * 1000)) {
+		timeout->tv_sec = delay / 1000;
+		timeout->tv_usec = (delay % 1000) * 1000;
+	}
+}
+
+void
+ApplyInterfaceWatchChanges(void)
+{
+	struct timeval now;
+	int known;
+	struct in_addr addr;
+
+	if(!pending)
+		return;
+	if(upnp_gettimeofday(&now) < 0 || pending_delay(&now) > 0)
+		return;
+	pending = 0;
+	/* only notify if the address really changed */
+	get_ext_addr(&known, &addr);
+	if(known != ext_addr_known || addr.s_addr != ext_addr.s_addr) {
+		ext_addr_known = known;
+		ext_addr = addr;
+		should_send_public_address_change_notif = 1;
+	} else {
+		syslog(LOG_DEBUG, "ApplyInterfaceWatchChanges: external address unchanged");
+	}
+}
+
 int
 OpenAndConfInterfaceWatchSocket(void)
 {
@@ -36,6 +133,9 @@ OpenAndConfInterfaceWatchSocket(void)
  * routing socket open per system. */
 	if(s < 0) {
 		syslog(LOG_ERR, "OpenAndConfInterfaceWatchSocket socket: %m");
+	} else {
+		getifaddr_set_watched(1);
+		get_ext_addr(&ext_addr_known, &ext_addr);
 	}
 	return s;
 }
@@ -55,71 +155,89 @@ ProcessInterfaceWatchNotify(int s)
 	char * p;
 	struct sockaddr * sa;
 	unsigned int ext_if_name_index = 0;
+	int changed = 0;
 
-	len = recv(s, buf, sizeof(buf), 0);
-	if(len < 0) {
-		syslog(LOG_ERR, "ProcessInterfaceWatchNotify recv: %m");
-		return;
-	}
 	if(ext_if_name) {
 		ext_if_name_index = if_nametoindex(ext_if_name);
 	}
-	rtm = (struct rt_msghdr *)buf;
-	syslog(LOG_DEBUG, "%u rt_msg : msglen=%d version=%d type=%d", (unsigned)len,
-	       rtm->rtm_msglen, rtm->rtm_version, rtm->rtm_type);
-	switch(rtm->rtm_type) {
-	case RTM_IFINFO:	/* iface going up/down etc. */
-		ifm = (struct if_msghdr *)buf;
-		syslog(LOG_DEBUG, " RTM_IFINFO: addrs=%x flags=%x index=%hu",
-		       ifm->ifm_addrs, ifm->ifm_flags, ifm->ifm_index);
-		break;
-	case RTM_ADD:	/* Add Route */
-		syslog(LOG_DEBUG, " RTM_ADD");
-		break;
-	case RTM_DELETE:	/* Delete Route */
-		syslog(LOG_DEBUG, " RTM_DELETE");
-		break;
-	case RTM_CHANGE:	/* Change Metrics or flags */
-		syslog(LOG_DEBUG, " RTM_CHANGE");
-		break;
-	case RTM_GET:	/* Report Metrics */
-		syslog(LOG_DEBUG, " RTM_GET");
-		break;
+	/* read all the queued messages */
+	for(;;) {
+		len = recv(s, buf, sizeof(buf), MSG_DONTWAIT);
+		if(len < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				syslog(LOG_ERR, "ProcessInterfaceWatchNotify recv: %m");
+			break;
+		}
+		rtm = (struct rt_msghdr *)buf;
+		syslog(LOG_DEBUG, "%u rt_msg : msglen=%d version=%d type=%d", (unsigned)len,
+		       rtm->rtm_msglen, rtm->rtm_version, rtm->rtm_type);
+		switch(rtm->rtm_type) {
+		case RTM_IFINFO:	/* iface going up/down etc. */
+			ifm = (struct if_msghdr *)buf;
+			syslog(LOG_DEBUG, " RTM_IFINFO: addrs=%x flags=%x index=%hu",
+			       ifm->ifm_addrs, ifm->ifm_flags, ifm->ifm_index);
+			changed = 1;
+			if(ifm->ifm_index == ext_if_name_index) {
+				add_pending_change();
+			}
+			break;
+		case RTM_ADD:	/* Add Route */
+			syslog(LOG_DEBUG, " RTM_ADD");
+			break;
+		case RTM_DELETE:	/* Delete Route */
+			syslog(LOG_DEBUG, " RTM_DELETE");
+			break;
+		case RTM_CHANGE:	/* Change Metrics or flags */
+			syslog(LOG_DEBUG, " RTM_CHANGE");
+			break;
+		case RTM_GET:	/* Report Metrics */
+			syslog(LOG_DEBUG, " RTM_GET");
+			break;
 #ifdef RTM_IFANNOUNCE
-	case RTM_IFANNOUNCE:	/* iface arrival/departure */
-		ifanm = (struct if_announcemsghdr *)buf;
-		syslog(LOG_DEBUG, " RTM_IFANNOUNCE: index=%hu what=%hu ifname=%s",
-		       ifanm->ifan_index, ifanm->ifan_what, ifanm->ifan_name);
-		break;
+		case RTM_IFANNOUNCE:	/* iface arrival/departure */
+			ifanm = (struct if_announcemsghdr *)buf;
+			syslog(LOG_DEBUG, " RTM_IFANNOUNCE: index=%hu what=%hu ifname=%s",
+			       ifanm->ifan_index, ifanm->ifan_what, ifanm->ifan_name);
+			changed = 1;
+			break;
 #endif
 #ifdef RTM_IEEE80211
-	case RTM_IEEE80211:	/* IEEE80211 wireless event */
-		syslog(LOG_DEBUG, " RTM_IEEE80211");
-		break;
+		case RTM_IEEE80211:	/* IEEE80211 wireless event */
+			syslog(LOG_DEBUG, " RTM_IEEE80211");
+			break;
 #endif
-	case RTM_NEWADDR:	/* address being added to iface */
-		ifam = (struct ifa_msghdr *)buf;
-		syslog(LOG_DEBUG, " RTM_NEWADDR: addrs=%x flags=%x index=%hu",
-		       ifam->ifam_addrs, ifam->ifam_flags, ifam->ifam_index);
-		p = buf + sizeof(struct ifa_msghdr);
-		while(p < buf + len) {
-			sa = (struct sockaddr *)p;
-			sockaddr_to_string(sa, tmp, sizeof(tmp));
-			syslog(LOG_DEBUG, "  %s", tmp);
-			p += SA_RLEN(sa);
-		}
-		if(ifam->ifam_index == ext_if_name_index) {
-			should_send_public_address_change_notif = 1;
-		}
-		break;
-	case RTM_DELADDR:	/* address being removed from iface */
-		ifam = (struct ifa_msghdr *)buf;
-		if(ifam->ifam_index == ext_if_name_index) {
-			should_send_public_address_change_notif = 1;
+		case RTM_NEWADDR:	/* address being added to iface */
+			ifam = (struct ifa_msghdr *)buf;
+			syslog(LOG_DEBUG, " RTM_NEWADDR: addrs=%x flags=%x index=%hu",
+			       ifam->ifam_addrs, ifam->ifam_flags, ifam->ifam_index);
+			changed = 1;
+			p = buf + sizeof(struct ifa_msghdr);
+			while(p < buf + len) {
+				sa = (struct sockaddr *)p;
+				sockaddr_to_string(sa, tmp, sizeof(tmp));
+				syslog(LOG_DEBUG, "  %s", tmp);
+				p += SA_RLEN(sa);
+			}
+			if(ifam->ifam_index == ext_if_name_index) {
+				add_pending_change();
+			}
+			break;
+		case RTM_DELADDR:	/* address being removed from iface */
+			ifam = (struct ifa_msghdr *)buf;
+			changed = 1;
+			if(ifam->ifam_index == ext_if_name_index) {
+				add_pending_change();
+			}
+			break;
+		default:
+			syslog(LOG_DEBUG, "unprocessed RTM message type=%d", rtm->rtm_type);
 		}
-		break;
-	default:
-		syslog(LOG_DEBUG, "unprocessed RTM message type=%d", rtm->rtm_type);
+	}
+	if(changed) {
+		/* once for all the messages read */
+		getifaddr_invalidate_cache();
+		invalidate_lan_index();
 	}
 }
-
@@ -1,6 +1,7 @@
 # (c) 2020 Thomas BERNARD
 
 check:	validateupnppermissions validategetifaddr validatessdppktgen \
+	validateupnpreplyparse validatepcpserver validateupnphttp \
 	validateversion
 
 validateversion:	miniupnpd $(SRCDIR)/VERSION
@@ -15,3 +16,15 @@ validate%:	$(SRCDIR)/test%.sh test%
 validatessdppktgen:	testssdppktgen
 	./$<
 	touch $@
+
+validateupnpreplyparse:	testupnpreplyparse
+	./$<
+	touch $@
+
+validatepcpserver:	testpcpserver
+	./$< 10
+	touch $@
+
+validateupnphttp:	testupnphttp
+	./$<
+	touch $@
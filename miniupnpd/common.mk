@@ -12,15 +12,26 @@ testgetifaddr:	testgetifaddr.o getifaddr.o getconnstatus.o
 
 testgetroute:	testgetroute.o getroute.o upnputils.o
 
-testssdppktgen:	testssdppktgen.o
+testssdppktgen:	testssdppktgen.o ssdppktgen.o
 
 testasyncsendto:	testasyncsendto.o asyncsendto.o upnputils.o \
 	getroute.o
 
 testminissdp:	testminissdp.o minissdp.o upnputils.o upnpglobalvars.o \
-	asyncsendto.o getroute.o
+	asyncsendto.o getroute.o ssdppktgen.o
 
-testifacewatcher:	testifacewatcher.o ifacewatcher.o
+testifacewatcher:	testifacewatcher.o ifacewatcher.o getifaddr.o \
+	getroute.o upnputils.o
+
+testupnpreplyparse:	testupnpreplyparse.o upnpreplyparse.o minixml.o
+
+testhttpshandshake:	testhttpshandshake.o
+
+testpcpserver:	testpcpserver.o pcpserver.o upnpglobalvars.o upnputils.o \
+	getroute.o upnppermissions.o ratelimit.o
+
+testupnphttp:	testupnphttp.o upnphttp.o upnpglobalvars.o upnputils.o \
+	getroute.o ratelimit.o
 
 miniupnpdctl:	miniupnpdctl.o
 
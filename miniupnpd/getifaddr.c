@@ -10,6 +10,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -27,9 +28,99 @@
 #include <ifaddrs.h>
 #endif
 
-int
-getifaddr(const char * ifname, char * buf, int len,
-          struct in_addr * addr, struct in_addr * mask)
+/* The addresses are cached : getifaddr() is called for most NAT-PMP,
+ * PCP and SOAP requests. The interface watcher invalidates the cache
+ * on address and link changes, the entries then live
+ * GETIFADDR_CACHE_WATCHED_TTL seconds. Without the interface watcher
+ * they live GETIFADDR_CACHE_TTL seconds. */
+#define GETIFADDR_CACHE_SIZE	(4)
+#define GETIFADDR_CACHE_TTL	(2)
+#define GETIFADDR_CACHE_WATCHED_TTL	(300)
+
+struct ifaddr_cache_entry {
+	char ifname[IFNAMSIZ];
+	/* getifaddr() */
+	time_t time;	/* 0 = not cached */
+	int result;
+	int mask_read;	/* the mask was requested by read_ifaddr() */
+	int have_mask;
+	struct in_addr addr;
+	struct in_addr mask;
+#ifdef ENABLE_PCP
+	/* getifaddr_in6() for AF_INET and AF_INET6 */
+	time_t time6[2];
+	int result6[2];
+	struct in6_addr addr6[2];
+#endif /* ENABLE_PCP */
+};
+
+static struct ifaddr_cache_entry ifaddr_cache[GETIFADDR_CACHE_SIZE];
+static time_t ifaddr_cache_ttl = GETIFADDR_CACHE_TTL;
+
+/* the clock may go backward */
+static int
+ifaddr_cache_fresh(time_t t, time_t now)
+{
+	return t != 0 && now >= t && now - t < ifaddr_cache_ttl;
+}
+
+static struct ifaddr_cache_entry *
+ifaddr_cache_get(const char * ifname)
+{
+	struct ifaddr_cache_entry * e;
+	struct ifaddr_cache_entry * oldest = NULL;
+	time_t t, oldest_t = 0;
+	int i;
+
+	for(i = 0; i < GETIFADDR_CACHE_SIZE; i++) {
+		e = &ifaddr_cache[i];
+		if(e->ifname[0] == '\0' || strncmp(e->ifname, ifname, IFNAMSIZ) == 0)
+			break;
+		t = e->time;
+#ifdef ENABLE_PCP
+		if(e->time6[0] > t) t = e->time6[0];
+		if(e->time6[1] > t) t = e->time6[1];
+#endif /* ENABLE_PCP */
+		if(oldest == NULL || t < oldest_t) {
+			oldest = e;
+			oldest_t = t;
+		}
+	}
+	if(i == GETIFADDR_CACHE_SIZE)
+		e = oldest;
+	if(strncmp(e->ifname, ifname, IFNAMSIZ) != 0) {
+		memset(e, 0, sizeof(struct ifaddr_cache_entry));
+		strncpy(e->ifname, ifname, IFNAMSIZ - 1);
+	}
+	return e;
+}
+
+void
+getifaddr_invalidate_cache(void)
+{
+	int i;
+
+	for(i = 0; i < GETIFADDR_CACHE_SIZE; i++) {
+		ifaddr_cache[i].time = 0;
+#ifdef ENABLE_PCP
+		ifaddr_cache[i].time6[0] = 0;
+		ifaddr_cache[i].time6[1] = 0;
+#endif /* ENABLE_PCP */
+	}
+}
+
+void
+getifaddr_set_watched(int watched)
+{
+	ifaddr_cache_ttl = watched ? GETIFADDR_CACHE_WATCHED_TTL : GETIFADDR_CACHE_TTL;
+	getifaddr_invalidate_cache();
+}
+
+/* read the address without the cache. The mask is read if want_mask
+ * is set, mask is set if *have_mask is set on return */
+static int
+read_ifaddr(const char * ifname, struct in_addr * addr,
+            struct in_addr * mask, int * have_mask, int want_mask)
 {
 #ifndef USE_GETIFADDRS
 	/* use ioctl SIOCGIFADDR. Works only for ip v4 */
@@ -40,8 +131,7 @@ getifaddr(const char * ifname, char * buf, int len,
 	struct sockaddr_in * ifaddr;
 	ifrlen = sizeof(ifr);
 
-	if(!ifname || ifname[0]=='\0')
-		return GETIFADDR_BAD_ARGS;
+	*have_mask = 0;
 	s = socket(PF_INET, SOCK_DGRAM, 0);
 	if(s < 0) {
 		syslog(LOG_ERR, "socket(PF_INET, SOCK_DGRAM): %m");
@@ -79,27 +169,20 @@ getifaddr(const char * ifname, char * buf, int len,
 		return r;
 	}
 	ifaddr = (struct sockaddr_in *)&ifr.ifr_addr;
-	if(addr) *addr = ifaddr->sin_addr;
-	if(buf) {
-		if(!inet_ntop(AF_INET, &ifaddr->sin_addr, buf, len)) {
-			syslog(LOG_ERR, "inet_ntop(): %m");
-			close(s);
-			return GETIFADDR_INET_NTOP_ERROR;
-		}
-	}
-	if(mask) {
+	*addr = ifaddr->sin_addr;
+	if(want_mask) {
 		strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
 		ifr.ifr_name[IFNAMSIZ-1] = '\0';
 		if(ioctl(s, SIOCGIFNETMASK, &ifr, &ifrlen) < 0) {
 			syslog(LOG_ERR, "ioctl(s, SIOCGIFNETMASK, ...): %m");
-			close(s);
-			return GETIFADDR_IOCTL_ERROR;
-		}
+		} else {
 #ifdef ifr_netmask
-		*mask = ((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr;
+			*mask = ((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr;
 #else
-		*mask = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+			*mask = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
 #endif
+			*have_mask = 1;
+		}
 	}
 	close(s);
 #else /* ifndef USE_GETIFADDRS */
@@ -108,8 +191,8 @@ getifaddr(const char * ifname, char * buf, int len,
 	struct ifaddrs * ife;
 	struct ifaddrs * candidate = NULL;
 
-	if(!ifname || ifname[0]=='\0')
-		return GETIFADDR_BAD_ARGS;
+	(void)want_mask;	/* the mask comes with the address */
+	*have_mask = 0;
 	if(getifaddrs(&ifap) < 0) {
 		syslog(LOG_ERR, "getifaddrs: %m");
 		return GETIFADDR_GETIFADDRS_ERROR;
@@ -141,13 +224,11 @@ getifaddr(const char * ifname, char * buf, int len,
 		}
 	}
 	if(candidate) {
-		if(buf) {
-			inet_ntop(candidate->ifa_addr->sa_family,
-			          &((struct sockaddr_in *)candidate->ifa_addr)->sin_addr,
-			          buf, len);
+		*addr = ((struct sockaddr_in *)candidate->ifa_addr)->sin_addr;
+		if(candidate->ifa_netmask) {
+			*mask = ((struct sockaddr_in *)candidate->ifa_netmask)->sin_addr;
+			*have_mask = 1;
 		}
-		if(addr) *addr = ((struct sockaddr_in *)candidate->ifa_addr)->sin_addr;
-		if(mask) *mask = ((struct sockaddr_in *)candidate->ifa_netmask)->sin_addr;
 	} else {
 		syslog(LOG_WARNING, "no AF_INET address found for %s", ifname);
 		freeifaddrs(ifap);
@@ -158,9 +239,45 @@ getifaddr(const char * ifname, char * buf, int len,
 	return GETIFADDR_OK;
 }
 
+int
+getifaddr(const char * ifname, char * buf, int len,
+          struct in_addr * addr, struct in_addr * mask)
+{
+	struct ifaddr_cache_entry * e;
+	time_t now;
+
+	if(!ifname || ifname[0]=='\0')
+		return GETIFADDR_BAD_ARGS;
+	now = time(NULL);
+	e = ifaddr_cache_get(ifname);
+	if(!ifaddr_cache_fresh(e->time, now) || (mask && !e->mask_read)) {
+		e->result = read_ifaddr(ifname, &e->addr, &e->mask, &e->have_mask,
+		                        mask != NULL);
+		e->mask_read = (mask != NULL);
+		/* a failure of socket() is not cached */
+		e->time = (e->result == GETIFADDR_SOCKET_ERROR) ? 0 : now;
+	}
+	if(e->result != GETIFADDR_OK)
+		return e->result;
+	if(mask) {
+		if(!e->have_mask)
+			return GETIFADDR_IOCTL_ERROR;
+		*mask = e->mask;
+	}
+	if(addr) *addr = e->addr;
+	if(buf) {
+		if(!inet_ntop(AF_INET, &e->addr, buf, len)) {
+			syslog(LOG_ERR, "inet_ntop(): %m");
+			return GETIFADDR_INET_NTOP_ERROR;
+		}
+	}
+	return GETIFADDR_OK;
+}
+
 #ifdef ENABLE_PCP
 
-int getifaddr_in6(const char * ifname, int af, struct in6_addr * addr)
+/* read the address without the cache */
+static int read_ifaddr_in6(const char * ifname, int af, struct in6_addr * addr)
 {
 #if defined(ENABLE_IPV6) || defined(USE_GETIFADDRS)
 	struct ifaddrs * ifap;
@@ -170,8 +287,6 @@ int getifaddr_in6(const char * ifname, int af, struct in6_addr * addr)
 #endif /* ENABLE_IPV6 */
 	int found = 0;
 
-	if(!ifname || ifname[0]=='\0')
-		return -1;
 	if(getifaddrs(&ifap)<0)
 	{
 		syslog(LOG_ERR, "getifaddrs: %m");
@@ -231,6 +346,32 @@ int getifaddr_in6(const char * ifname, int af, struct in6_addr * addr)
 	return 0;
 #endif
 }
+
+int getifaddr_in6(const char * ifname, int af, struct in6_addr * addr)
+{
+	struct ifaddr_cache_entry * e;
+	time_t now;
+	int i;
+
+	if(!ifname || ifname[0]=='\0')
+		return -1;
+	if(af == AF_INET)
+		i = 0;
+	else if(af == AF_INET6)
+		i = 1;
+	else
+		return read_ifaddr_in6(ifname, af, addr);
+	now = time(NULL);
+	e = ifaddr_cache_get(ifname);
+	if(!ifaddr_cache_fresh(e->time6[i], now)) {
+		e->result6[i] = read_ifaddr_in6(ifname, af, &e->addr6[i]);
+		e->time6[i] = now;
+	}
+	if(e->result6[i] < 0)
+		return -1;
+	*addr = e->addr6[i];
+	return 0;
+}
 #endif /* ENABLE_PCP */
 
 #ifdef ENABLE_IPV6
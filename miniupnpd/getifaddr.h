@@ -57,6 +57,22 @@ getifaddr(const char * ifname, char * buf, int len,
 int
 getifaddr_in6(const char * ifname, int af, struct in6_addr* addr);
 
+/*! \brief forget the cached addresses
+ *
+ * getifaddr() and getifaddr_in6() results are cached.
+ * To be called when an address or a network interface changes. */
+void
+getifaddr_invalidate_cache(void);
+
+/*! \brief set if the network interfaces are watched
+ *
+ * When the interfaces are watched (see ifacewatcher.h) the cached
+ * addresses are kept longer as getifaddr_invalidate_cache() is called
+ * on changes.
+ * \param[in] watched 1 if getifaddr_invalidate_cache() is called on changes */
+void
+getifaddr_set_watched(int watched);
+
 /*! \brief find a non link local IP v6 address for the interface.
  *
  * if ifname is NULL, look for all interfaces
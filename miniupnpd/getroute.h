@@ -27,4 +27,19 @@ get_src_for_route_to(const struct sockaddr * dst,
                      void * src, size_t * src_len,
                      int * index);
 
+/*! \brief forget the cached routes
+ *
+ * The Linux implementation caches the get_src_for_route_to() results.
+ * To be called when a route, an address or a network interface changes. */
+void
+getroute_invalidate_cache(void);
+
+/*! \brief set if the routes are watched
+ *
+ * When the routes are watched (see ifacewatcher.h) the cached routes
+ * are kept longer as getroute_invalidate_cache() is called on changes.
+ * \param[in] watched 1 if getroute_invalidate_cache() is called on changes */
+void
+getroute_set_watched(int watched);
+
 #endif
@@ -39,6 +39,7 @@
 #ifndef IFACEWATCHER_H_INCLUDED
 #define IFACEWATCHER_H_INCLUDED
 
+#include <sys/time.h>
 #include "config.h"
 
 #ifdef USE_IFACEWATCHER
@@ -50,6 +51,16 @@ int OpenAndConfInterfaceWatchSocket(void);
  * \param[in] s socket opened with OpenAndConfInterfaceWatchSocket()
  */
 void ProcessInterfaceWatchNotify(int s);
+/*! \brief lower the select() timeout when changes are pending
+ * \param[in,out] timeout
+ */
+void UpdateInterfaceWatchTimeout(struct timeval * timeout);
+/*! \brief apply the pending changes once they are stable
+ *
+ * The changes read by ProcessInterfaceWatchNotify() are gathered and
+ * applied at once, when no new change happened during a short delay.
+ */
+void ApplyInterfaceWatchChanges(void);
 #endif
 
 #endif
@@ -1,7 +1,7 @@
 /* $Id: getifstats.c,v 1.16 2020/05/10 17:51:00 nanard Exp $ */
 /* MiniUPnP project
  * http://miniupnp.free.fr/ or http://miniupnp.tuxfamily.org/
- * (c) 2006-2020 Thomas Bernard
+ * (c) 2006-2026 Thomas Bernard
  * This software is subject to the conditions detailed
  * in the LICENCE file provided within the distribution */
 
@@ -10,12 +10,22 @@
 #include <syslog.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
 
 #include "config.h"
 #include "../getifstats.h"
+#ifdef ENABLE_GETIFSTATS_CACHING
+#include "../upnputils.h"
+#endif /* ENABLE_GETIFSTATS_CACHING */
 
 #ifdef GET_WIRELESS_STATS
-#include <unistd.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <linux/wireless.h>
@@ -24,60 +34,224 @@
 /* that is the answer */
 #define BAUDRATE_DEFAULT 4200000
 
-/* this custom implementation of strtoul() rollover
- * this is needed by the UPnP standard */
-static unsigned long my_strtoul(const char * p, char ** endptr, int base)
+/* minimum interval between two samples used to compute the bitrate */
+#define BITRATE_MIN_INTERVAL_MS	1000
+
+/* netlink socket, kept open between calls */
+static int nl_fd = -1;
+static unsigned int nl_seq = 0;
+
+/* state of the interface used to compute the bitrate */
+static struct {
+	char ifname[IFNAMSIZ];
+	int running;			/* IFF_RUNNING flag of the last sample */
+	int speed_read;			/* link speed read since the last link change */
+	unsigned long speed;	/* link speed in bits per second, 0 = unknown */
+	struct timespec last;	/* time of the last sample */
+	unsigned long long ibytes;
+	unsigned long long obytes;
+	unsigned long rate;		/* smoothed bitrate, 0 = unknown */
+} link_state;
+
+static int
+open_nl_socket(void)
+{
+	struct sockaddr_nl local;
+
+	nl_fd = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(nl_fd < 0) {
+		syslog(LOG_ERR, "getifstats() : socket(PF_NETLINK) : %m");
+		return -1;
+	}
+	memset(&local, 0, sizeof(local));
+	local.nl_family = AF_NETLINK;
+	if(bind(nl_fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+		syslog(LOG_ERR, "getifstats() : bind(netlink) : %m");
+		close(nl_fd);
+		nl_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* send a RTM_GETLINK request for ifname and return the RTM_NEWLINK
+ * answer in buf, or NULL */
+static struct nlmsghdr *
+request_link(const char * ifname, char * buf, size_t bufsize)
 {
-	unsigned long value;
-
-	if (base == 0) {
-		/* autodetect base :
-		 * 0xnnnnn is hexadecimal
-		 * 0nnnnnn is octal
-		 * everything else is decimal */
-		if (*p == '0') {
-			p++;
-			if (*p == 'x') {
-				p++;
-				base = 16;
-			} else {
-				base = 8;
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+		char attrs[RTA_SPACE(IFNAMSIZ)];
+	} req;
+	struct rtattr * rta;
+	struct sockaddr_nl kernel;
+	struct nlmsghdr * h;
+	size_t namelen;
+	ssize_t len;
+
+	namelen = strlen(ifname);
+	if(namelen >= IFNAMSIZ)
+		return NULL;
+	if(nl_fd < 0 && open_nl_socket() < 0)
+		return NULL;
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_type = RTM_GETLINK;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_seq = ++nl_seq;
+	req.i.ifi_family = AF_UNSPEC;
+	rta = (struct rtattr *)(((char *)&req) + NLMSG_ALIGN(req.n.nlmsg_len));
+	rta->rta_type = IFLA_IFNAME;
+	rta->rta_len = RTA_LENGTH(namelen + 1);
+	memcpy(RTA_DATA(rta), ifname, namelen + 1);
+	req.n.nlmsg_len = NLMSG_ALIGN(req.n.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+	if(sendto(nl_fd, &req, req.n.nlmsg_len, 0,
+	          (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+		syslog(LOG_ERR, "getifstats() : sendto(netlink) : %m");
+		close(nl_fd);
+		nl_fd = -1;
+		return NULL;
+	}
+	/* the kernel answers synchronously : the reply is already queued.
+	 * Skip the answers to previous requests if any */
+	for(;;) {
+		len = recv(nl_fd, buf, bufsize, MSG_DONTWAIT);
+		if(len < 0) {
+			if(errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "getifstats() : recv(netlink) : %m");
+			return NULL;
+		}
+		for(h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned int)len);
+		    h = NLMSG_NEXT(h, len)) {
+			if(h->nlmsg_seq != nl_seq)
+				continue;
+			if(h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr * err = (struct nlmsgerr *)NLMSG_DATA(h);
+				if(h->nlmsg_len >= NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+					errno = -err->error;
+					syslog(LOG_WARNING, "getifstats() : RTM_GETLINK %s : %m",
+					       ifname);
+				}
+				return NULL;
 			}
-		} else {
-			base = 10;
+			if(h->nlmsg_type == RTM_NEWLINK
+			   && h->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+				return h;
 		}
 	}
+}
 
-	for (value = 0; *p >= '0'; p++) {
-		value *= (unsigned long)base;
-		if (*p <= '9') {
-			if (base < 10 && *p >= ('0' + base))
-				break;
-			value += (unsigned long)(*p - '0');	/* 0-9 */
-		} else if (base <= 10 || *p < 'A') {
-			break;
-		} else if (*p < ('A' + base - 10)) {
-			value += (unsigned long)(*p - 'A' + 10);	/* A-F */
-		} else if (*p >= 'a' && *p < ('a' + base - 10)) {
-			value += (unsigned long)(*p - 'a' + 10);	/* a-f */
-		} else {
-			break;
+/* link speed in bits per seconds, 0 if unknown */
+static unsigned long
+read_link_speed(const char * ifname)
+{
+	FILE *f;
+	char fname[64];
+	char line[32];
+	int i;
+	unsigned long speed = 0;
+
+	snprintf(fname, sizeof(fname), "/sys/class/net/%s/speed", ifname);
+	f = fopen(fname, "r");
+	if(f) {
+		if(fgets(line, sizeof(line), f)) {
+			i = atoi(line);	/* 65535 means unknown */
+			if(i > 0 && i < 65535)
+				speed = 1000000UL*i;
 		}
+		fclose(f);
+	} else {
+		syslog(LOG_INFO, "cannot read %s file : %m", fname);
 	}
-	if (endptr != NULL)
-		*endptr = (char *)p;
-	return value;
+#ifdef GET_WIRELESS_STATS
+	if(speed == 0) {
+		struct iwreq iwr;
+		int s;
+		s = socket(AF_INET, SOCK_DGRAM, 0);
+		if(s >= 0) {
+			strncpy(iwr.ifr_name, ifname, IFNAMSIZ);
+			if(ioctl(s, SIOCGIWRATE, &iwr) >= 0) {
+				speed = iwr.u.bitrate.value;
+			}
+			close(s);
+		}
+	}
+#endif /* GET_WIRELESS_STATS */
+	return speed;
+}
+
+/* update the smoothed bitrate with a new sample of the byte counters.
+ * When the link speed is unknown (ppp, tunnels, etc.), the bitrate
+ * is the exponentially weighted moving average (1/4 weight for the
+ * new value) of the throughput measured between two samples. */
+static unsigned long
+update_bitrate(const char * ifname, int running,
+               unsigned long long ibytes, unsigned long long obytes)
+{
+	struct timespec now;
+	long long ms;
+	unsigned long long delta;
+	unsigned long rate;
+
+	if(strncmp(link_state.ifname, ifname, IFNAMSIZ) != 0) {
+		memset(&link_state, 0, sizeof(link_state));
+		strncpy(link_state.ifname, ifname, IFNAMSIZ - 1);
+	}
+	if(!link_state.speed_read || running != link_state.running) {
+		/* the link speed may change when the link goes up or down */
+		link_state.speed = read_link_speed(ifname);
+		link_state.speed_read = 1;
+		link_state.running = running;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(link_state.last.tv_sec == 0 && link_state.last.tv_nsec == 0) {
+		/* first sample */
+		link_state.last = now;
+		link_state.ibytes = ibytes;
+		link_state.obytes = obytes;
+	} else {
+		ms = (long long)(now.tv_sec - link_state.last.tv_sec) * 1000
+		     + (now.tv_nsec - link_state.last.tv_nsec) / 1000000;
+		if(ms >= BITRATE_MIN_INTERVAL_MS) {
+			if(ibytes >= link_state.ibytes && obytes >= link_state.obytes) {
+				delta = ibytes - link_state.ibytes;
+				if(obytes - link_state.obytes > delta)
+					delta = obytes - link_state.obytes;
+				rate = (unsigned long)(delta * 8000 / (unsigned long long)ms);
+				if(link_state.rate == 0)
+					link_state.rate = rate;
+				else
+					link_state.rate = link_state.rate - link_state.rate / 4 + rate / 4;
+			}	/* else the counters were reset */
+			link_state.last = now;
+			link_state.ibytes = ibytes;
+			link_state.obytes = obytes;
+		}
+	}
+	if(link_state.speed != 0)
+		return link_state.speed;
+	if(link_state.rate != 0)
+		return link_state.rate;
+	return BAUDRATE_DEFAULT;
 }
 
 int
 getifstats(const char * ifname, struct ifdata * data)
 {
-	FILE *f;
-	char line[512];
-	char * p;
-	int i;
-	int r = -1;
-	char fname[64];
+	char buf[16384];
+	struct nlmsghdr * h;
+	struct ifinfomsg * ifi;
+	struct rtattr * rta;
+	int rtl;
+	int found = 0;
+	struct rtnl_link_stats64 stats64;
+	struct rtnl_link_stats stats;
+	unsigned long long ibytes = 0, obytes = 0;
 #ifdef ENABLE_GETIFSTATS_CACHING
 	static time_t cache_timestamp = 0;
 	static struct ifdata cache_data;
@@ -104,77 +278,48 @@ getifstats(const char * ifname, struct ifdata * data)
 		}
 	}
 #endif /* ENABLE_GETIFSTATS_CACHING */
-	f = fopen("/proc/net/dev", "r");
-	if(!f) {
-		syslog(LOG_ERR, "getifstats() : cannot open /proc/net/dev : %m");
+	h = request_link(ifname, buf, sizeof(buf));
+	if(h == NULL)
 		return -1;
-	}
-	/* discard the two header lines */
-	if(!fgets(line, sizeof(line), f) || !fgets(line, sizeof(line), f)) {
-		syslog(LOG_ERR, "getifstats() : error reading /proc/net/dev : %m");
-	}
-	while(fgets(line, sizeof(line), f)) {
-		p = line;
-		while(*p==' ') p++;
-		i = 0;
-		while(ifname[i] == *p) {
-			p++; i++;
-		}
-		/* TODO : how to handle aliases ? */
-		if(ifname[i] || *p != ':')
-			continue;
-		p++;
-		while(*p==' ') p++;
-		data->ibytes = my_strtoul(p, &p, 0);
-		while(*p==' ') p++;
-		data->ipackets = my_strtoul(p, &p, 0);
-		/* skip 6 columns */
-		for(i=6; i>0 && *p!='\0'; i--) {
-			while(*p==' ') p++;
-			while(*p!=' ' && *p) p++;
-		}
-		while(*p==' ') p++;
-		data->obytes = my_strtoul(p, &p, 0);
-		while(*p==' ') p++;
-		data->opackets = my_strtoul(p, &p, 0);
-		r = 0;
-		break;
-	}
-	fclose(f);
-	/* get interface speed */
-	snprintf(fname, sizeof(fname), "/sys/class/net/%s/speed", ifname);
-	f = fopen(fname, "r");
-	if(f) {
-		if(fgets(line, sizeof(line), f)) {
-			i = atoi(line);	/* 65535 means unknown */
-			if(i > 0 && i < 65535)
-				data->baudrate = 1000000*i;
+	ifi = (struct ifinfomsg *)NLMSG_DATA(h);
+	rtl = IFLA_PAYLOAD(h);
+	/* the counters are truncated to unsigned long : they roll over
+	 * as required by the UPnP standard */
+	for(rta = IFLA_RTA(ifi); RTA_OK(rta, rtl); rta = RTA_NEXT(rta, rtl)) {
+		if(rta->rta_type == IFLA_STATS64
+		   && RTA_PAYLOAD(rta) >= sizeof(stats64)) {
+			/* RTA_DATA() is only 4 bytes aligned */
+			memcpy(&stats64, RTA_DATA(rta), sizeof(stats64));
+			ibytes = stats64.rx_bytes;
+			obytes = stats64.tx_bytes;
+			data->ipackets = (unsigned long)stats64.rx_packets;
+			data->opackets = (unsigned long)stats64.tx_packets;
+			found = 2;
+		} else if(rta->rta_type == IFLA_STATS && found == 0
+		          && RTA_PAYLOAD(rta) >= sizeof(stats)) {
+			/* kernels older than 2.6.35 */
+			memcpy(&stats, RTA_DATA(rta), sizeof(stats));
+			ibytes = stats.rx_bytes;
+			obytes = stats.tx_bytes;
+			data->ipackets = stats.rx_packets;
+			data->opackets = stats.tx_packets;
+			found = 1;
 		}
-		fclose(f);
-	} else {
-		syslog(LOG_INFO, "cannot read %s file : %m", fname);
 	}
-#ifdef GET_WIRELESS_STATS
-	if(data->baudrate == BAUDRATE_DEFAULT) {
-		struct iwreq iwr;
-		int s;
-		s = socket(AF_INET, SOCK_DGRAM, 0);
-		if(s >= 0) {
-			strncpy(iwr.ifr_name, ifname, IFNAMSIZ);
-			if(ioctl(s, SIOCGIWRATE, &iwr) >= 0) {
-				data->baudrate = iwr.u.bitrate.value;
-			}
-			close(s);
-		}
+	if(!found) {
+		syslog(LOG_WARNING, "getifstats() : no statistics for %s", ifname);
+		return -1;
 	}
-#endif /* GET_WIRELESS_STATS */
+	data->ibytes = (unsigned long)ibytes;
+	data->obytes = (unsigned long)obytes;
+	data->baudrate = update_bitrate(ifname, (ifi->ifi_flags & IFF_RUNNING) != 0,
+	                                ibytes, obytes);
 #ifdef ENABLE_GETIFSTATS_CACHING
-	if(r==0 && current_time!=((time_t)-1)) {
+	if(current_time!=((time_t)-1)) {
 		/* cache the new data */
 		cache_timestamp = current_time;
 		memcpy(&cache_data, data, sizeof(struct ifdata));
 	}
 #endif /* ENABLE_GETIFSTATS_CACHING */
-	return r;
+	return 0;
 }
-
@@ -1,7 +1,7 @@
 /* $Id: getroute.c,v 1.4 2013/02/06 10:50:04 nanard Exp $ */
 /* MiniUPnP project
  * http://miniupnp.free.fr/ or http://miniupnp.tuxfamily.org/
- * (c) 2006-2015 Thomas Bernard
+ * (c) 2006-2026 Thomas Bernard
  * This software is subject to the conditions detailed
  * in the LICENCE file provided within the distribution */
 
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <syslog.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -26,12 +27,62 @@
 #include "../getroute.h"
 #include "../upnputils.h"
 
-int
-get_src_for_route_to(const struct sockaddr * dst,
-                     void * src, size_t * src_len,
-                     int * index)
+/* The results are cached : get_src_for_route_to() is called for
+ * SSDP and PCP packets. The interface watcher invalidates the cache on
+ * route, address and link changes, the entries then live
+ * GETROUTE_CACHE_WATCHED_TTL seconds. Without the interface watcher
+ * they live GETROUTE_CACHE_TTL seconds.
+ * The least recently used entry is replaced. */
+#define GETROUTE_CACHE_SIZE	(32)
+#define GETROUTE_CACHE_TTL	(2)
+#define GETROUTE_CACHE_WATCHED_TTL	(300)
+
+struct route_cache_entry {
+	time_t time;	/* 0 = free entry */
+	unsigned int last_use;
+	int family;
+	unsigned char dst[16];
+	unsigned char src[16];
+	size_t src_len;	/* 0 = no RTA_PREFSRC */
+	int index;
+	int has_index;
+};
+
+static struct route_cache_entry route_cache[GETROUTE_CACHE_SIZE];
+static unsigned int route_cache_clock = 0;
+static time_t route_cache_ttl = GETROUTE_CACHE_TTL;
+
+/* netlink socket, kept open between calls */
+static int nl_fd = -1;
+static unsigned int nl_seq = 0;
+
+void
+getroute_invalidate_cache(void)
+{
+	int i;
+
+	for(i = 0; i < GETROUTE_CACHE_SIZE; i++)
+		route_cache[i].time = 0;
+}
+
+void
+getroute_set_watched(int watched)
+{
+	route_cache_ttl = watched ? GETROUTE_CACHE_WATCHED_TTL : GETROUTE_CACHE_TTL;
+	getroute_invalidate_cache();
+}
+
+/* the clock may go backward */
+static int
+route_cache_fresh(time_t t, time_t now)
+{
+	return t != 0 && now >= t && now - t < route_cache_ttl;
+}
+
+/* ask the kernel for the route to dst */
+static int
+query_route(const struct sockaddr * dst, struct route_cache_entry * e)
 {
-	int fd = -1;
 	struct nlmsghdr *h;
 	int status;
 	struct {
@@ -101,19 +152,21 @@ get_src_for_route_to(const struct sockaddr * dst,
 	req.n.nlmsg_len += rta->rta_len;
 #endif /* USE_LIBNFNETLINK */
 
-	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
-	if (fd < 0) {
-		syslog(LOG_ERR, "socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE) : %m");
-		return -1;
+	if (nl_fd < 0) {
+		nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (nl_fd < 0) {
+			syslog(LOG_ERR, "socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE) : %m");
+			return -1;
+		}
 	}
 
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 
-	req.n.nlmsg_seq = 1;
+	req.n.nlmsg_seq = ++nl_seq;
 	iov.iov_len = req.n.nlmsg_len;
 
-	status = sendmsg(fd, &msg, 0);
+	status = sendmsg(nl_fd, &msg, 0);
 
 	if (status < 0) {
 		syslog(LOG_ERR, "sendmsg(rtnetlink) : %m");
@@ -124,7 +177,7 @@ get_src_for_route_to(const struct sockaddr * dst,
 
 	for(;;) {
 		iov.iov_len = sizeof(req);
-		status = recvmsg(fd, &msg, 0);
+		status = recvmsg(nl_fd, &msg, 0);
 		if(status < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
@@ -147,8 +200,9 @@ get_src_for_route_to(const struct sockaddr * dst,
 				goto error;
 			}
 
-			if(nladdr.nl_pid != 0 || h->nlmsg_seq != 1/*seq*/) {
-				syslog(LOG_ERR, "wrong seq = %d\n", h->nlmsg_seq);
+			if(nladdr.nl_pid != 0 || h->nlmsg_seq != nl_seq) {
+				/* answer to a previous request */
+				syslog(LOG_DEBUG, "wrong seq = %u", h->nlmsg_seq);
 				/* Don't forget to skip that message. */
 				status -= NLMSG_ALIGN(len);
 				h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
@@ -158,30 +212,29 @@ get_src_for_route_to(const struct sockaddr * dst,
 			if(h->nlmsg_type == NLMSG_ERROR) {
 				struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
 				syslog(LOG_ERR, "NLMSG_ERROR %d : %s", err->error, strerror(-err->error));
-				goto error;
+				return -1;
 			}
 			if(h->nlmsg_type == RTM_NEWROUTE) {
 				struct rtattr * rta;
 				int len = h->nlmsg_len;
 				len -= NLMSG_LENGTH(sizeof(struct rtmsg));
+				e->src_len = 0;
+				e->has_index = 0;
 				for(rta = RTM_RTA(NLMSG_DATA((h))); RTA_OK(rta, len); rta = RTA_NEXT(rta,len)) {
 					unsigned char * data = RTA_DATA(rta);
 					if(rta->rta_type == RTA_PREFSRC) {
-						if(src_len && src) {
-							if(*src_len < RTA_PAYLOAD(rta)) {
-								syslog(LOG_WARNING, "cannot copy src: %u<%lu",
-								       (unsigned)*src_len, (unsigned long)RTA_PAYLOAD(rta));
-								goto error;
-							}
-							*src_len = RTA_PAYLOAD(rta);
-							memcpy(src, data, RTA_PAYLOAD(rta));
+						if(RTA_PAYLOAD(rta) > sizeof(e->src)) {
+							syslog(LOG_WARNING, "cannot copy src: %u<%lu",
+							       (unsigned)sizeof(e->src), (unsigned long)RTA_PAYLOAD(rta));
+							return -1;
 						}
+						e->src_len = RTA_PAYLOAD(rta);
+						memcpy(e->src, data, RTA_PAYLOAD(rta));
 					} else if(rta->rta_type == RTA_OIF) {
-						if(index)
-							memcpy(index, data, sizeof(int));
+						memcpy(&e->index, data, sizeof(int));
+						e->has_index = 1;
 					}
 				}
-				close(fd);
 				return 0;
 			}
 			status -= NLMSG_ALIGN(len);
@@ -190,8 +243,65 @@ get_src_for_route_to(const struct sockaddr * dst,
 	}
 	syslog(LOG_WARNING, "get_src_for_route_to() : src not found");
 error:
-	if(fd >= 0)
-		close(fd);
+	/* the socket will be opened again */
+	close(nl_fd);
+	nl_fd = -1;
 	return -1;
 }
 
+int
+get_src_for_route_to(const struct sockaddr * dst,
+                     void * src, size_t * src_len,
+                     int * index)
+{
+	struct route_cache_entry * e = NULL;
+	struct route_cache_entry * lru = NULL;
+	const unsigned char * addr;
+	size_t addr_len;
+	time_t now;
+	int i;
+
+	if(dst->sa_family == AF_INET) {
+		addr = (const unsigned char *)&((const struct sockaddr_in *)dst)->sin_addr;
+		addr_len = 4;
+	} else {
+		addr = ((const struct sockaddr_in6 *)dst)->sin6_addr.s6_addr;
+		addr_len = 16;
+	}
+	now = upnp_time();
+	for(i = 0; i < GETROUTE_CACHE_SIZE; i++) {
+		if(route_cache_fresh(route_cache[i].time, now)
+		   && route_cache[i].family == dst->sa_family
+		   && memcmp(route_cache[i].dst, addr, addr_len) == 0) {
+			e = &route_cache[i];
+			break;
+		}
+		if(lru == NULL || !route_cache_fresh(route_cache[i].time, now)
+		   || (route_cache_fresh(lru->time, now)
+		       && route_cache[i].last_use < lru->last_use))
+			lru = &route_cache[i];
+	}
+	if(e == NULL) {
+		e = lru;
+		e->time = 0;
+		if(query_route(dst, e) < 0)
+			return -1;
+		e->time = now;
+		e->family = dst->sa_family;
+		memcpy(e->dst, addr, addr_len);
+	}
+	e->last_use = ++route_cache_clock;
+
+	if(e->src_len > 0 && src_len && src) {
+		if(*src_len < e->src_len) {
+			syslog(LOG_WARNING, "cannot copy src: %u<%lu",
+			       (unsigned)*src_len, (unsigned long)e->src_len);
+			return -1;
+		}
+		*src_len = e->src_len;
+		memcpy(src, e->src, e->src_len);
+	}
+	if(e->has_index && index)
+		*index = e->index;
+	return 0;
+}
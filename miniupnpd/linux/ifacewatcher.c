@@ -47,6 +47,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <errno.h>
 
 #include "config.h"
 #include "../macros.h"
@@ -56,11 +57,51 @@
 #include "../ifacewatcher.h"
 #include "../minissdp.h"
 #include "../getifaddr.h"
+#include "../getroute.h"
+#include "../upnputils.h"
 #include "../upnpglobalvars.h"
 #include "../natpmp.h"
 
 extern volatile sig_atomic_t should_send_public_address_change_notif;
 
+/* The changes are merged for each interface and applied when no
+ * change happened for IFACEWATCH_DEBOUNCE_MS milliseconds, or at most
+ * IFACEWATCH_MAX_DELAY_MS milliseconds after the first change. DHCP
+ * renewals and PPP flaps generate bursts of messages. */
+#define IFACEWATCH_DEBOUNCE_MS	(500)
+#define IFACEWATCH_MAX_DELAY_MS	(2000)
+#define IFACEWATCH_MAX_PENDING	(16)
+
+#define IFACE_CHANGE_LINK	0x01
+#define IFACE_CHANGE_ADDR4	0x02
+#define IFACE_CHANGE_ADDR6	0x04
+
+static struct {
+	int active;
+	struct timeval first;	/* first change */
+	struct timeval last;	/* last change */
+	int overflow;	/* too many interfaces : check everything */
+	unsigned int n;
+	struct {
+		unsigned int index;
+		int changes;
+	} iface[IFACEWATCH_MAX_PENDING];
+} pending;
+
+/* last known external IPv4 address, to filter out the changes not
+ * modifying it (DHCP renewals, etc.) */
+static int ext_addr_known = 0;
+static struct in_addr ext_addr;
+
+static void
+get_ext_addr(int * known, struct in_addr * addr)
+{
+	*known = (ext_if_name != NULL
+	          && getifaddr(ext_if_name, NULL, 0, addr, NULL) >= 0);
+	if(!*known)
+		addr->s_addr = 0;
+}
+
 
 int
 OpenAndConfInterfaceWatchSocket(void)
@@ -77,8 +118,16 @@ OpenAndConfInterfaceWatchSocket(void)
 
 	memset(&addr, 0, sizeof(addr));
 	addr.nl_family = AF_NETLINK;
-	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
-	/*addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;*/
+	/* route changes are needed to keep the get_src_for_route_to() cache
+	 * up to date */
+#ifdef ENABLE_IPV6
+	/* IPv6 address changes are needed to keep the getifaddr_in6() cache
+	 * up to date */
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR
+	                 | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+#else
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+#endif
 
 	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
 	{
@@ -86,6 +135,10 @@ OpenAndConfInterfaceWatchSocket(void)
 		close(s);
 		return -1;
 	}
+	getifaddr_set_watched(1);
+	getroute_set_watched(1);
+	lan_index_set_watched(1);
+	get_ext_addr(&ext_addr_known, &ext_addr);
 
 	return s;
 }
@@ -230,124 +283,248 @@ ProcessInterfaceDown(struct ifinfomsg *ifi)
 }
 #endif
 
-void
-ProcessInterfaceWatchNotify(int s)
+static void
+add_pending_change(unsigned int index, int changes)
 {
-	char buffer[4096];
-	struct iovec iov;
-	struct msghdr hdr;
-	struct nlmsghdr *nlhdr;
-#if 0
-/* disabled at the moment */
-	struct ifinfomsg *ifi;
-#endif
-	struct ifaddrmsg *ifa;
-	int len;
+	unsigned int i;
 
-	struct rtattr *rth;
-	int rtl;
+	upnp_gettimeofday(&pending.last);
+	if(!pending.active) {
+		pending.active = 1;
+		pending.first = pending.last;
+	}
+	for(i = 0; i < pending.n; i++) {
+		if(pending.iface[i].index == index) {
+			pending.iface[i].changes |= changes;
+			return;
+		}
+	}
+	if(pending.n < IFACEWATCH_MAX_PENDING) {
+		pending.iface[pending.n].index = index;
+		pending.iface[pending.n].changes = changes;
+		pending.n++;
+	} else {
+		pending.overflow = 1;
+	}
+}
 
-	unsigned int ext_if_name_index = 0;
+static long
+ms_since(const struct timeval * now, const struct timeval * t)
+{
+	return (now->tv_sec - t->tv_sec) * 1000
+	       + (now->tv_usec - t->tv_usec) / 1000;
+}
+
+/* milliseconds before the changes are applied */
+static long
+pending_delay(const struct timeval * now)
+{
+	long delay, max_delay;
 
-	iov.iov_base = buffer;
-	iov.iov_len = sizeof(buffer);
+	delay = IFACEWATCH_DEBOUNCE_MS - ms_since(now, &pending.last);
+	max_delay = IFACEWATCH_MAX_DELAY_MS - ms_since(now, &pending.first);
+	if(max_delay < delay)
+		delay = max_delay;
+	return (delay < 0) ? 0 : delay;
+}
 
-	memset(&hdr, 0, sizeof(hdr));
-	hdr.msg_iov = &iov;
-	hdr.msg_iovlen = 1;
+void
+UpdateInterfaceWatchTimeout(struct timeval * timeout)
+{
+	struct timeval now;
+	long delay;
 
-	len = recvmsg(s, &hdr, 0);
-	if (len < 0)
-	{
-		syslog(LOG_ERR, "recvmsg(s, &hdr, 0): %m");
+	if(!pending.active)
+		return;
+	if(upnp_gettimeofday(&now) < 0)
 		return;
+	delay = pending_delay(&now);
+	if(timeout->tv_sec > delay / 1000
+	   || (timeout->tv_sec == delay / 1000 && timeout->tv_usec > (delay % 1000) * 1000)) {
+		timeout->tv_sec = delay / 1000;
+		timeout->tv_usec = (delay % 1000) * 1000;
 	}
+}
+
+void
+ApplyInterfaceWatchChanges(void)
+{
+	struct timeval now;
+	unsigned int i;
+	unsigned int ext_if_name_index = 0;
+	int ext_changed = pending.overflow;
+	int known;
+	struct in_addr addr;
 
+	if(!pending.active)
+		return;
+	if(upnp_gettimeofday(&now) < 0 || pending_delay(&now) > 0)
+		return;
 	if(ext_if_name) {
 		ext_if_name_index = if_nametoindex(ext_if_name);
 	}
+	for(i = 0; i < pending.n; i++) {
+		syslog(LOG_DEBUG, "%s: index=%u%s%s%s", "ApplyInterfaceWatchChanges",
+		       pending.iface[i].index,
+		       (pending.iface[i].changes & IFACE_CHANGE_LINK) ? " link" : "",
+		       (pending.iface[i].changes & IFACE_CHANGE_ADDR4) ? " ipv4" : "",
+		       (pending.iface[i].changes & IFACE_CHANGE_ADDR6) ? " ipv6" : "");
+		if(pending.iface[i].index == ext_if_name_index
+		   && (pending.iface[i].changes & (IFACE_CHANGE_LINK | IFACE_CHANGE_ADDR4)))
+			ext_changed = 1;
+	}
+	memset(&pending, 0, sizeof(pending));
+	if(!ext_changed)
+		return;
+	/* only notify if the address really changed */
+	get_ext_addr(&known, &addr);
+	if(known != ext_addr_known || addr.s_addr != ext_addr.s_addr) {
+		ext_addr_known = known;
+		ext_addr = addr;
+		should_send_public_address_change_notif = 1;
+	} else {
+		syslog(LOG_DEBUG, "%s: external address unchanged",
+		       "ApplyInterfaceWatchChanges");
+	}
+}
 
-	for (nlhdr = (struct nlmsghdr *) buffer;
-	     NLMSG_OK (nlhdr, (unsigned int)len);
-	     nlhdr = NLMSG_NEXT (nlhdr, len))
-	{
-		int is_del = 0;
-		char address[48];
-		char ifname[IFNAMSIZ];
-		address[0] = '\0';
-		ifname[0] = '\0';
-		if (nlhdr->nlmsg_type == NLMSG_DONE)
+/* log the address attributes */
+static void
+log_address(struct nlmsghdr * nlhdr, int is_del)
+{
+	struct ifaddrmsg *ifa;
+	struct rtattr *rth;
+	int rtl;
+
+	ifa = (struct ifaddrmsg *) NLMSG_DATA(nlhdr);
+	syslog(LOG_DEBUG, "%s %s index=%d fam=%d", "ProcessInterfaceWatchNotify",
+	       is_del ? "RTM_DELADDR" : "RTM_NEWADDR",
+	       ifa->ifa_index, ifa->ifa_family);
+	for(rth = IFA_RTA(ifa), rtl = IFA_PAYLOAD(nlhdr);
+	    rtl && RTA_OK(rth, rtl);
+	    rth = RTA_NEXT(rth, rtl)) {
+		char tmp[128];
+		memset(tmp, 0, sizeof(tmp));
+		switch(rth->rta_type) {
+		case IFA_ADDRESS:
+		case IFA_LOCAL:
+		case IFA_BROADCAST:
+		case IFA_ANYCAST:
+			inet_ntop(ifa->ifa_family, RTA_DATA(rth), tmp, sizeof(tmp));
+			break;
+		case IFA_LABEL:
+			strncpy(tmp, RTA_DATA(rth), sizeof(tmp) - 1);
+			break;
+		case IFA_CACHEINFO:
+			{
+				struct ifa_cacheinfo *cache_info;
+				cache_info = RTA_DATA(rth);
+				snprintf(tmp, sizeof(tmp), "valid=%u preferred=%u",
+				         cache_info->ifa_valid, cache_info->ifa_prefered);
+			}
 			break;
-		switch(nlhdr->nlmsg_type) {
-		case RTM_DELLINK:
-			is_del = 1;
-			FALL_THROUGH;
-		case RTM_NEWLINK:
+		default:
+			strncpy(tmp, "*unknown*", sizeof(tmp));
+		}
+		syslog(LOG_DEBUG, " - %u - %s type=%d",
+		       ifa->ifa_index, tmp,
+		       rth->rta_type);
+	}
+}
+
+void
+ProcessInterfaceWatchNotify(int s)
+{
+	char buffer[8192];
+	struct nlmsghdr *nlhdr;
 #if 0
 /* disabled at the moment */
-			ifi = (struct ifinfomsg *) NLMSG_DATA(nlhdr);
-			if(is_del) {
-				if(ProcessInterfaceDown(ifi) < 0)
-					syslog(LOG_ERR, "ProcessInterfaceDown(ifi) failed");
-			} else {
-				if(ProcessInterfaceUp(ifi) < 0)
-					syslog(LOG_ERR, "ProcessInterfaceUp(ifi) failed");
-			}
+	struct ifinfomsg *ifi;
 #endif
+	struct ifaddrmsg *ifa;
+	int len;
+	int changed = 0;
+
+	/* read all the queued messages */
+	for(;;)
+	{
+		len = recv(s, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ENOBUFS)
+			{
+				/* messages were lost : check everything */
+				syslog(LOG_WARNING, "%s: netlink messages lost", "ProcessInterfaceWatchNotify");
+				add_pending_change(0, 0);
+				pending.overflow = 1;
+				changed = 1;
+				continue;
+			}
+			syslog(LOG_ERR, "recv(s, buffer, ...): %m");
 			break;
-		case RTM_DELADDR:
-			is_del = 1;
-			FALL_THROUGH;
-		case RTM_NEWADDR:
-			/* see /usr/include/linux/netlink.h
-			 * and /usr/include/linux/rtnetlink.h */
-			ifa = (struct ifaddrmsg *) NLMSG_DATA(nlhdr);
-			syslog(LOG_DEBUG, "%s %s index=%d fam=%d", "ProcessInterfaceWatchNotify",
-			       is_del ? "RTM_DELADDR" : "RTM_NEWADDR",
-			       ifa->ifa_index, ifa->ifa_family);
-			for(rth = IFA_RTA(ifa), rtl = IFA_PAYLOAD(nlhdr);
-			    rtl && RTA_OK(rth, rtl);
-			    rth = RTA_NEXT(rth, rtl)) {
-				char tmp[128];
-				memset(tmp, 0, sizeof(tmp));
-				switch(rth->rta_type) {
-				case IFA_ADDRESS:
-				case IFA_LOCAL:
-				case IFA_BROADCAST:
-				case IFA_ANYCAST:
-					inet_ntop(ifa->ifa_family, RTA_DATA(rth), tmp, sizeof(tmp));
-					if(rth->rta_type == IFA_ADDRESS)
-						strncpy(address, tmp, sizeof(address));
-					break;
-				case IFA_LABEL:
-					strncpy(tmp, RTA_DATA(rth), sizeof(tmp));
-					strncpy(ifname, tmp, sizeof(ifname));
-					break;
-				case IFA_CACHEINFO:
-					{
-						struct ifa_cacheinfo *cache_info;
-						cache_info = RTA_DATA(rth);
-						snprintf(tmp, sizeof(tmp), "valid=%u preferred=%u",
-						         cache_info->ifa_valid, cache_info->ifa_prefered);
-					}
-					break;
-				default:
-					strncpy(tmp, "*unknown*", sizeof(tmp));
+		}
+
+		for (nlhdr = (struct nlmsghdr *) buffer;
+		     NLMSG_OK (nlhdr, (unsigned int)len);
+		     nlhdr = NLMSG_NEXT (nlhdr, len))
+		{
+			int is_del = 0;
+			if (nlhdr->nlmsg_type == NLMSG_DONE)
+				break;
+			switch(nlhdr->nlmsg_type) {
+			case RTM_DELLINK:
+				is_del = 1;
+				FALL_THROUGH;
+			case RTM_NEWLINK:
+#if 0
+/* disabled at the moment */
+				ifi = (struct ifinfomsg *) NLMSG_DATA(nlhdr);
+				if(is_del) {
+					if(ProcessInterfaceDown(ifi) < 0)
+						syslog(LOG_ERR, "ProcessInterfaceDown(ifi) failed");
+				} else {
+					if(ProcessInterfaceUp(ifi) < 0)
+						syslog(LOG_ERR, "ProcessInterfaceUp(ifi) failed");
 				}
-				syslog(LOG_DEBUG, " - %u - %s type=%d",
-				       ifa->ifa_index, tmp,
-				       rth->rta_type);
-			}
-			if(ifa->ifa_index == ext_if_name_index) {
-				should_send_public_address_change_notif = 1;
+#endif
+				add_pending_change(((struct ifinfomsg *)NLMSG_DATA(nlhdr))->ifi_index,
+				                   IFACE_CHANGE_LINK);
+				changed = 1;
+				break;
+			case RTM_DELADDR:
+				is_del = 1;
+				FALL_THROUGH;
+			case RTM_NEWADDR:
+				/* see /usr/include/linux/netlink.h
+				 * and /usr/include/linux/rtnetlink.h */
+				ifa = (struct ifaddrmsg *) NLMSG_DATA(nlhdr);
+				log_address(nlhdr, is_del);
+				add_pending_change(ifa->ifa_index,
+				                   (ifa->ifa_family == AF_INET)
+				                   ? IFACE_CHANGE_ADDR4 : IFACE_CHANGE_ADDR6);
+				changed = 1;
+				break;
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				getroute_invalidate_cache();
+				break;
+			default:
+				syslog(LOG_DEBUG, "%s type %d ignored",
+				       "ProcessInterfaceWatchNotify", nlhdr->nlmsg_type);
 			}
-			break;
-		default:
-			syslog(LOG_DEBUG, "%s type %d ignored",
-			       "ProcessInterfaceWatchNotify", nlhdr->nlmsg_type);
 		}
 	}
-
+	if(changed) {
+		/* once for all the messages read */
+		getifaddr_invalidate_cache();
+		getroute_invalidate_cache();
+		/* the IPv6 prefixes of the LAN interfaces may have changed */
+		invalidate_lan_index();
+	}
 }
 
 #endif
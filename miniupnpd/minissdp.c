@@ -34,6 +34,7 @@
 #include "upnphttp.h"
 #include "upnpglobalvars.h"
 #include "minissdp.h"
+#include "ssdppktgen.h"
 #include "upnputils.h"
 #include "getroute.h"
 #include "asyncsendto.h"
@@ -43,6 +44,9 @@
 #ifndef MIN
 #define MIN(x,y) (((x)<(y))?(x):(y))
 #endif /* MIN */
+#ifndef MAX
+#define MAX(x,y) (((x)>(y))?(x):(y))
+#endif /* MAX */
 
 /* SSDP ip/port */
 #define SSDP_PORT (1900)
@@ -535,86 +539,19 @@ SendSSDPResponse(int s, const struct sockaddr * addr,
 	char buf[SSDP_PACKET_MAX_LEN];
 	char addr_str[64];
 	socklen_t addrlen;
-	int st_is_uuid;
-#ifdef ENABLE_HTTP_DATE
-	char http_date[64];
-	time_t t;
-	struct tm tm;
-
-	time(&t);
-	gmtime_r(&t, &tm);
-	strftime(http_date, sizeof(http_date),
-		    "%a, %d %b %Y %H:%M:%S GMT", &tm);
-#endif
 
-	st_is_uuid = (st_len == (int)strlen(uuidvalue)) &&
-	              (memcmp(uuidvalue, st, st_len) == 0);
-	/*
-	 * follow guideline from document "UPnP Device Architecture 1.0"
-	 * uppercase is recommended.
-	 * DATE: is recommended
-	 * SERVER: OS/ver UPnP/1.0 miniupnpd/1.0
-	 * CACHE-CONTROL: Should be greater than or equal to 1800 seconds
-	 */
-	l = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
-		"CACHE-CONTROL: max-age=1800\r\n"
-#ifdef ENABLE_HTTP_DATE
-		"DATE: %s\r\n"
-#endif
-		"ST: %.*s%s\r\n"
-		"USN: %s%s%.*s%s\r\n"
-		"EXT:\r\n"
-		"SERVER: " MINIUPNPD_SERVER_STRING "\r\n"
-#ifndef RANDOMIZE_URLS
-		"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
+	l = BuildSSDPResponse(buf, sizeof(buf), st, st_len, suffix,
+	                      host, http_port,
 #ifdef ENABLE_HTTPS
-		"SECURELOCATION.UPNP.ORG: https://%s:%u" ROOTDESC_PATH "\r\n"
-#endif	/* ENABLE_HTTPS */
-#else	/* RANDOMIZE_URLS */
-		"LOCATION: http://%s:%u/%s" ROOTDESC_PATH "\r\n"
-#ifdef ENABLE_HTTPS
-		"SECURELOCATION.UPNP.ORG: https://%s:%u/%s" ROOTDESC_PATH "\r\n"
-#endif	/* ENABLE_HTTPS */
-#endif	/* RANDOMIZE_URLS */
-		"OPT: \"http://schemas.upnp.org/upnp/1/0/\"; ns=01\r\n" /* UDA v1.1 */
-		"01-NLS: %u\r\n" /* same as BOOTID. UDA v1.1 */
-		"BOOTID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
-		"CONFIGID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
-		"\r\n",
-#ifdef ENABLE_HTTP_DATE
-		http_date,								/* DATE: */
-#endif
-		st_len, st, suffix,						/* ST: */
-		uuidvalue, st_is_uuid ? "" : "::",		/* USN: 2/5 */
-		st_is_uuid ? 0 : st_len, st, suffix,	/* USN: 3/5 */
-#ifdef DYNAMIC_OS_VERSION
-		os_version,								/* SERVER: */
+	                      https_port,
 #endif
-		host, (unsigned int)http_port,			/* LOCATION: */
-#ifdef RANDOMIZE_URLS
-		random_url,								/* LOCATION: 3/3 */
-#endif	/* RANDOMIZE_URLS */
-#ifdef ENABLE_HTTPS
-		host, (unsigned int)https_port,			/* SECURELOCATION.UPNP.ORG */
-#ifdef RANDOMIZE_URLS
-		random_url,								/* SECURELOCATION.UPNP.ORG 3/3 */
-#endif	/* RANDOMIZE_URLS */
-#endif	/* ENABLE_HTTPS */
-		upnp_bootid,							/* 01-NLS: */
-		upnp_bootid,							/* BOOTID.UPNP.ORG: */
-		upnp_configid);							/* CONFIGID.UPNP.ORG: */
-	if(l<0)
+	                      uuidvalue);
+	if(l < 0)
 	{
-		syslog(LOG_ERR, "%s: snprintf failed %m",
+		syslog(LOG_ERR, "%s: failed to build the response",
 		       "SendSSDPResponse()");
 		return;
 	}
-	else if((unsigned)l>=sizeof(buf))
-	{
-		syslog(LOG_WARNING, "%s: truncated output (%u>=%u)",
-		       "SendSSDPResponse()", (unsigned)l, (unsigned)sizeof(buf));
-		l = sizeof(buf) - 1;
-	}
 	addrlen = (addr->sa_family == AF_INET6)
 	          ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 	n = sendto_schedule(s, buf, l, 0,
@@ -687,57 +624,15 @@ SendSSDPNotify(int s, const struct sockaddr * dest, socklen_t dest_len,
 	char bufr[SSDP_PACKET_MAX_LEN];
 	int n, l;
 
-	l = snprintf(bufr, sizeof(bufr),
-		"NOTIFY * HTTP/1.1\r\n"
-		"HOST: %s:%d\r\n"
-		"CACHE-CONTROL: max-age=%u\r\n"
-#ifndef RANDOMIZE_URLS
-		"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
-#ifdef ENABLE_HTTPS
-		"SECURELOCATION.UPNP.ORG: https://%s:%u" ROOTDESC_PATH "\r\n"
-#endif	/* ENABLE_HTTPS */
-#else	/* RANDOMIZE_URLS */
-		"LOCATION: http://%s:%u/%s" ROOTDESC_PATH "\r\n"
+	l = BuildSSDPNotify(bufr, sizeof(bufr), dest_str,
+	                    host, http_port,
 #ifdef ENABLE_HTTPS
-		"SECURELOCATION.UPNP.ORG: https://%s:%u/%s" ROOTDESC_PATH "\r\n"
-#endif	/* ENABLE_HTTPS */
-#endif	/* RANDOMIZE_URLS */
-		"SERVER: " MINIUPNPD_SERVER_STRING "\r\n"
-		"NT: %s%s\r\n"
-		"USN: %s%s%s%s\r\n"
-		"NTS: ssdp:alive\r\n"
-		"OPT: \"http://schemas.upnp.org/upnp/1/0/\"; ns=01\r\n" /* UDA v1.1 */
-		"01-NLS: %u\r\n" /* same as BOOTID field. UDA v1.1 */
-		"BOOTID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
-		"CONFIGID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
-		"\r\n",
-		dest_str, SSDP_PORT,			/* HOST: */
-		lifetime,						/* CACHE-CONTROL: */
-		host, (unsigned int)http_port,	/* LOCATION: */
-#ifdef RANDOMIZE_URLS
-		random_url,
-#endif	/* RANDOMIZE_URLS */
-#ifdef ENABLE_HTTPS
-		host, (unsigned int)https_port,	/* SECURE-LOCATION: */
-#ifdef RANDOMIZE_URLS
-		random_url,
-#endif	/* RANDOMIZE_URLS */
-#endif	/* ENABLE_HTTPS */
-#ifdef DYNAMIC_OS_VERSION
-		os_version,						/* SERVER: */
+	                    https_port,
 #endif
-		nt, suffix,						/* NT: */
-		usn1, usn2, usn3, suffix,		/* USN: */
-		upnp_bootid,					/* 01-NLS: */
-		upnp_bootid,					/* BOOTID.UPNP.ORG: */
-		upnp_configid );				/* CONFIGID.UPNP.ORG: */
-	if(l<0) {
-		syslog(LOG_ERR, "%s: snprintf error", "SendSSDPNotify()");
+	                    nt, suffix, usn1, usn2, usn3, lifetime);
+	if(l < 0) {
+		syslog(LOG_ERR, "%s: failed to build the packet", "SendSSDPNotify()");
 		return;
-	} else if((unsigned int)l >= sizeof(bufr)) {
-		syslog(LOG_WARNING, "%s: truncated output (%u>=%u)",
-		       "SendSSDPNotify()", (unsigned)l, (unsigned)sizeof(bufr));
-		l = sizeof(bufr) - 1;
 	}
 	n = sendto_or_schedule(s, bufr, l, 0, dest, dest_len);
 	if(n < 0) {
@@ -757,25 +652,62 @@ SendSSDPNotify(int s, const struct sockaddr * dest, socklen_t dest_len,
 	}
 }
 
-/* SendSSDPNotifies() send SSPD NOTIFY for a specific
- * LAN (network interface) for all devices / services */
-#ifdef ENABLE_HTTPS
-static void
-SendSSDPNotifies(int s, const char * host, unsigned short http_port,
-                 unsigned short https_port,
-                 unsigned int lifetime, int ipv6)
-#else
+/* the NOTIFY sent for each destination : one for each service
+ * or device type, and one more on the uuid for each device */
+static struct {
+	short service;	/* index in known_service_types[] */
+	short uuid;
+} notify_units[2 * sizeof(known_service_types) / sizeof(known_service_types[0])];
+static int notify_units_count = 0;
+
 static void
-SendSSDPNotifies(int s, const char * host, unsigned short http_port,
-                 unsigned int lifetime, int ipv6)
-#endif
+init_notify_units(void)
 {
+	int i;
+
+	notify_units_count = 0;
+	for(i = 0; known_service_types[i].s; i++) {
+		notify_units[notify_units_count].service = i;
+		notify_units[notify_units_count].uuid = 0;
+		notify_units_count++;
+		/* for devices, also send NOTIFY on the uuid */
+		if(i > 0 &&	/* only known_service_types[0].s is shorter than "urn:schemas-upnp-org:device" */
+		   0==memcmp(known_service_types[i].s,
+		             "urn:schemas-upnp-org:device", sizeof("urn:schemas-upnp-org:device")-1)) {
+			notify_units[notify_units_count].service = i;
+			notify_units[notify_units_count].uuid = 1;
+			notify_units_count++;
+		}
+	}
+}
+
+/* number of NOTIFY for a LAN (network interface) */
+static unsigned int
+notify_count(int ipv6)
+{
+	unsigned int n = 1;
 #ifdef ENABLE_IPV6
-	struct sockaddr_storage sockname;
-	int j;
+	if(ipv6)
+		for(n = 0; mcast_addrs[n].p1 != NULL; n++);
 #else /* ENABLE_IPV6 */
-	struct sockaddr_in sockname;
+	UNUSED(ipv6);
 #endif /* ENABLE_IPV6 */
+	if(notify_units_count == 0)
+		init_notify_units();
+	return n * notify_units_count;
+}
+
+/* SendSSDPNotifyK() sends the NOTIFY number k for a specific
+ * LAN (network interface). k / notify_units_count is the destination
+ * (only 1 for IPv4) and k % notify_units_count the index in notify_units[] */
+static void
+SendSSDPNotifyK(int s, const char * host, unsigned short http_port,
+#ifdef ENABLE_HTTPS
+                unsigned short https_port,
+#endif
+                unsigned int lifetime, int ipv6, unsigned int k)
+{
+	struct sockaddr_storage sockname;
 	socklen_t sockname_len;
 	const char * dest_str;
 	int i;
@@ -786,104 +718,354 @@ SendSSDPNotifies(int s, const char * host, unsigned short http_port,
 
 	memset(&sockname, 0, sizeof(sockname));
 #ifdef ENABLE_IPV6
-	/* first iterate destinations for this LAN interface (only 1 for IPv4) */
-	for(j = 0; (mcast_addrs[j].p1 != 0 && ipv6) || j < 1; j++) {
-		if(ipv6) {
-			struct sockaddr_in6 * p = (struct sockaddr_in6 *)&sockname;
-			sockname_len = sizeof(struct sockaddr_in6);
-			p->sin6_family = AF_INET6;
-			p->sin6_port = htons(SSDP_PORT);
-			inet_pton(AF_INET6, mcast_addrs[j].p1, &(p->sin6_addr));
-			dest_str = mcast_addrs[j].p2;
-			/* UPnP Device Architecture 1.1 :
-			 * Devices MUST multicast SSDP messages for each of the UPnP-enabled
-			 * interfaces. The scope of multicast SSDP messages MUST be
-			 * link local FF02::C if the message is sent from a link local address.
-			 * If the message is sent from a global address it MUST be multicast
-			 * using either global scope FF0E::C or site local scope FF05::C.
-			 * In networks with complex topologies and overlapping sites, use of
-			 * global scope is RECOMMENDED. */
-		} else {
+	if(ipv6) {
+		struct sockaddr_in6 * p = (struct sockaddr_in6 *)&sockname;
+		sockname_len = sizeof(struct sockaddr_in6);
+		p->sin6_family = AF_INET6;
+		p->sin6_port = htons(SSDP_PORT);
+		inet_pton(AF_INET6, mcast_addrs[k / notify_units_count].p1, &(p->sin6_addr));
+		dest_str = mcast_addrs[k / notify_units_count].p2;
+		/* UPnP Device Architecture 1.1 :
+		 * Devices MUST multicast SSDP messages for each of the UPnP-enabled
+		 * interfaces. The scope of multicast SSDP messages MUST be
+		 * link local FF02::C if the message is sent from a link local address.
+		 * If the message is sent from a global address it MUST be multicast
+		 * using either global scope FF0E::C or site local scope FF05::C.
+		 * In networks with complex topologies and overlapping sites, use of
+		 * global scope is RECOMMENDED. */
+	} else {
 #else /* ENABLE_IPV6 */
-		{
+	{
 #endif /* ENABLE_IPV6 */
-			/* IPv4 */
-			struct sockaddr_in *p = (struct sockaddr_in *)&sockname;
-			sockname_len = sizeof(struct sockaddr_in);
-			p->sin_family = AF_INET;
-			p->sin_port = htons(SSDP_PORT);
-			p->sin_addr.s_addr = inet_addr(SSDP_MCAST_ADDR);
-			dest_str = SSDP_MCAST_ADDR;
-		}
+		/* IPv4 */
+		struct sockaddr_in *p = (struct sockaddr_in *)&sockname;
+		sockname_len = sizeof(struct sockaddr_in);
+		p->sin_family = AF_INET;
+		p->sin_port = htons(SSDP_PORT);
+		p->sin_addr.s_addr = inet_addr(SSDP_MCAST_ADDR);
+		dest_str = SSDP_MCAST_ADDR;
+	}
 
-		/* iterate all services / devices */
-		for(i = 0; known_service_types[i].s; i++) {
-			if(i==0)
-				ver_str[0] = '\0';
-			else
-				snprintf(ver_str, sizeof(ver_str), "%d", known_service_types[i].version);
-			SendSSDPNotify(s, (struct sockaddr *)&sockname, sockname_len, dest_str,
-			               host, http_port,
+	i = notify_units[k % notify_units_count].service;
+	if(notify_units[k % notify_units_count].uuid) {
+		SendSSDPNotify(s, (struct sockaddr *)&sockname, sockname_len, dest_str,
+		               host, http_port,
 #ifdef ENABLE_HTTPS
-			               https_port,
+		               https_port,
 #endif
-			               known_service_types[i].s, ver_str,	/* NT: */
-			               known_service_types[i].uuid, "::",
-			               known_service_types[i].s, /* ver_str,	USN: */
-			               lifetime);
-			/* for devices, also send NOTIFY on the uuid */
-			if(i > 0 &&	/* only known_service_types[0].s is shorter than "urn:schemas-upnp-org:device" */
-			   0==memcmp(known_service_types[i].s,
-			             "urn:schemas-upnp-org:device", sizeof("urn:schemas-upnp-org:device")-1)) {
-				SendSSDPNotify(s, (struct sockaddr *)&sockname, sockname_len, dest_str,
-				               host, http_port,
+		               known_service_types[i].uuid, "",	/* NT: */
+		               known_service_types[i].uuid, "", "", /* ver_str,	USN: */
+		               lifetime);
+	} else {
+		if(i==0)
+			ver_str[0] = '\0';
+		else
+			snprintf(ver_str, sizeof(ver_str), "%d", known_service_types[i].version);
+		SendSSDPNotify(s, (struct sockaddr *)&sockname, sockname_len, dest_str,
+		               host, http_port,
 #ifdef ENABLE_HTTPS
-				               https_port,
+		               https_port,
 #endif
-				               known_service_types[i].uuid, "",	/* NT: */
-				               known_service_types[i].uuid, "", "", /* ver_str,	USN: */
-				               lifetime);
-			}
-		} /* for(i = 0; known_service_types[i].s; i++) */
+		               known_service_types[i].s, ver_str,	/* NT: */
+		               known_service_types[i].uuid, "::",
+		               known_service_types[i].s, /* ver_str,	USN: */
+		               lifetime);
+	}
+}
+
+/* NOTIFY pacing :
+ * The NOTIFY of a round (all interfaces, all destinations, all
+ * devices / services) are sent one after the other, evenly spread
+ * over the round duration, and never faster than ssdp_notify_max_pps.
+ * The NOTIFY not sent when the next round starts are dropped. */
 #ifdef ENABLE_IPV6
-	} /* for(j = 0; (mcast_addrs[j].p1 != 0 && ipv6) || j < 1; j++) */
-#endif /* ENABLE_IPV6 */
+#define NOTIFY_SOCKETS_PER_LAN	(2)
+#else
+#define NOTIFY_SOCKETS_PER_LAN	(1)
+#endif
+/* each NOTIFY is sent twice, see SendSSDPNotify() */
+#define NOTIFY_PACKETS	(2)
+
+static struct {
+	int * sockets;
+	unsigned short http_port;
+#ifdef ENABLE_HTTPS
+	unsigned short https_port;
+#endif
+	unsigned int lifetime;
+	struct timeval start;
+	unsigned int spread;	/* milliseconds */
+	unsigned int total;	/* NOTIFY in the round */
+	unsigned int sent;	/* NOTIFY already sent */
+	/* next NOTIFY to send. lan_addr is NULL at the end of the round */
+	const struct lan_addr_s * lan_addr;
+	int slot;	/* index in sockets[] */
+	unsigned int k;	/* see SendSSDPNotifyK() */
+	int deferred;	/* the next NOTIFY was delayed by the ceiling */
+	/* packets per second ceiling, in 1/1000th of packet */
+	long credit;
+	struct timeval credit_time;
+} notify_pacer;
+
+static unsigned long notify_sent;
+static unsigned long notify_deferred;
+static unsigned long notify_dropped;
+
+/* move notify_pacer to the first valid NOTIFY from the current one */
+static void
+notify_pacer_skip(void)
+{
+	int ipv6;
+
+	while(notify_pacer.lan_addr != NULL) {
+		ipv6 = (notify_pacer.slot % NOTIFY_SOCKETS_PER_LAN) != 0;
+		if(notify_pacer.sockets[notify_pacer.slot] >= 0
+		   && notify_pacer.k < notify_count(ipv6))
+			return;
+		notify_pacer.k = 0;
+		notify_pacer.slot++;
+		if((notify_pacer.slot % NOTIFY_SOCKETS_PER_LAN) == 0)
+			notify_pacer.lan_addr = notify_pacer.lan_addr->list.le_next;
+	}
 }
 
-/* SendSSDPNotifies2() sends SSDP NOTIFY packets on all interfaces
- * for all destinations, all devices / services */
 void
-SendSSDPNotifies2(int * sockets,
+StartSSDPNotifies(int * sockets,
                   unsigned short http_port,
 #ifdef ENABLE_HTTPS
                   unsigned short https_port,
 #endif
-                  unsigned int lifetime)
+                  unsigned int lifetime, unsigned int spread,
+                  const struct timeval * now)
 {
 	int i;
-	struct lan_addr_s * lan_addr;
-	for(i = 0, lan_addr = lan_addrs.lh_first;
-	    lan_addr != NULL;
-	    lan_addr = lan_addr->list.le_next) {
-		SendSSDPNotifies(sockets[i], lan_addr->str, http_port,
+	const struct lan_addr_s * lan_addr;
+
+	if(notify_pacer.lan_addr != NULL) {
+		syslog(LOG_WARNING, "SSDP: %u NOTIFY of the previous round dropped",
+		       notify_pacer.total - notify_pacer.sent);
+		notify_dropped += notify_pacer.total - notify_pacer.sent;
+	}
+	notify_pacer.sockets = sockets;
+	notify_pacer.http_port = http_port;
 #ifdef ENABLE_HTTPS
-		                 https_port,
+	notify_pacer.https_port = https_port;
 #endif
-		                 lifetime, 0);
-		i++;
+	notify_pacer.lifetime = lifetime;
+	notify_pacer.start = *now;
+	notify_pacer.spread = spread;
+	notify_pacer.total = 0;
+	for(i = 0, lan_addr = lan_addrs.lh_first;
+	    lan_addr != NULL;
+	    lan_addr = lan_addr->list.le_next, i += NOTIFY_SOCKETS_PER_LAN) {
+		notify_pacer.total += notify_count(0);
 #ifdef ENABLE_IPV6
-		if(sockets[i] >= 0) {
-			SendSSDPNotifies(sockets[i], ipv6_addr_for_http_with_brackets, http_port,
+		if(sockets[i + 1] >= 0)
+			notify_pacer.total += notify_count(1);
+#endif /* ENABLE_IPV6 */
+	}
+	notify_pacer.sent = 0;
+	notify_pacer.lan_addr = lan_addrs.lh_first;
+	notify_pacer.slot = 0;
+	notify_pacer.k = 0;
+	notify_pacer.deferred = 0;
+	notify_pacer_skip();
+}
+
+/* milliseconds from a to b (0 if b is before a) */
+static long
+elapsed_ms(const struct timeval * a, const struct timeval * b)
+{
+	long ms;
+
+	ms = (long)(b->tv_sec - a->tv_sec) * 1000
+	     + (long)(b->tv_usec - a->tv_usec) / 1000;
+	return (ms < 0) ? 0 : ms;
+}
+
+void
+ProcessSSDPNotifies(const struct timeval * now, struct timeval * timeout)
+{
+	long elapsed;
+	long due;
+	long wait = -1;
+	long capacity;
+	int ipv6;
+
+	if(notify_pacer.lan_addr == NULL)
+		return;	/* nothing to send */
+	elapsed = elapsed_ms(&notify_pacer.start, now);
+	capacity = (long)MAX(ssdp_notify_max_pps, NOTIFY_PACKETS) * 1000;
+	if(ssdp_notify_max_pps > 0) {
+		long t = elapsed_ms(&notify_pacer.credit_time, now);
+		/* a full bucket is refilled in less than 2 seconds */
+		if(t > 2000)
+			notify_pacer.credit = capacity;
+		else
+			notify_pacer.credit = MIN(capacity,
+			                          notify_pacer.credit + t * (long)ssdp_notify_max_pps);
+		notify_pacer.credit_time = *now;
+	}
+	while(notify_pacer.lan_addr != NULL) {
+		/* time of this NOTIFY, from the start of the round */
+		due = (long)((unsigned long long)notify_pacer.sent * notify_pacer.spread
+		             / notify_pacer.total);
+		if(due > elapsed) {
+			wait = due - elapsed;
+			break;
+		}
+		if(ssdp_notify_max_pps > 0 &&
+		   notify_pacer.credit < NOTIFY_PACKETS * 1000) {
+			if(!notify_pacer.deferred) {
+				notify_pacer.deferred = 1;
+				notify_deferred++;
+			}
+			wait = (NOTIFY_PACKETS * 1000 - notify_pacer.credit
+			        + ssdp_notify_max_pps - 1) / ssdp_notify_max_pps;
+			break;
+		}
+		ipv6 = (notify_pacer.slot % NOTIFY_SOCKETS_PER_LAN) != 0;
+		SendSSDPNotifyK(notify_pacer.sockets[notify_pacer.slot],
+#ifdef ENABLE_IPV6
+		                ipv6 ? ipv6_addr_for_http_with_brackets :
+#endif /* ENABLE_IPV6 */
+		                notify_pacer.lan_addr->str,
+		                notify_pacer.http_port,
 #ifdef ENABLE_HTTPS
-			                 https_port,
+		                notify_pacer.https_port,
+#endif
+		                notify_pacer.lifetime, ipv6, notify_pacer.k);
+		notify_pacer.credit -= NOTIFY_PACKETS * 1000;
+		notify_pacer.deferred = 0;
+		notify_pacer.sent++;
+		notify_sent++;
+		notify_pacer.k++;
+		notify_pacer_skip();
+	}
+	if(wait >= 0 && (timeout->tv_sec > wait / 1000 ||
+	                 (timeout->tv_sec == wait / 1000 &&
+	                  timeout->tv_usec > (wait % 1000) * 1000))) {
+		timeout->tv_sec = wait / 1000;
+		timeout->tv_usec = (wait % 1000) * 1000;
+	}
+}
+
+#if defined(IP_RECVIF) || defined(IP_PKTINFO)
+#ifdef IP_RECVIF
+#define SSDP_CMSG_SPACE	CMSG_SPACE(sizeof(struct sockaddr_dl))
+#else /* IP_PKTINFO */
+#define SSDP_CMSG_SPACE	CMSG_SPACE(sizeof(struct in_pktinfo))
 #endif
-			                 lifetime, 1);
+
+/* get the index of the interface the packet was received on
+ * from the control messages. return -1 if not found */
+static int
+get_source_ifindex(struct msghdr * mh)
+{
+	int source_ifindex = -1;
+	struct cmsghdr *cmptr;
+
+	for(cmptr = CMSG_FIRSTHDR(mh); cmptr != NULL; cmptr = CMSG_NXTHDR(mh, cmptr))
+	{
+		syslog(LOG_DEBUG, "level=%d type=%d", cmptr->cmsg_level, cmptr->cmsg_type);
+#ifdef IP_RECVIF
+		if(cmptr->cmsg_level == IPPROTO_IP && cmptr->cmsg_type == IP_RECVIF)
+		{
+			struct sockaddr_dl *sdl;	/* fields : len, family, index, type, nlen, alen, slen, data */
+			sdl = (struct sockaddr_dl *)CMSG_DATA(cmptr);
+			syslog(LOG_DEBUG, "sdl_index = %d  %s", sdl->sdl_index, link_ntoa(sdl));
+			source_ifindex = sdl->sdl_index;
 		}
-		i++;
-#endif	/* ENABLE_IPV6 */
+#elif defined(IP_PKTINFO) /* IP_RECVIF */
+		if(cmptr->cmsg_level == IPPROTO_IP && cmptr->cmsg_type == IP_PKTINFO)
+		{
+			struct in_pktinfo * pi;	/* fields : ifindex, spec_dst, addr */
+			pi = (struct in_pktinfo *)CMSG_DATA(cmptr);
+			syslog(LOG_DEBUG, "ifindex = %u  %s", pi->ipi_ifindex, inet_ntoa(pi->ipi_spec_dst));
+			source_ifindex = pi->ipi_ifindex;
+		}
+#endif /* IP_PKTINFO */
+#if defined(ENABLE_IPV6) && defined(IPV6_RECVPKTINFO)
+		if(cmptr->cmsg_level == IPPROTO_IPV6 && cmptr->cmsg_type == IPV6_RECVPKTINFO)
+		{
+			struct in6_pktinfo * pi6;	/* fields : ifindex, addr */
+			pi6 = (struct in6_pktinfo *)CMSG_DATA(cmptr);
+			syslog(LOG_DEBUG, "ifindex = %u", pi6->ipi6_ifindex);
+			source_ifindex = pi6->ipi6_ifindex;
+		}
+#endif /* defined(ENABLE_IPV6) && defined(IPV6_RECVPKTINFO) */
 	}
+	return source_ifindex;
 }
+#endif /* defined(IP_RECVIF) || defined(IP_PKTINFO) */
+
+#if defined(HAVE_RECVMMSG) && (defined(IP_RECVIF) || defined(IP_PKTINFO))
+/* maximum number of SSDP packets read with one recvmmsg() call */
+#define SSDP_RECV_BATCH	(16)
 
+/* ProcessSSDPRequest()
+ * process SSDP M-SEARCH requests and responds to them.
+ * All the packets waiting on the socket (up to SSDP_RECV_BATCH)
+ * are read with a single recvmmsg() call */
+void
+#ifdef ENABLE_HTTPS
+ProcessSSDPRequest(int s, unsigned short http_port, unsigned short https_port)
+#else
+ProcessSSDPRequest(int s, unsigned short http_port)
+#endif
+{
+	int i, n;
+	static char bufr[SSDP_RECV_BATCH][1500];
+	static char cmbuf[SSDP_RECV_BATCH][SSDP_CMSG_SPACE];
+#ifdef ENABLE_IPV6
+	struct sockaddr_storage sendername[SSDP_RECV_BATCH];
+#else
+	struct sockaddr_in sendername[SSDP_RECV_BATCH];
+#endif
+	struct iovec iovec[SSDP_RECV_BATCH];
+	struct mmsghdr mmh[SSDP_RECV_BATCH];
+
+	memset(mmh, 0, sizeof(mmh));
+	for(i = 0; i < SSDP_RECV_BATCH; i++)
+	{
+		iovec[i].iov_base = bufr[i];
+		iovec[i].iov_len = sizeof(bufr[i]);
+		mmh[i].msg_hdr.msg_name = &sendername[i];
+		mmh[i].msg_hdr.msg_namelen = sizeof(sendername[i]);
+		mmh[i].msg_hdr.msg_iov = &iovec[i];
+		mmh[i].msg_hdr.msg_iovlen = 1;
+		mmh[i].msg_hdr.msg_control = cmbuf[i];
+		mmh[i].msg_hdr.msg_controllen = sizeof(cmbuf[i]);
+	}
+	n = recvmmsg(s, mmh, SSDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+	if(n < 0)
+	{
+		/* EAGAIN, EWOULDBLOCK, EINTR : silently ignore (try again next time)
+		 * other errors : log to LOG_ERR */
+		if(errno != EAGAIN &&
+		   errno != EWOULDBLOCK &&
+		   errno != EINTR)
+		{
+			syslog(LOG_ERR, "recvmmsg(udp): %m");
+		}
+		return;
+	}
+	for(i = 0; i < n; i++)
+	{
+#ifdef ENABLE_HTTPS
+		ProcessSSDPData(s, bufr[i], (int)mmh[i].msg_len,
+		                (struct sockaddr *)&sendername[i],
+		                get_source_ifindex(&mmh[i].msg_hdr),
+		                http_port, https_port);
+#else
+		ProcessSSDPData(s, bufr[i], (int)mmh[i].msg_len,
+		                (struct sockaddr *)&sendername[i],
+		                get_source_ifindex(&mmh[i].msg_hdr),
+		                http_port);
+#endif
+	}
+}
+#else /* defined(HAVE_RECVMMSG) && (defined(IP_RECVIF) || defined(IP_PKTINFO)) */
 /* ProcessSSDPRequest()
  * process SSDP M-SEARCH requests and responds to them */
 void
@@ -902,11 +1084,7 @@ ProcessSSDPRequest(int s, unsigned short http_port)
 #endif
 	int source_ifindex = -1;
 #if defined(IP_RECVIF) || defined(IP_PKTINFO)
-#ifdef IP_RECVIF
-	char cmbuf[CMSG_SPACE(sizeof(struct sockaddr_dl))];
-#else /* IP_PKTINFO */
-	char cmbuf[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
+	char cmbuf[SSDP_CMSG_SPACE];
 	struct iovec iovec = {
 		.iov_base = bufr,
 		.iov_len = sizeof(bufr)
@@ -919,7 +1097,6 @@ ProcessSSDPRequest(int s, unsigned short http_port)
 		.msg_control = cmbuf,
 		.msg_controllen = sizeof(cmbuf)
 	};
-	struct cmsghdr *cmptr;
 
 	n = recvmsg(s, &mh, 0);
 #else
@@ -946,36 +1123,7 @@ ProcessSSDPRequest(int s, unsigned short http_port)
 	}
 
 #if defined(IP_RECVIF) || defined(IP_PKTINFO)
-	for(cmptr = CMSG_FIRSTHDR(&mh); cmptr != NULL; cmptr = CMSG_NXTHDR(&mh, cmptr))
-	{
-		syslog(LOG_DEBUG, "level=%d type=%d", cmptr->cmsg_level, cmptr->cmsg_type);
-#ifdef IP_RECVIF
-		if(cmptr->cmsg_level == IPPROTO_IP && cmptr->cmsg_type == IP_RECVIF)
-		{
-			struct sockaddr_dl *sdl;	/* fields : len, family, index, type, nlen, alen, slen, data */
-			sdl = (struct sockaddr_dl *)CMSG_DATA(cmptr);
-			syslog(LOG_DEBUG, "sdl_index = %d  %s", sdl->sdl_index, link_ntoa(sdl));
-			source_ifindex = sdl->sdl_index;
-		}
-#elif defined(IP_PKTINFO) /* IP_RECVIF */
-		if(cmptr->cmsg_level == IPPROTO_IP && cmptr->cmsg_type == IP_PKTINFO)
-		{
-			struct in_pktinfo * pi;	/* fields : ifindex, spec_dst, addr */
-			pi = (struct in_pktinfo *)CMSG_DATA(cmptr);
-			syslog(LOG_DEBUG, "ifindex = %u  %s", pi->ipi_ifindex, inet_ntoa(pi->ipi_spec_dst));
-			source_ifindex = pi->ipi_ifindex;
-		}
-#endif /* IP_PKTINFO */
-#if defined(ENABLE_IPV6) && defined(IPV6_RECVPKTINFO)
-		if(cmptr->cmsg_level == IPPROTO_IPV6 && cmptr->cmsg_type == IPV6_RECVPKTINFO)
-		{
-			struct in6_pktinfo * pi6;	/* fields : ifindex, addr */
-			pi6 = (struct in6_pktinfo *)CMSG_DATA(cmptr);
-			syslog(LOG_DEBUG, "ifindex = %u", pi6->ipi6_ifindex);
-			source_ifindex = pi6->ipi6_ifindex;
-		}
-#endif /* defined(ENABLE_IPV6) && defined(IPV6_RECVPKTINFO) */
-	}
+	source_ifindex = get_source_ifindex(&mh);
 #endif /* defined(IP_RECVIF) || defined(IP_PKTINFO) */
 #ifdef ENABLE_HTTPS
 	ProcessSSDPData(s, bufr, n, (struct sockaddr *)&sendername, source_ifindex,
@@ -986,6 +1134,113 @@ ProcessSSDPRequest(int s, unsigned short http_port)
 #endif
 
 }
+#endif /* defined(HAVE_RECVMMSG) && (defined(IP_RECVIF) || defined(IP_PKTINFO)) */
+
+/* M-SEARCH storm protection.
+ * Control points often repeat the same M-SEARCH several times
+ * in a row. The (sender, ST) pairs are remembered in a small direct
+ * mapped table : a request already answered less than MX seconds
+ * ago is counted and ignored. */
+#define MSEARCH_TABLE_SIZE	(256)
+#define MSEARCH_ST_MAX_LEN	(128)
+
+struct msearch_entry {
+	struct timeval until;	/* end of the suppression window */
+	unsigned char addr[16];	/* IPv4 addresses are IPv4-mapped */
+	unsigned short port;
+	unsigned short st_len;	/* 0 = unused entry */
+	char st[MSEARCH_ST_MAX_LEN];
+};
+
+static struct msearch_entry msearch_table[MSEARCH_TABLE_SIZE];
+static unsigned long msearch_received;
+static unsigned long msearch_suppressed;
+
+/* return 1 if the same ST was received from sender less than
+ * window milliseconds ago. Otherwise remember the request and return 0 */
+static int
+msearch_is_repeated(const struct sockaddr * sender,
+                    const char * st, int st_len, unsigned int window)
+{
+	unsigned char addr[16];
+	unsigned short port;
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	struct msearch_entry * e;
+	struct timeval now;
+	int i;
+
+	msearch_received++;
+	if(st_len > MSEARCH_ST_MAX_LEN)
+		return 0;	/* not tracked */
+	memset(addr, 0, sizeof(addr));
+	if(sender->sa_family == AF_INET) {
+		const struct sockaddr_in * sin = (const struct sockaddr_in *)sender;
+		addr[10] = addr[11] = 0xff;
+		memcpy(addr + 12, &sin->sin_addr, 4);
+		port = sin->sin_port;
+#ifdef ENABLE_IPV6
+	} else if(sender->sa_family == AF_INET6) {
+		const struct sockaddr_in6 * sin6 = (const struct sockaddr_in6 *)sender;
+		memcpy(addr, &sin6->sin6_addr, 16);
+		port = sin6->sin6_port;
+#endif /* ENABLE_IPV6 */
+	} else {
+		return 0;
+	}
+	if(upnp_gettimeofday(&now) < 0)
+		return 0;
+	for(i = 0; i < 16; i++) {
+		h ^= addr[i];
+		h *= 16777619u;
+	}
+	h ^= port;
+	h *= 16777619u;
+	for(i = 0; i < st_len; i++) {
+		h ^= (unsigned char)st[i];
+		h *= 16777619u;
+	}
+	e = &msearch_table[h % MSEARCH_TABLE_SIZE];
+	if(e->st_len == st_len && e->port == port
+	   && memcmp(e->addr, addr, sizeof(addr)) == 0
+	   && memcmp(e->st, st, st_len) == 0
+	   && (now.tv_sec < e->until.tv_sec
+	       || (now.tv_sec == e->until.tv_sec && now.tv_usec < e->until.tv_usec))) {
+		msearch_suppressed++;
+		return 1;
+	}
+	/* new request, or replace an other (sender, ST) pair */
+	memcpy(e->addr, addr, sizeof(addr));
+	e->port = port;
+	e->st_len = (unsigned short)st_len;
+	memcpy(e->st, st, st_len);
+	e->until.tv_sec = now.tv_sec + window / 1000;
+	e->until.tv_usec = now.tv_usec + (window % 1000) * 1000;
+	if(e->until.tv_usec >= 1000000) {
+		e->until.tv_sec++;
+		e->until.tv_usec -= 1000000;
+	}
+	return 0;
+}
+
+#ifdef USE_MINIUPNPDCTL
+void
+write_ssdp_details(int fd)
+{
+	char buffer[128];
+	int len;
+
+	len = snprintf(buffer, sizeof(buffer),
+	               "SSDP M-SEARCH : received=%lu repeated_suppressed=%lu\n",
+	               msearch_received, msearch_suppressed);
+	if(len > 0 && len < (int)sizeof(buffer))
+		write(fd, buffer, len);
+	len = snprintf(buffer, sizeof(buffer),
+	               "SSDP NOTIFY : sent=%lu deferred=%lu dropped=%lu\n",
+	               notify_sent, notify_deferred, notify_dropped);
+	if(len > 0 && len < (int)sizeof(buffer))
+		write(fd, buffer, len);
+}
+#endif /* USE_MINIUPNPDCTL */
 
 #ifdef ENABLE_HTTPS
 void
@@ -1012,9 +1267,8 @@ ProcessSSDPData(int s, const char *bufr, int n,
 	char announced_host_buf[64];
 #endif
 #endif
-#if defined(UPNP_STRICT) || defined(DELAY_MSEARCH_RESPONSE)
 	int mx_value = -1;
-#endif
+	unsigned int window;	/* M-SEARCH duplicate suppression window (ms) */
 	unsigned int delay = 50; /* Non-zero default delay to prevent flooding */
 	/* UPnP Device Architecture v1.1.  1.3.3 Search response :
 	 * Devices responding to a multicast M-SEARCH SHOULD wait a random period
@@ -1096,7 +1350,6 @@ ProcessSSDPData(int s, const char *bufr, int n,
 				/*while(bufr[i+j]!='\r') j++;*/
 				/*syslog(LOG_INFO, "%.*s", j, bufr+i);*/
 			}
-#if defined(UPNP_STRICT) || defined(DELAY_MSEARCH_RESPONSE)
 			else if((i < n - 3) && (strncasecmp(bufr+i, "mx:", 3) == 0))
 			{
 				const char * mx;
@@ -1113,7 +1366,6 @@ ProcessSSDPData(int s, const char *bufr, int n,
 				mx_value = atoi(atoi_buffer);
 				syslog(LOG_DEBUG, "MX: %.*s (value=%d)", mx_len, mx, mx_value);
 			}
-#endif /* defined(UPNP_STRICT) || defined(DELAY_MSEARCH_RESPONSE) */
 #if defined(UPNP_STRICT)
 			/* Fix UDA-1.2.10 Man header empty or invalid */
 			else if((i < n - 4) && (strncasecmp(bufr+i, "man:", 4) == 0))
@@ -1163,6 +1415,15 @@ ProcessSSDPData(int s, const char *bufr, int n,
 		{
 			syslog(LOG_INFO, "SSDP M-SEARCH from %s ST: %.*s",
 			       sender_str, st_len, st);
+			/* the control point collects the responses during MX seconds :
+			 * the same request repeated in that window is already
+			 * answered by the responses we have scheduled. */
+			window = (mx_value < 1) ? 1000 : (mx_value > 5) ? 5000 : mx_value * 1000;
+			if(msearch_is_repeated(sender, st, st_len, window))
+			{
+				syslog(LOG_DEBUG, "repeated M-SEARCH from %s ignored", sender_str);
+				return;
+			}
 			/* find in which sub network the client is */
 #ifdef ENABLE_IPV6
 			if((sender->sa_family == AF_INET) ||
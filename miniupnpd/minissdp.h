@@ -7,6 +7,7 @@
 #ifndef MINISSDP_H_INCLUDED
 #define MINISSDP_H_INCLUDED
 
+#include <sys/time.h>
 #include "miniupnpdtypes.h"
 
 int
@@ -15,18 +16,24 @@ OpenAndConfSSDPReceiveSocket(int ipv6);
 int
 OpenAndConfSSDPNotifySockets(int * sockets);
 
-#ifdef ENABLE_HTTPS
+/* start a round of ssdp:alive NOTIFY on all interfaces
+ * for all destinations, all devices / services.
+ * The NOTIFY are sent by ProcessSSDPNotifies(), evenly spread
+ * over spread milliseconds, at most ssdp_notify_max_pps packets
+ * per second. The NOTIFY of the previous round not sent yet are dropped. */
 void
-SendSSDPNotifies2(int * sockets,
+StartSSDPNotifies(int * sockets,
                   unsigned short http_port,
+#ifdef ENABLE_HTTPS
                   unsigned short https_port,
-                  unsigned int lifetime);
-#else
-void
-SendSSDPNotifies2(int * sockets,
-                  unsigned short http_port,
-                  unsigned int lifetime);
 #endif
+                  unsigned int lifetime, unsigned int spread,
+                  const struct timeval * now);
+
+/* send the NOTIFY which are due.
+ * timeout is decreased to the time of the next NOTIFY */
+void
+ProcessSSDPNotifies(const struct timeval * now, struct timeval * timeout);
 
 void
 #ifdef ENABLE_HTTPS
@@ -51,6 +58,13 @@ ProcessSSDPData(int s, const char *bufr, int n,
 int
 SendSSDPGoodbye(int * sockets, int n);
 
+#ifdef USE_MINIUPNPDCTL
+/* write M-SEARCH counters (received and repeated requests ignored)
+ * and NOTIFY counters (sent, deferred and dropped) */
+void
+write_ssdp_details(int fd);
+#endif /* USE_MINIUPNPDCTL */
+
 int
 SubmitServicesToMiniSSDPD(const char * host, unsigned short port);
 
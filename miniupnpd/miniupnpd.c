@@ -37,6 +37,7 @@
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/param.h>
 #if defined(sun)
 #include <kstat.h>
@@ -86,6 +87,7 @@
 #include "daemonize.h"
 #include "upnpevents.h"
 #include "asyncsendto.h"
+#include "ratelimit.h"
 #ifdef ENABLE_NATPMP
 #include "natpmp.h"
 #ifdef ENABLE_PCP
@@ -1117,35 +1119,79 @@ parselan_error:
 
 static char ext_addr_str[INET_ADDRSTRLEN];
 
-int update_ext_ip_addr_from_stun(int init)
-{
-	struct in_addr if_addr, ext_addr;
+/* The STUN probes run in the background, driven by the main loop.
+ * The result is kept ext_stun_ttl seconds : the STUN server is probed
+ * again when the result expires, or when the address of the external
+ * interface changes. Failed probes are retried after STUN_RETRY_DELAY
+ * seconds, doubled after each failure up to ext_stun_ttl. All delays
+ * have a random jitter so routers do not probe the server together. */
+#define STUN_RETRY_DELAY	(30)
+#define STUN_RETRY_MAX_DELAY	(3600)
+
+static struct {
+	int valid;	/* ext_addr and restrictive_nat are set */
+	struct in_addr if_addr;	/* ext interface address of the result */
+	struct in_addr ext_addr;
 	int restrictive_nat;
-	char if_addr_str[INET_ADDRSTRLEN];
+	time_t expires;	/* 0 = never */
+	time_t next_probe;	/* 0 = no probe scheduled */
+	unsigned int failures;
+	struct in_addr probe_if_addr;	/* ext interface address of the probe */
+	int probe_requested;	/* probe started for an address change */
+} stun_state;
+
+/* delay +/- 12.5% */
+static time_t stun_jitter(unsigned int delay)
+{
+	return (time_t)(delay - delay / 8 + (unsigned int)random() % (delay / 4 + 1));
+}
 
-	syslog(LOG_INFO, "STUN: Performing with host=%s and port=%u ...", ext_stun_host, (unsigned)ext_stun_port);
+static void stun_schedule(time_t now, int success)
+{
+	unsigned int delay;
 
-	if (getifaddr(ext_if_name, if_addr_str, INET_ADDRSTRLEN, &if_addr, NULL) < 0) {
-		syslog(LOG_ERR, "STUN: Cannot get IP address for ext interface %s", ext_if_name);
-		return 1;
-	}
-	if (perform_stun(ext_if_name, if_addr_str, ext_stun_host, ext_stun_port, &ext_addr, &restrictive_nat) != 0) {
-		syslog(LOG_ERR, "STUN: Performing STUN failed: %s", strerror(errno));
-		return 1;
+	if (success) {
+		stun_state.failures = 0;
+		delay = ext_stun_ttl;
+	} else {
+		unsigned int max_delay = (ext_stun_ttl > 0) ? ext_stun_ttl : STUN_RETRY_MAX_DELAY;
+		delay = STUN_RETRY_DELAY;
+		if (stun_state.failures < 16)
+			delay <<= stun_state.failures;
+		else
+			delay = max_delay;
+		if (delay > max_delay)
+			delay = max_delay;
+		stun_state.failures++;
 	}
-	if (!inet_ntop(AF_INET, &ext_addr, ext_addr_str, sizeof(ext_addr_str))) {
+	stun_state.next_probe = (delay > 0) ? now + stun_jitter(delay) : 0;
+}
+
+/* apply a STUN result to use_ext_ip_addr and disable_port_forwarding
+ * returns 1 if the external address or the NAT type changed */
+static int apply_stun_result(int init, const char * if_addr_str,
+                             struct in_addr * if_addr,
+                             const struct in_addr * ext_addr,
+                             int restrictive_nat)
+{
+	int changed;
+
+	changed = !stun_state.valid
+	          || stun_state.ext_addr.s_addr != ext_addr->s_addr
+	          || stun_state.restrictive_nat != restrictive_nat;
+	if (!inet_ntop(AF_INET, ext_addr, ext_addr_str, sizeof(ext_addr_str))) {
 		syslog(LOG_ERR, "STUN: Function inet_ntop for IP address returned by STUN failed: %s", strerror(errno));
-		return 1;
+		return 0;
 	}
 
 	if ((init || disable_port_forwarding) && !restrictive_nat) {
-		if (addr_is_reserved(&if_addr))
+		if (addr_is_reserved(if_addr))
 			syslog(LOG_INFO, "STUN: ext interface %s with IP address %s is now behind unrestricted full-cone NAT 1:1 with public IP address %s and firewall does not block incoming connections set by miniupnpd", ext_if_name, if_addr_str, ext_addr_str);
 		else
 			syslog(LOG_INFO, "STUN: ext interface %s has now public IP address %s and firewall does not block incoming connections set by miniupnpd", ext_if_name, if_addr_str);
 		syslog(LOG_INFO, "Port forwarding is now enabled");
 	} else if ((init || !disable_port_forwarding) && restrictive_nat) {
-		if (addr_is_reserved(&if_addr)) {
+		if (addr_is_reserved(if_addr)) {
 			syslog(LOG_WARNING, "STUN: ext interface %s with private IP address %s is now possibly behind restrictive or symmetric NAT with public IP address %s which does not support port forwarding", ext_if_name, if_addr_str, ext_addr_str);
 			syslog(LOG_WARNING, "NAT on upstream router blocks incoming connections set by miniupnpd");
 			syslog(LOG_WARNING, "Turn off NAT on upstream router or change it to full-cone NAT 1:1 type");
@@ -1164,9 +1210,116 @@ int update_ext_ip_addr_from_stun(int init)
 	use_ext_ip_addr = ext_addr_str;
 	if (!GETFLAG(ALLOWFILTEREDSTUNMASK))
 		disable_port_forwarding = restrictive_nat;
+
+	stun_state.valid = 1;
+	stun_state.if_addr = *if_addr;
+	stun_state.ext_addr = *ext_addr;
+	stun_state.restrictive_nat = restrictive_nat;
+	return changed;
+}
+
+/* blocking STUN probe, used at startup */
+int update_ext_ip_addr_from_stun(int init)
+{
+	struct in_addr if_addr, ext_addr;
+	int restrictive_nat;
+	char if_addr_str[INET_ADDRSTRLEN];
+
+	syslog(LOG_INFO, "STUN: Performing with host=%s and port=%u ...", ext_stun_host, (unsigned)ext_stun_port);
+
+	if (getifaddr(ext_if_name, if_addr_str, INET_ADDRSTRLEN, &if_addr, NULL) < 0) {
+		syslog(LOG_ERR, "STUN: Cannot get IP address for ext interface %s", ext_if_name);
+		return 1;
+	}
+	if (perform_stun(ext_if_name, if_addr_str, ext_stun_host, ext_stun_port, &ext_addr, &restrictive_nat) != 0) {
+		syslog(LOG_ERR, "STUN: Performing STUN failed: %s", strerror(errno));
+		stun_schedule(upnp_time(), 0);
+		return 1;
+	}
+	apply_stun_result(init, if_addr_str, &if_addr, &ext_addr, restrictive_nat);
+	stun_schedule(upnp_time(), 1);
+	stun_state.expires = (ext_stun_ttl > 0) ? upnp_time() + ext_stun_ttl : 0;
 	return 0;
 }
 
+/* start a STUN probe in the background
+ * if_changed : the probe is for an address change of the ext interface,
+ *              the cached result is used if the address did not change,
+ *              a probe running for another address is restarted
+ * returns : 1 probe started, 0 cached result still valid, -1 error */
+static int start_stun_probe(int if_changed)
+{
+	struct in_addr if_addr;
+	char if_addr_str[INET_ADDRSTRLEN];
+	time_t now;
+
+	if (stun_probe_active() && !if_changed)
+		return 1;
+	now = upnp_time();
+	if (getifaddr(ext_if_name, if_addr_str, INET_ADDRSTRLEN, &if_addr, NULL) < 0) {
+		syslog(LOG_ERR, "STUN: Cannot get IP address for ext interface %s", ext_if_name);
+		stun_probe_cancel();
+		stun_schedule(now, 0);
+		return -1;
+	}
+	if (stun_probe_active()) {
+		if (stun_state.probe_if_addr.s_addr == if_addr.s_addr)
+			return 1;
+		/* the result of the running probe would be for the previous address */
+		syslog(LOG_INFO, "STUN: ext interface address changed to %s, restarting probe", if_addr_str);
+		stun_probe_cancel();
+	}
+	if (if_changed && stun_state.valid
+	    && stun_state.if_addr.s_addr == if_addr.s_addr
+	    && (stun_state.expires == 0 || now < stun_state.expires)) {
+		syslog(LOG_INFO, "STUN: ext interface address %s unchanged, using cached result", if_addr_str);
+		return 0;
+	}
+	syslog(LOG_INFO, "STUN: Performing with host=%s and port=%u ...", ext_stun_host, (unsigned)ext_stun_port);
+	if (stun_probe_start(ext_if_name, if_addr_str, ext_stun_host, ext_stun_port) < 0) {
+		syslog(LOG_ERR, "STUN: Performing STUN failed: %s", strerror(errno));
+		stun_schedule(now, 0);
+		return -1;
+	}
+	stun_state.probe_if_addr = if_addr;
+	stun_state.next_probe = 0;
+	return 1;
+}
+
+/* process the STUN probe in progress
+ * returns 1 if the public address change notifications should be sent */
+static int process_stun_probe(const fd_set * readset)
+{
+	struct in_addr ext_addr;
+	int restrictive_nat;
+	char if_addr_str[INET_ADDRSTRLEN];
+	int r;
+	time_t now;
+
+	r = stun_probe_process(readset, &ext_addr, &restrictive_nat);
+	if (r == 0)
+		return 0;	/* in progress */
+	now = upnp_time();
+	if (r < 0) {
+		syslog(LOG_ERR, "STUN: Performing STUN failed: %s", strerror(errno));
+		stun_schedule(now, 0);
+		if (stun_state.probe_requested) {
+			/* the address changed and STUN failed : port forwarding would not work */
+			disable_port_forwarding = 1;
+		} else if (stun_state.valid) {
+			syslog(LOG_WARNING, "STUN: keeping previous result %s", ext_addr_str);
+		}
+		return 0;
+	}
+	if (!inet_ntop(AF_INET, &stun_state.probe_if_addr, if_addr_str, sizeof(if_addr_str)))
+		if_addr_str[0] = '\0';
+	r = apply_stun_result(0, if_addr_str, &stun_state.probe_if_addr,
+	                      &ext_addr, restrictive_nat);
+	stun_schedule(now, 1);
+	stun_state.expires = (ext_stun_ttl > 0) ? now + ext_stun_ttl : 0;
+	return r;
+}
+
 /*! \brief check external IP address and update disable_port_forwarding
  */
 static void update_disable_port_forwarding(void)
@@ -1371,6 +1524,9 @@ init(int argc, char * * argv, struct runtime_vars * v)
 			case UPNPEXT_STUN_PORT:
 				ext_stun_port = atoi(ary_options[i].value);
 				break;
+			case UPNPEXT_STUN_TTL:
+				ext_stun_ttl = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
 			case UPNPLISTENING_IP:
 				lan_addr = (struct lan_addr_s *) malloc(sizeof(struct lan_addr_s));
 				if (lan_addr == NULL)
@@ -1498,6 +1654,48 @@ init(int argc, char * * argv, struct runtime_vars * v)
 			case UPNPCLEANINTERVAL:
 				v->clean_ruleset_interval = atoi(ary_options[i].value);
 				break;
+			case UPNPHTTPMAXHEADERSIZE:
+				http_max_header_size = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				if(http_max_header_size < 512)
+					http_max_header_size = 512;
+				else if(http_max_header_size > INT_MAX)
+					http_max_header_size = INT_MAX;
+				break;
+			case UPNPHTTPMAXBODYSIZE:
+				http_max_body_size = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				/* the Content-Length is stored in an int */
+				if(http_max_body_size > INT_MAX)
+					http_max_body_size = INT_MAX;
+				break;
+			case UPNPSOAPRATELIMIT:
+				soap_rate_limit = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+			case UPNPSOAPRATEBURST:
+				soap_rate_burst = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+			case UPNPPMPRATELIMIT:
+				pmp_rate_limit = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+			case UPNPPMPRATEBURST:
+				pmp_rate_burst = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+			case UPNPMAXMAPPINGS:
+				max_mappings = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+			case UPNPMAXMAPPINGSPERCLIENT:
+				max_mappings_per_client = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+			case UPNPSSDPNOTIFYMAXPPS:
+				ssdp_notify_max_pps = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+#ifdef ENABLE_EVENTS
+			case UPNPEVENTCOALESCINGWINDOW:
+				event_coalescing_window = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+			case UPNPMAXSUBSCRIBERSPERHOST:
+				max_subscribers_per_host = (unsigned int)strtoul(ary_options[i].value, 0, 0);
+				break;
+#endif
 #ifdef USE_PF
 			case UPNPANCHOR:
 				anchor_name = ary_options[i].value;
@@ -2035,6 +2233,9 @@ init(int argc, char * * argv, struct runtime_vars * v)
 
 	set_startup_time();
 
+	/* on failure, the permission rules are checked one by one */
+	compile_permissions(upnppermlist, num_upnpperm);
+
 	/* presentation url */
 	if(presurl)
 	{
@@ -2098,6 +2299,7 @@ init(int argc, char * * argv, struct runtime_vars * v)
 		syslog(LOG_ERR, "Failed to init redirection engine. EXITING");
 		return 1;
 	}
+	init_mapping_quotas();
 #ifdef ENABLE_UPNPPINHOLE
 #ifdef USE_NETFILTER
 	init_iptpinhole();
@@ -2732,19 +2934,31 @@ main(int argc, char * * argv)
 			should_rewrite_leasefile = 0;
 		}
 #endif /* !TOMATO && ENABLE_LEASEFILE && LEASEFILE_USE_REMAINING_TIME */
-		/* send public address change notifications if needed */
-		if(should_send_public_address_change_notif)
+#ifdef USE_IFACEWATCHER
+		/* interface changes gathered during the last iterations */
+		ApplyInterfaceWatchChanges();
+#endif
+		if(GETFLAG(PERFORMSTUNMASK))
 		{
-			syslog(LOG_INFO, "should send external iface address change notification(s)");
-			if(GETFLAG(PERFORMSTUNMASK))
+			if(should_send_public_address_change_notif && !stun_state.probe_requested)
 			{
-				if (update_ext_ip_addr_from_stun(0) != 0) {
-					/* if stun succeed it updates disable_port_forwarding;
-					 * if stun failed (non-zero return value) then port forwarding would not work, so disable it */
+				/* the notifications are sent when the probe is finished */
+				stun_state.probe_requested = 1;
+				if (start_stun_probe(1) < 0) {
+					/* port forwarding would not work, so disable it */
 					disable_port_forwarding = 1;
 				}
 			}
-			else if (!use_ext_ip_addr)
+			else if(stun_state.next_probe != 0 && upnp_time() >= stun_state.next_probe)
+			{
+				start_stun_probe(0);
+			}
+		}
+		/* send public address change notifications if needed */
+		if(should_send_public_address_change_notif && !stun_probe_active())
+		{
+			syslog(LOG_INFO, "should send external iface address change notification(s)");
+			if(!GETFLAG(PERFORMSTUNMASK) && !use_ext_ip_addr)
 			{
 				update_disable_port_forwarding();
 			}
@@ -2769,6 +2983,7 @@ main(int argc, char * * argv)
 			}
 #endif
 			should_send_public_address_change_notif = 0;
+			stun_state.probe_requested = 0;
 		}
 		/* Check if we need to send SSDP NOTIFY messages and do it if
 		 * needed */
@@ -2783,13 +2998,20 @@ main(int argc, char * * argv)
 			/* the comparaison is not very precise but who cares ? */
 			if(timeofday.tv_sec >= (lasttimeofday.tv_sec + current_notify_interval))
 			{
+				/* the first round is sent at once (within the
+				 * ssdp_notify_max_pps limit), the following ones
+				 * over half of the interval, so the delay between two
+				 * NOTIFY stays lower than their lifetime */
 				if (GETFLAG(ENABLEUPNPMASK))
-					SendSSDPNotifies2(snotify,
+					StartSSDPNotifies(snotify,
 				                  (unsigned short)v.port,
 #ifdef ENABLE_HTTPS
 					              (unsigned short)v.https_port,
 #endif
-				                  v.notify_interval << 1);
+				                  v.notify_interval << 1,
+				                  (lasttimeofday.tv_sec == 0 && lasttimeofday.tv_usec == 0)
+				                  ? 0 : (unsigned int)current_notify_interval * 500,
+				                  &timeofday);
 				current_notify_interval = gen_current_notify_interval(v.notify_interval);
 				memcpy(&lasttimeofday, &timeofday, sizeof(struct timeval));
 				timeout.tv_sec = current_notify_interval;
@@ -2810,6 +3032,8 @@ main(int argc, char * * argv)
 					timeout.tv_usec = lasttimeofday.tv_usec - timeofday.tv_usec;
 				}
 			}
+			if (GETFLAG(ENABLEUPNPMASK))
+				ProcessSSDPNotifies(&timeofday, &timeout);
 		}
 		/* remove unused rules */
 		if( v.clean_ruleset_interval
@@ -2852,6 +3076,17 @@ main(int argc, char * * argv)
 			timeout.tv_usec = 0;
 		}
 #endif /* ENABLE_UPNPPINHOLE */
+		/* next periodic STUN probe */
+		if(GETFLAG(PERFORMSTUNMASK) && stun_state.next_probe != 0
+		   && !stun_probe_active()) {
+			if(stun_state.next_probe <= timeofday.tv_sec) {
+				timeout.tv_sec = 0;
+				timeout.tv_usec = 0;
+			} else if(timeout.tv_sec >= stun_state.next_probe - timeofday.tv_sec) {
+				timeout.tv_sec = stun_state.next_probe - timeofday.tv_sec;
+				timeout.tv_usec = 0;
+			}
+		}
 
 		/* select open sockets (SSDP, HTTP listen, and all HTTP soap sockets) */
 		FD_ZERO(&readset);
@@ -2916,12 +3151,21 @@ main(int argc, char * * argv)
 		{
 			if(e->socket >= 0)
 			{
-				if(e->state <= EWaitingForHttpContent)
-					FD_SET(e->socket, &readset);
+				int want_write;
+				if(e->state <= EWaitingForHttpContent || e->state == ESSLHandshake)
+					want_write = 0;
 				else if(e->state == ESendingAndClosing)
-					FD_SET(e->socket, &writeset);
+					want_write = 1;
 				else
 					continue;
+#ifdef ENABLE_HTTPS
+				/* OpenSSL may need to write while reading and vice versa */
+				if(e->ssl_want == SSL_ERROR_WANT_READ)
+					want_write = 0;
+				else if(e->ssl_want == SSL_ERROR_WANT_WRITE)
+					want_write = 1;
+#endif /* ENABLE_HTTPS */
+				FD_SET(e->socket, want_write ? &writeset : &readset);
 				max_fd = MAX(max_fd, e->socket);
 				i++;
 			}
@@ -2964,6 +3208,12 @@ main(int argc, char * * argv)
 
 #ifdef ENABLE_EVENTS
 		upnpevents_selectfds(&readset, &writeset, &max_fd);
+		upnpevents_gettimeout(&timeout);
+#endif
+		stun_probe_selectfds(&readset, &max_fd);
+		stun_probe_gettimeout(&timeout);
+#ifdef USE_IFACEWATCHER
+		UpdateInterfaceWatchTimeout(&timeout);
 #endif
 
 		/* queued "sendto" */
@@ -3038,6 +3288,9 @@ main(int argc, char * * argv)
 					write_upnphttp_details(ectl->socket, upnphttphead.lh_first);
 					write_ctlsockets_list(ectl->socket, ctllisthead.lh_first);
 					write_ruleset_details(ectl->socket);
+					write_mapping_quotas(ectl->socket);
+					write_ratelimit_details(ectl->socket);
+					write_ssdp_details(ectl->socket);
 #ifdef ENABLE_EVENTS
 					write_events_details(ectl->socket);
 #endif
@@ -3084,27 +3337,54 @@ main(int argc, char * * argv)
 #ifdef ENABLE_EVENTS
 		upnpevents_processfds(&readset, &writeset);
 #endif
+		if(stun_probe_active() && process_stun_probe(&readset))
+		{
+			/* the external address or the NAT type changed */
+			should_send_public_address_change_notif = 1;
+			stun_state.probe_requested = 1;
+		}
 #ifdef ENABLE_NATPMP
 		/* process NAT-PMP packets */
 		for(i=0; i<addr_count; i++)
 		{
 			if((snatpmp[i] >= 0) && FD_ISSET(snatpmp[i], &readset))
 			{
-				unsigned char msg_buff[PCP_MAX_LEN];
-				struct sockaddr_in senderaddr;
-				socklen_t senderaddrlen;
-				int len;
-				memset(msg_buff, 0, PCP_MAX_LEN);
-				senderaddrlen = sizeof(senderaddr);
-				len = ReceiveNATPMPOrPCPPacket(snatpmp[i],
-				                               (struct sockaddr *)&senderaddr,
-				                               &senderaddrlen,
-				                               NULL,
-				                               msg_buff, sizeof(msg_buff));
-				if (len < 1)
-					continue;
+				struct natpmp_pcp_packet packets[NATPMP_RECV_BATCH];
+				int count, j;
+				count = ReceiveNATPMPOrPCPPackets(snatpmp[i], packets,
+				                                  NATPMP_RECV_BATCH);
+				for(j = 0; j < count; j++)
+				{
+					unsigned char * msg_buff = packets[j].msg_buff;
+					struct sockaddr_in * senderaddr = (struct sockaddr_in *)&packets[j].senderaddr;
+					int len = packets[j].len;
+					if (len < 1)
+						continue;
 #ifdef ENABLE_PCP
-				if (msg_buff[0]==0) {  /* version equals to 0 -> means NAT-PMP */
+					if (msg_buff[0]==0) {  /* version equals to 0 -> means NAT-PMP */
+						/* Check if the packet is coming from a LAN to enforce RFC6886 :
+						 * The NAT gateway MUST NOT accept mapping requests destined to the NAT
+						 * gateway's external IP address or received on its external network
+						 * interface.  Only packets received on the internal interface(s) with a
+						 * destination address matching the internal address(es) of the NAT
+						 * gateway should be allowed. */
+						/* TODO : move to ProcessIncomingNATPMPPacket() ? */
+						lan_addr = get_lan_for_peer((struct sockaddr *)senderaddr);
+						if(lan_addr == NULL) {
+							char sender_str[64];
+							sockaddr_to_string((struct sockaddr *)senderaddr, sender_str, sizeof(sender_str));
+							syslog(LOG_WARNING, "NAT-PMP packet sender %s not from a LAN, ignoring",
+							       sender_str);
+							continue;
+						}
+						ProcessIncomingNATPMPPacket(snatpmp[i], msg_buff, len,
+						                            senderaddr);
+					} else { /* everything else can be PCP */
+						ProcessIncomingPCPPacket(snatpmp[i], msg_buff, len,
+						                         (struct sockaddr *)senderaddr, NULL);
+					}
+
+#else
 					/* Check if the packet is coming from a LAN to enforce RFC6886 :
 					 * The NAT gateway MUST NOT accept mapping requests destined to the NAT
 					 * gateway's external IP address or received on its external network
@@ -3112,39 +3392,17 @@ main(int argc, char * * argv)
 					 * destination address matching the internal address(es) of the NAT
 					 * gateway should be allowed. */
 					/* TODO : move to ProcessIncomingNATPMPPacket() ? */
-					lan_addr = get_lan_for_peer((struct sockaddr *)&senderaddr);
+					lan_addr = get_lan_for_peer((struct sockaddr *)senderaddr);
 					if(lan_addr == NULL) {
 						char sender_str[64];
-						sockaddr_to_string((struct sockaddr *)&senderaddr, sender_str, sizeof(sender_str));
+						sockaddr_to_string((struct sockaddr *)senderaddr, sender_str, sizeof(sender_str));
 						syslog(LOG_WARNING, "NAT-PMP packet sender %s not from a LAN, ignoring",
 						       sender_str);
 						continue;
 					}
-					ProcessIncomingNATPMPPacket(snatpmp[i], msg_buff, len,
-					                            &senderaddr);
-				} else { /* everything else can be PCP */
-					ProcessIncomingPCPPacket(snatpmp[i], msg_buff, len,
-					                         (struct sockaddr *)&senderaddr, NULL);
-				}
-
-#else
-				/* Check if the packet is coming from a LAN to enforce RFC6886 :
-				 * The NAT gateway MUST NOT accept mapping requests destined to the NAT
-				 * gateway's external IP address or received on its external network
-				 * interface.  Only packets received on the internal interface(s) with a
-				 * destination address matching the internal address(es) of the NAT
-				 * gateway should be allowed. */
-				/* TODO : move to ProcessIncomingNATPMPPacket() ? */
-				lan_addr = get_lan_for_peer((struct sockaddr *)&senderaddr);
-				if(lan_addr == NULL) {
-					char sender_str[64];
-					sockaddr_to_string((struct sockaddr *)&senderaddr, sender_str, sizeof(sender_str));
-					syslog(LOG_WARNING, "NAT-PMP packet sender %s not from a LAN, ignoring",
-					       sender_str);
-					continue;
-				}
-				ProcessIncomingNATPMPPacket(snatpmp[i], msg_buff, len, &senderaddr);
+					ProcessIncomingNATPMPPacket(snatpmp[i], msg_buff, len, senderaddr);
 #endif
+				}
 			}
 		}
 #endif
@@ -3152,22 +3410,18 @@ main(int argc, char * * argv)
 		/* in IPv6, only PCP is supported, not NAT-PMP */
 		if(spcp_v6 >= 0 && FD_ISSET(spcp_v6, &readset))
 		{
-			unsigned char msg_buff[PCP_MAX_LEN];
-			struct sockaddr_in6 senderaddr;
-			socklen_t senderaddrlen;
-			struct sockaddr_in6 receiveraddr;
-			int len;
-			memset(msg_buff, 0, PCP_MAX_LEN);
-			senderaddrlen = sizeof(senderaddr);
-			len = ReceiveNATPMPOrPCPPacket(spcp_v6,
-			                               (struct sockaddr *)&senderaddr,
-			                               &senderaddrlen,
-			                               &receiveraddr,
-			                               msg_buff, sizeof(msg_buff));
-			if(len >= 1)
-				ProcessIncomingPCPPacket(spcp_v6, msg_buff, len,
-				                         (struct sockaddr *)&senderaddr,
-				                         &receiveraddr);
+			struct natpmp_pcp_packet packets[NATPMP_RECV_BATCH];
+			int count, j;
+			count = ReceiveNATPMPOrPCPPackets(spcp_v6, packets,
+			                                  NATPMP_RECV_BATCH);
+			for(j = 0; j < count; j++)
+			{
+				if(packets[j].len >= 1)
+					ProcessIncomingPCPPacket(spcp_v6, packets[j].msg_buff,
+					                         packets[j].len,
+					                         (struct sockaddr *)&packets[j].senderaddr,
+					                         &packets[j].receiveraddr);
+			}
 		}
 #endif
 		/* process SSDP packets */
@@ -3335,6 +3589,7 @@ shutdown:
 #ifdef USE_IFACEWATCHER
 	if(sifacewatcher >= 0) close(sifacewatcher);
 #endif
+	stun_probe_cancel();
 #ifdef ENABLE_NATPMP
 	for(i=0; i<addr_count; i++) {
 		if(snatpmp[i]>=0)
@@ -3382,6 +3637,7 @@ shutdown:
 #endif
 
 	/* delete lists */
+	invalidate_lan_index();
 	while(lan_addrs.lh_first != NULL)
 	{
 		lan_addr = lan_addrs.lh_first;
@@ -3398,6 +3654,7 @@ shutdown:
 	free(snotify);
 
 	shutdown_redirect();
+	free_mapping_quotas();
 
 #ifndef DISABLE_CONFIG_FILE
 	/* in some case shutdown_redirect() may need the option values */
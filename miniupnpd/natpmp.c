@@ -27,6 +27,7 @@
 #include "upnputils.h"
 #include "portinuse.h"
 #include "asyncsendto.h"
+#include "ratelimit.h"
 
 #ifdef ENABLE_NATPMP
 
@@ -92,30 +93,71 @@ error:
 	return -1;
 }
 
-static void FillPublicAddressResponse(unsigned char * resp, in_addr_t senderaddr)
-{
 #ifndef MULTIPLE_EXTERNAL_IP
+/* NAT-PMP clients poll the public address, so it is cached.
+ * The cache is invalidated by SendNATPMPPublicAddressChangeNotification()
+ * which is called when the ifacewatcher, SIGUSR1 or STUN report a
+ * change. An address read from the interface is still refreshed
+ * after PUBLIC_ADDR_CACHE_TTL seconds in case a change is not reported,
+ * and a failure is retried after PUBLIC_ADDR_FAILURE_TTL seconds. */
+#define PUBLIC_ADDR_CACHE_TTL	(60)
+#define PUBLIC_ADDR_FAILURE_TTL	(1)
+
+static struct {
+	int valid;
+	time_t expires;	/* 0 = until invalidated */
+	unsigned char result_code;
+	unsigned char addr[4];
+} public_addr_cache;
+
+static void UpdatePublicAddressCache(time_t now)
+{
 	struct in_addr addr;
 	char tmp[16];
-	UNUSED(senderaddr);
 
+	memset(public_addr_cache.addr, 0, sizeof(public_addr_cache.addr));
+	public_addr_cache.result_code = 0;
+	public_addr_cache.expires = 0;
+	public_addr_cache.valid = 1;
 	if(use_ext_ip_addr) {
-        inet_pton(AF_INET, use_ext_ip_addr, resp+8);
+		inet_pton(AF_INET, use_ext_ip_addr, public_addr_cache.addr);
+		return;
+	}
+	if(!ext_if_name || ext_if_name[0]=='\0') {
+		/* Network Failure (e.g. NAT box itself
+		 * has not obtained a DHCP lease) */
+		public_addr_cache.result_code = 3;
+	} else if(getifaddr(ext_if_name, tmp, INET_ADDRSTRLEN, &addr, NULL) < 0) {
+		syslog(LOG_ERR, "Failed to get IP for interface %s", ext_if_name);
+		/* Network Failure (e.g. NAT box itself
+		 * has not obtained a DHCP lease) */
+		public_addr_cache.result_code = 3;
+	} else if (!GETFLAG(ALLOWPRIVATEIPV4MASK) && addr_is_reserved(&addr)) {
+		/* Network Failure, box has not obtained
+		 * public IP address */
+		public_addr_cache.result_code = 3;
 	} else {
-		if(!ext_if_name || ext_if_name[0]=='\0') {
-			resp[3] = 3;	/* Network Failure (e.g. NAT box itself
-			                 * has not obtained a DHCP lease) */
-		} else if(getifaddr(ext_if_name, tmp, INET_ADDRSTRLEN, &addr, NULL) < 0) {
-			syslog(LOG_ERR, "Failed to get IP for interface %s", ext_if_name);
-			resp[3] = 3;	/* Network Failure (e.g. NAT box itself
-			                 * has not obtained a DHCP lease) */
-		} else if (!GETFLAG(ALLOWPRIVATEIPV4MASK) && addr_is_reserved(&addr)) {
-			resp[3] = 3;	/* Network Failure, box has not obtained
-			                   public IP address */
-		} else {
-			inet_pton(AF_INET, tmp, resp+8); /* ok */
-		}
+		memcpy(public_addr_cache.addr, &addr, sizeof(public_addr_cache.addr)); /* ok */
 	}
+	public_addr_cache.expires = now + ((public_addr_cache.result_code != 0) ?
+	                                   PUBLIC_ADDR_FAILURE_TTL : PUBLIC_ADDR_CACHE_TTL);
+}
+#endif /* MULTIPLE_EXTERNAL_IP */
+
+static void FillPublicAddressResponse(unsigned char * resp, in_addr_t senderaddr)
+{
+#ifndef MULTIPLE_EXTERNAL_IP
+	time_t now;
+	UNUSED(senderaddr);
+
+	now = upnp_time();
+	if(!public_addr_cache.valid ||
+	   (public_addr_cache.expires != 0 && now >= public_addr_cache.expires))
+		UpdatePublicAddressCache(now);
+	if(public_addr_cache.result_code != 0)
+		resp[3] = public_addr_cache.result_code;
+	else
+		memcpy(resp+8, public_addr_cache.addr, 4);
 #else
 	struct lan_addr_s * lan_addr;
 
@@ -130,6 +172,33 @@ static void FillPublicAddressResponse(unsigned char * resp, in_addr_t senderaddr
 #endif
 }
 
+#ifdef IPV6_PKTINFO
+/* retrieve the destination address of the packet from the
+ * IPV6_PKTINFO control message */
+static void
+get_receiver_addr(struct msghdr * msg, struct sockaddr_in6 * receiveraddr)
+{
+	struct cmsghdr *h;
+
+	memset(receiveraddr, 0, sizeof(struct sockaddr_in6));
+	for(h = CMSG_FIRSTHDR(msg); h;
+	    h = CMSG_NXTHDR(msg, h)) {
+		if(h->cmsg_level == IPPROTO_IPV6 && h->cmsg_type == IPV6_PKTINFO) {
+			char tmp[INET6_ADDRSTRLEN];
+			struct in6_pktinfo *ipi6 = (struct in6_pktinfo *)CMSG_DATA(h);
+			syslog(LOG_DEBUG, "%s: packet destination: %s scope_id=%u",
+			       "ReceiveNATPMPOrPCPPacket",
+			       inet_ntop(AF_INET6, &ipi6->ipi6_addr, tmp, sizeof(tmp)),
+			       ipi6->ipi6_ifindex);
+			receiveraddr->sin6_addr = ipi6->ipi6_addr;
+			receiveraddr->sin6_scope_id = ipi6->ipi6_ifindex;
+			receiveraddr->sin6_family = AF_INET6;
+			receiveraddr->sin6_port = htons(NATPMP_PORT);
+		}
+	}
+}
+#endif /* IPV6_PKTINFO */
+
 /*
  * Receives NATPMP and PCP packets and stores them in msg_buff.
  * The sender information is stored in senderaddr.
@@ -145,7 +214,6 @@ int ReceiveNATPMPOrPCPPacket(int s, struct sockaddr * senderaddr,
 	uint8_t c[1000];
 	struct msghdr msg;
 	int n;
-	struct cmsghdr *h;
 
 	iov.iov_base = msg_buff;
 	iov.iov_len = msg_buff_size;
@@ -169,30 +237,12 @@ int ReceiveNATPMPOrPCPPacket(int s, struct sockaddr * senderaddr,
 		return n;
 	}
 
-	if(receiveraddr) {
-		memset(receiveraddr, 0, sizeof(struct sockaddr_in6));
-	}
 	if ((msg.msg_flags & MSG_TRUNC) || (msg.msg_flags & MSG_CTRUNC)) {
 		syslog(LOG_WARNING, "%s: truncated message",
 		       "ReceiveNATPMPOrPCPPacket");
 	}
-	for(h = CMSG_FIRSTHDR(&msg); h;
-	    h = CMSG_NXTHDR(&msg, h)) {
-		if(h->cmsg_level == IPPROTO_IPV6 && h->cmsg_type == IPV6_PKTINFO) {
-			char tmp[INET6_ADDRSTRLEN];
-			struct in6_pktinfo *ipi6 = (struct in6_pktinfo *)CMSG_DATA(h);
-			syslog(LOG_DEBUG, "%s: packet destination: %s scope_id=%u",
-			       "ReceiveNATPMPOrPCPPacket",
-			       inet_ntop(AF_INET6, &ipi6->ipi6_addr, tmp, sizeof(tmp)),
-			       ipi6->ipi6_ifindex);
-			if(receiveraddr) {
-				receiveraddr->sin6_addr = ipi6->ipi6_addr;
-				receiveraddr->sin6_scope_id = ipi6->ipi6_ifindex;
-				receiveraddr->sin6_family = AF_INET6;
-				receiveraddr->sin6_port = htons(NATPMP_PORT);
-			}
-		}
-	}
+	if(receiveraddr)
+		get_receiver_addr(&msg, receiveraddr);
 #else /* IPV6_PKTINFO */
 	int n;
 
@@ -214,6 +264,107 @@ int ReceiveNATPMPOrPCPPacket(int s, struct sockaddr * senderaddr,
 	return n;
 }
 
+#if defined(HAVE_RECVMMSG) && defined(IPV6_PKTINFO)
+int ReceiveNATPMPOrPCPPackets(int s, struct natpmp_pcp_packet * packets,
+                              int count)
+{
+	struct mmsghdr msgs[NATPMP_RECV_BATCH];
+	struct iovec iovs[NATPMP_RECV_BATCH];
+	uint8_t c[NATPMP_RECV_BATCH][CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	int i, n;
+
+	if(count > NATPMP_RECV_BATCH)
+		count = NATPMP_RECV_BATCH;
+	memset(msgs, 0, sizeof(msgs));
+	for(i = 0; i < count; i++) {
+		iovs[i].iov_base = packets[i].msg_buff;
+		iovs[i].iov_len = sizeof(packets[i].msg_buff);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &packets[i].senderaddr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(packets[i].senderaddr);
+		msgs[i].msg_hdr.msg_control = c[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(c[i]);
+	}
+	n = recvmmsg(s, msgs, count, MSG_DONTWAIT, NULL);
+	if(n < 0) {
+		/* EAGAIN, EWOULDBLOCK and EINTR : silently ignore (retry next time)
+		 * other errors : log to LOG_ERR */
+		if(errno != EAGAIN &&
+		   errno != EWOULDBLOCK &&
+		   errno != EINTR) {
+			syslog(LOG_ERR, "recvmmsg(natpmp): %m");
+		}
+		return n;
+	}
+	for(i = 0; i < n; i++) {
+		packets[i].len = (int)msgs[i].msg_len;
+		memset(packets[i].msg_buff + packets[i].len, 0,
+		       sizeof(packets[i].msg_buff) - packets[i].len);
+		if((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || (msgs[i].msg_hdr.msg_flags & MSG_CTRUNC)) {
+			syslog(LOG_WARNING, "%s: truncated message",
+			       "ReceiveNATPMPOrPCPPackets");
+		}
+		get_receiver_addr(&msgs[i].msg_hdr, &packets[i].receiveraddr);
+	}
+	return n;
+}
+#else /* defined(HAVE_RECVMMSG) && defined(IPV6_PKTINFO) */
+int ReceiveNATPMPOrPCPPackets(int s, struct natpmp_pcp_packet * packets,
+                              int count)
+{
+	socklen_t senderaddrlen = sizeof(packets[0].senderaddr);
+
+	if(count < 1)
+		return 0;
+	memset(&packets[0].receiveraddr, 0, sizeof(packets[0].receiveraddr));
+	memset(packets[0].msg_buff, 0, sizeof(packets[0].msg_buff));
+	packets[0].len = ReceiveNATPMPOrPCPPacket(s,
+	                         (struct sockaddr *)&packets[0].senderaddr,
+	                         &senderaddrlen, &packets[0].receiveraddr,
+	                         packets[0].msg_buff, sizeof(packets[0].msg_buff));
+	return (packets[0].len < 0) ? -1 : 1;
+}
+#endif /* defined(HAVE_RECVMMSG) && defined(IPV6_PKTINFO) */
+
+/** send an error response to the request without processing it.
+ */
+static void SendNATPMPErrorResponse(int s, const unsigned char *req, int len,
+		struct sockaddr_in *senderaddr, int resultcode)
+{
+	unsigned char resp[16];	/* response udp packet */
+	int resplen;
+	int n;
+
+	if(len < 2 || (req[1] & 128))
+		return;	/* too short or a response */
+	memset(resp, 0, sizeof(resp));
+	resp[1] = 128 + req[1];	/* response OPCODE is request OPCODE + 128 */
+	resp[3] = (unsigned char)resultcode;
+	if(epoch_origin == 0) {
+		epoch_origin = startup_time;
+	}
+	WRITENU32(resp+4, upnp_time() - epoch_origin);
+	switch(req[1]) {
+	case 0:	/* Public address request */
+		resplen = 12;
+		break;
+	case 1:	/* UDP port mapping request */
+	case 2:	/* TCP port mapping request */
+		if(len >= 6)
+			memcpy(resp+8, req+4, 2);	/* private port */
+		resplen = 16;
+		break;
+	default:
+		resplen = 8;
+	}
+	n = sendto_or_schedule(s, resp, resplen, 0,
+	           (struct sockaddr *)senderaddr, sizeof(*senderaddr));
+	if(n<0) {
+		syslog(LOG_ERR, "sendto(natpmp): %m");
+	}
+}
+
 /** read the request from the socket, process it and then send the
  * response back.
  */
@@ -226,6 +377,10 @@ void ProcessIncomingNATPMPPacket(int s, unsigned char *msg_buff, int len,
 	int n = len;
 	char senderaddrstr[16];
 
+	if(!ratelimit_check(RATELIMIT_NATPMP_PCP, AF_INET, &senderaddr->sin_addr)) {
+		SendNATPMPErrorResponse(s, req, n, senderaddr, 4);	/* Out of resources */
+		return;
+	}
 	if(!inet_ntop(AF_INET, &senderaddr->sin_addr,
 			senderaddrstr, sizeof(senderaddrstr))) {
 		syslog(LOG_ERR, "inet_ntop(natpmp): %m");
@@ -390,10 +545,14 @@ void ProcessIncomingNATPMPPacket(int s, unsigned char *msg_buff, int len,
 					timestamp = upnp_time() + lifetime;
 					snprintf(desc, sizeof(desc), "NAT-PMP %hu %s",
 					         eport, proto_itoa(proto));
-					/* TODO : check return code */
-					if(upnp_redirect_internal(NULL, eport, senderaddrstr,
-					                          iport, proto, desc,
-					                          timestamp) < 0) {
+					r = upnp_redirect_internal(NULL, eport, senderaddrstr,
+					                           iport, proto, desc,
+					                           timestamp);
+					if(r == -5) {
+						syslog(LOG_NOTICE, "NAT-PMP %hu %s->%s:%hu : mapping quota exceeded",
+						       eport, proto_itoa(proto), senderaddrstr, iport);
+						resp[3] = 4;	/* Out of resources */
+					} else if(r < 0) {
 						syslog(LOG_ERR, "Failed to add NAT-PMP %hu %s->%s:%hu '%s'",
 						       eport, proto_itoa(proto), senderaddrstr, iport, desc);
 						resp[3] = 3;  /* Failure */
@@ -440,6 +599,7 @@ void SendNATPMPPublicAddressChangeNotification(int * sockets, int n_sockets)
 	}
 	WRITENU32(notif+4, upnp_time() - epoch_origin);
 #ifndef MULTIPLE_EXTERNAL_IP
+	public_addr_cache.valid = 0;
 	FillPublicAddressResponse(notif, 0);
 	if(notif[3])
 	{
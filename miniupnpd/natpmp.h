@@ -18,6 +18,11 @@
 #define NATPMP_NOTIF_PORT	(5350)
 #define NATPMP_NOTIF_ADDR	("224.0.0.1")
 
+#include "pcpserver.h"
+
+/* maximum number of packets read by ReceiveNATPMPOrPCPPackets() */
+#define NATPMP_RECV_BATCH	(8)
+
 int OpenAndConfNATPMPSockets(int * sockets);
 
 /* receiveraddr is only used with IPV6 sockets */
@@ -26,6 +31,18 @@ int ReceiveNATPMPOrPCPPacket(int s, struct sockaddr * senderaddr,
                              struct sockaddr_in6 * receiveraddr,
                              unsigned char * msg_buff, size_t msg_buff_size);
 
+struct natpmp_pcp_packet {
+	struct sockaddr_storage senderaddr;
+	struct sockaddr_in6 receiveraddr;	/* only for IPv6 sockets */
+	int len;
+	unsigned char msg_buff[PCP_MAX_LEN];	/* zero padded after len */
+};
+
+/* read up to count packets at once (with recvmmsg() if available)
+ * returns the number of packets received or -1 */
+int ReceiveNATPMPOrPCPPackets(int s, struct natpmp_pcp_packet * packets,
+                              int count);
+
 void ProcessIncomingNATPMPPacket(int s, unsigned char * msg_buff, int len,
                                  struct sockaddr_in * senderaddr);
 
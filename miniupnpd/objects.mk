@@ -4,7 +4,8 @@ BASEOBJS = miniupnpd.o upnphttp.o upnpdescgen.o upnpsoap.o \
            upnpredirect.o getifaddr.o daemonize.o \
            options.o upnppermissions.o minissdp.o natpmp.o pcpserver.o \
            upnpglobalvars.o upnpevents.o upnputils.o getconnstatus.o \
-           upnpstun.o upnppinhole.o pcplearndscp.o asyncsendto.o
+           upnpstun.o upnppinhole.o pcplearndscp.o asyncsendto.o \
+           ratelimit.o ssdppktgen.o
 
 # sources in linux/ directory
 LNXOBJS = getifstats.o ifacewatcher.o getroute.o
@@ -13,4 +14,5 @@ LNXOBJS = getifstats.o ifacewatcher.o getroute.o
 OTHEROBJS = miniupnpdctl.o testupnpdescgen.o testgetifstats.o \
             testupnppermissions.o testgetifaddr.o testgetroute.o \
             testssdppktgen.o testasyncsendto.o testportinuse.o testminissdp.o \
-            testifacewatcher.o teststun.o
+            testifacewatcher.o teststun.o testupnpreplyparse.o \
+            testhttpshandshake.o testpcpserver.o testupnphttp.o
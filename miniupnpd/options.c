@@ -39,6 +39,7 @@ static const struct {
 	{ UPNPEXT_PERFORM_STUN, "ext_perform_stun" },
 	{ UPNPEXT_STUN_HOST, "ext_stun_host" },
 	{ UPNPEXT_STUN_PORT, "ext_stun_port" },
+	{ UPNPEXT_STUN_TTL, "ext_stun_ttl" },
 	{ UPNPLISTENING_IP, "listening_ip" },
 #ifdef ENABLE_IPV6
 	{ UPNPIPV6_LISTENING_IP, "ipv6_listening_ip" },
@@ -68,6 +69,19 @@ static const struct {
 	{ UPNPMODEL_NUMBER, "model_number"},
 	{ UPNPCLEANTHRESHOLD, "clean_ruleset_threshold"},
 	{ UPNPCLEANINTERVAL, "clean_ruleset_interval"},
+	{ UPNPHTTPMAXHEADERSIZE, "http_max_header_size"},
+	{ UPNPHTTPMAXBODYSIZE, "http_max_body_size"},
+	{ UPNPSOAPRATELIMIT, "soap_rate_limit"},
+	{ UPNPSOAPRATEBURST, "soap_rate_burst"},
+	{ UPNPPMPRATELIMIT, "pmp_rate_limit"},
+	{ UPNPPMPRATEBURST, "pmp_rate_burst"},
+	{ UPNPMAXMAPPINGS, "max_mappings"},
+	{ UPNPMAXMAPPINGSPERCLIENT, "max_mappings_per_client"},
+	{ UPNPSSDPNOTIFYMAXPPS, "ssdp_notify_max_pps"},
+#ifdef ENABLE_EVENTS
+	{ UPNPEVENTCOALESCINGWINDOW, "event_coalescing_window"},
+	{ UPNPMAXSUBSCRIBERSPERHOST, "max_subscribers_per_host"},
+#endif
 #ifdef USE_NETFILTER
 	{ UPNPTABLENAME, "upnp_table_name"},
 	{ UPNPNATTABLENAME, "upnp_nat_table_name"},
@@ -322,6 +336,7 @@ freeoptions(void)
 		free(string_repo);
 		string_repo = NULL;
 	}
+	free_compiled_permissions();
 	if(upnppermlist)
 	{
 		unsigned int i;
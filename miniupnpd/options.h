@@ -29,6 +29,7 @@ enum upnpconfigoptions {
 	UPNPEXT_PERFORM_STUN,		/*!< ext_perform_stun */
 	UPNPEXT_STUN_HOST,		/*!< ext_stun_host */
 	UPNPEXT_STUN_PORT,		/*!< ext_stun_port */
+	UPNPEXT_STUN_TTL,		/*!< ext_stun_ttl */
 	UPNPLISTENING_IP,		/*!< listening_ip */
 #ifdef ENABLE_IPV6
 	UPNPIPV6_LISTENING_IP,		/*!< listening address for IPv6 */
@@ -57,6 +58,17 @@ enum upnpconfigoptions {
 	UPNPMODEL_NUMBER,		/*!< model_number */
 	UPNPCLEANTHRESHOLD,		/*!< clean_ruleset_threshold */
 	UPNPCLEANINTERVAL,		/*!< clean_ruleset_interval */
+	UPNPHTTPMAXHEADERSIZE,	/*!< http_max_header_size */
+	UPNPHTTPMAXBODYSIZE,	/*!< http_max_body_size */
+	UPNPSOAPRATELIMIT,		/*!< soap_rate_limit */
+	UPNPSOAPRATEBURST,		/*!< soap_rate_burst */
+	UPNPPMPRATELIMIT,		/*!< pmp_rate_limit */
+	UPNPPMPRATEBURST,		/*!< pmp_rate_burst */
+	UPNPMAXMAPPINGS,		/*!< max_mappings */
+	UPNPMAXMAPPINGSPERCLIENT,	/*!< max_mappings_per_client */
+	UPNPSSDPNOTIFYMAXPPS,	/*!< ssdp_notify_max_pps */
+	UPNPEVENTCOALESCINGWINDOW,	/*!< event_coalescing_window */
+	UPNPMAXSUBSCRIBERSPERHOST,	/*!< max_subscribers_per_host */
 	UPNPENABLENATPMP,		/*!< enable_natpmp or enable_pcp_pmp */
 	UPNPPCPMINLIFETIME,		/*!< minimum lifetime for PCP mapping */
 	UPNPPCPMAXLIFETIME,		/*!< maximum lifetime for PCP mapping */
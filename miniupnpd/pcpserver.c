@@ -83,6 +83,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "upnputils.h"
 #include "portinuse.h"
 #include "pcp_msg_struct.h"
+#include "ratelimit.h"
 #ifdef ENABLE_UPNPPINHOLE
 #include "upnppinhole.h"
 #endif /* ENABLE_UPNPPINHOLE */
@@ -556,6 +557,57 @@ static void parsePCPOptions(void* pcp_buf, int remain, pcp_info_t *pcp_msg_info)
 }
 
 
+/* The external addresses are cached, one for each address family so
+ * that requests from IPv4 and IPv6 clients do not evict each other.
+ * The cache is invalidated by PCPPublicAddressChanged(), and an address
+ * read from the interface is refreshed after PCP_EXT_ADDR_CACHE_TTL
+ * seconds in case a change is not reported. */
+#define PCP_EXT_ADDR_CACHE_TTL	(60)
+
+static struct {
+	int valid;
+	time_t expires;	/* 0 = until invalidated */
+	struct in6_addr addr;	/* can contain a IPv4-mapped IPv6 address */
+} ext_addr_cache[2];	/* [0] AF_INET, [1] AF_INET6 */
+
+/* GetExternalAddress()
+ * return values :
+ *   0 : OK
+ *  -1 : no external address */
+static int GetExternalAddress(int af, struct in6_addr * external_addr)
+{
+	/* TODO : be able to handle case with multiple
+	 * external addresses */
+	if(use_ext_ip_addr) {
+		if (inet_pton(AF_INET, use_ext_ip_addr,
+			      ((uint32_t*)external_addr->s6_addr)+3) == 1) {
+			((uint32_t*)external_addr->s6_addr)[0] = 0;
+			((uint32_t*)external_addr->s6_addr)[1] = 0;
+			((uint32_t*)external_addr->s6_addr)[2] = htonl(0xFFFF);
+		} else if (inet_pton(AF_INET6, use_ext_ip_addr, external_addr->s6_addr)
+			   != 1) {
+			return -1;
+		}
+#ifdef ENABLE_IPV6
+	} else if ((af == AF_INET6) && (strcmp(ext_if_name6, ext_if_name) != 0)) {
+		if(!ext_if_name6 || ext_if_name6[0]=='\0') {
+			return -1;
+		}
+		if(getifaddr_in6(ext_if_name6, af, external_addr) < 0) {
+			return -1;
+		}
+#endif
+	} else {
+		if(!ext_if_name || ext_if_name[0]=='\0') {
+			return -1;
+		}
+		if(getifaddr_in6(ext_if_name, af, external_addr) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /* CheckExternalAddress()
  * Check that suggested external address in request match a real external
  * IP address.
@@ -569,6 +621,8 @@ static int CheckExternalAddress(pcp_info_t* pcp_msg_info)
 	/* can contain a IPv4-mapped IPv6 address */
 	static struct in6_addr external_addr;
 	int af;
+	time_t now;
+	int i;
 
 	af = IN6_IS_ADDR_V4MAPPED(pcp_msg_info->mapped_ip)
 		? AF_INET : AF_INET6;
@@ -578,40 +632,19 @@ static int CheckExternalAddress(pcp_info_t* pcp_msg_info)
 	if (pcp_msg_info->is_fw) {
 		external_addr = *pcp_msg_info->mapped_ip;
 	} else {
-		/* TODO : be able to handle case with multiple
-		 * external addresses */
-		if(use_ext_ip_addr) {
-			if (inet_pton(AF_INET, use_ext_ip_addr,
-				      ((uint32_t*)external_addr.s6_addr)+3) == 1) {
-				((uint32_t*)external_addr.s6_addr)[0] = 0;
-				((uint32_t*)external_addr.s6_addr)[1] = 0;
-				((uint32_t*)external_addr.s6_addr)[2] = htonl(0xFFFF);
-			} else if (inet_pton(AF_INET6, use_ext_ip_addr, external_addr.s6_addr)
-				   != 1) {
-				pcp_msg_info->result_code = PCP_ERR_NETWORK_FAILURE;
-				return -1;
-			}
-#ifdef ENABLE_IPV6
-		} else if ((af == AF_INET6) && (strcmp(ext_if_name6, ext_if_name) != 0)) {
-			if(!ext_if_name6 || ext_if_name6[0]=='\0') {
-				pcp_msg_info->result_code = PCP_ERR_NETWORK_FAILURE;
-				return -1;
-			}
-			if(getifaddr_in6(ext_if_name6, af, &external_addr) < 0) {
-				pcp_msg_info->result_code = PCP_ERR_NETWORK_FAILURE;
-				return -1;
-			}
-#endif
-		} else {
-			if(!ext_if_name || ext_if_name[0]=='\0') {
-				pcp_msg_info->result_code = PCP_ERR_NETWORK_FAILURE;
-				return -1;
-			}
-			if(getifaddr_in6(ext_if_name, af, &external_addr) < 0) {
+		now = upnp_time();
+		i = (af == AF_INET6) ? 1 : 0;
+		if (!ext_addr_cache[i].valid ||
+		    (ext_addr_cache[i].expires != 0 && now >= ext_addr_cache[i].expires)) {
+			if (GetExternalAddress(af, &ext_addr_cache[i].addr) < 0) {
+				ext_addr_cache[i].valid = 0;
 				pcp_msg_info->result_code = PCP_ERR_NETWORK_FAILURE;
 				return -1;
 			}
+			ext_addr_cache[i].valid = 1;
+			ext_addr_cache[i].expires = use_ext_ip_addr ? 0 : now + PCP_EXT_ADDR_CACHE_TTL;
 		}
+		external_addr = ext_addr_cache[i].addr;
 	}
 	if (pcp_msg_info->ext_ip == NULL ||
 	    IN6_IS_ADDR_UNSPECIFIED(pcp_msg_info->ext_ip) ||
@@ -902,6 +935,208 @@ static void DeletePCPPeer(pcp_info_t *pcp_msg_info)
 }
 #endif /* PCP_PEER */
 
+/* PCP MAP mappings (NAT only)
+ * Indexed by internal address (the internal port and protocol are
+ * compared in the hash chain), by nonce and by external port, so MAP
+ * requests do not need to read the ruleset to find the mapping of a
+ * client or to check its nonce.
+ * The table is kept in sync with the ruleset by PCPMappingAdded() and
+ * PCPMappingRemoved(). The nonce is read from the description
+ * "PCP MAP <nonce>" of the rule, so it survives a restart or a lease
+ * file reload. A mapping without a nonce cannot be modified by PCP. */
+#define PCP_MAPPING_HASH_SIZE	(256)
+
+struct pcp_mapping {
+	struct pcp_mapping * next_client;
+	struct pcp_mapping * next_nonce;
+	struct pcp_mapping * next_eport;
+	struct in_addr iaddr;
+	uint16_t iport;
+	uint16_t eport;
+	uint8_t proto;
+	uint8_t nonce_known;
+	uint32_t nonce[3];
+	unsigned int timestamp;	/* expiration */
+};
+
+static struct pcp_mapping * pcp_mappings_client[PCP_MAPPING_HASH_SIZE];
+static struct pcp_mapping * pcp_mappings_nonce[PCP_MAPPING_HASH_SIZE];
+static struct pcp_mapping * pcp_mappings_eport[PCP_MAPPING_HASH_SIZE];
+
+static unsigned int pcp_client_hash(struct in_addr iaddr)
+{
+	uint32_t h = ntohl(iaddr.s_addr);
+	return (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) % PCP_MAPPING_HASH_SIZE;
+}
+
+static unsigned int pcp_nonce_hash(const uint32_t * nonce)
+{
+	return (nonce[0] ^ nonce[1] ^ nonce[2]) % PCP_MAPPING_HASH_SIZE;
+}
+
+static unsigned int pcp_eport_hash(uint16_t eport, uint8_t proto)
+{
+	return ((unsigned int)eport * 3 + proto) % PCP_MAPPING_HASH_SIZE;
+}
+
+static struct pcp_mapping * pcp_mapping_find(struct in_addr iaddr,
+                                             uint16_t iport, uint8_t proto)
+{
+	struct pcp_mapping * m;
+
+	for (m = pcp_mappings_client[pcp_client_hash(iaddr)]; m != NULL; m = m->next_client) {
+		if (m->iaddr.s_addr == iaddr.s_addr && m->iport == iport && m->proto == proto)
+			return m;
+	}
+	return NULL;
+}
+
+static struct pcp_mapping * pcp_mapping_find_eport(uint16_t eport, uint8_t proto)
+{
+	struct pcp_mapping * m;
+
+	for (m = pcp_mappings_eport[pcp_eport_hash(eport, proto)]; m != NULL; m = m->next_eport) {
+		if (m->eport == eport && m->proto == proto)
+			return m;
+	}
+	return NULL;
+}
+
+static void pcp_mapping_unlink_nonce(struct pcp_mapping * m)
+{
+	struct pcp_mapping * * p;
+
+	for (p = &pcp_mappings_nonce[pcp_nonce_hash(m->nonce)]; *p != NULL; p = &(*p)->next_nonce) {
+		if (*p == m) {
+			*p = m->next_nonce;
+			return;
+		}
+	}
+}
+
+static void pcp_mapping_set_nonce(struct pcp_mapping * m, const uint32_t * nonce)
+{
+	unsigned int h;
+
+	pcp_mapping_unlink_nonce(m);
+	memcpy(m->nonce, nonce, sizeof(m->nonce));
+	m->nonce_known = 1;
+	h = pcp_nonce_hash(m->nonce);
+	m->next_nonce = pcp_mappings_nonce[h];
+	pcp_mappings_nonce[h] = m;
+}
+
+static void pcp_mapping_free(struct pcp_mapping * m)
+{
+	struct pcp_mapping * * p;
+
+	for (p = &pcp_mappings_client[pcp_client_hash(m->iaddr)]; *p != NULL; p = &(*p)->next_client) {
+		if (*p == m) {
+			*p = m->next_client;
+			break;
+		}
+	}
+	for (p = &pcp_mappings_eport[pcp_eport_hash(m->eport, m->proto)]; *p != NULL; p = &(*p)->next_eport) {
+		if (*p == m) {
+			*p = m->next_eport;
+			break;
+		}
+	}
+	pcp_mapping_unlink_nonce(m);
+	free(m);
+}
+
+/* add a mapping with an unknown nonce */
+static struct pcp_mapping * pcp_mapping_add(struct in_addr iaddr, uint16_t iport,
+                                            uint8_t proto, uint16_t eport,
+                                            unsigned int timestamp)
+{
+	struct pcp_mapping * m;
+	unsigned int h;
+
+	/* there is only one mapping for an internal address, port and protocol */
+	m = pcp_mapping_find(iaddr, iport, proto);
+	if (m != NULL)
+		pcp_mapping_free(m);
+	m = calloc(1, sizeof(struct pcp_mapping));
+	if (m == NULL) {
+		syslog(LOG_ERR, "%s: calloc(): %m", "pcp_mapping_add");
+		return NULL;
+	}
+	m->iaddr = iaddr;
+	m->iport = iport;
+	m->eport = eport;
+	m->proto = proto;
+	m->timestamp = timestamp;
+	h = pcp_client_hash(iaddr);
+	m->next_client = pcp_mappings_client[h];
+	pcp_mappings_client[h] = m;
+	h = pcp_eport_hash(eport, proto);
+	m->next_eport = pcp_mappings_eport[h];
+	pcp_mappings_eport[h] = m;
+	h = pcp_nonce_hash(m->nonce);
+	m->next_nonce = pcp_mappings_nonce[h];
+	pcp_mappings_nonce[h] = m;
+	return m;
+}
+
+void PCPMappingAdded(unsigned short eport, const char * iaddr,
+                     unsigned short iport, int proto,
+                     const char * desc, unsigned int timestamp)
+{
+	struct in_addr addr;
+	struct pcp_mapping * m;
+	unsigned int nonce[3];
+	uint32_t nonce32[3];
+
+	/* the external port may have been held by another mapping */
+	PCPMappingRemoved(eport, proto);
+	/* "PCP MAP <nonce>" */
+	if (desc == NULL || strncmp(desc, "PCP MAP", 7) != 0 ||
+	    (desc[7] != '\0' && desc[7] != ' '))
+		return;
+	if (inet_pton(AF_INET, iaddr, &addr) <= 0)
+		return;
+	m = pcp_mapping_add(addr, iport, (uint8_t)proto, eport, timestamp);
+	if (m != NULL &&
+	    sscanf(desc + 7, " %8x%8x%8x", &nonce[0], &nonce[1], &nonce[2]) == 3) {
+		nonce32[0] = nonce[0];
+		nonce32[1] = nonce[1];
+		nonce32[2] = nonce[2];
+		pcp_mapping_set_nonce(m, nonce32);
+	}
+}
+
+void PCPMappingRemoved(unsigned short eport, int proto)
+{
+	struct pcp_mapping * m;
+
+	m = pcp_mapping_find_eport(eport, (uint8_t)proto);
+	if (m != NULL)
+		pcp_mapping_free(m);
+}
+
+void PCPFreeMappings(void)
+{
+	int i;
+	struct pcp_mapping * m;
+
+	for (i = 0; i < PCP_MAPPING_HASH_SIZE; i++) {
+		while ((m = pcp_mappings_client[i]) != NULL) {
+			pcp_mappings_client[i] = m->next_client;
+			free(m);
+		}
+		pcp_mappings_nonce[i] = NULL;
+		pcp_mappings_eport[i] = NULL;
+	}
+}
+
+static int pcp_nonce_match(const struct pcp_mapping * m, const pcp_info_t * pcp_msg_info)
+{
+	return m->nonce_known &&
+	       memcmp(m->nonce, pcp_msg_info->nonce, sizeof(m->nonce)) == 0;
+}
+
 static int CreatePCPMap_NAT(pcp_info_t *pcp_msg_info)
 {
 	int r = 0;
@@ -909,6 +1144,26 @@ static int CreatePCPMap_NAT(pcp_info_t *pcp_msg_info)
 	uint16_t iport_old, eport_first = 0;
 	int any_eport_allowed = 0;
 	unsigned int timestamp = upnp_time() + pcp_msg_info->lifetime;
+	struct in_addr iaddr;
+	struct pcp_mapping * m;
+
+	iaddr = ((struct in_addr*)pcp_msg_info->mapped_ip->s6_addr)[3];
+	m = pcp_mapping_find(iaddr, pcp_msg_info->int_port, pcp_msg_info->protocol);
+	if (m != NULL) {
+		if (!pcp_nonce_match(m, pcp_msg_info)) {
+			syslog(LOG_ERR, "Unauthorized to update PCP mapping internal port %hu, protocol %s",
+			       pcp_msg_info->int_port, proto_itoa(pcp_msg_info->protocol));
+			return PCP_ERR_NOT_AUTHORIZED;
+		}
+		/* refresh : the external port of the mapping does not change */
+		pcp_msg_info->ext_port = m->eport;
+		syslog(LOG_INFO, "port %hu %s already redirected to %s:%hu, replacing",
+		       m->eport, proto_itoa(pcp_msg_info->protocol),
+		       pcp_msg_info->mapped_str, pcp_msg_info->int_port);
+		if (_upnp_delete_redir(m->eport, pcp_msg_info->protocol) < 0)
+			return PCP_ERR_NO_RESOURCES;
+		goto add;
+	}
 
 	if (pcp_msg_info->ext_port == 0) {
 		pcp_msg_info->ext_port = pcp_msg_info->int_port;
@@ -957,6 +1212,25 @@ static int CreatePCPMap_NAT(pcp_info_t *pcp_msg_info)
 			continue;
 		}
 #endif
+		m = pcp_mapping_find_eport(pcp_msg_info->ext_port, pcp_msg_info->protocol);
+		if (m != NULL) {
+			/* held by the PCP mapping of another client */
+			if (m->timestamp > 0 && m->timestamp <= upnp_time()) {
+				syslog(LOG_INFO, "port %hu %s PCP mapping has expired, replacing",
+				       m->eport, proto_itoa(m->proto));
+				if (_upnp_delete_redir(m->eport, m->proto) == 0)
+					break;
+			}
+			if (pcp_msg_info->pfailure_present) {
+				return PCP_ERR_CANNOT_PROVIDE_EXTERNAL;
+			}
+			pcp_msg_info->ext_port++;
+			if (pcp_msg_info->ext_port == 0) { /* skip port zero */
+				pcp_msg_info->ext_port++;
+			}
+			r = 0;
+			continue;
+		}
 		r = get_redirect_rule(ext_if_name,
 				      pcp_msg_info->ext_port,
 				      pcp_msg_info->protocol,
@@ -990,6 +1264,7 @@ static int CreatePCPMap_NAT(pcp_info_t *pcp_msg_info)
 		}
 	} while (r==0);
 
+add:
 	r = upnp_redirect_internal(NULL,
 				   pcp_msg_info->ext_port,
 				   pcp_msg_info->mapped_str,
@@ -997,8 +1272,14 @@ static int CreatePCPMap_NAT(pcp_info_t *pcp_msg_info)
 				   pcp_msg_info->protocol,
 				   pcp_msg_info->desc,
 				   timestamp);
+	if (r == -5)
+		return PCP_ERR_USER_EX_QUOTA;
 	if (r < 0)
 		return PCP_ERR_NO_RESOURCES;
+	/* added to the table by PCPMappingAdded() */
+	m = pcp_mapping_find_eport(pcp_msg_info->ext_port, pcp_msg_info->protocol);
+	if (m != NULL)
+		pcp_mapping_set_nonce(m, pcp_msg_info->nonce);
 	return PCP_SUCCESS;
 }
 
@@ -1101,42 +1382,52 @@ static void DeletePCPMap(pcp_info_t *pcp_msg_info)
 	uint16_t iport = pcp_msg_info->int_port;  /* private port */
 	uint8_t  proto = pcp_msg_info->protocol;
 	int r=-1;
-	/* remove the mapping */
-	/* remove all the mappings for this client */
-	unsigned short eport2, iport2;
-	char iaddr2[INET6_ADDRSTRLEN];
-	int proto2;
+	unsigned short eport2 = 0;
+#ifdef ENABLE_UPNPPINHOLE
 	char desc[64];
-	unsigned int timestamp;
+#endif /* ENABLE_UPNPPINHOLE */
 
 	syslog(LOG_DEBUG, "is_fw=%d addr=%s iport=%hu proto=%d",
 	       pcp_msg_info->is_fw,  pcp_msg_info->mapped_str, iport, (int)proto);
 	if (!pcp_msg_info->is_fw) {
-		int index;
-		/* iterate through all rules and delete the requested ones */
-		for (index = 0;
-		     get_redirect_rule_by_index(index, 0,
-					 &eport2, iaddr2, sizeof(iaddr2),
-					 &iport2, &proto2,
-					 desc, sizeof(desc),
-					 0, 0, &timestamp, 0, 0) >= 0;
-		     index++) {
-			syslog(LOG_DEBUG, "%d: %s %hu %d", index, iaddr2, iport2, proto2);
-			if(0 == strcmp(iaddr2, pcp_msg_info->mapped_str)
-			   && (proto2==proto)
-			   && ((iport2==iport) || (iport==0))) {
-				if(0 != strcmp(desc, pcp_msg_info->desc)) {
-					/* nonce does not match */
-					pcp_msg_info->result_code = PCP_ERR_NOT_AUTHORIZED;
-					syslog(LOG_ERR, "Unauthorized to remove PCP mapping internal port %hu, protocol %s",
-					       iport, proto_itoa(pcp_msg_info->protocol));
-					return;
-				} else {
-					r = _upnp_delete_redir(eport2, proto2);
+		struct in_addr iaddr;
+		struct pcp_mapping * m;
+		struct pcp_mapping * next;
+
+		iaddr = ((struct in_addr*)pcp_msg_info->mapped_ip->s6_addr)[3];
+		if (iport == 0) {
+			/* remove all the mappings of this client with the same nonce */
+			for (m = pcp_mappings_nonce[pcp_nonce_hash(pcp_msg_info->nonce)];
+			     m != NULL; m = next) {
+				next = m->next_nonce;
+				if (m->nonce_known &&
+				    memcmp(m->nonce, pcp_msg_info->nonce, sizeof(m->nonce)) == 0 &&
+				    m->iaddr.s_addr == iaddr.s_addr &&
+				    (proto == 0 || m->proto == proto)) {
+					int proto2 = m->proto;
+					eport2 = m->eport;
+					if (_upnp_delete_redir(eport2, proto2) >= 0)	/* frees m */
+						syslog(LOG_INFO, "PCP: %s port %hu mapping removed",
+						       proto_itoa(proto2), eport2);
 				}
-				break;
 			}
+			return;
 		}
+		m = pcp_mapping_find(iaddr, iport, proto);
+		if (m == NULL) {
+			/* RFC 6887 15 : deleting a non existing mapping is a success */
+			syslog(LOG_INFO, "PCP: no mapping to %s:%hu %s",
+			       pcp_msg_info->mapped_str, iport, proto_itoa(proto));
+			return;
+		}
+		if (!pcp_nonce_match(m, pcp_msg_info)) {
+			pcp_msg_info->result_code = PCP_ERR_NOT_AUTHORIZED;
+			syslog(LOG_ERR, "Unauthorized to remove PCP mapping internal port %hu, protocol %s",
+			       iport, proto_itoa(pcp_msg_info->protocol));
+			return;
+		}
+		eport2 = m->eport;
+		r = _upnp_delete_redir(m->eport, m->proto);
 	} else {
 #ifdef ENABLE_UPNPPINHOLE
 		int uid;
@@ -1252,6 +1543,41 @@ static int ValidatePCPMsg(pcp_info_t *pcp_msg_info)
 	return 1;
 }
 
+/* size of the opcode specific information of a request,
+ * -1 if the opcode is not supported for this version */
+static int getPCPOpcodeSize(uint8_t version, uint8_t opcode)
+{
+	if (version == 1) {
+		/* legacy PCP version 1 support */
+		switch (opcode) {
+		case PCP_OPCODE_MAP:
+			return PCP_MAP_V1_SIZE;
+#ifdef PCP_PEER
+		case PCP_OPCODE_PEER:
+			return PCP_PEER_V1_SIZE;
+#endif /* PCP_PEER */
+		}
+	} else if (version == 2) {
+		/* RFC 6887 PCP support
+		 * http://tools.ietf.org/html/rfc6887 */
+		switch (opcode) {
+		case PCP_OPCODE_ANNOUNCE:
+			return 0;
+		case PCP_OPCODE_MAP:
+			return PCP_MAP_V2_SIZE;
+#ifdef PCP_PEER
+		case PCP_OPCODE_PEER:
+			return PCP_PEER_V2_SIZE;
+#endif /* PCP_PEER */
+#ifdef PCP_SADSCP
+		case PCP_OPCODE_SADSCP:
+			return PCP_SADSCP_REQ_SIZE;
+#endif /* PCP_SADSCP */
+		}
+	}
+	return -1;
+}
+
 /*
  * return value indicates whether the request is valid or not.
  * Based on the return value simple response can be formed.
@@ -1259,13 +1585,12 @@ static int ValidatePCPMsg(pcp_info_t *pcp_msg_info)
 static int processPCPRequest(void * req, int req_size, pcp_info_t *pcp_msg_info)
 {
 	int remainingSize;
+	int opcodeSize;
 
 	/* start with PCP_SUCCESS as result code,
 	 * if everything is OK value will be unchanged */
 	pcp_msg_info->result_code = PCP_SUCCESS;
 
-	remainingSize = req_size;
-
 	/* discard request that exceeds maximal length,
 	   or that is shorter than PCP_MIN_LEN (=24)
 	   or that is not the multiple of 4 */
@@ -1289,185 +1614,114 @@ static int processPCPRequest(void * req, int req_size, pcp_info_t *pcp_msg_info)
 		return 1;
 	}
 
-	remainingSize -= PCP_COMMON_REQUEST_SIZE;
+	if (pcp_msg_info->version != 1 && pcp_msg_info->version != 2) {
+		pcp_msg_info->result_code = PCP_ERR_UNSUPP_VERSION;
+		return pcp_msg_info->result_code;
+	}
+	opcodeSize = getPCPOpcodeSize(pcp_msg_info->version, pcp_msg_info->opcode);
+	if (opcodeSize < 0) {
+		pcp_msg_info->result_code = PCP_ERR_UNSUPP_OPCODE;
+		return 1;
+	}
+	/* one check for the common header and the opcode specific
+	 * information : the parse functions below read fixed offsets */
+	remainingSize = req_size - PCP_COMMON_REQUEST_SIZE - opcodeSize;
+	if (remainingSize < 0) {
+		pcp_msg_info->result_code = PCP_ERR_MALFORMED_REQUEST;
+		return pcp_msg_info->result_code;
+	}
 	req += PCP_COMMON_REQUEST_SIZE;
 
-	if (pcp_msg_info->version == 1) {
-		/* legacy PCP version 1 support */
-		switch (pcp_msg_info->opcode) {
-		case PCP_OPCODE_MAP:
-
-			remainingSize -= PCP_MAP_V1_SIZE;
-			if (remainingSize < 0) {
-				pcp_msg_info->result_code = PCP_ERR_MALFORMED_REQUEST;
-				return pcp_msg_info->result_code;
-			}
-
+	switch (pcp_msg_info->opcode) {
+	case PCP_OPCODE_ANNOUNCE:
+		/* should check PCP Client's IP Address in request */
+		/* see http://tools.ietf.org/html/rfc6887#section-14.1 */
+		break;
+	case PCP_OPCODE_MAP:
+		if (pcp_msg_info->version == 1) {
 #ifdef DEBUG
 			printMAPOpcodeVersion1(req);
 #endif /* DEBUG */
 			parsePCPMAP_version1(req, pcp_msg_info);
-
-			req += PCP_MAP_V1_SIZE;
-
-			parsePCPOptions(req, remainingSize, pcp_msg_info);
-			if (ValidatePCPMsg(pcp_msg_info)) {
-				if (pcp_msg_info->lifetime == 0) {
-					DeletePCPMap(pcp_msg_info);
-				} else {
-					CreatePCPMap(pcp_msg_info);
-				}
-			} else {
-				syslog(LOG_ERR, "PCP: Invalid PCP v1 MAP message.");
-				return pcp_msg_info->result_code;
-			}
-			break;
-
-#ifdef PCP_PEER
-		case PCP_OPCODE_PEER:
-
-			remainingSize -= PCP_PEER_V1_SIZE;
-			if (remainingSize < 0) {
-				pcp_msg_info->result_code = PCP_ERR_MALFORMED_REQUEST;
-				return pcp_msg_info->result_code;
-			}
-
-#ifdef DEBUG
-			printPEEROpcodeVersion1(req);
-#endif /* DEBUG */
-			parsePCPPEER_version1(req, pcp_msg_info);
-
-			req += PCP_PEER_V1_SIZE;
-
-			parsePCPOptions(req, remainingSize, pcp_msg_info);
-
-			if (ValidatePCPMsg(pcp_msg_info)) {
-				if (pcp_msg_info->lifetime == 0) {
-					DeletePCPPeer(pcp_msg_info);
-				} else {
-					CreatePCPPeer(pcp_msg_info);
-				}
-			} else {
-				syslog(LOG_ERR, "PCP: Invalid PCP v1 PEER message.");
-				 return pcp_msg_info->result_code;
-			}
-
-
-			break;
-#endif /* PCP_PEER */
-		default:
-			pcp_msg_info->result_code = PCP_ERR_UNSUPP_OPCODE;
-			break;
-		}
-
-	} else if (pcp_msg_info->version == 2) {
-		/* RFC 6887 PCP support
-		 * http://tools.ietf.org/html/rfc6887 */
-		switch (pcp_msg_info->opcode) {
-		case PCP_OPCODE_ANNOUNCE:
-			/* should check PCP Client's IP Address in request */
-			/* see http://tools.ietf.org/html/rfc6887#section-14.1 */
-			break;
-		case PCP_OPCODE_MAP:
-
-			remainingSize -= PCP_MAP_V2_SIZE;
-			if (remainingSize < 0) {
-				pcp_msg_info->result_code = PCP_ERR_MALFORMED_REQUEST;
-				return pcp_msg_info->result_code;
-			}
-
+		} else {
 #ifdef DEBUG
 			printMAPOpcodeVersion2(req);
 #endif /* DEBUG */
 			parsePCPMAP_version2(req, pcp_msg_info);
-			req += PCP_MAP_V2_SIZE;
+		}
+		req += opcodeSize;
 
-			parsePCPOptions(req, remainingSize, pcp_msg_info);
+		parsePCPOptions(req, remainingSize, pcp_msg_info);
 
-			if (ValidatePCPMsg(pcp_msg_info)) {
-				if (pcp_msg_info->lifetime == 0) {
-					DeletePCPMap(pcp_msg_info);
-				} else {
-					CreatePCPMap(pcp_msg_info);
-				}
+		if (ValidatePCPMsg(pcp_msg_info)) {
+			if (pcp_msg_info->lifetime == 0) {
+				DeletePCPMap(pcp_msg_info);
 			} else {
-				syslog(LOG_ERR, "PCP: Invalid PCP v2 MAP message.");
-				return pcp_msg_info->result_code;
+				CreatePCPMap(pcp_msg_info);
 			}
-
-
-			break;
+		} else {
+			syslog(LOG_ERR, "PCP: Invalid PCP v%d MAP message.",
+			       (int)pcp_msg_info->version);
+			return pcp_msg_info->result_code;
+		}
+		break;
 
 #ifdef PCP_PEER
-		case PCP_OPCODE_PEER:
-
-			remainingSize -= PCP_PEER_V2_SIZE;
-			if (remainingSize < 0) {
-				pcp_msg_info->result_code = PCP_ERR_MALFORMED_REQUEST;
-				return pcp_msg_info->result_code;
-			}
-
+	case PCP_OPCODE_PEER:
+		if (pcp_msg_info->version == 1) {
+#ifdef DEBUG
+			printPEEROpcodeVersion1(req);
+#endif /* DEBUG */
+			parsePCPPEER_version1(req, pcp_msg_info);
+		} else {
 #ifdef DEBUG
 			printPEEROpcodeVersion2(req);
 #endif /* DEBUG */
 			parsePCPPEER_version2(req, pcp_msg_info);
-			req += PCP_PEER_V2_SIZE;
-
 			if (pcp_msg_info->result_code != 0) {
 				return pcp_msg_info->result_code;
 			}
+		}
+		req += opcodeSize;
 
-			parsePCPOptions(req, remainingSize, pcp_msg_info);
+		parsePCPOptions(req, remainingSize, pcp_msg_info);
 
-			if (ValidatePCPMsg(pcp_msg_info)) {
-				if (pcp_msg_info->lifetime == 0) {
-					DeletePCPPeer(pcp_msg_info);
-				} else {
-					CreatePCPPeer(pcp_msg_info);
-				}
+		if (ValidatePCPMsg(pcp_msg_info)) {
+			if (pcp_msg_info->lifetime == 0) {
+				DeletePCPPeer(pcp_msg_info);
 			} else {
-				syslog(LOG_ERR, "PCP: Invalid PCP v2 PEER message.");
+				CreatePCPPeer(pcp_msg_info);
 			}
-
+		} else {
+			syslog(LOG_ERR, "PCP: Invalid PCP v%d PEER message.",
+			       (int)pcp_msg_info->version);
+			if (pcp_msg_info->version == 1)
+				return pcp_msg_info->result_code;
+		}
 		break;
 #endif /* PCP_PEER */
 
 #ifdef PCP_SADSCP
-		case PCP_OPCODE_SADSCP:
-			remainingSize -= PCP_SADSCP_REQ_SIZE;
-			if (remainingSize < 0) {
-				pcp_msg_info->result_code = PCP_ERR_MALFORMED_REQUEST;
-				return pcp_msg_info->result_code;
-			}
-
-			remainingSize -= ((uint8_t *)req)[13];	/* app_name_length */
-			if (remainingSize < 0) {
-				pcp_msg_info->result_code = PCP_ERR_MALFORMED_OPTION;
-				return pcp_msg_info->result_code;
-			}
+	case PCP_OPCODE_SADSCP:
+		remainingSize -= ((uint8_t *)req)[13];	/* app_name_length */
+		if (remainingSize < 0) {
+			pcp_msg_info->result_code = PCP_ERR_MALFORMED_OPTION;
+			return pcp_msg_info->result_code;
+		}
 
 #ifdef DEBUG
-			printSADSCPOpcode(req);
+		printSADSCPOpcode(req);
 #endif
-			parseSADSCP(req, pcp_msg_info);
-			req += PCP_SADSCP_REQ_SIZE;
-			if (pcp_msg_info->result_code != 0) {
-				return pcp_msg_info->result_code;
-			}
-			req += pcp_msg_info->app_name_len;
-
-			get_dscp_value(pcp_msg_info);
-
-
-			break;
-#endif
-		default:
-			pcp_msg_info->result_code = PCP_ERR_UNSUPP_OPCODE;
-			break;
+		parseSADSCP(req, pcp_msg_info);
+		req += PCP_SADSCP_REQ_SIZE;
+		if (pcp_msg_info->result_code != 0) {
+			return pcp_msg_info->result_code;
 		}
-	} else {
-		pcp_msg_info->result_code = PCP_ERR_UNSUPP_VERSION;
-		return pcp_msg_info->result_code;
+		req += pcp_msg_info->app_name_len;
+
+		get_dscp_value(pcp_msg_info);
+		break;
+#endif /* PCP_SADSCP */
 	}
 	return 1;
 }
@@ -1560,6 +1814,39 @@ static void createPCPResponse(unsigned char *response, const pcp_info_t *pcp_msg
 #endif /* PCP_SADSCP */
 }
 
+/* send an error response without processing the request.
+ * The response is built in place in buff. */
+static void SendPCPErrorResponse(int s, unsigned char *buff, int len,
+                                 const struct sockaddr *senderaddr,
+                                 const struct sockaddr_in6 *receiveraddr,
+                                 int result_code)
+{
+	if(len < PCP_MIN_LEN || (buff[1] & 128))
+		return;	/* too short or a response */
+	/* The opcode specific data of the request is left in place,
+	 * only the common header is rewritten as a response */
+	buff[1] |= 0x80;	/* r_opcode */
+	buff[2] = 0;	/* reserved */
+	buff[3] = (unsigned char)result_code;
+	WRITENU32(buff + 4, 30);	/* lifetime : retry later */
+	if(epoch_origin == 0) {
+		epoch_origin = startup_time;
+	}
+	WRITENU32(buff + 8, upnp_time() - epoch_origin); /* epochtime */
+	memset(buff + 12, 0, 12);	/* reserved */
+	len = (len + 3) & ~3;	/* round up resp. length to multiple of 4 */
+	if(len > PCP_MAX_LEN)
+		len = PCP_MAX_LEN;
+	len = sendto_or_schedule2(s, buff, len, 0, senderaddr,
+	           (senderaddr->sa_family == AF_INET) ?
+	                  sizeof(struct sockaddr_in) :
+	                  sizeof(struct sockaddr_in6),
+	           receiveraddr);
+	if( len < 0 ) {
+		syslog(LOG_ERR, "sendto(pcpserver): %m");
+	}
+}
+
 int ProcessIncomingPCPPacket(int s, unsigned char *buff, int len,
                              const struct sockaddr *senderaddr,
                              const struct sockaddr_in6 *receiveraddr)
@@ -1587,7 +1874,10 @@ int ProcessIncomingPCPPacket(int s, unsigned char *buff, int len,
 		return 0;
 	}
 
-	if(sockaddr_to_string(senderaddr, addr_str, sizeof(addr_str)))
+	/* the address is only formatted for the log messages */
+	addr_str[0] = '\0';
+	if((setlogmask(0) & LOG_MASK(LOG_DEBUG)) &&
+	   sockaddr_to_string(senderaddr, addr_str, sizeof(addr_str)))
 		syslog(LOG_DEBUG, "PCP request received from %s %dbytes",
 		       addr_str, len);
 
@@ -1601,12 +1891,20 @@ int ProcessIncomingPCPPacket(int s, unsigned char *buff, int len,
 	if (!GETFLAG(PCP_ALLOWTHIRDPARTYMASK)) {
 		lan_addr = get_lan_for_peer(senderaddr);
 		if(lan_addr == NULL) {
+			if(addr_str[0] == '\0')
+				sockaddr_to_string(senderaddr, addr_str, sizeof(addr_str));
 			syslog(LOG_WARNING, "PCP packet sender %s not from a LAN, ignoring",
 			       addr_str);
 			return 0;
 		}
 	}
 
+	if(!ratelimit_check_sockaddr(RATELIMIT_NATPMP_PCP, senderaddr)) {
+		SendPCPErrorResponse(s, buff, len, senderaddr, receiveraddr,
+		                     PCP_ERR_NO_RESOURCES);
+		return 0;
+	}
+
 	if (processPCPRequest(buff, len, &pcp_msg_info) ) {
 
 		createPCPResponse(buff, &pcp_msg_info);
@@ -1749,6 +2047,8 @@ void PCPPublicAddressChanged(int * sockets, int n_sockets)
 	 *   if the external IP address(es) of the NAT (controlled by
 	 *   the PCP server) changes, the Epoch time MUST be reset. */
 	epoch_origin = upnp_time();
+	ext_addr_cache[0].valid = 0;
+	ext_addr_cache[1].valid = 0;
 #ifdef ENABLE_IPV6
 	PCPSendUnsolicitedAnnounce(sockets, n_sockets, socket6);
 #else /* IPv4 Only */
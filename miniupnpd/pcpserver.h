@@ -70,4 +70,17 @@ void PCPPublicAddressChanged(int * sockets, int n_sockets, int socket6);
 void PCPPublicAddressChanged(int * sockets, int n_sockets);
 #endif
 
+/*
+ * Keep the table of the PCP MAP mappings in sync with the ruleset.
+ * Called for each port mapping added (or updated) or removed,
+ * whatever the protocol used.
+ */
+void PCPMappingAdded(unsigned short eport, const char * iaddr,
+                     unsigned short iport, int proto,
+                     const char * desc, unsigned int timestamp);
+
+void PCPMappingRemoved(unsigned short eport, int proto);
+
+void PCPFreeMappings(void);
+
 #endif /* PCPSERVER_H_INCLUDED */
@@ -0,0 +1,275 @@
+/* $Id: $ */
+/* MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2026 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "ratelimit.h"
+#include "upnpglobalvars.h"
+#include "upnputils.h"
+
+#define RATELIMIT_HASH_SIZE	(2 * RATELIMIT_MAX_CLIENTS)
+
+/* tokens are counted in 1/1000th so that rates are
+ * expressed in tokens per millisecond */
+#define TOKEN	(1000)
+
+/* all links are indexes in entries[] plus one, 0 meaning none,
+ * so a zeroed table is a valid empty table */
+struct ratelimit_entry {
+	struct in6_addr addr;	/* IPv4 addresses are IPv4-mapped */
+	struct timeval last;	/* last refill */
+	unsigned int tokens;	/* in 1/1000th of token */
+	unsigned short hnext;	/* next entry in hash chain */
+	unsigned short lprev;	/* LRU list : more recently used */
+	unsigned short lnext;	/* LRU list : less recently used */
+	unsigned char limited;	/* the last request was rejected */
+};
+
+struct ratelimit_table {
+	struct ratelimit_entry entries[RATELIMIT_MAX_CLIENTS];
+	unsigned short hash[RATELIMIT_HASH_SIZE];
+	unsigned short lru_head;	/* most recently used */
+	unsigned short lru_tail;	/* least recently used */
+	unsigned int count;
+	unsigned long accepted;
+	unsigned long rejected;
+};
+
+static struct ratelimit_table tables[RATELIMIT_CLASS_COUNT];
+
+static const char * const class_names[RATELIMIT_CLASS_COUNT] = {
+	"SOAP", "NAT-PMP/PCP"
+};
+
+static void
+get_params(enum ratelimit_class cls, unsigned int * rate, unsigned int * burst)
+{
+	if(cls == RATELIMIT_SOAP) {
+		*rate = soap_rate_limit;
+		*burst = soap_rate_burst;
+	} else {
+		*rate = pmp_rate_limit;
+		*burst = pmp_rate_burst;
+	}
+	if(*burst == 0)
+		*burst = (*rate > 500000) ? 1000000 : 2 * *rate;
+	if(*burst > 1000000)
+		*burst = 1000000;	/* so the bucket never overflows */
+}
+
+static unsigned int
+hash_addr(const struct in6_addr * addr)
+{
+	const unsigned char * p = addr->s6_addr;
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	int i;
+	for(i = 0; i < 16; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h % RATELIMIT_HASH_SIZE;
+}
+
+static void
+lru_unlink(struct ratelimit_table * t, unsigned short i)
+{
+	struct ratelimit_entry * e = &t->entries[i - 1];
+	if(e->lprev)
+		t->entries[e->lprev - 1].lnext = e->lnext;
+	else
+		t->lru_head = e->lnext;
+	if(e->lnext)
+		t->entries[e->lnext - 1].lprev = e->lprev;
+	else
+		t->lru_tail = e->lprev;
+	e->lprev = e->lnext = 0;
+}
+
+static void
+lru_push_head(struct ratelimit_table * t, unsigned short i)
+{
+	struct ratelimit_entry * e = &t->entries[i - 1];
+	e->lprev = 0;
+	e->lnext = t->lru_head;
+	if(t->lru_head)
+		t->entries[t->lru_head - 1].lprev = i;
+	else
+		t->lru_tail = i;
+	t->lru_head = i;
+}
+
+static void
+hash_unlink(struct ratelimit_table * t, unsigned short i)
+{
+	unsigned short * link = &t->hash[hash_addr(&t->entries[i - 1].addr)];
+	while(*link) {
+		if(*link == i) {
+			*link = t->entries[i - 1].hnext;
+			return;
+		}
+		link = &t->entries[*link - 1].hnext;
+	}
+}
+
+/* return the entry for addr, creating it (and evicting the least
+ * recently used one) if needed. The entry is moved at the head
+ * of the LRU list. */
+static struct ratelimit_entry *
+lookup(struct ratelimit_table * t, const struct in6_addr * addr,
+       unsigned int burst, const struct timeval * now)
+{
+	unsigned int h = hash_addr(addr);
+	unsigned short i;
+	struct ratelimit_entry * e;
+
+	for(i = t->hash[h]; i; i = t->entries[i - 1].hnext) {
+		if(memcmp(&t->entries[i - 1].addr, addr, sizeof(struct in6_addr)) == 0) {
+			if(t->lru_head != i) {
+				lru_unlink(t, i);
+				lru_push_head(t, i);
+			}
+			return &t->entries[i - 1];
+		}
+	}
+	if(t->count < RATELIMIT_MAX_CLIENTS) {
+		i = (unsigned short)++t->count;
+	} else {
+		/* recycle the least recently used entry */
+		i = t->lru_tail;
+		hash_unlink(t, i);
+		lru_unlink(t, i);
+	}
+	e = &t->entries[i - 1];
+	memcpy(&e->addr, addr, sizeof(struct in6_addr));
+	e->last = *now;
+	e->tokens = burst * TOKEN;
+	e->limited = 0;
+	e->hnext = t->hash[h];
+	t->hash[h] = i;
+	lru_push_head(t, i);
+	return e;
+}
+
+int
+ratelimit_check(enum ratelimit_class cls, int af, const void * addr)
+{
+	struct ratelimit_table * t;
+	struct ratelimit_entry * e;
+	struct in6_addr key;
+	struct timeval now;
+	unsigned int rate, burst;
+	long elapsed;	/* in milliseconds */
+	long usec;
+
+	if((unsigned)cls >= RATELIMIT_CLASS_COUNT)
+		return 1;
+	get_params(cls, &rate, &burst);
+	if(rate == 0)
+		return 1;	/* disabled */
+	if(af == AF_INET) {
+		memset(&key, 0, sizeof(key));
+		key.s6_addr[10] = 0xff;
+		key.s6_addr[11] = 0xff;
+		memcpy(key.s6_addr + 12, addr, 4);
+	} else if(af == AF_INET6) {
+		memcpy(&key, addr, sizeof(key));
+	} else {
+		return 1;
+	}
+	t = &tables[cls];
+	upnp_gettimeofday(&now);
+	e = lookup(t, &key, burst, &now);
+	/* refill */
+	if(now.tv_sec - e->last.tv_sec > 2000000) {
+		elapsed = 2000000000L;	/* more than burst * TOKEN / rate */
+	} else {
+		elapsed = (long)(now.tv_sec - e->last.tv_sec) * 1000;
+		usec = (long)(now.tv_usec - e->last.tv_usec);
+		if(usec < 0) {
+			elapsed -= 1000;
+			usec += 1000000;
+		}
+		elapsed += usec / 1000;
+	}
+	if(elapsed > 0) {
+		if((unsigned long)elapsed >= (unsigned long)burst * TOKEN / rate) {
+			e->tokens = burst * TOKEN;
+			e->last = now;
+		} else {
+			e->tokens += (unsigned int)elapsed * rate;
+			if(e->tokens > burst * TOKEN)
+				e->tokens = burst * TOKEN;
+			/* only advance by the milliseconds converted to tokens,
+			 * the remainder is kept for the next refill */
+			e->last.tv_sec += elapsed / 1000;
+			e->last.tv_usec += (elapsed % 1000) * 1000;
+			if(e->last.tv_usec >= 1000000) {
+				e->last.tv_sec++;
+				e->last.tv_usec -= 1000000;
+			}
+		}
+	}
+	if(e->tokens >= TOKEN) {
+		e->tokens -= TOKEN;
+		e->limited = 0;
+		t->accepted++;
+		return 1;
+	}
+	t->rejected++;
+	if(!e->limited) {
+		/* only log the first rejected request of a burst */
+		char addr_str[INET6_ADDRSTRLEN];
+		if(inet_ntop(af, addr, addr_str, sizeof(addr_str)) == NULL)
+			addr_str[0] = '\0';
+		syslog(LOG_NOTICE, "%s requests from %s exceed %u/s, rate limiting",
+		       class_names[cls], addr_str, rate);
+		e->limited = 1;
+	}
+	return 0;
+}
+
+int
+ratelimit_check_sockaddr(enum ratelimit_class cls, const struct sockaddr * sa)
+{
+	if(sa->sa_family == AF_INET)
+		return ratelimit_check(cls, AF_INET,
+		                       &((const struct sockaddr_in *)sa)->sin_addr);
+	else if(sa->sa_family == AF_INET6)
+		return ratelimit_check(cls, AF_INET6,
+		                       &((const struct sockaddr_in6 *)sa)->sin6_addr);
+	return 1;
+}
+
+#ifdef USE_MINIUPNPDCTL
+void
+write_ratelimit_details(int fd)
+{
+	char buffer[256];
+	int len;
+	int i;
+	unsigned int rate, burst;
+
+	write(fd, "Rate limiting :\n", 16);
+	for(i = 0; i < RATELIMIT_CLASS_COUNT; i++) {
+		get_params((enum ratelimit_class)i, &rate, &burst);
+		len = snprintf(buffer, sizeof(buffer),
+		               " %s rate=%u/s burst=%u clients=%u accepted=%lu rejected=%lu\n",
+		               class_names[i], rate, burst, tables[i].count,
+		               tables[i].accepted, tables[i].rejected);
+		write(fd, buffer, len);
+	}
+}
+#endif /* USE_MINIUPNPDCTL */
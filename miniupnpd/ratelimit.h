@@ -0,0 +1,58 @@
+/* $Id: $ */
+/* MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2026 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+
+#ifndef RATELIMIT_H_INCLUDED
+#define RATELIMIT_H_INCLUDED
+
+/*! \file ratelimit.h
+ * \brief per client token bucket request rate limiting
+ *
+ * Each client address owns a token bucket refilled at
+ * `rate` tokens per second, up to `burst` tokens. Every request
+ * consumes one token. The buckets are kept in a fixed size
+ * hash table : when it is full, the least recently seen client
+ * is evicted.
+ */
+
+struct sockaddr;
+
+/*! \brief maximum number of clients tracked for each class */
+#define RATELIMIT_MAX_CLIENTS	(256)
+
+/*! \brief request classes, each with its own table and parameters */
+enum ratelimit_class {
+	RATELIMIT_SOAP = 0,		/*!< UPnP SOAP actions */
+	RATELIMIT_NATPMP_PCP,	/*!< NAT-PMP and PCP requests */
+	RATELIMIT_CLASS_COUNT
+};
+
+/*! \brief check if the client is allowed to send one more request
+ *
+ * The check is disabled (always successful) when the rate configured
+ * for the class is 0.
+ * \param[in] cls request class
+ * \param[in] af AF_INET or AF_INET6
+ * \param[in] addr struct in_addr or struct in6_addr
+ * \return 1 if the request is allowed, 0 if it should be rejected */
+int
+ratelimit_check(enum ratelimit_class cls, int af, const void * addr);
+
+/*! \brief same as ratelimit_check() with a socket address
+ * \param[in] cls request class
+ * \param[in] sa sender address (AF_INET or AF_INET6)
+ * \return 1 if the request is allowed, 0 if it should be rejected */
+int
+ratelimit_check_sockaddr(enum ratelimit_class cls, const struct sockaddr * sa);
+
+#ifdef USE_MINIUPNPDCTL
+/*! \brief write rate limiting parameters and counters
+ * \param[in] fd file descriptor to write to */
+void
+write_ratelimit_details(int fd);
+#endif /* USE_MINIUPNPDCTL */
+
+#endif /* RATELIMIT_H_INCLUDED */
@@ -0,0 +1,308 @@
+/* $Id: $ */
+/* MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2026 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "config.h"
+#include "miniupnpdpath.h"
+#include "upnphttp.h"
+#include "upnpglobalvars.h"
+#include "ssdppktgen.h"
+
+/* same as SSDP_PORT in minissdp.c */
+#define SSDP_PORT_STR	"1900"
+
+/* number of hosts for which the templates are kept :
+ * one IPv4 and one IPv6 address per LAN interface */
+#define SSDP_TEMPLATE_COUNT	(8)
+
+#define CONST_STR(s)	(s), (int)(sizeof(s) - 1)
+
+struct ssdp_template {
+	/* key */
+	char host[64];
+	unsigned short http_port;
+#ifdef ENABLE_HTTPS
+	unsigned short https_port;
+#endif
+	unsigned int bootid;
+	unsigned int configid;
+	unsigned int lastuse;
+	/* LOCATION: and SECURELOCATION.UPNP.ORG: headers */
+	int location_len;
+	/* SERVER: header */
+	int server_len;
+	/* OPT:, 01-NLS:, BOOTID.UPNP.ORG:, CONFIGID.UPNP.ORG:
+	 * and the empty line ending the headers */
+	int ids_len;
+	/* the 3 parts above, one after the other */
+	char data[SSDP_PACKET_MAX_LEN];
+};
+
+static struct ssdp_template templates[SSDP_TEMPLATE_COUNT];
+static unsigned int templates_clock;
+
+/* format the headers of the template, return -1 if it does not fit */
+static int
+build_template(struct ssdp_template * t)
+{
+	int l, n;
+
+	l = snprintf(t->data, sizeof(t->data),
+#ifndef RANDOMIZE_URLS
+		"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
+#ifdef ENABLE_HTTPS
+		"SECURELOCATION.UPNP.ORG: https://%s:%u" ROOTDESC_PATH "\r\n"
+#endif	/* ENABLE_HTTPS */
+#else	/* RANDOMIZE_URLS */
+		"LOCATION: http://%s:%u/%s" ROOTDESC_PATH "\r\n"
+#ifdef ENABLE_HTTPS
+		"SECURELOCATION.UPNP.ORG: https://%s:%u/%s" ROOTDESC_PATH "\r\n"
+#endif	/* ENABLE_HTTPS */
+#endif	/* RANDOMIZE_URLS */
+		, t->host, (unsigned int)t->http_port	/* LOCATION: */
+#ifdef RANDOMIZE_URLS
+		, random_url
+#endif	/* RANDOMIZE_URLS */
+#ifdef ENABLE_HTTPS
+		, t->host, (unsigned int)t->https_port	/* SECURELOCATION.UPNP.ORG: */
+#ifdef RANDOMIZE_URLS
+		, random_url
+#endif	/* RANDOMIZE_URLS */
+#endif	/* ENABLE_HTTPS */
+		);
+	if(l < 0 || l >= (int)sizeof(t->data))
+		return -1;
+	t->location_len = l;
+	n = snprintf(t->data + l, sizeof(t->data) - l,
+		"SERVER: " MINIUPNPD_SERVER_STRING "\r\n"
+#ifdef DYNAMIC_OS_VERSION
+		, os_version
+#endif
+		);
+	if(n < 0 || n >= (int)sizeof(t->data) - l)
+		return -1;
+	t->server_len = n;
+	l += n;
+	n = snprintf(t->data + l, sizeof(t->data) - l,
+		"OPT: \"http://schemas.upnp.org/upnp/1/0/\"; ns=01\r\n" /* UDA v1.1 */
+		"01-NLS: %u\r\n" /* same as BOOTID field. UDA v1.1 */
+		"BOOTID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
+		"CONFIGID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
+		"\r\n",
+		t->bootid, t->bootid, t->configid);
+	if(n < 0 || n >= (int)sizeof(t->data) - l)
+		return -1;
+	t->ids_len = n;
+	return 0;
+}
+
+/* return the template for host, (re)building it if needed */
+static const struct ssdp_template *
+get_template(const char * host, unsigned short http_port
+#ifdef ENABLE_HTTPS
+             , unsigned short https_port
+#endif
+            )
+{
+	int i;
+	struct ssdp_template * t = NULL;
+
+	templates_clock++;
+	for(i = 0; i < SSDP_TEMPLATE_COUNT; i++) {
+		if(templates[i].host[0] != '\0'
+		   && 0 == strcmp(templates[i].host, host)
+		   && templates[i].http_port == http_port
+#ifdef ENABLE_HTTPS
+		   && templates[i].https_port == https_port
+#endif
+		  ) {
+			t = &templates[i];
+			if(t->bootid == upnp_bootid && t->configid == upnp_configid) {
+				t->lastuse = templates_clock;
+				return t;
+			}
+			break;	/* BOOTID or CONFIGID changed : rebuild */
+		}
+		/* unused entries have lastuse == 0 */
+		if(t == NULL || templates[i].lastuse < t->lastuse)
+			t = &templates[i];
+	}
+	if(strlen(host) >= sizeof(t->host)) {
+		syslog(LOG_ERR, "%s: host %s too long", "get_template()", host);
+		return NULL;
+	}
+	strncpy(t->host, host, sizeof(t->host));
+	t->http_port = http_port;
+#ifdef ENABLE_HTTPS
+	t->https_port = https_port;
+#endif
+	t->bootid = upnp_bootid;
+	t->configid = upnp_configid;
+	t->lastuse = templates_clock;
+	if(build_template(t) < 0) {
+		syslog(LOG_WARNING, "%s: SSDP headers for %s longer than %d bytes",
+		       "get_template()", host, SSDP_PACKET_MAX_LEN);
+		t->host[0] = '\0';
+		t->lastuse = 0;
+		return NULL;
+	}
+	syslog(LOG_DEBUG, "SSDP template for %s built", host);
+	return t;
+}
+
+/* append n bytes at position l of buf.
+ * return the new length, or -1 if the data does not fit
+ * (or if l is already -1) */
+static int
+append(char * buf, int size, int l, const char * data, int n)
+{
+	if(l < 0 || n > size - l)
+		return -1;
+	memcpy(buf + l, data, n);
+	return l + n;
+}
+
+static int
+append_uint(char * buf, int size, int l, unsigned int value)
+{
+	char tmp[12];
+	int i = sizeof(tmp);
+
+	do {
+		tmp[--i] = '0' + (value % 10);
+		value /= 10;
+	} while(value > 0);
+	return append(buf, size, l, tmp + i, sizeof(tmp) - i);
+}
+
+#ifdef ENABLE_HTTP_DATE
+const char *
+ssdp_http_date(void)
+{
+	static time_t last = (time_t)-1;
+	static char http_date[64];
+	time_t t;
+	struct tm tm;
+
+	time(&t);
+	if(t != last) {
+		gmtime_r(&t, &tm);
+		strftime(http_date, sizeof(http_date),
+		         "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		last = t;
+	}
+	return http_date;
+}
+#endif /* ENABLE_HTTP_DATE */
+
+int
+BuildSSDPResponse(char * buf, int size,
+                  const char * st, int st_len, const char * suffix,
+                  const char * host, unsigned short http_port,
+#ifdef ENABLE_HTTPS
+                  unsigned short https_port,
+#endif
+                  const char * uuidvalue)
+{
+	const struct ssdp_template * t;
+	int l;
+	int suffix_len;
+	int uuid_len;
+	int st_is_uuid;
+#ifdef ENABLE_HTTP_DATE
+	const char * http_date;
+#endif
+
+	t = get_template(host, http_port
+#ifdef ENABLE_HTTPS
+	                 , https_port
+#endif
+	                );
+	if(t == NULL)
+		return -1;
+	suffix_len = (int)strlen(suffix);
+	uuid_len = (int)strlen(uuidvalue);
+	st_is_uuid = (st_len == uuid_len) && (memcmp(uuidvalue, st, st_len) == 0);
+	/*
+	 * follow guideline from document "UPnP Device Architecture 1.0"
+	 * uppercase is recommended.
+	 * DATE: is recommended
+	 * SERVER: OS/ver UPnP/1.0 miniupnpd/1.0
+	 * CACHE-CONTROL: Should be greater than or equal to 1800 seconds
+	 */
+	l = append(buf, size, 0, CONST_STR("HTTP/1.1 200 OK\r\n"
+	                                   "CACHE-CONTROL: max-age=1800\r\n"));
+#ifdef ENABLE_HTTP_DATE
+	http_date = ssdp_http_date();
+	l = append(buf, size, l, CONST_STR("DATE: "));
+	l = append(buf, size, l, http_date, (int)strlen(http_date));
+	l = append(buf, size, l, CONST_STR("\r\n"));
+#endif
+	l = append(buf, size, l, CONST_STR("ST: "));
+	l = append(buf, size, l, st, st_len);
+	l = append(buf, size, l, suffix, suffix_len);
+	l = append(buf, size, l, CONST_STR("\r\nUSN: "));
+	l = append(buf, size, l, uuidvalue, uuid_len);
+	if(!st_is_uuid) {
+		l = append(buf, size, l, CONST_STR("::"));
+		l = append(buf, size, l, st, st_len);
+	}
+	l = append(buf, size, l, suffix, suffix_len);
+	l = append(buf, size, l, CONST_STR("\r\nEXT:\r\n"));
+	l = append(buf, size, l, t->data + t->location_len, t->server_len);
+	l = append(buf, size, l, t->data, t->location_len);
+	l = append(buf, size, l, t->data + t->location_len + t->server_len,
+	           t->ids_len);
+	return l;
+}
+
+int
+BuildSSDPNotify(char * buf, int size, const char * dest_str,
+                const char * host, unsigned short http_port,
+#ifdef ENABLE_HTTPS
+                unsigned short https_port,
+#endif
+                const char * nt, const char * suffix,
+                const char * usn1, const char * usn2, const char * usn3,
+                unsigned int lifetime)
+{
+	const struct ssdp_template * t;
+	int l;
+	int suffix_len;
+
+	t = get_template(host, http_port
+#ifdef ENABLE_HTTPS
+	                 , https_port
+#endif
+	                );
+	if(t == NULL)
+		return -1;
+	suffix_len = (int)strlen(suffix);
+	l = append(buf, size, 0, CONST_STR("NOTIFY * HTTP/1.1\r\nHOST: "));
+	l = append(buf, size, l, dest_str, (int)strlen(dest_str));
+	l = append(buf, size, l, CONST_STR(":" SSDP_PORT_STR "\r\n"
+	                                   "CACHE-CONTROL: max-age="));
+	l = append_uint(buf, size, l, lifetime);
+	l = append(buf, size, l, CONST_STR("\r\n"));
+	l = append(buf, size, l, t->data, t->location_len + t->server_len);
+	l = append(buf, size, l, CONST_STR("NT: "));
+	l = append(buf, size, l, nt, (int)strlen(nt));
+	l = append(buf, size, l, suffix, suffix_len);
+	l = append(buf, size, l, CONST_STR("\r\nUSN: "));
+	l = append(buf, size, l, usn1, (int)strlen(usn1));
+	l = append(buf, size, l, usn2, (int)strlen(usn2));
+	l = append(buf, size, l, usn3, (int)strlen(usn3));
+	l = append(buf, size, l, suffix, suffix_len);
+	l = append(buf, size, l, CONST_STR("\r\nNTS: ssdp:alive\r\n"));
+	l = append(buf, size, l, t->data + t->location_len + t->server_len,
+	           t->ids_len);
+	return l;
+}
@@ -0,0 +1,67 @@
+/* $Id: $ */
+/* MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2026 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+
+#ifndef SSDPPKTGEN_H_INCLUDED
+#define SSDPPKTGEN_H_INCLUDED
+
+#include "config.h"
+
+/*! \file ssdppktgen.h
+ * \brief SSDP response and NOTIFY packets generation
+ *
+ * The headers which only depend on the announced host, the HTTP(S)
+ * ports, BOOTID and CONFIGID (LOCATION:, SERVER:, 01-NLS:, etc.)
+ * are formatted once and kept in a small cache indexed by host.
+ * A template is rebuilt when one of these values changes.
+ * Building a packet is then only a sequence of copies.
+ */
+
+/*! \brief build the response to a M-SEARCH
+ * \param[out] buf output buffer
+ * \param[in] size size of buf, SSDP_PACKET_MAX_LEN is enough
+ * \param[in] st, st_len ST: value
+ * \param[in] suffix appended to ST: (version)
+ * \param[in] host announced host (IPv6 address with brackets)
+ * \param[in] uuidvalue uuid of the device
+ * \return packet length or -1 in case of error */
+int
+BuildSSDPResponse(char * buf, int size,
+                  const char * st, int st_len, const char * suffix,
+                  const char * host, unsigned short http_port,
+#ifdef ENABLE_HTTPS
+                  unsigned short https_port,
+#endif
+                  const char * uuidvalue);
+
+/*! \brief build a ssdp:alive NOTIFY packet
+ * \param[out] buf output buffer
+ * \param[in] size size of buf, SSDP_PACKET_MAX_LEN is enough
+ * \param[in] dest_str multicast destination, for the HOST: header
+ * \param[in] host announced host (IPv6 address with brackets)
+ * \param[in] nt, suffix NT: value
+ * \param[in] usn1, usn2, usn3 USN: value (followed by suffix)
+ * \param[in] lifetime CACHE-CONTROL: max-age value
+ * \return packet length or -1 in case of error */
+int
+BuildSSDPNotify(char * buf, int size, const char * dest_str,
+                const char * host, unsigned short http_port,
+#ifdef ENABLE_HTTPS
+                unsigned short https_port,
+#endif
+                const char * nt, const char * suffix,
+                const char * usn1, const char * usn2, const char * usn3,
+                unsigned int lifetime);
+
+#ifdef ENABLE_HTTP_DATE
+/*! \brief current date in the RFC 1123 format used by HTTP
+ *
+ * The string is formatted once per second. */
+const char *
+ssdp_http_date(void);
+#endif /* ENABLE_HTTP_DATE */
+
+#endif /* SSDPPKTGEN_H_INCLUDED */
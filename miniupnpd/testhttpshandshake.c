@@ -0,0 +1,235 @@
+/* $Id: $ */
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2026 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+
+/* benchmark of the TLS handshakes per second, with and without
+ * session resumption. Client and server run in the same process
+ * and are connected with a BIO pair, so only the cryptography
+ * and the protocol processing are measured. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "config.h"
+
+#if defined(ENABLE_HTTPS)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#endif
+
+#if defined(ENABLE_HTTPS) && OPENSSL_VERSION_NUMBER >= 0x10101000L
+
+/* same session settings as init_ssl() in upnphttp.c */
+static SSL_CTX *
+new_server_ctx(EVP_PKEY * pkey, X509 * cert)
+{
+	SSL_CTX * ctx;
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if(ctx == NULL)
+		return NULL;
+	SSL_CTX_use_certificate(ctx, cert);
+	SSL_CTX_use_PrivateKey(ctx, pkey);
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"miniupnpd", 9);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, 128);
+	SSL_CTX_set_timeout(ctx, 3600);
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_num_tickets(ctx, 1);
+	return ctx;
+}
+
+static int
+make_key_and_cert(EVP_PKEY * * pkey, X509 * * cert)
+{
+	EVP_PKEY_CTX * pctx;
+	X509_NAME * name;
+
+	*pkey = NULL;
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if(pctx == NULL
+	   || EVP_PKEY_keygen_init(pctx) <= 0
+	   || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0
+	   || EVP_PKEY_keygen(pctx, pkey) <= 0) {
+		EVP_PKEY_CTX_free(pctx);
+		return -1;
+	}
+	EVP_PKEY_CTX_free(pctx);
+	*cert = X509_new();
+	if(*cert == NULL)
+		return -1;
+	X509_set_version(*cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(*cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(*cert), 3600);
+	X509_set_pubkey(*cert, *pkey);
+	name = X509_get_subject_name(*cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	                           (const unsigned char *)"miniupnpd", -1, -1, 0);
+	X509_set_issuer_name(*cert, name);
+	if(X509_sign(*cert, *pkey, EVP_sha256()) <= 0)
+		return -1;
+	return 0;
+}
+
+/* do one handshake. If session is not NULL, try to resume it.
+ * Return the session to resume next time, or NULL on error */
+static SSL_SESSION *
+handshake(SSL_CTX * sctx, SSL_CTX * cctx, SSL_SESSION * session, int * reused)
+{
+	SSL * server;
+	SSL * client;
+	BIO * sbio;
+	BIO * cbio;
+	SSL_SESSION * ret = NULL;
+	int sdone = 0, cdone = 0;
+	int i;
+	char c;
+
+	server = SSL_new(sctx);
+	client = SSL_new(cctx);
+	if(!BIO_new_bio_pair(&sbio, 0, &cbio, 0))
+		goto end;
+	SSL_set_bio(server, sbio, sbio);
+	SSL_set_bio(client, cbio, cbio);
+	SSL_set_accept_state(server);
+	SSL_set_connect_state(client);
+	if(session)
+		SSL_set_session(client, session);
+	for(i = 0; i < 20 && !(sdone && cdone); i++) {
+		if(!cdone) {
+			int r = SSL_do_handshake(client);
+			if(r == 1)
+				cdone = 1;
+			else if(SSL_get_error(client, r) != SSL_ERROR_WANT_READ)
+				goto end;
+		}
+		if(!sdone) {
+			int r = SSL_do_handshake(server);
+			if(r == 1)
+				sdone = 1;
+			else if(SSL_get_error(server, r) != SSL_ERROR_WANT_READ)
+				goto end;
+		}
+	}
+	if(!(sdone && cdone))
+		goto end;
+	/* let the client process the TLS 1.3 NewSessionTicket messages */
+	if(SSL_read(client, &c, 1) <= 0 &&
+	   SSL_get_error(client, 0) != SSL_ERROR_WANT_READ)
+		goto end;
+	*reused = SSL_session_reused(client);
+	/* as CloseSocket_upnphttp() does, otherwise the session
+	 * is removed from the cache */
+	SSL_shutdown(server);
+	SSL_shutdown(client);
+	ret = SSL_get1_session(client);
+end:
+	SSL_free(client);
+	SSL_free(server);
+	return ret;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int
+bench(EVP_PKEY * pkey, X509 * cert, int version, const char * version_str,
+      int resume, int count)
+{
+	SSL_CTX * sctx;
+	SSL_CTX * cctx;
+	SSL_SESSION * session = NULL;
+	SSL_SESSION * tmp;
+	int i, reused, nreused = 0;
+	double t0, t1;
+
+	sctx = new_server_ctx(pkey, cert);
+	cctx = SSL_CTX_new(TLS_client_method());
+	if(sctx == NULL || cctx == NULL)
+		return -1;
+	SSL_CTX_set_min_proto_version(cctx, version);
+	SSL_CTX_set_max_proto_version(cctx, version);
+	SSL_CTX_set_session_cache_mode(cctx, SSL_SESS_CACHE_CLIENT);
+	/* first full handshake to get a session */
+	session = handshake(sctx, cctx, NULL, &reused);
+	if(session == NULL) {
+		fprintf(stderr, "%s handshake failed\n", version_str);
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	t0 = now();
+	for(i = 0; i < count; i++) {
+		reused = 0;
+		tmp = handshake(sctx, cctx, resume ? session : NULL, &reused);
+		if(tmp == NULL) {
+			fprintf(stderr, "%s handshake failed\n", version_str);
+			return -1;
+		}
+		nreused += reused;
+		SSL_SESSION_free(session);
+		session = tmp;
+	}
+	t1 = now();
+	printf("%s %-8s : %8.1f handshakes/s (%d/%d resumed)\n",
+	       version_str, resume ? "resumed" : "full",
+	       (double)count / (t1 - t0), nreused, count);
+	SSL_SESSION_free(session);
+	SSL_CTX_free(cctx);
+	SSL_CTX_free(sctx);
+	if(resume && nreused != count) {
+		fprintf(stderr, "%s : sessions were not resumed\n", version_str);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char * * argv)
+{
+	EVP_PKEY * pkey;
+	X509 * cert;
+	int count = 200;
+	int r = 0;
+
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(count <= 0)
+		count = 1;
+	if(make_key_and_cert(&pkey, &cert) < 0) {
+		fprintf(stderr, "failed to generate the test certificate\n");
+		ERR_print_errors_fp(stderr);
+		return 1;
+	}
+	r |= bench(pkey, cert, TLS1_2_VERSION, "TLSv1.2", 0, count);
+	r |= bench(pkey, cert, TLS1_2_VERSION, "TLSv1.2", 1, count);
+	r |= bench(pkey, cert, TLS1_3_VERSION, "TLSv1.3", 0, count);
+	r |= bench(pkey, cert, TLS1_3_VERSION, "TLSv1.3", 1, count);
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+	return r ? 1 : 0;
+}
+
+#else /* defined(ENABLE_HTTPS) && OPENSSL_VERSION_NUMBER >= 0x10101000L */
+
+int
+main(int argc, char * * argv)
+{
+	(void)argc; (void)argv;
+	printf("HTTPS support disabled or OpenSSL older than 1.1.1, nothing to benchmark\n");
+	return 0;
+}
+
+#endif /* defined(ENABLE_HTTPS) && OPENSSL_VERSION_NUMBER >= 0x10101000L */
@@ -2,6 +2,7 @@
 
 #include <syslog.h>
 #include <signal.h>
+#include <sys/select.h>
 
 #include "ifacewatcher.h"
 #include "miniupnpdtypes.h"
@@ -19,6 +20,8 @@ int main(int argc, char * * argv)
 	return 1;
 #else
 	int s;
+	fd_set readset;
+	struct timeval timeout;
 
 	ext_if_name = (const char *)0;
 	if (argc > 1) {
@@ -34,11 +37,22 @@ int main(int argc, char * * argv)
 	}
 	syslog(LOG_DEBUG, "Socket %d open. waiting", s);
 	for(;;) {
+		ApplyInterfaceWatchChanges();
 		if(should_send_public_address_change_notif) {
 			syslog(LOG_DEBUG, "should_send_public_address_change_notif !");
 			should_send_public_address_change_notif = 0;
 		}
-		ProcessInterfaceWatchNotify(s);
+		FD_ZERO(&readset);
+		FD_SET(s, &readset);
+		timeout.tv_sec = 60;
+		timeout.tv_usec = 0;
+		UpdateInterfaceWatchTimeout(&timeout);
+		if(select(s + 1, &readset, NULL, NULL, &timeout) < 0) {
+			syslog(LOG_ERR, "select(): %m");
+			break;
+		}
+		if(FD_ISSET(s, &readset))
+			ProcessInterfaceWatchNotify(s);
 	}
 	closelog();
 	return 0;
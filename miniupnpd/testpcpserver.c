@@ -0,0 +1,484 @@
+/* $Id: $ */
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2026 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+
+/* benchmark of the PCP requests processed per second.
+ * A corpus of PCP MAP requests (version 1 and 2, creation, refresh
+ * and deletion, with and without options) is replayed through
+ * ProcessIncomingPCPPacket(). The firewall is replaced by an in memory
+ * ruleset, so only the PCP processing is measured. The benchmark is
+ * single threaded : the result is the rate for one core. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+
+#ifdef ENABLE_PCP
+#include "macros.h"
+#include "upnpglobalvars.h"
+#include "upnpredirect.h"
+#include "commonrdr.h"
+#include "getifaddr.h"
+#include "asyncsendto.h"
+#include "portinuse.h"
+#include "pcpserver.h"
+#include "pcp_msg_struct.h"
+#ifdef ENABLE_UPNPPINHOLE
+#include "upnppinhole.h"
+#endif /* ENABLE_UPNPPINHOLE */
+#ifdef PCP_PEER
+#include "netfilter/iptcrdr.h"
+#endif /* PCP_PEER */
+
+#define CLIENTS	256
+#define MAPPINGS_PER_CLIENT	4
+#define MAX_RULES	(CLIENTS * MAPPINGS_PER_CLIENT)
+
+/* in memory ruleset replacing the firewall */
+struct rule {
+	unsigned short eport;
+	unsigned short iport;
+	int proto;
+	char iaddr[INET_ADDRSTRLEN];
+	unsigned int timestamp;
+};
+
+static struct rule rules[MAX_RULES];
+/* rule index + 1, by protocol and external port */
+static unsigned short rule_slot[2][65536];
+static int rule_count = 0;
+
+static unsigned char last_response[PCP_MAX_LEN];
+static int last_response_len = 0;
+
+static struct rule *
+find_rule(unsigned short eport, int proto)
+{
+	unsigned short i = rule_slot[proto == IPPROTO_UDP][eport];
+	return (i == 0) ? NULL : &rules[i - 1];
+}
+
+int
+upnp_redirect_internal(const char * rhost, unsigned short eport,
+                       const char * iaddr, unsigned short iport,
+                       int proto, const char * desc,
+                       unsigned int timestamp)
+{
+	struct rule * r;
+	UNUSED(rhost);
+
+	if(find_rule(eport, proto) != NULL || rule_count >= MAX_RULES)
+		return -1;
+	r = &rules[rule_count];
+	r->eport = eport;
+	r->iport = iport;
+	r->proto = proto;
+	strncpy(r->iaddr, iaddr, sizeof(r->iaddr) - 1);
+	r->iaddr[sizeof(r->iaddr) - 1] = '\0';
+	r->timestamp = timestamp;
+	rule_slot[proto == IPPROTO_UDP][eport] = ++rule_count;
+	PCPMappingAdded(eport, iaddr, iport, proto, desc, timestamp);
+	return 0;
+}
+
+int
+_upnp_delete_redir(unsigned short eport, int proto)
+{
+	struct rule * r;
+	struct rule * last;
+
+	r = find_rule(eport, proto);
+	if(r == NULL)
+		return -1;
+	rule_slot[proto == IPPROTO_UDP][eport] = 0;
+	last = &rules[--rule_count];
+	if(r != last) {
+		*r = *last;
+		rule_slot[r->proto == IPPROTO_UDP][r->eport] = (r - rules) + 1;
+	}
+	PCPMappingRemoved(eport, proto);
+	return 0;
+}
+
+int
+get_redirect_rule(const char * ifname, unsigned short eport, int proto,
+                  char * iaddr, int iaddrlen, unsigned short * iport,
+                  char * desc, int desclen,
+                  char * rhost, int rhostlen,
+                  unsigned int * timestamp,
+                  u_int64_t * packets, u_int64_t * bytes)
+{
+	struct rule * r;
+	UNUSED(ifname);
+
+	r = find_rule(eport, proto);
+	if(r == NULL)
+		return -1;
+	if(iaddr)
+		snprintf(iaddr, iaddrlen, "%s", r->iaddr);
+	if(iport)
+		*iport = r->iport;
+	if(desc && desclen > 0)
+		desc[0] = '\0';
+	if(rhost && rhostlen > 0)
+		rhost[0] = '\0';
+	if(timestamp)
+		*timestamp = r->timestamp;
+	if(packets)
+		*packets = 0;
+	if(bytes)
+		*bytes = 0;
+	return 0;
+}
+
+#ifdef CHECK_PORTINUSE
+int
+port_in_use(const char *if_name,
+            unsigned port, int proto,
+            const char *iaddr, unsigned iport)
+{
+	UNUSED(if_name); UNUSED(port); UNUSED(proto);
+	UNUSED(iaddr); UNUSED(iport);
+	return 0;
+}
+#endif /* CHECK_PORTINUSE */
+
+int
+getifaddr_in6(const char * ifname, int af, struct in6_addr* addr)
+{
+	UNUSED(ifname); UNUSED(af); UNUSED(addr);
+	return -1;
+}
+
+ssize_t
+sendto_or_schedule(int sockfd, const void *buf, size_t len, int flags,
+                   const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	UNUSED(sockfd); UNUSED(buf); UNUSED(flags);
+	UNUSED(dest_addr); UNUSED(addrlen);
+	return (ssize_t)len;
+}
+
+ssize_t
+sendto_or_schedule2(int sockfd, const void *buf, size_t len, int flags,
+                   const struct sockaddr *dest_addr, socklen_t addrlen,
+                   const struct sockaddr_in6 *src_addr)
+{
+	UNUSED(sockfd); UNUSED(flags);
+	UNUSED(dest_addr); UNUSED(addrlen); UNUSED(src_addr);
+	if(len > sizeof(last_response))
+		len = sizeof(last_response);
+	memcpy(last_response, buf, len);
+	last_response_len = (int)len;
+	return (ssize_t)len;
+}
+
+#ifdef ENABLE_UPNPPINHOLE
+int
+upnp_find_inboundpinhole(const char * raddr, unsigned short rport,
+                         const char * iaddr, unsigned short iport,
+                         int proto,
+                         char * desc, int desc_len, unsigned int * leasetime)
+{
+	UNUSED(raddr); UNUSED(rport); UNUSED(iaddr); UNUSED(iport);
+	UNUSED(proto); UNUSED(desc); UNUSED(desc_len); UNUSED(leasetime);
+	return -1;
+}
+
+int
+upnp_add_inboundpinhole(const char * raddr, unsigned short rport,
+                        const char * iaddr, unsigned short iport,
+                        int proto, char * desc,
+                        unsigned int leasetime, int * uid)
+{
+	UNUSED(raddr); UNUSED(rport); UNUSED(iaddr); UNUSED(iport);
+	UNUSED(proto); UNUSED(desc); UNUSED(leasetime); UNUSED(uid);
+	return -1;
+}
+
+int
+upnp_update_inboundpinhole(unsigned short uid, unsigned int leasetime)
+{
+	UNUSED(uid); UNUSED(leasetime);
+	return -1;
+}
+
+int
+upnp_delete_inboundpinhole(unsigned short uid)
+{
+	UNUSED(uid);
+	return -1;
+}
+#endif /* ENABLE_UPNPPINHOLE */
+
+#ifdef PCP_PEER
+int
+add_peer_redirect_rule2(const char * ifname,
+                   const char * rhost, unsigned short rport,
+                   const char * eaddr, unsigned short eport,
+                   const char * iaddr, unsigned short iport, int proto,
+                   const char * desc, unsigned int timestamp)
+{
+	UNUSED(ifname); UNUSED(rhost); UNUSED(rport); UNUSED(eaddr);
+	UNUSED(eport); UNUSED(iaddr); UNUSED(iport); UNUSED(proto);
+	UNUSED(desc); UNUSED(timestamp);
+	return -1;
+}
+
+int
+get_nat_ext_addr(struct sockaddr* src, struct sockaddr *dst, uint8_t proto,
+                 struct sockaddr* ret_ext)
+{
+	UNUSED(src); UNUSED(dst); UNUSED(proto); UNUSED(ret_ext);
+	return -1;
+}
+
+int
+get_peer_rule_by_index(int index,
+                           char * ifname, unsigned short * eport,
+                           char * iaddr, int iaddrlen, unsigned short * iport,
+                           int * proto, char * desc, int desclen,
+                           char * rhost, int rhostlen, unsigned short * rport,
+                           unsigned int * timestamp,
+                           u_int64_t * packets, u_int64_t * bytes)
+{
+	UNUSED(index); UNUSED(ifname); UNUSED(eport); UNUSED(iaddr);
+	UNUSED(iaddrlen); UNUSED(iport); UNUSED(proto); UNUSED(desc);
+	UNUSED(desclen); UNUSED(rhost); UNUSED(rhostlen); UNUSED(rport);
+	UNUSED(timestamp); UNUSED(packets); UNUSED(bytes);
+	return -1;
+}
+#endif /* PCP_PEER */
+
+/* the corpus */
+struct pcp_request {
+	unsigned char buf[PCP_MAX_LEN];
+	int len;
+	struct sockaddr_in sender;
+	unsigned short eport;	/* expected external port in the response */
+	int delete;
+};
+
+#define CORPUS_SIZE	(MAX_RULES * 3)
+static struct pcp_request corpus[CORPUS_SIZE];
+
+static void
+client_addr(int client, struct in_addr * addr)
+{
+	addr->s_addr = htonl(0xc0a80000 | ((1 + client / 200) << 8) | (10 + client % 200));
+}
+
+/* request as sent by a client : common header, MAP opcode and options */
+static int
+make_map_request(struct pcp_request * req, int version, int client,
+                 int mapping, unsigned long lifetime)
+{
+	unsigned char * p = req->buf;
+	unsigned short port = 10000 + client * MAPPINGS_PER_CLIENT + mapping;
+	struct in_addr addr;
+
+	memset(req, 0, sizeof(*req));
+	client_addr(client, &addr);
+	req->sender.sin_family = AF_INET;
+	req->sender.sin_port = htons(5350);
+	req->sender.sin_addr = addr;
+	req->eport = port;
+	req->delete = (lifetime == 0);
+
+	p[0] = version;
+	p[1] = PCP_OPCODE_MAP;
+	p[4] = (lifetime >> 24) & 0xff;
+	p[5] = (lifetime >> 16) & 0xff;
+	p[6] = (lifetime >> 8) & 0xff;
+	p[7] = lifetime & 0xff;
+	/* IPv4 mapped client address */
+	p[18] = p[19] = 0xff;
+	memcpy(p + 20, &addr, 4);
+	p += PCP_COMMON_REQUEST_SIZE;
+	if(version == 1) {
+		p[0] = (mapping & 1) ? IPPROTO_UDP : IPPROTO_TCP;
+		p[4] = port >> 8;
+		p[5] = port & 0xff;
+		p[6] = port >> 8;
+		p[7] = port & 0xff;
+		p[18] = p[19] = 0xff;
+		p += PCP_MAP_V1_SIZE;
+	} else {
+		/* nonce */
+		p[0] = 0x4e;
+		p[1] = client & 0xff;
+		p[2] = (client >> 8) & 0xff;
+		p[11] = 0x01;
+		p[12] = (mapping & 1) ? IPPROTO_UDP : IPPROTO_TCP;
+		p[16] = port >> 8;
+		p[17] = port & 0xff;
+		p[18] = port >> 8;
+		p[19] = port & 0xff;
+		p[30] = p[31] = 0xff;
+		p += PCP_MAP_V2_SIZE;
+		if(lifetime != 0 && mapping == 1) {
+			p[0] = PCP_OPTION_PREF_FAIL;
+			p += PCP_PREFER_FAIL_OPTION_SIZE;
+		} else if(lifetime != 0 && mapping == 2) {
+			p[0] = PCP_OPTION_FILTER;
+			p[3] = PCP_FILTER_OPTION_SIZE - 4;
+			p[5] = 0;	/* prefix length : all remote peers */
+			p += PCP_FILTER_OPTION_SIZE;
+		}
+	}
+	req->len = p - req->buf;
+	return req->len;
+}
+
+static int
+build_corpus(void)
+{
+	int n = 0;
+	int client, mapping, pass;
+	unsigned long lifetime[3] = { 3600, 3600, 0 };	/* create, refresh, delete */
+
+	for(pass = 0; pass < 3; pass++) {
+		for(client = 0; client < CLIENTS; client++) {
+			for(mapping = 0; mapping < MAPPINGS_PER_CLIENT; mapping++) {
+				/* one client out of 4 uses PCP version 1 */
+				make_map_request(&corpus[n++], (client & 3) == 3 ? 1 : 2,
+				                 client, mapping, lifetime[pass]);
+			}
+		}
+	}
+	return n;
+}
+
+/* response is ok and contains the expected external port */
+static int
+check_response(const struct pcp_request * req)
+{
+	int eport_offset;
+
+	if(last_response_len < PCP_MIN_LEN)
+		return 0;
+	if(last_response[1] != (PCP_OPCODE_MAP | 0x80))
+		return 0;
+	if(last_response[3] != PCP_SUCCESS) {
+		fprintf(stderr, "result code %u for port %hu\n",
+		        last_response[3], req->eport);
+		return 0;
+	}
+	if(req->delete)
+		return 1;
+	eport_offset = PCP_COMMON_RESPONSE_SIZE + ((req->buf[0] == 1) ? 6 : 18);
+	return ((last_response[eport_offset] << 8) | last_response[eport_offset + 1])
+	       == req->eport;
+}
+
+static double
+elapsed(const struct timespec * start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+	       + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char * * argv)
+{
+	static struct lan_addr_s lan;
+	unsigned char buf[PCP_MAX_LEN];
+	struct timespec start;
+	double t;
+	long requests = 0;
+	int rounds = 100;
+	int n, i, round;
+	int errors = 0;
+
+	if(argc > 1)
+		rounds = atoi(argv[1]);
+	if(rounds <= 0) {
+		fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	/* logging at the daemon default level */
+	openlog("testpcpserver", LOG_PERROR, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_NOTICE));
+
+	ext_if_name = "eth0";
+	use_ext_ip_addr = "198.51.100.1";
+	min_lifetime = 120;
+	max_lifetime = 86400;
+	LIST_INIT(&lan_addrs);
+	strncpy(lan.ifname, "eth1", sizeof(lan.ifname));
+	strncpy(lan.str, "192.168.0.1", sizeof(lan.str));
+	inet_pton(AF_INET, "192.168.0.1", &lan.addr);
+	inet_pton(AF_INET, "255.255.0.0", &lan.mask);
+	LIST_INSERT_HEAD(&lan_addrs, &lan, list);
+
+	n = build_corpus();
+	printf("corpus : %d PCP MAP requests from %d clients\n", n, CLIENTS);
+
+	/* first round : check the responses */
+	for(i = 0; i < n; i++) {
+		memcpy(buf, corpus[i].buf, corpus[i].len);
+		last_response_len = 0;
+		ProcessIncomingPCPPacket(0, buf, corpus[i].len,
+		                         (struct sockaddr *)&corpus[i].sender, NULL);
+		if(!check_response(&corpus[i]))
+			errors++;
+		if(i == (n / 3 - 1) && rule_count != MAX_RULES) {
+			fprintf(stderr, "%d rules after creation, %d expected\n",
+			        rule_count, MAX_RULES);
+			errors++;
+		}
+	}
+	if(rule_count != 0) {
+		fprintf(stderr, "%d rules left after deletion\n", rule_count);
+		errors++;
+	}
+	if(errors > 0) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(round = 0; round < rounds; round++) {
+		for(i = 0; i < n; i++) {
+			memcpy(buf, corpus[i].buf, corpus[i].len);
+			ProcessIncomingPCPPacket(0, buf, corpus[i].len,
+			                         (struct sockaddr *)&corpus[i].sender, NULL);
+		}
+		requests += n;
+	}
+	t = elapsed(&start);
+	printf("%ld requests in %.3fs : %.0f requests/s (1 core)\n",
+	       requests, t, requests / t);
+
+	PCPFreeMappings();
+	closelog();
+	return 0;
+}
+
+#else /* ENABLE_PCP */
+
+int
+main(int argc, char * * argv)
+{
+	(void)argc; (void)argv;
+	printf("PCP support disabled, nothing to benchmark\n");
+	return 0;
+}
+
+#endif /* ENABLE_PCP */
@@ -1,15 +1,17 @@
 /* $Id: testssdppktgen.c,v 1.2 2021/05/21 22:05:17 nanard Exp $ */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <time.h>
 #include "config.h"
 #ifdef DYNAMIC_OS_VERSION
-#include <string.h>
 #include <sys/utsname.h>
 #endif
 
 #include "miniupnpdpath.h"
 #include "upnphttp.h"
+#include "ssdppktgen.h"
 #include "macros.h"
 
 #define SSDP_PORT 1900
@@ -17,12 +19,17 @@
 const char uuidvalue_igd[] = "uuid:12345678-0000-0000-0000-000000abcd01";
 unsigned upnp_bootid;
 unsigned upnp_configid;
+#ifdef RANDOMIZE_URLS
+char random_url[16] = "0123abcd";
+#endif /* RANDOMIZE_URLS */
 #ifdef DYNAMIC_OS_VERSION
 char * os_version;
 #endif
 
+/* reference implementation : SSDP NOTIFY packet
+ * as it was built by SendSSDPNotify() */
 static int
-MakeSSDPPacket(const char * dest_str,
+MakeSSDPPacket(char * bufr, int size, const char * dest_str,
                const char * host, unsigned short http_port,
 #ifdef ENABLE_HTTPS
                unsigned short https_port,
@@ -31,17 +38,23 @@ MakeSSDPPacket(const char * dest_str,
                const char * usn1, const char * usn2, const char * usn3,
                unsigned int lifetime)
 {
-	char bufr[SSDP_PACKET_MAX_LEN];
 	int l;
 
-		l = snprintf(bufr, sizeof(bufr),
+		l = snprintf(bufr, size,
 		"NOTIFY * HTTP/1.1\r\n"
 		"HOST: %s:%d\r\n"
 		"CACHE-CONTROL: max-age=%u\r\n"
+#ifndef RANDOMIZE_URLS
 		"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
 #ifdef ENABLE_HTTPS
 		"SECURELOCATION.UPNP.ORG: https://%s:%u" ROOTDESC_PATH "\r\n"
 #endif
+#else	/* RANDOMIZE_URLS */
+		"LOCATION: http://%s:%u/%s" ROOTDESC_PATH "\r\n"
+#ifdef ENABLE_HTTPS
+		"SECURELOCATION.UPNP.ORG: https://%s:%u/%s" ROOTDESC_PATH "\r\n"
+#endif
+#endif	/* RANDOMIZE_URLS */
 		"SERVER: " MINIUPNPD_SERVER_STRING "\r\n"
 		"NT: %s%s\r\n"
 		"USN: %s%s%s%s\r\n"
@@ -54,8 +67,14 @@ MakeSSDPPacket(const char * dest_str,
 		dest_str, SSDP_PORT,			/* HOST: */
 		lifetime,						/* CACHE-CONTROL: */
 		host, (unsigned int)http_port,	/* LOCATION: */
+#ifdef RANDOMIZE_URLS
+		random_url,
+#endif	/* RANDOMIZE_URLS */
 #ifdef ENABLE_HTTPS
 		host, (unsigned int)https_port,	/* SECURE-LOCATION: */
+#ifdef RANDOMIZE_URLS
+		random_url,
+#endif	/* RANDOMIZE_URLS */
 #endif
 #ifdef DYNAMIC_OS_VERSION
 		os_version,
@@ -68,26 +87,244 @@ MakeSSDPPacket(const char * dest_str,
 	if(l<0) {
 		syslog(LOG_ERR, "%s: snprintf error", "MakeSSDPPacket()");
 		return -1;
-	} else if((unsigned int)l >= sizeof(bufr)) {
+	} else if(l >= size) {
 		syslog(LOG_WARNING, "%s: truncated output (%u>=%u)",
-		       "MakeSSDPPacket()", (unsigned)l, (unsigned)sizeof(bufr));
-		l = sizeof(bufr) - 1;
+		       "MakeSSDPPacket()", (unsigned)l, (unsigned)size);
 		return -1;
 	}
-	syslog(LOG_DEBUG, "%s", bufr);
+	return l;
+}
+
+/* reference implementation : M-SEARCH response
+ * as it was built by SendSSDPResponse() */
+static int
+MakeSSDPResponse(char * buf, int size,
+                 const char * st, int st_len, const char * suffix,
+                 const char * host, unsigned short http_port,
+#ifdef ENABLE_HTTPS
+                 unsigned short https_port,
+#endif
+                 const char * uuidvalue)
+{
+	int l;
+	int st_is_uuid;
+#ifdef ENABLE_HTTP_DATE
+	const char * http_date = ssdp_http_date();
+#endif
+
+	st_is_uuid = (st_len == (int)strlen(uuidvalue)) &&
+	              (memcmp(uuidvalue, st, st_len) == 0);
+	l = snprintf(buf, size, "HTTP/1.1 200 OK\r\n"
+		"CACHE-CONTROL: max-age=1800\r\n"
+#ifdef ENABLE_HTTP_DATE
+		"DATE: %s\r\n"
+#endif
+		"ST: %.*s%s\r\n"
+		"USN: %s%s%.*s%s\r\n"
+		"EXT:\r\n"
+		"SERVER: " MINIUPNPD_SERVER_STRING "\r\n"
+#ifndef RANDOMIZE_URLS
+		"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
+#ifdef ENABLE_HTTPS
+		"SECURELOCATION.UPNP.ORG: https://%s:%u" ROOTDESC_PATH "\r\n"
+#endif	/* ENABLE_HTTPS */
+#else	/* RANDOMIZE_URLS */
+		"LOCATION: http://%s:%u/%s" ROOTDESC_PATH "\r\n"
+#ifdef ENABLE_HTTPS
+		"SECURELOCATION.UPNP.ORG: https://%s:%u/%s" ROOTDESC_PATH "\r\n"
+#endif	/* ENABLE_HTTPS */
+#endif	/* RANDOMIZE_URLS */
+		"OPT: \"http://schemas.upnp.org/upnp/1/0/\"; ns=01\r\n" /* UDA v1.1 */
+		"01-NLS: %u\r\n" /* same as BOOTID. UDA v1.1 */
+		"BOOTID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
+		"CONFIGID.UPNP.ORG: %u\r\n" /* UDA v1.1 */
+		"\r\n",
+#ifdef ENABLE_HTTP_DATE
+		http_date,								/* DATE: */
+#endif
+		st_len, st, suffix,						/* ST: */
+		uuidvalue, st_is_uuid ? "" : "::",		/* USN: 2/5 */
+		st_is_uuid ? 0 : st_len, st, suffix,	/* USN: 3/5 */
+#ifdef DYNAMIC_OS_VERSION
+		os_version,								/* SERVER: */
+#endif
+		host, (unsigned int)http_port,			/* LOCATION: */
+#ifdef RANDOMIZE_URLS
+		random_url,								/* LOCATION: 3/3 */
+#endif	/* RANDOMIZE_URLS */
+#ifdef ENABLE_HTTPS
+		host, (unsigned int)https_port,			/* SECURELOCATION.UPNP.ORG */
+#ifdef RANDOMIZE_URLS
+		random_url,								/* SECURELOCATION.UPNP.ORG 3/3 */
+#endif	/* RANDOMIZE_URLS */
+#endif	/* ENABLE_HTTPS */
+		upnp_bootid,							/* 01-NLS: */
+		upnp_bootid,							/* BOOTID.UPNP.ORG: */
+		upnp_configid);							/* CONFIGID.UPNP.ORG: */
+	if(l < 0 || l >= size)
+		return -1;
+	return l;
+}
+
+static const char * const hosts[] = {
+	"222.222.222.222",
+#ifdef ENABLE_IPV6
+	"[1000:2000:3000:4000:5000:6000:7000:8000]",
+#endif /* ENABLE_IPV6 */
+	NULL
+};
+
+#define ST_WANCIC	"urn:schemas-upnp-org:service:WANCommonInterfaceConfig:"
+
+/* compare the packets built with the templates to the reference */
+static int
+check_packets(void)
+{
+	char ref[SSDP_PACKET_MAX_LEN];
+	char buf[SSDP_PACKET_MAX_LEN];
+	int lref, l;
+	int i;
+
+	for(i = 0; hosts[i]; i++) {
+		lref = MakeSSDPPacket(ref, sizeof(ref), "123.456.789.123",
+		                      hosts[i], 12345,
+#ifdef ENABLE_HTTPS
+		                      54321,
+#endif /* ENABLE_HTTPS */
+		                      ST_WANCIC, "1",
+		                      uuidvalue_igd, "::", ST_WANCIC,
+		                      1234567890);
+		l = BuildSSDPNotify(buf, sizeof(buf), "123.456.789.123",
+		                    hosts[i], 12345,
+#ifdef ENABLE_HTTPS
+		                    54321,
+#endif /* ENABLE_HTTPS */
+		                    ST_WANCIC, "1",
+		                    uuidvalue_igd, "::", ST_WANCIC,
+		                    1234567890);
+		if(lref < 0 || l != lref || memcmp(ref, buf, l) != 0) {
+			syslog(LOG_ERR, "NOTIFY mismatch for %s :\n%.*s", hosts[i], l, buf);
+			return -1;
+		}
+		syslog(LOG_DEBUG, "%.*s", l, buf);
+		/* ST: service type */
+		lref = MakeSSDPResponse(ref, sizeof(ref), ST_WANCIC, sizeof(ST_WANCIC) - 1, "1",
+		                        hosts[i], 12345,
+#ifdef ENABLE_HTTPS
+		                        54321,
+#endif /* ENABLE_HTTPS */
+		                        uuidvalue_igd);
+		l = BuildSSDPResponse(buf, sizeof(buf), ST_WANCIC, sizeof(ST_WANCIC) - 1, "1",
+		                      hosts[i], 12345,
+#ifdef ENABLE_HTTPS
+		                      54321,
+#endif /* ENABLE_HTTPS */
+		                      uuidvalue_igd);
+		if(lref < 0 || l != lref || memcmp(ref, buf, l) != 0) {
+			syslog(LOG_ERR, "response mismatch for %s :\n%.*s", hosts[i], l, buf);
+			return -1;
+		}
+		syslog(LOG_DEBUG, "%.*s", l, buf);
+		/* ST: uuid */
+		lref = MakeSSDPResponse(ref, sizeof(ref), uuidvalue_igd, strlen(uuidvalue_igd), "",
+		                        hosts[i], 12345,
+#ifdef ENABLE_HTTPS
+		                        54321,
+#endif /* ENABLE_HTTPS */
+		                        uuidvalue_igd);
+		l = BuildSSDPResponse(buf, sizeof(buf), uuidvalue_igd, strlen(uuidvalue_igd), "",
+		                      hosts[i], 12345,
+#ifdef ENABLE_HTTPS
+		                      54321,
+#endif /* ENABLE_HTTPS */
+		                      uuidvalue_igd);
+		if(lref < 0 || l != lref || memcmp(ref, buf, l) != 0) {
+			syslog(LOG_ERR, "uuid response mismatch for %s :\n%.*s", hosts[i], l, buf);
+			return -1;
+		}
+	}
 	return 0;
 }
 
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* packets built per second, with snprintf() and with the templates */
+static void
+benchmark(int count)
+{
+	char buf[SSDP_PACKET_MAX_LEN];
+	int i, pass;
+	int total = 0;
+	double t0, t1;
+
+	for(pass = 0; pass < 2; pass++) {
+		t0 = now();
+		for(i = 0; i < count; i++) {
+			const char * host = hosts[i & 1] ? hosts[i & 1] : hosts[0];
+			if(pass == 0)
+				total += MakeSSDPResponse(buf, sizeof(buf), ST_WANCIC, sizeof(ST_WANCIC) - 1, "1",
+				                          host, 12345,
+#ifdef ENABLE_HTTPS
+				                          54321,
+#endif /* ENABLE_HTTPS */
+				                          uuidvalue_igd);
+			else
+				total += BuildSSDPResponse(buf, sizeof(buf), ST_WANCIC, sizeof(ST_WANCIC) - 1, "1",
+				                           host, 12345,
+#ifdef ENABLE_HTTPS
+				                           54321,
+#endif /* ENABLE_HTTPS */
+				                           uuidvalue_igd);
+		}
+		t1 = now();
+		printf("%-10s : %10.0f responses/s\n", pass == 0 ? "snprintf" : "templates",
+		       (double)count / (t1 - t0));
+	}
+	for(pass = 0; pass < 2; pass++) {
+		t0 = now();
+		for(i = 0; i < count; i++) {
+			const char * host = hosts[i & 1] ? hosts[i & 1] : hosts[0];
+			if(pass == 0)
+				total += MakeSSDPPacket(buf, sizeof(buf), "239.255.255.250",
+				                        host, 12345,
+#ifdef ENABLE_HTTPS
+				                        54321,
+#endif /* ENABLE_HTTPS */
+				                        ST_WANCIC, "1", uuidvalue_igd, "::", ST_WANCIC,
+				                        120);
+			else
+				total += BuildSSDPNotify(buf, sizeof(buf), "239.255.255.250",
+				                         host, 12345,
+#ifdef ENABLE_HTTPS
+				                         54321,
+#endif /* ENABLE_HTTPS */
+				                         ST_WANCIC, "1", uuidvalue_igd, "::", ST_WANCIC,
+				                         120);
+		}
+		t1 = now();
+		printf("%-10s : %10.0f NOTIFY/s\n", pass == 0 ? "snprintf" : "templates",
+		       (double)count / (t1 - t0));
+	}
+	syslog(LOG_DEBUG, "%d bytes built", total);
+}
 
 int main(int argc, char * * argv)
 {
-	int r;
+	int count = 100000;
 #ifdef DYNAMIC_OS_VERSION
 	struct utsname utsname;
 #endif
-	UNUSED(argc); UNUSED(argv);
 
+	if(argc > 1)
+		count = atoi(argv[1]);
 	openlog("testssdppktgen", LOG_CONS|LOG_PERROR, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_INFO));
 #ifdef DYNAMIC_OS_VERSION
 	if (uname(&utsname) < 0) {
 		syslog(LOG_ERR, "uname(): %m");
@@ -99,25 +336,13 @@ int main(int argc, char * * argv)
 #endif
 	upnp_bootid = (unsigned)time(NULL);
 	upnp_configid = 1234567890;
-	r = MakeSSDPPacket("123.456.789.123", "222.222.222.222", 12345,
-#ifdef ENABLE_HTTPS
-	                   54321,
-#endif /* ENABLE_HTTPS */
-	                   "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:", "1",
-	                   uuidvalue_igd, "", "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:",
-	                   1234567890);
-	if(r < 0) return 1;
-#ifdef ENABLE_IPV6
-	r = MakeSSDPPacket("[1234:5678:abcd:ef00:1234:5678:abcd:ef00]",
-	                   "[1000:2000:3000:4000:5000:6000:7000:8000]", 12345,
-#ifdef ENABLE_HTTPS
-	                   54321,
-#endif /* ENABLE_HTTPS */
-	                   "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:", "1",
-	                   uuidvalue_igd, "", "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:",
-	                   1234567890);
-	if(r < 0) return 1;
-#endif /* ENABLE_IPV6 */
+	if(check_packets() < 0)
+		return 1;
+	/* BOOTID change : the templates must be rebuilt */
+	upnp_bootid++;
+	if(check_packets() < 0)
+		return 1;
+	if(count > 0)
+		benchmark(count);
 	return 0;
 }
-
@@ -0,0 +1,243 @@
+/* $Id: $ */
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2026 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+
+/* check of the HTTP request size limits.
+ * Requests are written to one end of a socket pair and processed by
+ * Process_upnphttp() on the other end. The status code of the response
+ * is compared with the expected one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "upnpsoap.h"
+#include "upnpdescgen.h"
+#ifdef ENABLE_EVENTS
+#include "upnpevents.h"
+#endif /* ENABLE_EVENTS */
+
+/* stubs : the requests of this test never reach these functions */
+void
+ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
+{
+	(void)action; (void)n;
+	BuildResp2_upnphttp(h, 500, "Internal Server Error", NULL, 0);
+	SendRespAndClose_upnphttp(h);
+}
+
+void
+SoapErrorRateLimited(struct upnphttp * h)
+{
+	BuildResp2_upnphttp(h, 500, "Internal Server Error", NULL, 0);
+	SendRespAndClose_upnphttp(h);
+}
+
+char *
+genRootDesc(int * len, int force_igd1)
+{
+	(void)force_igd1;
+	*len = 0;
+	return NULL;
+}
+
+char *
+genWANIPCn(int * len, int force_igd1)
+{
+	(void)force_igd1;
+	*len = 0;
+	return NULL;
+}
+
+char *
+genWANCfg(int * len, int force_igd1)
+{
+	(void)force_igd1;
+	*len = 0;
+	return NULL;
+}
+
+#ifdef ENABLE_L3F_SERVICE
+char *
+genL3F(int * len, int force_igd1)
+{
+	(void)force_igd1;
+	*len = 0;
+	return NULL;
+}
+#endif /* ENABLE_L3F_SERVICE */
+
+#ifdef ENABLE_6FC_SERVICE
+char *
+gen6FC(int * len, int force_igd1)
+{
+	(void)force_igd1;
+	*len = 0;
+	return NULL;
+}
+#endif /* ENABLE_6FC_SERVICE */
+
+#ifdef ENABLE_DP_SERVICE
+char *
+genDP(int * len, int force_igd1)
+{
+	(void)force_igd1;
+	*len = 0;
+	return NULL;
+}
+#endif /* ENABLE_DP_SERVICE */
+
+#ifdef ENABLE_EVENTS
+const char *
+upnpevents_addSubscriber(const char * eventurl,
+                         const char * callback, int callbacklen,
+                         int timeout)
+{
+	(void)eventurl; (void)callback; (void)callbacklen; (void)timeout;
+	return NULL;
+}
+
+int
+upnpevents_removeSubscriber(const char * sid, int sidlen)
+{
+	(void)sid; (void)sidlen;
+	return -1;
+}
+
+const char *
+upnpevents_renewSubscription(const char * sid, int sidlen, int timeout)
+{
+	(void)sid; (void)sidlen; (void)timeout;
+	return NULL;
+}
+#endif /* ENABLE_EVENTS */
+
+/* send the request and return the status code of the response,
+ * or -1 on error */
+static int
+process_request(const char * request, size_t len)
+{
+	int fds[2];
+	struct upnphttp * h;
+	char resp[256];
+	ssize_t n;
+	size_t sent;
+	int i;
+	int code = -1;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	h = New_upnphttp(fds[0]);
+	if(h == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	strncpy(h->clientaddr_str, "test", sizeof(h->clientaddr_str));
+	sent = 0;
+	/* the request is processed as it is received */
+	for(i = 0; i < 1000 && h->state != EToDelete; i++) {
+		if(sent < len) {
+			n = write(fds[1], request + sent, len - sent);
+			if(n > 0)
+				sent += (size_t)n;
+		}
+		Process_upnphttp(h);
+	}
+	n = read(fds[1], resp, sizeof(resp) - 1);
+	if(n > 0) {
+		resp[n] = '\0';
+		if(sscanf(resp, "HTTP/%*s %d", &code) != 1)
+			code = -1;
+	}
+	Delete_upnphttp(h);
+	close(fds[1]);
+	return code;
+}
+
+static int
+check(const char * name, const char * request, size_t len, int expected)
+{
+	int code = process_request(request, len);
+
+	if(code != expected) {
+		fprintf(stderr, "%s : status %d, %d expected\n", name, code, expected);
+		return 0;
+	}
+	printf("%s : %d OK\n", name, code);
+	return 1;
+}
+
+int
+main(int argc, char * * argv)
+{
+	static const char small[] =
+		"GET /notfound HTTP/1.1\r\n"
+		"Host: 192.168.0.1:5000\r\n"
+		"\r\n";
+	static const char body_too_large[] =
+		"POST /ctl/IPConn HTTP/1.1\r\n"
+		"Host: 192.168.0.1:5000\r\n"
+		"Content-Length: 100000\r\n"
+		"\r\n";
+	static const char body_overflow[] =
+		"POST /ctl/IPConn HTTP/1.1\r\n"
+		"Host: 192.168.0.1:5000\r\n"
+		"Content-Length: 3000000000\r\n"
+		"\r\n";
+	char headers_too_large[2048];
+	int len;
+	int errors = 0;
+
+	(void)argc; (void)argv;
+	openlog("testupnphttp", LOG_PERROR, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	http_max_header_size = 1024;
+	http_max_body_size = 65536;
+
+	if(!check("small request", small, sizeof(small) - 1, 404))
+		errors++;
+	if(!check("Content-Length above http_max_body_size", body_too_large,
+	          sizeof(body_too_large) - 1, 413))
+		errors++;
+	/* the Content-Length does not fit in an int, even if
+	 * http_max_body_size was not clamped to INT_MAX */
+	http_max_body_size = UINT_MAX;
+	if(!check("Content-Length above INT_MAX", body_overflow,
+	          sizeof(body_overflow) - 1, 413))
+		errors++;
+	len = snprintf(headers_too_large, sizeof(headers_too_large),
+	               "GET /notfound HTTP/1.1\r\n"
+	               "Host: 192.168.0.1:5000\r\n"
+	               "User-Agent: %01500d\r\n"
+	               "\r\n", 0);
+	if(!check("headers above http_max_header_size", headers_too_large,
+	          (size_t)len, 431))
+		errors++;
+	/* no end of headers received */
+	if(!check("unterminated headers above http_max_header_size", headers_too_large,
+	          (size_t)len - 4, 431))
+		errors++;
+
+	closelog();
+	if(errors > 0) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+	return 0;
+}
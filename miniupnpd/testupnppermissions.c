@@ -4,8 +4,10 @@
  * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -37,16 +39,199 @@ print_upnpperm(const struct upnpperm * p)
 	putchar('\n');
 }
 
+static double
+elapsed(const struct timespec * start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+	       + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#define BENCH_QUERIES	200000
+#define BENCH_EPORTS_QUERIES	2000
+
+/* benchmark check_upnp_rule_against_permissions() and
+ * get_permitted_ext_ports() with n_perms rules, the compiled rules
+ * must give the same results as the rules checked one by one.
+ * returns the number of differences */
+static int
+bench(int n_perms)
+{
+	struct upnpperm * perms;
+	char line[128];
+	int i, n, errors = 0;
+	struct in_addr * addrs;
+	u_short * eports;
+	u_short * iports;
+	unsigned char * results;
+	static uint32_t allowed[65536 / 32];
+	static uint32_t allowed_compiled[65536 / 32];
+	struct timespec start;
+	double t_linear, t_compiled;
+
+	perms = calloc(n_perms, sizeof(struct upnpperm));
+	addrs = malloc(BENCH_QUERIES * sizeof(struct in_addr));
+	eports = malloc(BENCH_QUERIES * sizeof(u_short));
+	iports = malloc(BENCH_QUERIES * sizeof(u_short));
+	results = malloc(BENCH_QUERIES);
+	if(!perms || !addrs || !eports || !iports || !results) {
+		fprintf(stderr, "memory allocation error\n");
+		return 1;
+	}
+	srandom(1234);
+	/* rules for a site with many LAN subnets and hosts,
+	 * the last rule denies everything else */
+	for(i = 0; i < n_perms - 1; i++) {
+		unsigned int net = (unsigned int)random() % 64;
+		unsigned int host = 1 + (unsigned int)random() % 254;
+		unsigned int port = 1024 + (unsigned int)random() % 60000;
+		switch(i % 4) {
+		case 0:
+			snprintf(line, sizeof(line), "allow 1024-65535 10.0.%u.0/24 1024-65535", net);
+			break;
+		case 1:
+			snprintf(line, sizeof(line), "deny 0-65535 10.0.%u.%u/32 0-65535", net, host);
+			break;
+		case 2:
+			snprintf(line, sizeof(line), "allow %u-%u 192.168.%u.%u/32 %u",
+			         port, port + 100, net, host, port);
+			break;
+		default:
+			snprintf(line, sizeof(line), "deny %u-%u 10.0.%u.0/23 0-%u",
+			         port, port + 1000, net & ~1U, port);
+		}
+		/* non contiguous masks */
+		if(i % 100 == 98)
+			snprintf(line, sizeof(line), "deny %u-%u 10.0.0.%u/255.255.0.255 0-65535",
+			         port, port + 1000, host);
+#ifdef ENABLE_REGEX
+		if(i % 50 == 49) {
+			size_t len = strlen(line);
+			snprintf(line + len, sizeof(line) - len, " \"^game[0-9]*\"");
+		}
+#endif /* ENABLE_REGEX */
+		if(read_permission_line(perms + i, line) < 0) {
+			fprintf(stderr, "failed to read \"%s\"\n", line);
+			return 1;
+		}
+	}
+	if(read_permission_line(perms + n_perms - 1, "deny 0-65535 0.0.0.0/0 0-65535") < 0)
+		return 1;
+	for(i = 0; i < BENCH_QUERIES; i++) {
+		addrs[i].s_addr = htonl(((random() % 2) ? 0x0a000000 : 0xc0a80000)
+		                        | (unsigned int)(random() % 64) << 8
+		                        | (unsigned int)(random() % 256));
+		eports[i] = (u_short)random();
+		iports[i] = (u_short)random();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < BENCH_QUERIES; i++)
+		results[i] = (unsigned char)check_upnp_rule_against_permissions(perms, n_perms,
+		                eports[i], addrs[i], iports[i], "game42");
+	t_linear = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(compile_permissions(perms, n_perms) < 0) {
+		fprintf(stderr, "compile_permissions() failed\n");
+		return 1;
+	}
+	printf("%d rules compiled in %.3fms\n", n_perms, elapsed(&start) * 1000);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0, n = 0; i < BENCH_QUERIES; i++) {
+		if(check_upnp_rule_against_permissions(perms, n_perms,
+		       eports[i], addrs[i], iports[i], "game42") != results[i])
+			n++;
+	}
+	t_compiled = elapsed(&start);
+	printf("check_upnp_rule_against_permissions() : %.0f/s one by one, %.0f/s compiled, %d differences\n",
+	       BENCH_QUERIES / t_linear, BENCH_QUERIES / t_compiled, n);
+	errors += n;
+
+	t_linear = t_compiled = 0;
+	for(i = 0, n = 0; i < BENCH_EPORTS_QUERIES; i++) {
+		free_compiled_permissions();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		get_permitted_ext_ports(allowed, perms, n_perms, addrs[i].s_addr, iports[i]);
+		t_linear += elapsed(&start);
+		compile_permissions(perms, n_perms);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		get_permitted_ext_ports(allowed_compiled, perms, n_perms, addrs[i].s_addr, iports[i]);
+		t_compiled += elapsed(&start);
+		if(memcmp(allowed, allowed_compiled, sizeof(allowed)) != 0)
+			n++;
+	}
+	printf("get_permitted_ext_ports() : %.0f/s one by one, %.0f/s compiled, %d differences\n",
+	       BENCH_EPORTS_QUERIES / t_linear, BENCH_EPORTS_QUERIES / t_compiled, n);
+	errors += n;
+
+	free_compiled_permissions();
+	for(i = 0; i < n_perms; i++)
+		free_permission_line(perms + i);
+	free(perms);
+	free(addrs);
+	free(eports);
+	free(iports);
+	free(results);
+	return errors;
+}
+
+/* the compiled rules must give the same results as the rules
+ * checked one by one with a non contiguous mask.
+ * returns the number of differences */
+static int
+check_noncontiguous_mask(void)
+{
+	struct upnpperm perms[2];
+	struct in_addr addr;
+	static uint32_t allowed[65536 / 32];
+	static uint32_t allowed_compiled[65536 / 32];
+	int r, r_compiled, errors = 0;
+
+	memset(perms, 0, sizeof(perms));
+	if(read_permission_line(perms, "deny 1-65535 10.0.0.0/255.0.0.255 1-65535") < 0
+	   || read_permission_line(perms + 1, "allow 1-65535 10.0.0.0/8 1-65535") < 0)
+		return 1;
+	addr.s_addr = inet_addr("10.1.2.3");
+	r = check_upnp_rule_against_permissions(perms, 2, 1234, addr, 1234, NULL);
+	get_permitted_ext_ports(allowed, perms, 2, addr.s_addr, 1234);
+	if(compile_permissions(perms, 2) < 0)
+		return 1;
+	r_compiled = check_upnp_rule_against_permissions(perms, 2, 1234, addr, 1234, NULL);
+	get_permitted_ext_ports(allowed_compiled, perms, 2, addr.s_addr, 1234);
+	if(r != 1 || r_compiled != r) {
+		fprintf(stderr, "non contiguous mask : %d one by one, %d compiled\n",
+		        r, r_compiled);
+		errors++;
+	}
+	if(memcmp(allowed, allowed_compiled, sizeof(allowed)) != 0) {
+		fprintf(stderr, "non contiguous mask : different permitted ports\n");
+		errors++;
+	}
+	free_compiled_permissions();
+	return errors;
+}
+
 int main(int argc, char * * argv)
 {
 	int i, r, ret;
 	struct upnpperm p;
 	if(argc < 2) {
 		fprintf(stderr, "Usage:   %s \"permission line\" [...]\n", argv[0]);
+		fprintf(stderr, "         %s -b <number of rules>\n", argv[0]);
 		fprintf(stderr, "Example: %s \"allow 1234 10.10.10.10/32 1234\"\n", argv[0]);
 		return 1;
 	}
 	openlog("testupnppermissions", LOG_PERROR, LOG_USER);
+	if(argc == 3 && strcmp(argv[1], "-b") == 0) {
+		setlogmask(LOG_UPTO(LOG_NOTICE));
+		if(check_noncontiguous_mask() != 0)
+			return 1;
+		return bench(atoi(argv[2])) == 0 ? 0 : 1;
+	}
 	ret = 0;
 	for(i=1; i<argc; i++) {
 		printf("%2d '%s'\n", i, argv[i]);
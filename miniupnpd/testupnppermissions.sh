@@ -56,6 +56,11 @@ done
 # retrieve return status from subshell
 r=$?
 
+# compiled rules must give the same results
+if [ $r -eq 0 ] ; then
+	./testupnppermissions -b 1000 || r=$?
+fi
+
 if [ $r -eq 0 ] ; then
 	echo "testupnppermissions tests OK"
 else
@@ -0,0 +1,77 @@
+/* $Id: $ */
+/* MiniUPnP project
+ * http://miniupnp.free.fr/ or https://miniupnp.tuxfamily.org/
+ * (c) 2025 Thomas Bernard
+ * This software is subject to the conditions detailed
+ * in the LICENCE file provided within the distribution */
+#include <stdio.h>
+#include <string.h>
+
+#include "upnpreplyparse.h"
+
+static const char * const AddPortMappingArgNames[] = {
+	"NewRemoteHost", "NewExternalPort", "NewProtocol", "NewInternalPort",
+	"NewInternalClient", "NewEnabled", "NewPortMappingDescription",
+	"NewLeaseDuration", NULL
+};
+static struct NameValueArgs AddPortMappingArgs = NAMEVALUE_ARGS(AddPortMappingArgNames);
+
+static const char request[] =
+	"<?xml version=\"1.0\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>"
+	"<u:AddPortMapping xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:1\">"
+	"<NewRemoteHost></NewRemoteHost>"
+	"<NewExternalPort>1234</NewExternalPort>"
+	"<NewProtocol>TCP</NewProtocol>"
+	"<NewInternalPort>4321</NewInternalPort>"
+	"<NewInternalClient>192.168.1.2</NewInternalClient>"
+	"<NewUnknownArgument>foo</NewUnknownArgument>"
+	"<NewEnabled>0</NewEnabled>"
+	"<NewEnabled>1</NewEnabled>"
+	"<NewPortMappingDescription><![CDATA[a <b> c]]></NewPortMappingDescription>"
+	"</u:AddPortMapping>"
+	"</s:Body>"
+	"</s:Envelope>\r\n";
+
+static int
+check(const struct NameValueSlices * data, const char * name, const char * expected)
+{
+	const char * value = GetValueFromNameValueSlices(data, name);
+	if(value == expected)
+		return 1;	/* both NULL */
+	if(value == NULL || expected == NULL || strcmp(value, expected) != 0) {
+		fprintf(stderr, "Element <%s> : expecting value '%s', got '%s'\n",
+		        name, expected ? expected : "<null string>",
+		        value ? value : "<null string>");
+		return 0;
+	}
+	return 1;
+}
+
+int
+main(int argc, char * * argv)
+{
+	char buffer[sizeof(request)];
+	struct NameValueSlices data;
+	int ok = 1;
+	(void)argc; (void)argv;
+
+	memcpy(buffer, request, sizeof(request));
+	if(ParseNameValueSlices(buffer, sizeof(request) - 1, &AddPortMappingArgs, &data) < 0) {
+		fprintf(stderr, "ParseNameValueSlices() failed\n");
+		return 1;
+	}
+	ok &= check(&data, "NewRemoteHost", "");
+	ok &= check(&data, "NewExternalPort", "1234");
+	ok &= check(&data, "NewProtocol", "TCP");
+	ok &= check(&data, "NewInternalPort", "4321");
+	ok &= check(&data, "NewInternalClient", "192.168.1.2");
+	ok &= check(&data, "NewEnabled", "1");	/* the last value is kept */
+	ok &= check(&data, "NewPortMappingDescription", "a <b> c");
+	ok &= check(&data, "NewLeaseDuration", NULL);
+	ok &= check(&data, "NewUnknownArgument", NULL);
+	printf("testupnpreplyparse : %s\n", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -2,12 +2,13 @@
 /* vim: tabstop=4 shiftwidth=4 noexpandtab
  * MiniUPnP project
  * http://miniupnp.free.fr/ or http://miniupnp.tuxfamily.org/
- * (c) 2008-2024 Thomas Bernard
+ * (c) 2008-2026 Thomas Bernard
  * This software is subject to the conditions detailed
  * in the LICENCE file provided within the distribution */
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <syslog.h>
 #include <sys/queue.h>
 #include <stdlib.h>
@@ -16,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -46,18 +48,34 @@
 };*/
 
 /* stuctures definitions */
+
+/* property set of a service, with the final CRLF.
+ * It is rendered once after each state change and shared by all
+ * the notifications sent for this change */
+struct upnp_event_body {
+	unsigned int refcount;
+	int len;
+	char data[];
+};
+
+struct callback_host;
+
 struct subscriber {
 	LIST_ENTRY(subscriber) entries;
+	struct subscriber * hash_next;	/* in subscriber_hash[] */
+	struct callback_host * host;
+	int heap_index;	/* in expiry_heap[], -1 if not there */
 	struct upnp_event_notify * notify;
 	time_t timeout;
 	uint32_t seq;
+	int pending;	/* a state change happened during the notification */
 	enum subscriber_service_enum service;
 	char uuid[42];
 	char callback[];
 };
 
 struct upnp_event_notify {
-	LIST_ENTRY(upnp_event_notify) entries;
+	TAILQ_ENTRY(upnp_event_notify) entries;
     int s;  /* socket */
     enum { ECreated=1,
 	       EConnecting,
@@ -66,10 +84,16 @@ struct upnp_event_notify {
 	       EFinished,
 	       EError } state;
     struct subscriber * sub;
-    char * buffer;
+    char * buffer;	/* HTTP headers, then the response */
     int buffersize;
+	int headerlen;
+	struct upnp_event_body * body;
 	int tosend;
     int sent;
+	int received;
+	int reused;	/* sent over a persistent connection */
+	int keepalive;	/* the connection can be reused */
+	time_t deadline;
 	const char * path;
 #ifdef ENABLE_IPV6
 	int ipv6;
@@ -80,15 +104,341 @@ struct upnp_event_notify {
 	char portstr[8];
 };
 
+/* persistent connections to the subscribers */
+#define EVENT_CONN_POOL_SIZE	(16)	/* maximum number of idle connections */
+#define EVENT_CONN_IDLE_TIMEOUT	(30)	/* seconds */
+#define EVENT_MAX_ACTIVE_NOTIFY	(32)	/* notifications in progress */
+#define EVENT_NOTIFY_TIMEOUT	(30)	/* seconds */
+/* the delay before retrying after a failure is doubled each time.
+ * The subscriber is removed after EVENT_MAX_FAILURES failures */
+#define EVENT_RETRY_DELAY	(2)	/* seconds */
+#define EVENT_RETRY_MAX_DELAY	(300)	/* seconds */
+#define EVENT_MAX_FAILURES	(8)
+
+struct event_conn {
+	LIST_ENTRY(event_conn) entries;
+	int s;	/* socket */
+	time_t idle_since;
+#ifdef ENABLE_IPV6
+	char addrstr[48];
+#else
+	char addrstr[16];
+#endif
+	char portstr[8];
+};
+
 /* prototypes */
 static void
 upnp_event_create_notify(struct subscriber * sub);
+static void
+upnp_event_prepare(struct upnp_event_notify * obj);
 
 /* Subscriber list */
 LIST_HEAD(listhead, subscriber) subscriberlist = { NULL };
 
+/* subscribers indexed by SID */
+#define SUBSCRIBER_HASH_SIZE	(256)
+static struct subscriber * subscriber_hash[SUBSCRIBER_HASH_SIZE];
+
+/* subscribers with a timeout, in a binary min-heap ordered by timeout */
+static struct subscriber * * expiry_heap = NULL;
+static int expiry_len = 0;
+static int expiry_size = 0;
+
+/* number of subscribers for each callback host */
+struct callback_host {
+	struct callback_host * next;
+	unsigned int count;
+	unsigned int failures;	/* consecutive notification failures */
+	time_t retry_time;	/* no notification before */
+	char host[];
+};
+#define CALLBACK_HOST_HASH_SIZE	(64)
+static struct callback_host * callback_hosts[CALLBACK_HOST_HASH_SIZE];
+static unsigned int subscriber_count = 0;
+
 /* notify list */
-LIST_HEAD(listheadnotif, upnp_event_notify) notifylist = { NULL };
+TAILQ_HEAD(listheadnotif, upnp_event_notify) notifylist =
+	TAILQ_HEAD_INITIALIZER(notifylist);
+
+/* idle persistent connections, most recently used first */
+static LIST_HEAD(listheadconn, event_conn) idleconns = { NULL };
+static int idleconns_count = 0;
+static unsigned long event_conn_opened = 0;
+static unsigned long event_conn_reused = 0;
+
+/* time of the next retry of the notifications deferred
+ * because of a failure, 0 if none */
+static time_t next_retry = 0;
+
+/* current property set of each service, indexed by
+ * enum subscriber_service_enum. NULL when it has to be rendered */
+static struct upnp_event_body * event_bodies[8];
+
+/* state changes of each service not notified yet. All the changes
+ * during event_coalescing_window milliseconds are notified at once */
+static struct {
+	int dirty;
+	struct timeval deadline;
+} event_changes[8];
+
+/* statistics */
+static unsigned long event_changes_count;
+static unsigned long event_changes_coalesced;
+
+static void
+upnp_event_release_body(struct upnp_event_body * body)
+{
+	if(body != NULL && --body->refcount == 0)
+		free(body);
+}
+
+/* forget the property set of the service, the state changed */
+static void
+upnp_event_invalidate_body(enum subscriber_service_enum service)
+{
+	if((unsigned)service < sizeof(event_bodies)/sizeof(event_bodies[0])) {
+		upnp_event_release_body(event_bodies[service]);
+		event_bodies[service] = NULL;
+	}
+}
+
+/* return the property set of the service, with a reference
+ * to release with upnp_event_release_body() */
+static struct upnp_event_body *
+upnp_event_get_body(enum subscriber_service_enum service)
+{
+	struct upnp_event_body * body;
+	char * xml;
+	int l;
+
+	if((unsigned)service >= sizeof(event_bodies)/sizeof(event_bodies[0]))
+		return NULL;
+	body = event_bodies[service];
+	if(body != NULL) {
+		body->refcount++;
+		return body;
+	}
+	switch(service) {
+	case EWanCFG:
+		xml = getVarsWANCfg(&l);
+		break;
+	case EWanIPC:
+		xml = getVarsWANIPCn(&l);
+		break;
+#ifdef ENABLE_L3F_SERVICE
+	case EL3F:
+		xml = getVarsL3F(&l);
+		break;
+#endif
+#ifdef ENABLE_6FC_SERVICE
+	case E6FC:
+		xml = getVars6FC(&l);
+		break;
+#endif
+#ifdef ENABLE_DP_SERVICE
+	case EDP:
+		xml = getVarsDP(&l);
+		break;
+#endif
+	default:
+		xml = NULL;
+	}
+	if(xml == NULL)
+		l = 0;
+	body = malloc(sizeof(struct upnp_event_body) + l + 2);
+	if(body == NULL) {
+		syslog(LOG_ERR, "%s: malloc returned NULL", "upnp_event_get_body");
+		free(xml);
+		return NULL;
+	}
+	if(l > 0)
+		memcpy(body->data, xml, l);
+	memcpy(body->data + l, "\r\n", 2);
+	body->len = l + 2;
+	free(xml);
+	/* one reference for event_bodies[], one for the caller */
+	body->refcount = 2;
+	event_bodies[service] = body;
+	return body;
+}
+
+/* FNV-1a */
+static unsigned int
+hash_str(const char * p, int len)
+{
+	unsigned int h = 2166136261U;
+	while(len-- > 0) {
+		h ^= (unsigned char)*p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static struct subscriber *
+findSubscriber(const char * sid, int sidlen)
+{
+	struct subscriber * sub;
+	if(sidlen != 41)
+		return NULL;
+	for(sub = subscriber_hash[hash_str(sid, sidlen) % SUBSCRIBER_HASH_SIZE];
+	    sub != NULL; sub = sub->hash_next) {
+		if(memcmp(sid, sub->uuid, 41) == 0)
+			return sub;
+	}
+	return NULL;
+}
+
+static void
+expiry_set(int i, struct subscriber * sub)
+{
+	expiry_heap[i] = sub;
+	sub->heap_index = i;
+}
+
+/* restore the heap property for the element at index i */
+static void
+expiry_fix(int i)
+{
+	struct subscriber * sub = expiry_heap[i];
+	int parent, child;
+
+	while(i > 0) {
+		parent = (i - 1) / 2;
+		if(expiry_heap[parent]->timeout <= sub->timeout)
+			break;
+		expiry_set(i, expiry_heap[parent]);
+		i = parent;
+	}
+	while((child = 2 * i + 1) < expiry_len) {
+		if(child + 1 < expiry_len &&
+		   expiry_heap[child + 1]->timeout < expiry_heap[child]->timeout)
+			child++;
+		if(sub->timeout <= expiry_heap[child]->timeout)
+			break;
+		expiry_set(i, expiry_heap[child]);
+		i = child;
+	}
+	expiry_set(i, sub);
+}
+
+static void
+expiry_remove(struct subscriber * sub)
+{
+	int i = sub->heap_index;
+
+	if(i < 0)
+		return;
+	sub->heap_index = -1;
+	if(--expiry_len > i) {
+		expiry_set(i, expiry_heap[expiry_len]);
+		expiry_fix(i);
+	}
+}
+
+/* (re)insert the subscriber in expiry_heap[] after its timeout changed */
+static void
+expiry_update(struct subscriber * sub)
+{
+	if(sub->timeout == 0) {
+		expiry_remove(sub);	/* infinite */
+		return;
+	}
+	if(sub->heap_index < 0) {
+		if(expiry_len >= expiry_size) {
+			int new_size = (expiry_size > 0) ? expiry_size * 2 : 32;
+			struct subscriber * * tmp;
+			tmp = realloc(expiry_heap, new_size * sizeof(struct subscriber *));
+			if(tmp == NULL) {
+				syslog(LOG_ERR, "%s: realloc(): %m", "expiry_update");
+				return;	/* the subscription will not expire */
+			}
+			expiry_heap = tmp;
+			expiry_size = new_size;
+		}
+		expiry_set(expiry_len, sub);
+		expiry_len++;
+	}
+	expiry_fix(sub->heap_index);
+}
+
+/* host part of the callback URL, without the port */
+static int
+callback_host_len(const char * callback, const char * * host)
+{
+	const char * p = callback + 7;	/* http:// */
+	int n = 0;
+
+	if(*p == '[') {	/* ip v6 */
+		while(p[n] != '\0' && p[n] != ']')
+			n++;
+	} else {
+		while(p[n] != '\0' && p[n] != ':' && p[n] != '/')
+			n++;
+	}
+	*host = p;
+	return n;
+}
+
+static struct callback_host *
+get_callback_host(const char * host, int len)
+{
+	struct callback_host * ch;
+	unsigned int i = hash_str(host, len) % CALLBACK_HOST_HASH_SIZE;
+
+	for(ch = callback_hosts[i]; ch != NULL; ch = ch->next) {
+		if((int)strlen(ch->host) == len && memcmp(ch->host, host, len) == 0)
+			return ch;
+	}
+	ch = malloc(sizeof(struct callback_host) + len + 1);
+	if(ch == NULL)
+		return NULL;
+	ch->count = 0;
+	ch->failures = 0;
+	ch->retry_time = 0;
+	memcpy(ch->host, host, len);
+	ch->host[len] = '\0';
+	ch->next = callback_hosts[i];
+	callback_hosts[i] = ch;
+	return ch;
+}
+
+static void
+release_callback_host(struct callback_host * ch)
+{
+	struct callback_host * * pp;
+
+	if(ch == NULL || --ch->count > 0)
+		return;
+	for(pp = &callback_hosts[hash_str(ch->host, strlen(ch->host)) % CALLBACK_HOST_HASH_SIZE];
+	    *pp != NULL; pp = &(*pp)->next) {
+		if(*pp == ch) {
+			*pp = ch->next;
+			free(ch);
+			return;
+		}
+	}
+}
+
+/* remove the subscriber from the list and indexes and free it */
+static void
+freeSubscriber(struct subscriber * sub)
+{
+	struct subscriber * * pp;
+
+	for(pp = &subscriber_hash[hash_str(sub->uuid, 41) % SUBSCRIBER_HASH_SIZE];
+	    *pp != NULL; pp = &(*pp)->hash_next) {
+		if(*pp == sub) {
+			*pp = sub->hash_next;
+			break;
+		}
+	}
+	expiry_remove(sub);
+	release_callback_host(sub->host);
+	LIST_REMOVE(sub, entries);
+	subscriber_count--;
+	free(sub);
+}
 
 /* create a new subscriber */
 static struct subscriber *
@@ -170,15 +520,18 @@ newSubscriber(const char * eventurl, const char * callback, int callbacklen)
 }
 
 /* creates a new subscriber and adds it to the subscriber list
- * also initiate 1st notify
- * TODO : add a check on the number of subscriber in order to
- * prevent memory overflow... */
+ * also initiate 1st notify.
+ * The number of subscribers for a callback host is limited to
+ * max_subscribers_per_host */
 const char *
 upnpevents_addSubscriber(const char * eventurl,
                          const char * callback, int callbacklen,
                          int timeout)
 {
 	struct subscriber * tmp;
+	unsigned int i;
+	const char * host;
+	int hostlen;
 	/*static char uuid[42];*/
 	/* "uuid:00000000-0000-0000-0000-000000000000"; 5+36+1=42bytes */
 	syslog(LOG_DEBUG, "addSubscriber(%s, %.*s, %d)",
@@ -188,9 +541,33 @@ upnpevents_addSubscriber(const char * eventurl,
 	tmp = newSubscriber(eventurl, callback, callbacklen);
 	if(!tmp)
 		return NULL;
+	hostlen = callback_host_len(tmp->callback, &host);
+	tmp->host = get_callback_host(host, hostlen);
+	if(tmp->host == NULL) {
+		syslog(LOG_ERR, "%s: malloc(): %m", "upnpevents_addSubscriber");
+		free(tmp);
+		return NULL;
+	}
+	if(max_subscribers_per_host > 0 &&
+	   tmp->host->count >= max_subscribers_per_host) {
+		syslog(LOG_WARNING, "%s: too many subscribers (%u) for %s",
+		       "upnpevents_addSubscriber", tmp->host->count, tmp->host->host);
+		free(tmp);
+		return NULL;
+	}
+	tmp->host->count++;
 	if(timeout)
 		tmp->timeout = upnp_time() + timeout;
 	LIST_INSERT_HEAD(&subscriberlist, tmp, entries);
+	i = hash_str(tmp->uuid, 41) % SUBSCRIBER_HASH_SIZE;
+	tmp->hash_next = subscriber_hash[i];
+	subscriber_hash[i] = tmp;
+	tmp->heap_index = -1;
+	expiry_update(tmp);
+	subscriber_count++;
+	/* not all state changes are notified (ConnectionStatus, etc.),
+	 * render the property set again for the initial event */
+	upnp_event_invalidate_body(tmp->service);
 	upnp_event_create_notify(tmp);
 	return tmp->uuid;
 }
@@ -200,18 +577,17 @@ const char *
 upnpevents_renewSubscription(const char * sid, int sidlen, int timeout)
 {
 	struct subscriber * sub;
-	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
-		if((sidlen == 41) && (memcmp(sid, sub->uuid, 41) == 0)) {
+	sub = findSubscriber(sid, sidlen);
+	if(sub == NULL)
+		return NULL;
 #ifdef UPNP_STRICT
-			/* check if the subscription already timeouted */
-			if(sub->timeout && upnp_time() > sub->timeout)
-				continue;
+	/* check if the subscription already timeouted */
+	if(sub->timeout && upnp_time() > sub->timeout)
+		return NULL;
 #endif
-			sub->timeout = (timeout ? upnp_time() + timeout : 0);
-			return sub->uuid;
-		}
-	}
-	return NULL;
+	sub->timeout = (timeout ? upnp_time() + timeout : 0);
+	expiry_update(sub);
+	return sub->uuid;
 }
 
 int
@@ -220,38 +596,130 @@ upnpevents_removeSubscriber(const char * sid, int sidlen)
 	struct subscriber * sub;
 	if(!sid)
 		return -1;
-	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
-		if((sidlen == 41) && (memcmp(sid, sub->uuid, 41) == 0)) {
-			if(sub->notify) {
-				sub->notify->sub = NULL;
-			}
-			LIST_REMOVE(sub, entries);
-			free(sub);
-			return 0;
-		}
+	sub = findSubscriber(sid, sidlen);
+	if(sub == NULL)
+		return -1;
+	if(sub->notify) {
+		sub->notify->sub = NULL;
 	}
-	return -1;
+	freeSubscriber(sub);
+	return 0;
 }
 
 /* notifies all subscriber of a number of port mapping change
- * or external ip address change */
+ * or external ip address change.
+ * The notification is delayed by event_coalescing_window milliseconds
+ * so a single NOTIFY carries the result of several changes */
 void
 upnp_event_var_change_notify(enum subscriber_service_enum service)
+{
+	struct timeval * deadline;
+
+	if((unsigned)service >= sizeof(event_changes)/sizeof(event_changes[0]))
+		return;
+	event_changes_count++;
+	upnp_event_invalidate_body(service);
+	if(event_changes[service].dirty) {
+		event_changes_coalesced++;
+		return;
+	}
+	deadline = &event_changes[service].deadline;
+	if(upnp_gettimeofday(deadline) < 0) {
+		syslog(LOG_ERR, "%s: gettimeofday: %m", "upnp_event_var_change_notify");
+		deadline->tv_sec = 0;
+		deadline->tv_usec = 0;
+	}
+	deadline->tv_sec += event_coalescing_window / 1000;
+	deadline->tv_usec += (event_coalescing_window % 1000) * 1000;
+	if(deadline->tv_usec >= 1000000) {
+		deadline->tv_sec++;
+		deadline->tv_usec -= 1000000;
+	}
+	event_changes[service].dirty = 1;
+}
+
+/* create the notifications for the changes which are due */
+static void
+upnp_event_send_changes(const struct timeval * now)
 {
 	struct subscriber * sub;
-	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
-		if(sub->service == service && sub->notify == NULL)
-			upnp_event_create_notify(sub);
+	unsigned int service;
+
+	for(service = 0; service < sizeof(event_changes)/sizeof(event_changes[0]); service++) {
+		if(!event_changes[service].dirty)
+			continue;
+		if(now->tv_sec < event_changes[service].deadline.tv_sec ||
+		   (now->tv_sec == event_changes[service].deadline.tv_sec &&
+		    now->tv_usec < event_changes[service].deadline.tv_usec))
+			continue;
+		event_changes[service].dirty = 0;
+		for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
+			if(sub->service != service)
+				continue;
+			if(sub->notify == NULL)
+				upnp_event_create_notify(sub);
+			else
+				sub->pending = 1;	/* notify again when finished */
+		}
+	}
+}
+
+void
+upnpevents_gettimeout(struct timeval * timeout)
+{
+	struct timeval now;
+	struct timeval t;
+	unsigned int service;
+
+	if(upnp_gettimeofday(&now) < 0)
+		return;
+	for(service = 0; service < sizeof(event_changes)/sizeof(event_changes[0]); service++) {
+		if(!event_changes[service].dirty)
+			continue;
+		t.tv_sec = event_changes[service].deadline.tv_sec - now.tv_sec;
+		t.tv_usec = event_changes[service].deadline.tv_usec - now.tv_usec;
+		if(t.tv_usec < 0) {
+			t.tv_sec--;
+			t.tv_usec += 1000000;
+		}
+		if(t.tv_sec < 0) {
+			t.tv_sec = 0;
+			t.tv_usec = 0;
+		}
+		if(t.tv_sec < timeout->tv_sec ||
+		   (t.tv_sec == timeout->tv_sec && t.tv_usec < timeout->tv_usec))
+			*timeout = t;
 	}
+	if(next_retry != 0) {
+		t.tv_sec = next_retry - now.tv_sec;
+		t.tv_usec = 0;
+		if(t.tv_sec < 0)
+			t.tv_sec = 0;
+		if(t.tv_sec < timeout->tv_sec ||
+		   (t.tv_sec == timeout->tv_sec && t.tv_usec < timeout->tv_usec))
+			*timeout = t;
+	}
+}
+
+static void
+set_next_retry(time_t t)
+{
+	if(next_retry == 0 || t < next_retry)
+		next_retry = t;
 }
 
-/* create and add the notify object to the list */
+/* create and add the notify object to the list.
+ * The notification is deferred if the callback host is unreachable */
 static void
 upnp_event_create_notify(struct subscriber * sub)
 {
 	struct upnp_event_notify * obj;
-	/*struct timeval sock_timeout;*/
 
+	if(sub->host != NULL && sub->host->retry_time > upnp_time()) {
+		sub->pending = 1;
+		set_next_retry(sub->host->retry_time);
+		return;
+	}
 	obj = calloc(1, sizeof(struct upnp_event_notify));
 	if(!obj) {
 		syslog(LOG_ERR, "%s: calloc(): %m", "upnp_event_create_notify");
@@ -259,45 +727,132 @@ upnp_event_create_notify(struct subscriber * sub)
 	}
 	obj->sub = sub;
 	obj->state = ECreated;
-#ifdef ENABLE_IPV6
-	obj->s = socket((obj->sub->callback[7] == '[') ? PF_INET6 : PF_INET,
-	                SOCK_STREAM, 0);
-#else
-	obj->s = socket(PF_INET, SOCK_STREAM, 0);
-#endif
-	if(obj->s<0) {
-		syslog(LOG_ERR, "%s: socket(): %m", "upnp_event_create_notify");
-		goto error;
-	}
-#if 0 /* does not work for non blocking connect() */
-	/* set timeout to 3 seconds */
-	sock_timeout.tv_sec = 3;
-	sock_timeout.tv_usec = 0;
-	if(setsockopt(obj->s, SOL_SOCKET, SO_RCVTIMEO, &sock_timeout, sizeof(struct timeval)) < 0) {
-		syslog(LOG_WARNING, "%s: setsockopt(SO_RCVTIMEO): %m",
-		       "upnp_event_create_notify");
-	}
-	sock_timeout.tv_sec = 3;
-	sock_timeout.tv_usec = 0;
-	if(setsockopt(obj->s, SOL_SOCKET, SO_SNDTIMEO, &sock_timeout, sizeof(struct timeval)) < 0) {
-		syslog(LOG_WARNING, "%s: setsockopt(SO_SNDTIMEO): %m",
-		       "upnp_event_create_notify");
+	obj->s = -1;	/* the socket is opened or taken from the pool later */
+	sub->notify = obj;
+	TAILQ_INSERT_TAIL(&notifylist, obj, entries);
+}
+
+/* put back the notification in the ECreated state */
+static void
+upnp_event_notify_reset(struct upnp_event_notify * obj)
+{
+	if(obj->s >= 0) {
+		close(obj->s);
+		obj->s = -1;
 	}
-#endif
-	/* set socket non blocking */
-	if(!set_non_blocking(obj->s)) {
-		syslog(LOG_ERR, "%s: set_non_blocking(): %m",
-		       "upnp_event_create_notify");
-		goto error;
-	}
-	if(sub)
-		sub->notify = obj;
-	LIST_INSERT_HEAD(&notifylist, obj, entries);
-	return;
-error:
-	if(obj->s >= 0)
+	free(obj->buffer);
+	obj->buffer = NULL;
+	upnp_event_release_body(obj->body);
+	obj->body = NULL;
+	obj->tosend = 0;
+	obj->sent = 0;
+	obj->received = 0;
+	obj->reused = 0;
+	obj->state = ECreated;
+}
+
+/* a notification could not be delivered. It will be sent again
+ * after a delay, doubled after each failure, during which no
+ * connection is attempted to the callback host.
+ * return -1 if the subscriber should be removed */
+static int
+upnp_event_notify_failed(struct subscriber * sub, time_t curtime)
+{
+	struct callback_host * host = sub->host;
+	time_t delay;
+
+	if(host->retry_time <= curtime) {
+		/* first failure since the last attempt */
+		host->failures++;
+		delay = EVENT_RETRY_MAX_DELAY;
+		if(host->failures < 16) {
+			delay = (time_t)EVENT_RETRY_DELAY << (host->failures - 1);
+			if(delay > EVENT_RETRY_MAX_DELAY)
+				delay = EVENT_RETRY_MAX_DELAY;
+		}
+		host->retry_time = curtime + delay;
+		syslog(LOG_INFO, "%s: %s unreachable (%u), retry in %ds",
+		       "upnp_event_notify_failed", host->host, host->failures, (int)delay);
+	}
+	if(host->failures >= EVENT_MAX_FAILURES)
+		return -1;
+	sub->pending = 1;
+	set_next_retry(host->retry_time);
+	return 0;
+}
+
+/* create the notifications deferred because of a failure */
+static void
+upnp_event_retry(time_t curtime)
+{
+	struct subscriber * sub;
+
+	if(next_retry == 0 || curtime < next_retry)
+		return;
+	next_retry = 0;
+	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
+		if(!sub->pending || sub->notify != NULL)
+			continue;
+		sub->pending = 0;
+		upnp_event_create_notify(sub);	/* set pending again if too early */
+	}
+}
+
+/* take an idle connection to addrstr:portstr from the pool.
+ * return the socket or -1 */
+static int
+event_conn_get(const char * addrstr, const char * portstr)
+{
+	struct event_conn * conn;
+	int s;
+
+	for(conn = idleconns.lh_first; conn != NULL; conn = conn->entries.le_next) {
+		if(strcmp(conn->addrstr, addrstr) == 0 &&
+		   strcmp(conn->portstr, portstr) == 0) {
+			s = conn->s;
+			LIST_REMOVE(conn, entries);
+			idleconns_count--;
+			free(conn);
+			return s;
+		}
+	}
+	return -1;
+}
+
+static void
+event_conn_close(struct event_conn * conn)
+{
+	close(conn->s);
+	LIST_REMOVE(conn, entries);
+	idleconns_count--;
+	free(conn);
+}
+
+/* keep the connection of a finished notification in the pool.
+ * The least recently used idle connection is closed if the pool is full */
+static void
+event_conn_put(struct upnp_event_notify * obj, time_t curtime)
+{
+	struct event_conn * conn;
+	struct event_conn * oldest = NULL;
+
+	if(idleconns_count >= EVENT_CONN_POOL_SIZE) {
+		for(conn = idleconns.lh_first; conn != NULL; conn = conn->entries.le_next)
+			oldest = conn;
+		event_conn_close(oldest);
+	}
+	conn = malloc(sizeof(struct event_conn));
+	if(conn == NULL) {
 		close(obj->s);
-	free(obj);
+	} else {
+		conn->s = obj->s;
+		conn->idle_since = curtime;
+		memcpy(conn->addrstr, obj->addrstr, sizeof(conn->addrstr));
+		memcpy(conn->portstr, obj->portstr, sizeof(conn->portstr));
+		LIST_INSERT_HEAD(&idleconns, conn, entries);
+		idleconns_count++;
+	}
+	obj->s = -1;
 }
 
 static void
@@ -387,6 +942,33 @@ upnp_event_notify_connect(struct upnp_event_notify * obj)
 #endif
 	syslog(LOG_DEBUG, "%s: '%s' %hu '%s'", "upnp_event_notify_connect",
 	       obj->addrstr, port, obj->path);
+	obj->deadline = upnp_time() + EVENT_NOTIFY_TIMEOUT;
+	obj->s = event_conn_get(obj->addrstr, obj->portstr);
+	if(obj->s >= 0) {
+		/* persistent connection : the request can be sent now */
+		obj->reused = 1;
+		event_conn_reused++;
+		upnp_event_prepare(obj);
+		return;
+	}
+#ifdef ENABLE_IPV6
+	obj->s = socket(obj->ipv6 ? PF_INET6 : PF_INET, SOCK_STREAM, 0);
+#else
+	obj->s = socket(PF_INET, SOCK_STREAM, 0);
+#endif
+	if(obj->s < 0) {
+		syslog(LOG_ERR, "%s: socket(): %m", "upnp_event_notify_connect");
+		obj->state = EError;
+		return;
+	}
+	/* set socket non blocking */
+	if(!set_non_blocking(obj->s)) {
+		syslog(LOG_ERR, "%s: set_non_blocking(): %m",
+		       "upnp_event_notify_connect");
+		obj->state = EError;
+		return;
+	}
+	event_conn_opened++;
 	obj->state = EConnecting;
 	if(connect(obj->s, (struct sockaddr *)&addr, addrlen) < 0) {
 		if(errno != EINPROGRESS && errno != EWOULDBLOCK) {
@@ -398,6 +980,8 @@ upnp_event_notify_connect(struct upnp_event_notify * obj)
 	}
 }
 
+/* build the HTTP headers for the subscriber, the body
+ * (property set) is shared with the other subscribers */
 static void upnp_event_prepare(struct upnp_event_notify * obj)
 {
 	static const char notifymsg[] =
@@ -413,88 +997,64 @@ static void upnp_event_prepare(struct upnp_event_notify * obj)
 		"NTS: upnp:propchange\r\n"
 		"SID: %s\r\n"
 		"SEQ: %u\r\n"
-		"Connection: close\r\n"
 		"Cache-Control: no-cache\r\n"
-		"\r\n"
-		"%.*s\r\n";
-	char * xml;
-	int l;
+		"\r\n";
 	if(obj->sub == NULL) {
 		obj->state = EError;
 		return;
 	}
-	switch(obj->sub->service) {
-	case EWanCFG:
-		xml = getVarsWANCfg(&l);
-		break;
-	case EWanIPC:
-		xml = getVarsWANIPCn(&l);
-		break;
-#ifdef ENABLE_L3F_SERVICE
-	case EL3F:
-		xml = getVarsL3F(&l);
-		break;
-#endif
-#ifdef ENABLE_6FC_SERVICE
-	case E6FC:
-		xml = getVars6FC(&l);
-		break;
-#endif
-#ifdef ENABLE_DP_SERVICE
-	case EDP:
-		xml = getVarsDP(&l);
-		break;
-#endif
-	default:
-		xml = NULL;
-		l = 0;
+	obj->body = upnp_event_get_body(obj->sub->service);
+	if(obj->body == NULL) {
+		obj->state = EError;
+		return;
 	}
-	obj->buffersize = 1024;
+	obj->buffersize = 512;
 	for (;;) {
 		obj->buffer = malloc(obj->buffersize);
 		if(!obj->buffer) {
 			syslog(LOG_ERR, "%s: malloc returned NULL", "upnp_event_prepare");
-			if(xml) {
-				free(xml);
-			}
 			obj->state = EError;
 			return;
 		}
-		obj->tosend = snprintf(obj->buffer, obj->buffersize, notifymsg,
-		                       (obj->path[0] != '\0') ? obj->path : "/",
-		                       obj->addrstr, obj->portstr, l+2,
-		                       obj->sub->uuid, obj->sub->seq,
-		                       l, xml);
-		if (obj->tosend < 0) {
+		obj->headerlen = snprintf(obj->buffer, obj->buffersize, notifymsg,
+		                          (obj->path[0] != '\0') ? obj->path : "/",
+		                          obj->addrstr, obj->portstr, obj->body->len,
+		                          obj->sub->uuid, obj->sub->seq);
+		if (obj->headerlen < 0) {
 			syslog(LOG_ERR, "%s: snprintf() failed", "upnp_event_prepare");
-			if(xml) {
-				free(xml);
-			}
 			obj->state = EError;
 			return;
-		} else if (obj->tosend < obj->buffersize) {
+		} else if (obj->headerlen < obj->buffersize) {
 			break; /* the buffer was large enough */
 		}
 		/* Try again with a buffer big enough */
 		free(obj->buffer);
-		obj->buffersize = obj->tosend + 1;	/* reserve space for the final 0 */
-	}
-	if(xml) {
-		free(xml);
-		xml = NULL;
+		obj->buffersize = obj->headerlen + 1;	/* reserve space for the final 0 */
 	}
+	obj->tosend = obj->headerlen + obj->body->len;
 	obj->state = ESending;
 }
 
 static void upnp_event_send(struct upnp_event_notify * obj)
 {
 	int i;
+	struct iovec iov[2];
 
 	syslog(LOG_DEBUG, "%s: sending event notify message to %s%s",
 	       "upnp_event_send", obj->addrstr, obj->portstr);
-	syslog(LOG_DEBUG, "%s: msg: %s",
-	       "upnp_event_send", obj->buffer + obj->sent);
-	i = send(obj->s, obj->buffer + obj->sent, obj->tosend - obj->sent, 0);
+	if(obj->sent < obj->headerlen) {
+		syslog(LOG_DEBUG, "%s: msg: %s%.*s",
+		       "upnp_event_send", obj->buffer + obj->sent,
+		       obj->body->len, obj->body->data);
+		iov[0].iov_base = obj->buffer + obj->sent;
+		iov[0].iov_len = obj->headerlen - obj->sent;
+		iov[1].iov_base = obj->body->data;
+		iov[1].iov_len = obj->body->len;
+		i = writev(obj->s, iov, 2);
+	} else {
+		i = send(obj->s, obj->body->data + obj->sent - obj->headerlen,
+		         obj->tosend - obj->sent, 0);
+	}
 	if(i<0) {
 		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
 			syslog(LOG_NOTICE, "%s: send(%s%s): %m", "upnp_event_send",
@@ -514,10 +1074,56 @@ static void upnp_event_send(struct upnp_event_notify * obj)
 		obj->state = EWaitingForResponse;
 }
 
+/* check if the whole HTTP response is in obj->buffer.
+ * return 1 when complete, 0 if more data is needed.
+ * obj->keepalive is set when the connection can be reused :
+ * HTTP/1.1 response with a Content-Length and without "Connection: close" */
+static int
+upnp_event_parse_response(struct upnp_event_notify * obj)
+{
+	const char * p;
+	const char * end;
+	int content_length = -1;
+	int len;
+
+	obj->keepalive = 0;
+	end = strstr(obj->buffer, "\r\n\r\n");
+	if(end == NULL)
+		return (obj->received >= obj->buffersize - 1);	/* too long, give up */
+	obj->keepalive = (memcmp(obj->buffer, "HTTP/1.1 ", 9) == 0);
+	for(p = strstr(obj->buffer, "\r\n"); p != NULL && p < end; p = strstr(p, "\r\n")) {
+		p += 2;
+		if(strncasecmp(p, "Content-Length:", 15) == 0) {
+			content_length = atoi(p + 15);
+		} else if(strncasecmp(p, "Connection:", 11) == 0) {
+			p += 11;
+			while(*p == ' ' || *p == '\t')
+				p++;
+			if(strncasecmp(p, "close", 5) == 0)
+				obj->keepalive = 0;
+		} else if(strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+			obj->keepalive = 0;
+		}
+	}
+	len = (int)(end + 4 - obj->buffer);
+	if(content_length < 0) {
+		/* the body ends when the connection is closed */
+		obj->keepalive = 0;
+	} else if(obj->received < len + content_length) {
+		if(len + content_length < obj->buffersize - 1)
+			return 0;	/* wait for the body */
+		obj->keepalive = 0;
+	} else if(obj->received > len + content_length) {
+		obj->keepalive = 0;	/* unexpected data */
+	}
+	return 1;
+}
+
 static void upnp_event_recv(struct upnp_event_notify * obj)
 {
 	int n;
-	n = recv(obj->s, obj->buffer, obj->buffersize, 0);
+	n = recv(obj->s, obj->buffer + obj->received,
+	         obj->buffersize - obj->received - 1, 0);
 	if(n<0) {
 		if(errno != EAGAIN &&
 		   errno != EWOULDBLOCK &&
@@ -527,11 +1133,23 @@ static void upnp_event_recv(struct upnp_event_notify * obj)
 		}
 		return;
 	}
-	syslog(LOG_DEBUG, "%s: (%dbytes) %.*s", "upnp_event_recv",
-	       n, n, obj->buffer);
-	/* TODO : do something with the data recevied ?
-	 * right now, n (number of bytes received) is ignored
-	 * We may need to recv() more bytes. */
+	if(n == 0) {
+		/* connection closed */
+		if(obj->received == 0) {
+			syslog(LOG_NOTICE, "%s: connection closed by %s%s",
+			       "upnp_event_recv", obj->addrstr, obj->portstr);
+			obj->state = EError;
+			return;
+		}
+		obj->keepalive = 0;
+	} else {
+		syslog(LOG_DEBUG, "%s: (%dbytes) %.*s", "upnp_event_recv",
+		       n, n, obj->buffer + obj->received);
+		obj->received += n;
+		obj->buffer[obj->received] = '\0';
+		if(!upnp_event_parse_response(obj))
+			return;
+	}
 	obj->state = EFinished;
 	if(obj->sub)
 		obj->sub->seq++;
@@ -581,18 +1199,29 @@ upnp_event_process_notify(struct upnp_event_notify * obj)
 void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd)
 {
 	struct upnp_event_notify * obj;
-	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
+	struct event_conn * conn;
+	struct timeval now;
+	int active = 0;
+
+	if(upnp_gettimeofday(&now) >= 0)
+		upnp_event_send_changes(&now);
+	upnp_event_retry(upnp_time());
+	for(obj = notifylist.tqh_first; obj != NULL; obj = obj->entries.tqe_next) {
+		if(obj->state != ECreated)
+			active++;
+	}
+	for(obj = notifylist.tqh_first; obj != NULL; obj = obj->entries.tqe_next) {
 		syslog(LOG_DEBUG, "upnpevents_selectfds: %p %d %d",
 		       obj, obj->state, obj->s);
+		if(obj->state == ECreated) {
+			/* the other notifications wait in the list */
+			if(active >= EVENT_MAX_ACTIVE_NOTIFY)
+				continue;
+			upnp_event_notify_connect(obj);
+			active++;
+		}
 		if(obj->s >= 0) {
 			switch(obj->state) {
-			case ECreated:
-				upnp_event_notify_connect(obj);
-				if(obj->state != EConnecting)
-					break;
-#if defined(__GNUC__) && (__GNUC__ >= 7)
-				__attribute__ ((fallthrough));
-#endif
 			case EConnecting:
 			case ESending:
 				FD_SET(obj->s, writeset);
@@ -609,59 +1238,103 @@ void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd)
 			}
 		}
 	}
+	/* detect the idle connections closed by the subscribers */
+	for(conn = idleconns.lh_first; conn != NULL; conn = conn->entries.le_next) {
+		FD_SET(conn->s, readset);
+		if(conn->s > *max_fd)
+			*max_fd = conn->s;
+	}
 }
 
 void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 {
 	struct upnp_event_notify * obj;
 	struct upnp_event_notify * next;
+	struct event_conn * conn;
+	struct event_conn * connnext;
 	struct subscriber * sub;
-	struct subscriber * subnext;
 	time_t curtime;
-	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
-		syslog(LOG_DEBUG, "%s: %p %d %d %d %d",
-		       "upnpevents_processfds", obj, obj->state, obj->s,
-		       FD_ISSET(obj->s, readset), FD_ISSET(obj->s, writeset));
+	for(obj = notifylist.tqh_first; obj != NULL; obj = obj->entries.tqe_next) {
 		if(obj->s >= 0) {
+			/* s is -1 while waiting for an active slot or when
+			 * socket() failed : FD_ISSET(-1) aborts with FORTIFY */
+			syslog(LOG_DEBUG, "%s: %p %d %d %d %d",
+			       "upnpevents_processfds", obj, obj->state, obj->s,
+			       FD_ISSET(obj->s, readset), FD_ISSET(obj->s, writeset));
 			if(FD_ISSET(obj->s, readset) || FD_ISSET(obj->s, writeset))
 				upnp_event_process_notify(obj);
 		}
 	}
-	obj = notifylist.lh_first;
+	curtime = upnp_time();
+	/* an idle connection is readable when closed by the other end */
+	for(conn = idleconns.lh_first; conn != NULL; conn = connnext) {
+		connnext = conn->entries.le_next;
+		if(FD_ISSET(conn->s, readset) ||
+		   curtime - conn->idle_since > EVENT_CONN_IDLE_TIMEOUT)
+			event_conn_close(conn);
+	}
+	obj = notifylist.tqh_first;
 	while(obj != NULL) {
-		next = obj->entries.le_next;
-		if(obj->state == EError || obj->state == EFinished) {
+		next = obj->entries.tqe_next;
+		if(obj->state != ECreated && obj->state != EFinished &&
+		   obj->state != EError && curtime > obj->deadline) {
+			syslog(LOG_NOTICE, "%s: notify to %s%s timeouted",
+			       "upnpevents_processfds", obj->addrstr, obj->portstr);
+			obj->state = EError;
+		}
+		if(obj->state == EError && obj->reused && obj->received == 0) {
+			/* the persistent connection was closed by the subscriber
+			 * before we used it : try again with another connection */
+			upnp_event_notify_reset(obj);
+		} else if(obj->state == EError || obj->state == EFinished) {
 			if(obj->s >= 0) {
-				close(obj->s);
+				if(obj->state == EFinished && obj->keepalive)
+					event_conn_put(obj, curtime);
+				else
+					close(obj->s);
 			}
-			if(obj->sub)
-				obj->sub->notify = NULL;
-			/* remove also the subscriber from the list if there was an error */
-			if(obj->state == EError && obj->sub) {
+			sub = obj->sub;
+			if(sub) {
+				sub->notify = NULL;
+				if(obj->state == EFinished)
+					sub->host->failures = 0;
+			}
+			/* remove also the subscriber from the list after too many errors */
+			if(obj->state == EError && sub &&
+			   upnp_event_notify_failed(sub, curtime) < 0) {
 				syslog(LOG_ERR, "%s: %p, remove subscriber %s after an ERROR cb: %s",
-				       "upnpevents_processfds", obj, obj->sub->uuid, obj->sub->callback);
-				LIST_REMOVE(obj->sub, entries);
-				free(obj->sub);
+				       "upnpevents_processfds", obj, sub->uuid, sub->callback);
+				freeSubscriber(sub);
+			} else if(sub && sub->timeout && curtime > sub->timeout) {
+				/* expired during the notification */
+				syslog(LOG_INFO, "subscriber timeouted : %u > %u SID=%s",
+				       (unsigned)curtime, (unsigned)sub->timeout, sub->uuid);
+				freeSubscriber(sub);
+			} else if(sub && sub->pending) {
+				/* send the state after the last change, or retry later */
+				sub->pending = 0;
+				upnp_event_create_notify(sub);
 			}
 			if(obj->buffer) {
 				free(obj->buffer);
 			}
-			LIST_REMOVE(obj, entries);
+			upnp_event_release_body(obj->body);
+			TAILQ_REMOVE(&notifylist, obj, entries);
 			free(obj);
 		}
 		obj = next;
 	}
 	/* remove timeouted subscribers */
-	curtime = upnp_time();
-	for(sub = subscriberlist.lh_first; sub != NULL; ) {
-		subnext = sub->entries.le_next;
-		if(sub->timeout && curtime > sub->timeout && sub->notify == NULL) {
-			syslog(LOG_INFO, "subscriber timeouted : %u > %u SID=%s",
-			       (unsigned)curtime, (unsigned)sub->timeout, sub->uuid);
-			LIST_REMOVE(sub, entries);
-			free(sub);
+	while(expiry_len > 0 && curtime > expiry_heap[0]->timeout) {
+		sub = expiry_heap[0];
+		if(sub->notify != NULL) {
+			/* removed once the notification is done */
+			expiry_remove(sub);
+			continue;
 		}
-		sub = subnext;
+		syslog(LOG_INFO, "subscriber timeouted : %u > %u SID=%s",
+		       (unsigned)curtime, (unsigned)sub->timeout, sub->uuid);
+		freeSubscriber(sub);
 	}
 }
 
@@ -672,7 +1345,16 @@ void write_events_details(int s) {
 	struct upnp_event_notify * obj;
 	struct subscriber * sub;
 	write(s, "Events details :\n", 17);
-	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
+	n = snprintf(buff, sizeof(buff), " state changes=%lu coalesced=%lu\n",
+	             event_changes_count, event_changes_coalesced);
+	write(s, buff, n);
+	n = snprintf(buff, sizeof(buff), " subscribers=%u with timeout=%d\n",
+	             subscriber_count, expiry_len);
+	write(s, buff, n);
+	n = snprintf(buff, sizeof(buff), " connections opened=%lu reused=%lu idle=%d\n",
+	             event_conn_opened, event_conn_reused, idleconns_count);
+	write(s, buff, n);
+	for(obj = notifylist.tqh_first; obj != NULL; obj = obj->entries.tqe_next) {
 		n = snprintf(buff, sizeof(buff), " %p sub=%p state=%d s=%d\n",
 		             obj, obj->sub, obj->state, obj->s);
 		write(s, buff, n);
@@ -42,6 +42,8 @@ const char *
 upnpevents_renewSubscription(const char * sid, int sidlen, int timeout);
 
 void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd);
+/* decrease timeout to the time of the next coalesced notification */
+void upnpevents_gettimeout(struct timeval * timeout);
 void upnpevents_processfds(fd_set *readset, fd_set *writeset);
 
 #ifdef USE_MINIUPNPDCTL
@@ -24,6 +24,8 @@ const char * ext_if_name6 = 0;
 /* stun host/port configuration */
 const char * ext_stun_host = 0;
 uint16_t ext_stun_port = 0;
+/* lifetime of the STUN result in seconds, 0 = no expiry */
+unsigned int ext_stun_ttl = 600;
 
 /* file to store leases */
 #ifdef ENABLE_LEASEFILE
@@ -131,6 +133,31 @@ struct in6_addr ipv6_bind_addr;
 /* Path of the Unix socket used to communicate with MiniSSDPd */
 const char * minissdpdsocketpath = "/var/run/minissdpd.sock";
 
+/* HTTP requests with larger headers are rejected with 431,
+ * requests with a larger body are rejected with 413 */
+unsigned int http_max_header_size = 8192;
+unsigned int http_max_body_size = 65536;
+
+/* per client token buckets, see ratelimit.c */
+unsigned int soap_rate_limit = 0;
+unsigned int soap_rate_burst = 0;
+unsigned int pmp_rate_limit = 0;
+unsigned int pmp_rate_burst = 0;
+
+/* port mapping quotas, see upnpredirect.c */
+unsigned int max_mappings = 0;
+unsigned int max_mappings_per_client = 0;
+
+/* SSDP NOTIFY pacing, see minissdp.c */
+unsigned int ssdp_notify_max_pps = 0;
+
+#ifdef ENABLE_EVENTS
+/* see upnp_event_var_change_notify() */
+unsigned int event_coalescing_window = 100;
+/* see upnpevents_addSubscriber() */
+unsigned int max_subscribers_per_host = 32;
+#endif
+
 /* BOOTID.UPNP.ORG and CONFIGID.UPNP.ORG */
 /* See UPnP Device Architecture v1.1 section 1.2 Advertisement :
  * The field value of the BOOTID.UPNP.ORG header field MUST be increased
@@ -29,6 +29,9 @@ extern const char * ext_if_name6;
 extern const char * ext_stun_host;
 /*! \brief STUN server port */
 extern uint16_t ext_stun_port;
+/*! \brief lifetime of the STUN result before it is probed again,
+ * in seconds, 0 = no expiry */
+extern unsigned int ext_stun_ttl;
 
 /* file to store all leases */
 #ifdef ENABLE_LEASEFILE
@@ -186,6 +189,38 @@ extern struct in6_addr ipv6_bind_addr;
 /*! \brief path to the minissdpd unix socket */
 extern const char * minissdpdsocketpath;
 
+/*! \brief maximum size of the HTTP request line and headers */
+extern unsigned int http_max_header_size;
+/*! \brief maximum Content-Length accepted for HTTP requests */
+extern unsigned int http_max_body_size;
+
+/*! \brief SOAP requests per second allowed for each client, 0 = no limit */
+extern unsigned int soap_rate_limit;
+/*! \brief SOAP requests burst size, 0 = twice the rate */
+extern unsigned int soap_rate_burst;
+/*! \brief NAT-PMP/PCP requests per second allowed for each client, 0 = no limit */
+extern unsigned int pmp_rate_limit;
+/*! \brief NAT-PMP/PCP requests burst size, 0 = twice the rate */
+extern unsigned int pmp_rate_burst;
+
+/*! \brief maximum number of port mappings, 0 = no limit */
+extern unsigned int max_mappings;
+/*! \brief maximum number of port mappings for one internal client, 0 = no limit */
+extern unsigned int max_mappings_per_client;
+
+/*! \brief maximum number of SSDP NOTIFY packets per second, 0 = no limit */
+extern unsigned int ssdp_notify_max_pps;
+
+#ifdef ENABLE_EVENTS
+/*! \brief delay in milliseconds during which state changes are
+ * gathered in one event notification */
+extern unsigned int event_coalescing_window;
+
+/*! \brief maximum number of event subscriptions with the same
+ * callback host, 0 = no limit */
+extern unsigned int max_subscribers_per_host;
+#endif
+
 /*! \brief BOOTID.UPNP.ORG */
 extern unsigned int upnp_bootid;
 /*! \brief CONFIGID.UPNP.ORG */
@@ -19,6 +19,7 @@
 #include <syslog.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include "config.h"
 #ifdef ENABLE_HTTP_DATE
 #include <time.h>
@@ -29,9 +30,8 @@
 #include "upnpsoap.h"
 #include "upnpevents.h"
 #include "upnputils.h"
-#if defined(RANDOMIZE_URLS) || defined(DYNAMIC_OS_VERSION) || defined(IGD_V2)
 #include "upnpglobalvars.h"
-#endif /* RANDOMIZE_URLS */
+#include "ratelimit.h"
 
 #ifdef ENABLE_HTTPS
 #include <openssl/err.h>
@@ -39,6 +39,14 @@
 #include <openssl/conf.h>
 static SSL_CTX *ssl_ctx = NULL;
 
+/* number of TLS sessions kept for resumption and their lifetime */
+#ifndef HTTPS_SESSION_CACHE_SIZE
+#define HTTPS_SESSION_CACHE_SIZE	(128)
+#endif
+#ifndef HTTPS_SESSION_TIMEOUT
+#define HTTPS_SESSION_TIMEOUT	(3600)
+#endif
+
 static void
 syslogsslerr(void)
 {
@@ -101,6 +109,18 @@ int init_ssl(void)
 	/*SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER|SSL_VERIFY_CLIENT_ONCE, verify_callback);*/
 	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, verify_callback);
 	/*SSL_CTX_set_verify_depth(depth);*/
+	/* control points open a new connection for each request :
+	 * allow them to resume their session (abbreviated handshake)
+	 * with the server side session cache or a session ticket */
+	SSL_CTX_set_session_id_context(ssl_ctx, (const unsigned char *)"miniupnpd", 9);
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ssl_ctx, HTTPS_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ssl_ctx, HTTPS_SESSION_TIMEOUT);
+	SSL_CTX_clear_options(ssl_ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	/* one TLS 1.3 ticket is enough as connections are sequential */
+	SSL_CTX_set_num_tickets(ssl_ctx, 1);
+#endif
 	syslog(LOG_INFO, "using %s", SSLeay_version(SSLEAY_VERSION));
 	return 0;
 }
@@ -142,39 +162,67 @@ New_upnphttp(int s)
 }
 
 #ifdef ENABLE_HTTPS
+/* continue the TLS handshake as far as possible without blocking.
+ * h->ssl_want tells the main loop which event to wait for */
+static void
+SSLHandshake_upnphttp(struct upnphttp * h)
+{
+	int r;
+	int err;
+
+	r = SSL_do_handshake(h->ssl);
+	if(r == 1) {
+		syslog(LOG_DEBUG, "TLS handshake with %s done%s",
+		       h->clientaddr_str,
+		       SSL_session_reused(h->ssl) ? " (session resumed)" : "");
+		h->ssl_want = 0;
+		h->state = EWaitingForHttpRequest;
+		return;
+	}
+	err = SSL_get_error(h->ssl, r);
+	if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+		h->ssl_want = err;
+		return;
+	}
+	syslog(LOG_WARNING, "TLS handshake with %s failed (SSL_get_error() %d)",
+	       h->clientaddr_str, err);
+	syslogsslerr();
+	h->state = EToDelete;
+}
+
 void
 InitSSL_upnphttp(struct upnphttp * h)
 {
-	int r;
 	h->ssl = SSL_new(ssl_ctx);
 	if(h->ssl == NULL) {
 		syslog(LOG_ERR, "SSL_new() failed");
 		syslogsslerr();
-		abort();
+		h->state = EToDelete;
+		return;
 	}
 	if(!SSL_set_fd(h->ssl, h->socket)) {
 		syslog(LOG_ERR, "SSL_set_fd() failed");
 		syslogsslerr();
-		abort();
-	}
-	r = SSL_accept(h->ssl); /* start the handshaking */
-	if(r < 0) {
-		int err;
-		err = SSL_get_error(h->ssl, r);
-		syslog(LOG_DEBUG, "SSL_accept() returned %d, SSL_get_error() %d", r, err);
-		if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
-			syslog(LOG_ERR, "SSL_accept() failed");
-			syslogsslerr();
-			abort();
-		}
+		h->state = EToDelete;
+		return;
 	}
+	SSL_set_accept_state(h->ssl);
+	h->state = ESSLHandshake;
+	SSLHandshake_upnphttp(h); /* start the handshaking */
 }
 #endif /* ENABLE_HTTPS */
 
 void
 CloseSocket_upnphttp(struct upnphttp * h)
 {
-	/* SSL_shutdown() ? */
+#ifdef ENABLE_HTTPS
+	if(h->ssl && SSL_is_init_finished(h->ssl)) {
+		/* send close_notify, without waiting for the peer one.
+		 * OpenSSL removes the sessions which were not shut down
+		 * from the cache, so they could not be resumed */
+		SSL_shutdown(h->ssl);
+	}
+#endif /* ENABLE_HTTPS */
 	if(close(h->socket) < 0)
 	{
 		syslog(LOG_ERR, "CloseSocket_upnphttp: close(%d): %m", h->socket);
@@ -202,182 +250,211 @@ Delete_upnphttp(struct upnphttp * h)
 	}
 }
 
-/* parse HttpHeaders of the REQUEST
- * This function is called after the \r\n\r\n character
- * sequence has been found in h->req_buf */
-static void
-ParseHttpHeaders(struct upnphttp * h)
+/* parse one header line of the REQUEST
+ * The line is terminated by the \r\n character sequence.
+ * return 0, or the HTTP error code if the request must be rejected */
+static int
+ParseHttpHeaderLine(struct upnphttp * h, char * line)
 {
-	char * line;
 	char * colon;
 	char * p;
 	int n;
-	if((h->req_buf == NULL) || (h->req_contentoff <= 0))
-		return;
-	line = h->req_buf;
-	while(line < (h->req_buf + h->req_contentoff))
+
+	colon = line;
+	while(*colon != ':')
 	{
-		colon = line;
-		while(*colon != ':')
-		{
-			if(*colon == '\r' || *colon == '\n')
-			{
-				colon = NULL;	/* no ':' character found on the line */
-				break;
-			}
-			colon++;
+		if(*colon == '\r' || *colon == '\n')
+			return 0;	/* no ':' character found on the line */
+		colon++;
+	}
+	if(strncasecmp(line, "Content-Length:", 15)==0)
+	{
+		long l;
+		p = colon;
+		while((*p < '0' || *p > '9') && (*p != '\r') && (*p != '\n'))
+			p++;
+		l = strtol(p, NULL, 10);
+		if(l > (long)http_max_body_size || l > INT_MAX) {
+			/* reject the request before receiving the body */
+			syslog(LOG_WARNING, "ParseHttpHeaders() Content-Length %ld exceeds %u bytes",
+			       l, http_max_body_size);
+			return 413;
 		}
-		if(colon)
+		h->req_contentlen = (int)l;
+	}
+	else if(strncasecmp(line, "Host:", 5)==0)
+	{
+		p = colon;
+		n = 0;
+		while(*p == ':' || *p == ' ' || *p == '\t')
+			p++;
+		while(p[n]>' ')
+			n++;
+		h->req_HostOff = p - h->req_buf;
+		h->req_HostLen = n;
+	}
+	else if(strncasecmp(line, "SOAPAction:", 11)==0)
+	{
+		p = colon;
+		n = 0;
+		while(*p == ':' || *p == ' ' || *p == '\t')
+			p++;
+		while(p[n]>=' ')
+			n++;
+		if((p[0] == '"' && p[n-1] == '"')
+		  || (p[0] == '\'' && p[n-1] == '\''))
 		{
-			if(strncasecmp(line, "Content-Length:", 15)==0)
-			{
-				p = colon;
-				while((*p < '0' || *p > '9') && (*p != '\r') && (*p != '\n'))
-					p++;
-				h->req_contentlen = atoi(p);
-				if(h->req_contentlen < 0) {
-					syslog(LOG_WARNING, "ParseHttpHeaders() invalid Content-Length %d", h->req_contentlen);
-					h->req_contentlen = 0;
-				}
-				/*printf("*** Content-Lenght = %d ***\n", h->req_contentlen);
-				printf("    readbufflen=%d contentoff = %d\n",
-					h->req_buflen, h->req_contentoff);*/
-			}
-			else if(strncasecmp(line, "Host:", 5)==0)
-			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n]>' ')
-					n++;
-				h->req_HostOff = p - h->req_buf;
-				h->req_HostLen = n;
-			}
-			else if(strncasecmp(line, "SOAPAction:", 11)==0)
-			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n]>=' ')
-					n++;
-				if((p[0] == '"' && p[n-1] == '"')
-				  || (p[0] == '\'' && p[n-1] == '\''))
-				{
-					p++; n -= 2;
-				}
-				h->req_soapActionOff = p - h->req_buf;
-				h->req_soapActionLen = n;
-			}
-			else if(strncasecmp(line, "accept-language:", 16) == 0)
-			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n]>=' ')
-					n++;
-				syslog(LOG_DEBUG, "accept-language HTTP header : '%.*s'", n, p);
-				/* keep only the 1st accepted language */
-				n = 0;
-				while(p[n]>' ' && p[n] != ',')
-					n++;
-				if(n >= (int)sizeof(h->accept_language))
-					n = (int)sizeof(h->accept_language) - 1;
-				memcpy(h->accept_language, p, n);
-				h->accept_language[n] = '\0';
-			}
-			else if(strncasecmp(line, "expect:", 7) == 0)
-			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n]>=' ')
-					n++;
-				if(strncasecmp(p, "100-continue", 12) == 0) {
-					h->respflags |= FLAG_CONTINUE;
-					syslog(LOG_DEBUG, "\"Expect: 100-Continue\" header detected");
-				}
-			}
-			else if(strncasecmp(line, "user-agent:", 11) == 0)
-			{
-				/* - User-Agent: Microsoft-Windows/10.0 UPnP/1.0
-				 * - User-Agent: FDSSDP                           */
-				if(strcasestr(line + 11, "microsoft") != NULL || strstr(line + 11, "FDSSDP") != NULL) {
-					h->respflags |= FLAG_MS_CLIENT;
-				}
-			}
+			p++; n -= 2;
+		}
+		h->req_soapActionOff = p - h->req_buf;
+		h->req_soapActionLen = n;
+	}
+	else if(strncasecmp(line, "accept-language:", 16) == 0)
+	{
+		p = colon;
+		n = 0;
+		while(*p == ':' || *p == ' ' || *p == '\t')
+			p++;
+		while(p[n]>=' ')
+			n++;
+		syslog(LOG_DEBUG, "accept-language HTTP header : '%.*s'", n, p);
+		/* keep only the 1st accepted language */
+		n = 0;
+		while(p[n]>' ' && p[n] != ',')
+			n++;
+		if(n >= (int)sizeof(h->accept_language))
+			n = (int)sizeof(h->accept_language) - 1;
+		memcpy(h->accept_language, p, n);
+		h->accept_language[n] = '\0';
+	}
+	else if(strncasecmp(line, "expect:", 7) == 0)
+	{
+		p = colon;
+		n = 0;
+		while(*p == ':' || *p == ' ' || *p == '\t')
+			p++;
+		while(p[n]>=' ')
+			n++;
+		if(strncasecmp(p, "100-continue", 12) == 0) {
+			h->respflags |= FLAG_CONTINUE;
+			syslog(LOG_DEBUG, "\"Expect: 100-Continue\" header detected");
+		}
+	}
+	else if(strncasecmp(line, "user-agent:", 11) == 0)
+	{
+		/* - User-Agent: Microsoft-Windows/10.0 UPnP/1.0
+		 * - User-Agent: FDSSDP                           */
+		/* limit the search to this line : the following
+		 * headers may not have been received yet */
+		p = strchr(line, '\r');
+		*p = '\0';
+		if(strcasestr(line + 11, "microsoft") != NULL || strstr(line + 11, "FDSSDP") != NULL) {
+			h->respflags |= FLAG_MS_CLIENT;
+		}
+		*p = '\r';
+	}
 #ifdef ENABLE_EVENTS
-			else if(strncasecmp(line, "Callback:", 9)==0)
-			{
-				/* The Callback can contain several urls :
-				 * If there is more than one URL, when the service sends
-				 * events, it will try these URLs in order until one
-				 * succeeds. One or more URLs each enclosed by angle
-				 * brackets ("<" and ">") */
-				p = colon;
-				while(*p != '<' && *p != '\r' )
-					p++;
-				n = 0;
-				while(p[n] != '\r')
-					n++;
-				while(n > 0 && p[n] != '>')
-					n--;
-				/* found last > character */
-				h->req_CallbackOff = p - h->req_buf;
-				h->req_CallbackLen = MAX(0, n + 1);
-			}
-			else if(strncasecmp(line, "SID:", 4)==0)
-			{
-				p = colon + 1;
-				while((*p == ' ') || (*p == '\t'))
-					p++;
-				n = 0;
-				while(!isspace(p[n]))
-					n++;
-				h->req_SIDOff = p - h->req_buf;
-				h->req_SIDLen = n;
-			}
-			/* Timeout: Seconds-nnnn */
+	else if(strncasecmp(line, "Callback:", 9)==0)
+	{
+		/* The Callback can contain several urls :
+		 * If there is more than one URL, when the service sends
+		 * events, it will try these URLs in order until one
+		 * succeeds. One or more URLs each enclosed by angle
+		 * brackets ("<" and ">") */
+		p = colon;
+		while(*p != '<' && *p != '\r' )
+			p++;
+		n = 0;
+		while(p[n] != '\r')
+			n++;
+		while(n > 0 && p[n] != '>')
+			n--;
+		/* found last > character */
+		h->req_CallbackOff = p - h->req_buf;
+		h->req_CallbackLen = MAX(0, n + 1);
+	}
+	else if(strncasecmp(line, "SID:", 4)==0)
+	{
+		p = colon + 1;
+		while((*p == ' ') || (*p == '\t'))
+			p++;
+		n = 0;
+		while(!isspace(p[n]))
+			n++;
+		h->req_SIDOff = p - h->req_buf;
+		h->req_SIDLen = n;
+	}
+	/* Timeout: Seconds-nnnn */
 /* TIMEOUT
 Recommended. Requested duration until subscription expires,
 either number of seconds or infinite. Recommendation
 by a UPnP Forum working committee. Defined by UPnP vendor.
  Consists of the keyword "Second-" followed (without an
 intervening space) by either an integer or the keyword "infinite". */
-			else if(strncasecmp(line, "Timeout:", 8)==0)
-			{
-				p = colon + 1;
-				while((*p == ' ') || (*p == '\t'))
-					p++;
-				if(strncasecmp(p, "Second-", 7)==0) {
-					h->req_Timeout = atoi(p+7);
-				}
-			}
+	else if(strncasecmp(line, "Timeout:", 8)==0)
+	{
+		p = colon + 1;
+		while((*p == ' ') || (*p == '\t'))
+			p++;
+		if(strncasecmp(p, "Second-", 7)==0) {
+			h->req_Timeout = atoi(p+7);
+		}
+	}
 #ifdef UPNP_STRICT
-			else if(strncasecmp(line, "nt:", 3)==0)
-			{
-				p = colon + 1;
-				while((*p == ' ') || (*p == '\t'))
-					p++;
-				n = 0;
-				while(!isspace(p[n]))
-					n++;
-				h->req_NTOff = p - h->req_buf;
-				h->req_NTLen = n;
-			}
+	else if(strncasecmp(line, "nt:", 3)==0)
+	{
+		p = colon + 1;
+		while((*p == ' ') || (*p == '\t'))
+			p++;
+		n = 0;
+		while(!isspace(p[n]))
+			n++;
+		h->req_NTOff = p - h->req_buf;
+		h->req_NTLen = n;
+	}
 #endif /* UPNP_STRICT */
 #endif /* ENABLE_EVENTS */
+	return 0;
+}
+
+/* parse HttpHeaders of the REQUEST as they are received
+ * The scan resumes at h->req_scanoff, so each received byte is examined
+ * only once, and each complete line is parsed immediately.
+ * return 1 once the \r\n\r\n character sequence has been found,
+ * 0 if more data is needed, or the HTTP error code if the request
+ * must be rejected */
+static int
+ParseHttpHeaders(struct upnphttp * h)
+{
+	int i;
+	int r;
+
+	for(i = h->req_scanoff; i < h->req_buflen; i++)
+	{
+		if(h->req_buf[i] != '\n' || i == 0 || h->req_buf[i-1] != '\r')
+			continue;
+		if(i - 1 == h->req_lineoff && h->req_lineoff > 0)
+		{
+			/* empty line : end of the headers */
+			h->req_contentoff = i + 1;
+			h->req_scanoff = i + 1;
+			if(h->req_contentoff > (int)http_max_header_size)
+				return 431;
+			return 1;
+		}
+		/* the request line is parsed by ProcessHttpQuery_upnphttp() */
+		if(h->req_lineoff > 0)
+		{
+			r = ParseHttpHeaderLine(h, h->req_buf + h->req_lineoff);
+			if(r != 0)
+				return r;
 		}
-		/* the loop below won't run off the end of the buffer
-		 * because the buffer is guaranteed to contain the \r\n\r\n
-		 * character sequence */
-		while(!(line[0] == '\r' && line[1] == '\n'))
-			line++;
-		line += 2;
+		h->req_lineoff = i + 1;
 	}
+	h->req_scanoff = i;
+	if(h->req_buflen > (int)http_max_header_size)
+		return 431;
+	return 0;
 }
 
 /* very minimalistic 404 error message */
@@ -424,19 +501,25 @@ Send501(struct upnphttp * h)
 	SendRespAndClose_upnphttp(h);
 }
 
-/* findendheaders() find the \r\n\r\n character sequence and
- * return a pointer to it.
- * It returns NULL if not found */
-static const char *
-findendheaders(const char * s, int len)
+/* minimalistic error message, used to reject a request
+ * before its request line has been parsed */
+static void
+SendError_upnphttp(struct upnphttp * h, int respcode, const char * respmsg)
 {
-	while(len-->3)
-	{
-		if(s[0]=='\r' && s[1]=='\n' && s[2]=='\r' && s[3]=='\n')
-			return s;
-		s++;
-	}
-	return NULL;
+	char body[256];
+	int bodylen;
+
+	if(h->HttpVer[0] == '\0')
+		strncpy(h->HttpVer, "HTTP/1.1", sizeof(h->HttpVer));
+	bodylen = snprintf(body, sizeof(body),
+	                   "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>"
+	                   "<BODY><H1>%s</H1></BODY></HTML>\r\n",
+	                   respcode, respmsg, respmsg);
+	if(bodylen < 0 || bodylen >= (int)sizeof(body))
+		bodylen = 0;
+	h->respflags = FLAG_HTML;
+	BuildResp2_upnphttp(h, respcode, respmsg, body, bodylen);
+	SendRespAndClose_upnphttp(h);
 }
 
 #ifdef HAS_DUMMY_SERVICE
@@ -499,6 +582,17 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 		/* the request body is received */
 		if(h->req_soapActionOff > 0)
 		{
+			/* check the client request rate before doing any work */
+#ifdef ENABLE_IPV6
+			if(h->ipv6 ? !ratelimit_check(RATELIMIT_SOAP, AF_INET6, &h->clientaddr_v6)
+			           : !ratelimit_check(RATELIMIT_SOAP, AF_INET, &h->clientaddr))
+#else
+			if(!ratelimit_check(RATELIMIT_SOAP, AF_INET, &h->clientaddr))
+#endif
+			{
+				SoapErrorRateLimited(h);
+				return;
+			}
 			/* we can process the request */
 			syslog(LOG_INFO, "SOAPAction: %.*s",
 			       h->req_soapActionLen, h->req_buf + h->req_soapActionOff);
@@ -690,8 +784,12 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 					syslog(LOG_DEBUG, "generated sid=%s", sid);
 					h->respflags |= FLAG_SID;
 					h->res_SID = sid;
+					BuildResp_upnphttp(h, 0, 0);
+				} else {
+					/* UDA : 5xx Unable to accept subscription */
+					h->respflags = 0;
+					BuildResp2_upnphttp(h, 503, "Service Unavailable", 0, 0);
 				}
-				BuildResp_upnphttp(h, 0, 0);
 			} else {
 				syslog(LOG_WARNING, "Invalid Callback in SUBSCRIBE %.*s",
 				       h->req_CallbackLen, h->req_buf + h->req_CallbackOff);
@@ -807,7 +905,6 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 	HttpVer[i] = '\0';
 	syslog(LOG_INFO, "HTTP REQUEST from %s : %s %s (%s)",
 	       h->clientaddr_str, HttpCommand, HttpUrl, HttpVer);
-	ParseHttpHeaders(h);
 	if(h->req_HostOff > 0 && h->req_HostLen > 0) {
 		syslog(LOG_DEBUG, "Host: %.*s", h->req_HostLen, h->req_buf + h->req_HostOff);
 		p = h->req_buf + h->req_HostOff;
@@ -914,170 +1011,129 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 }
 
 
-void
-Process_upnphttp(struct upnphttp * h)
+/* receive data at the end of h->req_buf
+ * The buffer grows geometrically and is kept NUL terminated.
+ * return the number of bytes received, 0 if no data is available yet,
+ * or -1 if the connection was closed or is in error */
+static int
+RecvData_upnphttp(struct upnphttp * h)
 {
-	char * h_tmp;
-	char buf[2048];
 	int n;
 
-	if(!h)
-		return;
-	switch(h->state)
+	if(h->req_buf_alloclen - h->req_buflen < 1024)
 	{
-	case EWaitingForHttpRequest:
-#ifdef ENABLE_HTTPS
-		if(h->ssl) {
-			n = SSL_read(h->ssl, buf, sizeof(buf));
-		} else {
-			n = recv(h->socket, buf, sizeof(buf), 0);
+		int newlen;
+		char * tmp;
+		newlen = (h->req_buf_alloclen > 0) ? (h->req_buf_alloclen * 2) : 2048;
+		/* if 1st arg of realloc() is null,
+		 * realloc behaves the same as malloc() */
+		tmp = (char *)realloc(h->req_buf, newlen);
+		if(tmp == NULL)
+		{
+			syslog(LOG_WARNING, "Unable to allocate new memory for h->req_buf)");
+			h->state = EToDelete;
+			return -1;
 		}
+		h->req_buf = tmp;
+		h->req_buf_alloclen = newlen;
+	}
+	/* keep room for the terminating NUL */
+#ifdef ENABLE_HTTPS
+	if(h->ssl) {
+		n = SSL_read(h->ssl, h->req_buf + h->req_buflen,
+		             h->req_buf_alloclen - h->req_buflen - 1);
+	} else {
+		n = recv(h->socket, h->req_buf + h->req_buflen,
+		         h->req_buf_alloclen - h->req_buflen - 1, 0);
+	}
 #else
-		n = recv(h->socket, buf, sizeof(buf), 0);
+	n = recv(h->socket, h->req_buf + h->req_buflen,
+	         h->req_buf_alloclen - h->req_buflen - 1, 0);
 #endif
-		if(n<0)
-		{
+	if(n<0)
+	{
 #ifdef ENABLE_HTTPS
-			if(h->ssl) {
-				int err;
-				err = SSL_get_error(h->ssl, n);
-				if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
-				{
-					syslog(LOG_ERR, "SSL_read() failed");
-					syslogsslerr();
-					h->state = EToDelete;
-				}
-			} else {
-#endif
-			if(errno != EAGAIN &&
-			   errno != EWOULDBLOCK &&
-			   errno != EINTR)
+		if(h->ssl) {
+			int err;
+			err = SSL_get_error(h->ssl, n);
+			if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
 			{
-				syslog(LOG_ERR, "recv (state0): %m");
+				syslog(LOG_ERR, "SSL_read() failed");
+				syslogsslerr();
 				h->state = EToDelete;
+				return -1;
 			}
-			/* if errno is EAGAIN, EWOULDBLOCK or EINTR, try again later */
-#ifdef ENABLE_HTTPS
-			}
+			h->ssl_want = err;
+		} else {
 #endif
-		}
-		else if(n==0)
+		if(errno != EAGAIN &&
+		   errno != EWOULDBLOCK &&
+		   errno != EINTR)
 		{
-#ifdef ENABLE_IPV6
-			if (h->ipv6)
-			{
-				char clientaddr_str[INET6_ADDRSTRLEN];
-				if(inet_ntop(AF_INET6, &(h->clientaddr_v6), clientaddr_str, INET6_ADDRSTRLEN) == NULL)
-					strncpy(clientaddr_str, "*inet_ntop error*", sizeof(clientaddr_str));
-				syslog(LOG_WARNING, "HTTP Connection from %s closed unexpectedly", clientaddr_str);
-			}
-			else
-#endif
-			{
-				syslog(LOG_WARNING, "HTTP Connection from %s closed unexpectedly", inet_ntoa(h->clientaddr));
-			}
+			syslog(LOG_ERR, "recv (state%d): %m", h->state);
 			h->state = EToDelete;
+			return -1;
 		}
-		else
-		{
-			const char * endheaders;
-			/* if 1st arg of realloc() is null,
-			 * realloc behaves the same as malloc() */
-			h_tmp = (char *)realloc(h->req_buf, n + h->req_buflen + 1);
-			if (h_tmp == NULL)
-			{
-				syslog(LOG_WARNING, "Unable to allocate new memory for h->req_buf)");
-				h->state = EToDelete;
-			}
-			else
-			{
-				h->req_buf = h_tmp;
-				memcpy(h->req_buf + h->req_buflen, buf, n);
-				h->req_buflen += n;
-				h->req_buf[h->req_buflen] = '\0';
-			}
-			/* search for the string "\r\n\r\n" */
-			endheaders = findendheaders(h->req_buf, h->req_buflen);
-			if(endheaders)
-			{
-				/* at this point, the request buffer (h->req_buf)
-				 * is guaranteed to contain the \r\n\r\n character sequence */
-				h->req_contentoff = endheaders - h->req_buf + 4;
-				ProcessHttpQuery_upnphttp(h);
-			}
-		}
-		break;
-	case EWaitingForHttpContent:
+		/* if errno is EAGAIN, EWOULDBLOCK or EINTR, try again later */
 #ifdef ENABLE_HTTPS
-		if(h->ssl) {
-			n = SSL_read(h->ssl, buf, sizeof(buf));
-		} else {
-			n = recv(h->socket, buf, sizeof(buf), 0);
 		}
-#else
-		n = recv(h->socket, buf, sizeof(buf), 0);
 #endif
-		if(n<0)
-		{
-#ifdef ENABLE_HTTPS
-			if(h->ssl) {
-				int err;
-				err = SSL_get_error(h->ssl, n);
-				if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
-				{
-					syslog(LOG_ERR, "SSL_read() failed");
-					syslogsslerr();
-					h->state = EToDelete;
-				}
-			} else {
-#endif
-			if(errno != EAGAIN &&
-			   errno != EWOULDBLOCK &&
-			   errno != EINTR)
-			{
-				syslog(LOG_ERR, "recv (state1): %m");
-				h->state = EToDelete;
-			}
-			/* if errno is EAGAIN, EWOULDBLOCK or EINTR, try again later */
+		return 0;
+	}
+	else if(n==0)
+	{
+		syslog(LOG_WARNING, "HTTP Connection from %s closed unexpectedly",
+		       h->clientaddr_str);
+		h->state = EToDelete;
+		return -1;
+	}
 #ifdef ENABLE_HTTPS
-			}
+	h->ssl_want = 0;
 #endif
-		}
-		else if(n==0)
+	h->req_buflen += n;
+	h->req_buf[h->req_buflen] = '\0';
+	return n;
+}
+
+void
+Process_upnphttp(struct upnphttp * h)
+{
+	if(!h)
+		return;
+	switch(h->state)
+	{
+	case EWaitingForHttpRequest:
+		if(RecvData_upnphttp(h) <= 0)
+			break;
+		switch(ParseHttpHeaders(h))
 		{
-#ifdef ENABLE_IPV6
-			if (h->ipv6)
-			{
-				char clientaddr_str[INET6_ADDRSTRLEN];
-				if(inet_ntop(AF_INET6, &(h->clientaddr_v6), clientaddr_str, INET6_ADDRSTRLEN) == NULL)
-					strncpy(clientaddr_str, "*inet_ntop error*", sizeof(clientaddr_str));
-				syslog(LOG_WARNING, "HTTP Connection from %s closed unexpectedly", clientaddr_str);
-			}
-			else
-#endif
-			{
-				syslog(LOG_WARNING, "HTTP Connection from %s closed unexpectedly", inet_ntoa(h->clientaddr));
-			}
-			h->state = EToDelete;
+		case 0:	/* waiting for the end of the headers */
+			break;
+		case 1:
+			/* at this point, the request buffer (h->req_buf)
+			 * is guaranteed to contain the \r\n\r\n character sequence */
+			ProcessHttpQuery_upnphttp(h);
+			break;
+		case 413:
+			syslog(LOG_NOTICE, "HTTP request from %s rejected : body too large",
+			       h->clientaddr_str);
+			SendError_upnphttp(h, 413, "Payload Too Large");
+			break;
+		case 431:
+			syslog(LOG_NOTICE, "HTTP request from %s rejected : headers larger than %u bytes",
+			       h->clientaddr_str, http_max_header_size);
+			SendError_upnphttp(h, 431, "Request Header Fields Too Large");
+			break;
+		default:
+			SendError_upnphttp(h, 400, "Bad Request");
 		}
-		else
+		break;
+	case EWaitingForHttpContent:
+		if(RecvData_upnphttp(h) <= 0)
+			break;
+		if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 		{
-			void * tmp = realloc(h->req_buf, n + h->req_buflen);
-			if(!tmp)
-			{
-				syslog(LOG_ERR, "memory allocation error %m");
-				h->state = EToDelete;
-			}
-			else
-			{
-				h->req_buf = tmp;
-				memcpy(h->req_buf + h->req_buflen, buf, n);
-				h->req_buflen += n;
-				if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
-				{
-					ProcessHTTPPOST_upnphttp(h);
-				}
-			}
+			ProcessHTTPPOST_upnphttp(h);
 		}
 		break;
 	case ESendingContinue:
@@ -1087,6 +1143,11 @@ Process_upnphttp(struct upnphttp * h)
 	case ESendingAndClosing:
 		SendRespAndClose_upnphttp(h);
 		break;
+#ifdef ENABLE_HTTPS
+	case ESSLHandshake:
+		SSLHandshake_upnphttp(h);
+		break;
+#endif /* ENABLE_HTTPS */
 	default:
 		syslog(LOG_WARNING, "Unexpected state: %d", h->state);
 	}
@@ -1261,6 +1322,7 @@ SendResp_upnphttp(struct upnphttp * h)
 				err = SSL_get_error(h->ssl, n);
 				if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
 					/* try again later */
+					h->ssl_want = err;
 					return 0;
 				}
 				syslog(LOG_ERR, "SSL_write() failed");
@@ -1290,6 +1352,9 @@ SendResp_upnphttp(struct upnphttp * h)
 		else
 		{
 			h->res_sent += n;
+#ifdef ENABLE_HTTPS
+			h->ssl_want = 0;
+#endif
 		}
 	}
 	return 1;	/* finished */
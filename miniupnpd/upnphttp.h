@@ -28,6 +28,8 @@
   0 - waiting for data to read
   1 - waiting for HTTP Post Content.
   ...
+  4 - TLS handshake in progress
+  ...
   >= 100 - to be deleted
 */
 enum httpStates {
@@ -35,6 +37,7 @@ enum httpStates {
 	EWaitingForHttpContent,
 	ESendingContinue,
 	ESendingAndClosing,
+	ESSLHandshake,
 	EToDelete = 100
 };
 
@@ -55,6 +58,7 @@ struct upnphttp {
 #endif /* ENABLE_IPV6 */
 #ifdef ENABLE_HTTPS
 	SSL * ssl;
+	int ssl_want;	/* SSL_ERROR_WANT_READ, SSL_ERROR_WANT_WRITE or 0 */
 #endif /* ENABLE_HTTPS */
 	char clientaddr_str[64];	/* used for syslog() output */
 	enum httpStates state;
@@ -63,6 +67,9 @@ struct upnphttp {
 	char * req_buf;
 	char accept_language[8];
 	int req_buflen;
+	int req_buf_alloclen;
+	int req_scanoff;	/* position where the header scan resumes */
+	int req_lineoff;	/* start of the current header line */
 	int req_contentlen;
 	int req_contentoff;     /* header length */
 	enum httpCommands req_command;
@@ -119,6 +126,9 @@ struct upnphttp *
 New_upnphttp(int);
 
 #ifdef ENABLE_HTTPS
+/* InitSSL_upnphttp()
+ * start the TLS handshake. It is continued by Process_upnphttp()
+ * in the ESSLHandshake state without blocking */
 void
 InitSSL_upnphttp(struct upnphttp *);
 #endif /* ENABLE_HTTPS */
@@ -502,6 +502,334 @@ match_permission_internal(const struct upnpperm * perm,
 }
 #endif
 
+/* Compiled permission rules.
+ *
+ * The IPv4 address space is split at the boundaries of the rules
+ * prefixes : within each interval (bucket) the set of rules matching the
+ * address is the same. The bucket of an address is found by a binary
+ * search. Each bucket holds the list of its rules, in the original order.
+ *
+ * For the buckets with up to PERM_MAX_PRECOMPUTED_RULES rules, the
+ * decision is precomputed : the internal ports are split in classes
+ * (again at the rules boundaries), and for each class the external ports
+ * are split in segments with the index of the rule deciding for the
+ * segment. The rules with a regex are not precomputed, the buckets
+ * containing some are checked rule by rule, and the regex is only
+ * executed if the ports and address match.
+ * A rule with a non contiguous mask (such as 255.0.0.255) is placed in
+ * the buckets of its leading prefix, which also hold addresses it does
+ * not match : these buckets are not precomputed either. */
+#define PERM_MAX_PRECOMPUTED_RULES	64
+
+struct perm_segment {
+	u_short eport_min;	/* up to the eport_min of the next segment - 1 */
+	int rule;	/* index of the deciding rule or -1 (accept by default) */
+};
+
+struct perm_iport_class {
+	u_short iport_min;	/* up to the iport_min of the next class - 1 */
+	unsigned int first_segment, n_segments;
+};
+
+struct perm_bucket {
+	uint32_t addr_min;	/* host order. up to the addr_min of the next bucket - 1 */
+	unsigned int first_rule, n_rules;
+	unsigned int first_class, n_classes;	/* n_classes = 0 : not precomputed */
+};
+
+static struct {
+	const struct upnpperm * permary;	/* NULL : nothing compiled */
+	int n_perms;
+	struct perm_bucket * buckets;
+	unsigned int n_buckets;
+	int * rules;	/* indexes in permary */
+	unsigned int n_rules;
+	struct perm_iport_class * classes;
+	unsigned int n_classes, alloc_classes;
+	struct perm_segment * segments;
+	unsigned int n_segments, alloc_segments;
+} compiled;
+
+static int
+compare_uint32(const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+compare_ushort(const void * a, const void * b)
+{
+	return (int)*(const u_short *)a - (int)*(const u_short *)b;
+}
+
+/* sort and remove duplicates, return the new count */
+static unsigned int
+sort_unique_ushort(u_short * v, unsigned int n)
+{
+	unsigned int i, j;
+	if(n == 0)
+		return 0;
+	qsort(v, n, sizeof(u_short), compare_ushort);
+	for(i = 1, j = 1; i < n; i++) {
+		if(v[i] != v[j - 1])
+			v[j++] = v[i];
+	}
+	return j;
+}
+
+/* return the leading ones of the mask (host order) */
+static uint32_t
+perm_prefix_mask(const struct upnpperm * perm)
+{
+	uint32_t x = ~ntohl(perm->mask.s_addr);
+	x |= x >> 1;
+	x |= x >> 2;
+	x |= x >> 4;
+	x |= x >> 8;
+	x |= x >> 16;
+	return ~x;
+}
+
+/* range of the addresses with the same prefix as the rule. it is
+ * a superset of the matching addresses if the mask is not contiguous */
+static void
+perm_range(const struct upnpperm * perm, uint32_t * first, uint32_t * last)
+{
+	uint32_t mask = perm_prefix_mask(perm);
+	*first = ntohl(perm->address.s_addr) & mask;
+	*last = *first | ~mask;
+}
+
+/* precompute the decision for the rules of the bucket */
+static int
+precompute_bucket(struct perm_bucket * bucket, const struct upnpperm * permary)
+{
+	u_short ibounds[2 * PERM_MAX_PRECOMPUTED_RULES + 1];
+	u_short ebounds[2 * PERM_MAX_PRECOMPUTED_RULES + 1];
+	unsigned int n_ibounds, n_ebounds;
+	unsigned int i, j, k;
+	const int * rules = compiled.rules + bucket->first_rule;
+	const struct upnpperm * perm;
+	u_short iport, eport;
+	int rule;
+
+	/* class boundaries */
+	n_ibounds = 0;
+	ibounds[n_ibounds++] = 0;
+	for(i = 0; i < bucket->n_rules; i++) {
+		perm = permary + rules[i];
+		if(perm->re || perm_prefix_mask(perm) != ntohl(perm->mask.s_addr))
+			return 0;	/* cannot be precomputed */
+		ibounds[n_ibounds++] = perm->iport_min;
+		if(perm->iport_max < 65535)
+			ibounds[n_ibounds++] = perm->iport_max + 1;
+	}
+	n_ibounds = sort_unique_ushort(ibounds, n_ibounds);
+	if(compiled.n_classes + n_ibounds > compiled.alloc_classes) {
+		void * tmp;
+		unsigned int alloc = compiled.alloc_classes * 2 + n_ibounds;
+		tmp = realloc(compiled.classes, alloc * sizeof(struct perm_iport_class));
+		if(tmp == NULL)
+			return -1;
+		compiled.classes = tmp;
+		compiled.alloc_classes = alloc;
+	}
+	bucket->first_class = compiled.n_classes;
+	for(i = 0; i < n_ibounds; i++) {
+		struct perm_iport_class * class = compiled.classes + compiled.n_classes++;
+		iport = ibounds[i];
+		class->iport_min = iport;
+		/* segment boundaries for the rules matching this class */
+		n_ebounds = 0;
+		ebounds[n_ebounds++] = 0;
+		for(j = 0; j < bucket->n_rules; j++) {
+			perm = permary + rules[j];
+			if(iport < perm->iport_min || perm->iport_max < iport)
+				continue;
+			ebounds[n_ebounds++] = perm->eport_min;
+			if(perm->eport_max < 65535)
+				ebounds[n_ebounds++] = perm->eport_max + 1;
+		}
+		n_ebounds = sort_unique_ushort(ebounds, n_ebounds);
+		if(compiled.n_segments + n_ebounds > compiled.alloc_segments) {
+			void * tmp;
+			unsigned int alloc = compiled.alloc_segments * 2 + n_ebounds;
+			tmp = realloc(compiled.segments, alloc * sizeof(struct perm_segment));
+			if(tmp == NULL)
+				return -1;
+			compiled.segments = tmp;
+			compiled.alloc_segments = alloc;
+		}
+		class->first_segment = compiled.n_segments;
+		class->n_segments = 0;
+		for(j = 0; j < n_ebounds; j++) {
+			eport = ebounds[j];
+			rule = -1;
+			for(k = 0; k < bucket->n_rules; k++) {
+				perm = permary + rules[k];
+				if(iport >= perm->iport_min && perm->iport_max >= iport
+				   && eport >= perm->eport_min && perm->eport_max >= eport) {
+					rule = rules[k];
+					break;
+				}
+			}
+			/* merge with the previous segment when the same rule decides */
+			if(class->n_segments > 0
+			   && compiled.segments[compiled.n_segments - 1].rule == rule)
+				continue;
+			compiled.segments[compiled.n_segments].eport_min = eport;
+			compiled.segments[compiled.n_segments].rule = rule;
+			compiled.n_segments++;
+			class->n_segments++;
+		}
+	}
+	bucket->n_classes = n_ibounds;
+	return 0;
+}
+
+void
+free_compiled_permissions(void)
+{
+	free(compiled.buckets);
+	free(compiled.rules);
+	free(compiled.classes);
+	free(compiled.segments);
+	memset(&compiled, 0, sizeof(compiled));
+}
+
+int
+compile_permissions(const struct upnpperm * permary, int n_perms)
+{
+	uint32_t * bounds;
+	unsigned int n_bounds;
+	uint32_t first, last;
+	unsigned int i, j, k;
+	int r;
+
+	free_compiled_permissions();
+	if(n_perms <= 0)
+		return 0;
+	bounds = malloc((2 * (size_t)n_perms + 1) * sizeof(uint32_t));
+	if(bounds == NULL)
+		goto error;
+	n_bounds = 0;
+	bounds[n_bounds++] = 0;
+	for(r = 0; r < n_perms; r++) {
+		perm_range(permary + r, &first, &last);
+		bounds[n_bounds++] = first;
+		if(last != 0xffffffff)
+			bounds[n_bounds++] = last + 1;
+	}
+	qsort(bounds, n_bounds, sizeof(uint32_t), compare_uint32);
+	for(i = 1, j = 1; i < n_bounds; i++) {
+		if(bounds[i] != bounds[j - 1])
+			bounds[j++] = bounds[i];
+	}
+	n_bounds = j;
+
+	compiled.buckets = calloc(n_bounds, sizeof(struct perm_bucket));
+	if(compiled.buckets == NULL) {
+		free(bounds);
+		goto error;
+	}
+	compiled.n_buckets = n_bounds;
+	/* first pass : count the rules of each bucket */
+	for(i = 0; i < n_bounds; i++) {
+		compiled.buckets[i].addr_min = bounds[i];
+		compiled.buckets[i].first_rule = compiled.n_rules;
+		for(r = 0; r < n_perms; r++) {
+			perm_range(permary + r, &first, &last);
+			if(first <= bounds[i] && bounds[i] <= last)
+				compiled.buckets[i].n_rules++;
+		}
+		compiled.n_rules += compiled.buckets[i].n_rules;
+	}
+	free(bounds);
+	compiled.rules = malloc((compiled.n_rules + 1) * sizeof(int));
+	if(compiled.rules == NULL)
+		goto error;
+	/* second pass : fill the rule lists */
+	for(i = 0, k = 0; i < compiled.n_buckets; i++) {
+		for(r = 0; r < n_perms; r++) {
+			perm_range(permary + r, &first, &last);
+			if(first <= compiled.buckets[i].addr_min
+			   && compiled.buckets[i].addr_min <= last)
+				compiled.rules[k++] = r;
+		}
+		if(compiled.buckets[i].n_rules <= PERM_MAX_PRECOMPUTED_RULES) {
+			if(precompute_bucket(compiled.buckets + i, permary) < 0)
+				goto error;
+		}
+	}
+	compiled.permary = permary;
+	compiled.n_perms = n_perms;
+	syslog(LOG_DEBUG, "%d permission rules compiled : %u buckets, %u segments",
+	       n_perms, compiled.n_buckets, compiled.n_segments);
+	return 0;
+error:
+	syslog(LOG_ERR, "compile_permissions(): memory allocation error");
+	free_compiled_permissions();
+	return -1;
+}
+
+static const struct perm_bucket *
+find_bucket(const struct upnpperm * permary, int n_perms, struct in_addr address)
+{
+	uint32_t addr;
+	unsigned int lo, hi, mid;
+
+	if(compiled.permary == NULL || compiled.permary != permary
+	   || compiled.n_perms != n_perms)
+		return NULL;
+	addr = ntohl(address.s_addr);
+	/* last bucket with addr_min <= addr. buckets[0].addr_min is 0 */
+	lo = 0;
+	hi = compiled.n_buckets;
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if(compiled.buckets[mid].addr_min <= addr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return compiled.buckets + lo;
+}
+
+static const struct perm_iport_class *
+find_class(const struct perm_bucket * bucket, u_short iport)
+{
+	const struct perm_iport_class * classes = compiled.classes + bucket->first_class;
+	unsigned int lo = 0, hi = bucket->n_classes, mid;
+
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if(classes[mid].iport_min <= iport)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return classes + lo;
+}
+
+/* return the index of the deciding rule or -1 */
+static int
+find_segment_rule(const struct perm_iport_class * class, u_short eport)
+{
+	const struct perm_segment * segments = compiled.segments + class->first_segment;
+	unsigned int lo = 0, hi = class->n_segments, mid;
+
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if(segments[mid].eport_min <= eport)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return segments[lo].rule;
+}
+
 int
 check_upnp_rule_against_permissions(const struct upnpperm * permary,
                                     int n_perms,
@@ -509,7 +837,33 @@ check_upnp_rule_against_permissions(const struct upnpperm * permary,
                                     u_short iport, const char * desc)
 {
 	int i;
-	for(i=0; i<n_perms; i++)
+	const struct perm_bucket * bucket;
+
+	bucket = find_bucket(permary, n_perms, address);
+	if(bucket != NULL && bucket->n_classes > 0) {
+		i = find_segment_rule(find_class(bucket, iport), eport);
+		if(i >= 0) {
+			syslog(LOG_DEBUG,
+			       "UPnP permission rule %d matched : port mapping %s",
+			       i, (permary[i].type == UPNPPERM_ALLOW)?"accepted":"rejected"
+			       );
+			return (permary[i].type == UPNPPERM_ALLOW);
+		}
+	} else if(bucket != NULL) {
+		unsigned int j;
+		for(j = 0; j < bucket->n_rules; j++)
+		{
+			i = compiled.rules[bucket->first_rule + j];
+			if(match_permission(permary + i, eport, address, iport, desc))
+			{
+				syslog(LOG_DEBUG,
+				       "UPnP permission rule %d matched : port mapping %s",
+				       i, (permary[i].type == UPNPPERM_ALLOW)?"accepted":"rejected"
+				       );
+				return (permary[i].type == UPNPPERM_ALLOW);
+			}
+		}
+	} else for(i=0; i<n_perms; i++)
 	{
 		if(match_permission(permary + i, eport, address, iport, desc))
 		{
@@ -524,16 +878,75 @@ check_upnp_rule_against_permissions(const struct upnpperm * permary,
 	return 1;	/* Default : accept */
 }
 
+/* set or clear the bits first to last */
+static void
+set_ports(uint32_t * allowed, unsigned int first, unsigned int last, int allow)
+{
+	unsigned int j;
+
+	for (j = first; j <= last; )
+	{
+		if ((j % 32) == 0 && last >= (j + 31))
+		{
+			/* 32bits at once */
+			allowed[j / 32] = allow ? 0xffffffff : 0;
+			j += 32;
+		}
+		else
+		{
+			/* one bit at once */
+			if (allow)
+				allowed[j / 32] |= (1U << (j % 32));
+			else
+				allowed[j / 32] &= ~(1U << (j % 32));
+			j++;
+		}
+	}
+}
+
 void
 get_permitted_ext_ports(uint32_t * allowed,
                         const struct upnpperm * permary, int n_perms,
                         in_addr_t addr, u_short iport)
 {
-	int i, j;
+	int i;
+	struct in_addr address;
+	const struct perm_bucket * bucket;
+
+	address.s_addr = addr;
+	bucket = find_bucket(permary, n_perms, address);
+	if(bucket != NULL && bucket->n_classes > 0) {
+		const struct perm_iport_class * class = find_class(bucket, iport);
+		const struct perm_segment * seg = compiled.segments + class->first_segment;
+		unsigned int j, last;
+
+		for(j = 0; j < class->n_segments; j++) {
+			last = (j + 1 < class->n_segments) ? seg[j + 1].eport_min - 1u : 65535u;
+			set_ports(allowed, seg[j].eport_min, last,
+			          seg[j].rule < 0 || permary[seg[j].rule].type == UPNPPERM_ALLOW);
+		}
+		return;
+	}
 
 	/* build allowed external ports array */
 	memset(allowed, 0xff, 65536 / 8);	/* everything allowed by default */
 
+	if(bucket != NULL) {
+		unsigned int j;
+		/* only the rules of the bucket can match the address.
+		 * With a non contiguous mask, they may still not match */
+		for(j = bucket->n_rules; j > 0; j--) {
+			i = compiled.rules[bucket->first_rule + j - 1];
+			if( (addr & permary[i].mask.s_addr)
+			  != (permary[i].address.s_addr & permary[i].mask.s_addr) )
+				continue;
+			if( (iport < permary[i].iport_min) || (permary[i].iport_max < iport))
+				continue;
+			set_ports(allowed, permary[i].eport_min, permary[i].eport_max,
+			          permary[i].type == UPNPPERM_ALLOW);
+		}
+		return;
+	}
 	for (i = n_perms - 1; i >= 0; i--)
 	{
 		if( (addr & permary[i].mask.s_addr)
@@ -541,27 +954,7 @@ get_permitted_ext_ports(uint32_t * allowed,
 			continue;
 		if( (iport < permary[i].iport_min) || (permary[i].iport_max < iport))
 			continue;
-		for (j = (int)permary[i].eport_min ; j <= (int)permary[i].eport_max; )
-		{
-			if ((j % 32) == 0 && ((int)permary[i].eport_max >= (j + 31)))
-			{
-				/* 32bits at once */
-				allowed[j / 32] = (permary[i].type == UPNPPERM_ALLOW) ? 0xffffffff : 0;
-				j += 32;
-			}
-			else
-			{
-				do
-				{
-					/* one bit at once */
-					if (permary[i].type == UPNPPERM_ALLOW)
-						allowed[j / 32] |= (1 << (j % 32));
-					else
-						allowed[j / 32] &= ~(1 << (j % 32));
-					j++;
-				}
-				while ((j % 32) != 0 && (j <= (int)permary[i].eport_max));
-			}
-		}
+		set_ports(allowed, permary[i].eport_min, permary[i].eport_max,
+		          permary[i].type == UPNPPERM_ALLOW);
 	}
 }
@@ -65,6 +65,19 @@ get_permitted_ext_ports(uint32_t * allowed,
                         const struct upnpperm * permary, int n_perms,
                         in_addr_t addr, u_short iport);
 
+/* compile_permissions()
+ * build the structures used to speed up
+ * check_upnp_rule_against_permissions() and get_permitted_ext_ports()
+ * for this array of permission rules. The rules must not be modified
+ * after that.
+ * returns: 0 on success, -1 on memory allocation error (the rules are
+ *          then checked one by one) */
+int
+compile_permissions(const struct upnpperm * permary, int n_perms);
+
+void
+free_compiled_permissions(void);
+
 #ifdef USE_MINIUPNPDCTL
 void
 write_permlist(int fd, const struct upnpperm * permary,
@@ -26,6 +26,9 @@
 #include "upnpevents.h"
 #include "portinuse.h"
 #include "upnputils.h"
+#ifdef ENABLE_PCP
+#include "pcpserver.h"
+#endif /* ENABLE_PCP */
 #if defined(USE_NETFILTER)
 #include "netfilter/iptcrdr.h"
 #endif
@@ -284,6 +287,285 @@ void lease_file_rewrite(void)
 #endif
 #endif
 
+/* Mapping quotas
+ * The number of port mappings held by each internal client is kept in
+ * a hash table, so the per client and global limits can be checked
+ * without walking the ruleset. A second hash table records the client
+ * owning each (eport, proto) pair, so deletions, which only know
+ * the external port, can be accounted for too. The remote host is not
+ * part of this key.
+ * The number of entries of this table, plus the number of rules which
+ * could not be accounted for (not an IPv4 internal address, out of
+ * memory), is the number of port mappings returned by
+ * upnp_get_portmapping_number_of_entries(). It is checked against the
+ * ruleset by get_upnp_rules_state_list(), which reconciles the table
+ * with the ruleset rule by rule when they differ. */
+#define QUOTA_CLIENT_HASH_SIZE	(256)
+#define QUOTA_MAPPING_HASH_SIZE	(1024)
+
+struct quota_client {
+	struct quota_client * next;
+	struct in_addr addr;
+	unsigned int count;
+};
+
+struct quota_mapping {
+	struct quota_mapping * next;
+	struct quota_client * client;
+	unsigned short eport;
+	short proto;
+	int seen;	/* used by quota_resync() */
+};
+
+static struct quota_client * quota_clients[QUOTA_CLIENT_HASH_SIZE];
+static struct quota_mapping * quota_mappings[QUOTA_MAPPING_HASH_SIZE];
+static unsigned int quota_mapping_count = 0;
+static unsigned int quota_skipped_count = 0;
+
+static unsigned int
+quota_client_hash(struct in_addr addr)
+{
+	unsigned int h = ntohl(addr.s_addr);
+	return (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) % QUOTA_CLIENT_HASH_SIZE;
+}
+
+static struct quota_client *
+quota_get_client(struct in_addr addr, int create)
+{
+	struct quota_client * c;
+	unsigned int h;
+
+	h = quota_client_hash(addr);
+	for(c = quota_clients[h]; c != NULL; c = c->next) {
+		if(c->addr.s_addr == addr.s_addr)
+			return c;
+	}
+	if(!create)
+		return NULL;
+	c = malloc(sizeof(struct quota_client));
+	if(c == NULL) {
+		syslog(LOG_ERR, "%s: malloc() failed", "quota_get_client");
+		return NULL;
+	}
+	c->addr = addr;
+	c->count = 0;
+	c->next = quota_clients[h];
+	quota_clients[h] = c;
+	return c;
+}
+
+/* decrement the client mapping count and free it once it reaches 0 */
+static void
+quota_release_client(struct quota_client * c)
+{
+	struct quota_client * * p;
+
+	if(--c->count > 0)
+		return;
+	for(p = &quota_clients[quota_client_hash(c->addr)]; *p != NULL; p = &(*p)->next) {
+		if(*p == c) {
+			*p = c->next;
+			free(c);
+			return;
+		}
+	}
+}
+
+static struct quota_mapping * *
+quota_find_mapping(unsigned short eport, int proto)
+{
+	struct quota_mapping * * p;
+	unsigned int h = ((unsigned int)eport * 3 + (unsigned int)proto) % QUOTA_MAPPING_HASH_SIZE;
+
+	for(p = &quota_mappings[h]; *p != NULL; p = &(*p)->next) {
+		if((*p)->eport == eport && (*p)->proto == proto)
+			break;
+	}
+	return p;	/* points to the NULL terminating the chain if not found */
+}
+
+/* return 1 if iaddr may hold one more port mapping, 0 otherwise.
+ * The (eport, proto) mapping already held by iaddr is not counted */
+static int
+quota_check(struct in_addr iaddr, unsigned short eport, int proto)
+{
+	struct quota_mapping * m;
+	struct quota_client * c;
+
+	if(max_mappings == 0 && max_mappings_per_client == 0)
+		return 1;
+	m = *quota_find_mapping(eport, proto);
+	if(m != NULL && m->client->addr.s_addr == iaddr.s_addr)
+		return 1;	/* replacing its own mapping */
+	if(max_mappings > 0 && quota_mapping_count >= max_mappings) {
+		syslog(LOG_NOTICE, "maximum number of port mappings (%u) reached",
+		       max_mappings);
+		return 0;
+	}
+	c = quota_get_client(iaddr, 0);
+	if(max_mappings_per_client > 0 && c != NULL &&
+	   c->count >= max_mappings_per_client) {
+		syslog(LOG_NOTICE, "%s holds the maximum number of port mappings (%u)",
+		       inet_ntoa(iaddr), max_mappings_per_client);
+		return 0;
+	}
+	return 1;
+}
+
+/* return 0 on success, -1 if the mapping could not be accounted for */
+static int
+quota_add(const char * iaddr, unsigned short eport, int proto)
+{
+	struct quota_mapping * * p;
+	struct quota_mapping * m;
+	struct in_addr addr;
+
+	if(inet_pton(AF_INET, iaddr, &addr) <= 0)
+		return -1;
+	p = quota_find_mapping(eport, proto);
+	if(*p != NULL) {
+		/* the mapping was replaced without being deleted */
+		if((*p)->client->addr.s_addr == addr.s_addr)
+			return 0;
+		m = *p;
+		quota_release_client(m->client);
+	} else {
+		m = malloc(sizeof(struct quota_mapping));
+		if(m == NULL) {
+			syslog(LOG_ERR, "%s: malloc() failed", "quota_add");
+			return -1;
+		}
+		m->eport = eport;
+		m->proto = (short)proto;
+		m->seen = 0;
+		m->next = NULL;
+		*p = m;
+		quota_mapping_count++;
+	}
+	m->client = quota_get_client(addr, 1);
+	if(m->client == NULL) {
+		*p = m->next;
+		free(m);
+		quota_mapping_count--;
+		return -1;
+	}
+	m->client->count++;
+	return 0;
+}
+
+static void
+quota_remove(unsigned short eport, int proto)
+{
+	struct quota_mapping * * p;
+	struct quota_mapping * m;
+
+	p = quota_find_mapping(eport, proto);
+	m = *p;
+	if(m == NULL)
+		return;
+	*p = m->next;
+	quota_release_client(m->client);
+	quota_mapping_count--;
+	free(m);
+}
+
+/* bring the quota table in line with the ruleset. The mappings
+ * which did not change are left untouched, so is their PCP nonce */
+static void
+quota_resync(void)
+{
+	int index, i;
+	unsigned short eport, iport;
+	int proto;
+	char iaddr[32];
+	char desc[64];
+	unsigned int timestamp;
+	struct in_addr addr;
+	struct quota_mapping * * p;
+	struct quota_mapping * m;
+
+	for(i = 0; i < QUOTA_MAPPING_HASH_SIZE; i++) {
+		for(m = quota_mappings[i]; m != NULL; m = m->next)
+			m->seen = 0;
+	}
+	quota_skipped_count = 0;
+	for(index = 0; ; index++) {
+		if(get_redirect_rule_by_index(index, 0/*ifname*/, &eport, iaddr, sizeof(iaddr),
+		                              &iport, &proto, desc, sizeof(desc), 0, 0,
+		                              &timestamp, 0, 0) < 0)
+			break;
+		m = *quota_find_mapping(eport, proto);
+		if(m != NULL && m->seen) {
+			/* same external port and protocol as a previous rule */
+			quota_skipped_count++;
+			continue;
+		}
+		if(m != NULL && inet_pton(AF_INET, iaddr, &addr) > 0 &&
+		   m->client->addr.s_addr == addr.s_addr) {
+			m->seen = 1;	/* unchanged */
+			continue;
+		}
+		if(quota_add(iaddr, eport, proto) < 0) {
+			quota_skipped_count++;
+		} else {
+			(*quota_find_mapping(eport, proto))->seen = 1;
+		}
+#ifdef ENABLE_PCP
+		PCPMappingAdded(eport, iaddr, iport, proto, desc, timestamp);
+#endif /* ENABLE_PCP */
+	}
+	/* remove the mappings which are not in the ruleset anymore */
+	for(i = 0; i < QUOTA_MAPPING_HASH_SIZE; i++) {
+		p = &quota_mappings[i];
+		while((m = *p) != NULL) {
+			if(m->seen) {
+				p = &m->next;
+				continue;
+			}
+			*p = m->next;
+#ifdef ENABLE_PCP
+			PCPMappingRemoved(m->eport, m->proto);
+#endif /* ENABLE_PCP */
+			quota_release_client(m->client);
+			quota_mapping_count--;
+			free(m);
+		}
+	}
+}
+
+void
+init_mapping_quotas(void)
+{
+	/* account for the port mappings already present */
+	quota_resync();
+}
+
+void
+free_mapping_quotas(void)
+{
+	int i;
+	struct quota_mapping * m;
+	struct quota_client * c;
+
+	for(i = 0; i < QUOTA_MAPPING_HASH_SIZE; i++) {
+		while((m = quota_mappings[i]) != NULL) {
+			quota_mappings[i] = m->next;
+			free(m);
+		}
+	}
+	for(i = 0; i < QUOTA_CLIENT_HASH_SIZE; i++) {
+		while((c = quota_clients[i]) != NULL) {
+			quota_clients[i] = c->next;
+			free(c);
+		}
+	}
+	quota_mapping_count = 0;
+	quota_skipped_count = 0;
+#ifdef ENABLE_PCP
+	PCPFreeMappings();
+#endif /* ENABLE_PCP */
+}
+
 /* upnp_redirect()
  * calls OS/fw dependent implementation of the redirection.
  * protocol should be the string "TCP" or "UDP"
@@ -292,6 +574,7 @@ void lease_file_rewrite(void)
  *          -2 already redirected
  *          -3 permission check failed
  *          -4 already redirected (other mechanism)
+ *          -5 port mapping quota exceeded
  */
 int
 upnp_redirect(const char * rhost, unsigned short eport,
@@ -319,6 +602,13 @@ upnp_redirect(const char * rhost, unsigned short eport,
 		return -3;
 	}
 
+	/* checked before any access to the firewall */
+	if(!quota_check(address, eport, proto)) {
+		syslog(LOG_INFO, "port mapping quota exceeded for "
+		                 "%hu->%s:%hu %s %s", eport, iaddr, iport, protocol, desc);
+		return -5;
+	}
+
 	if (desc == NULL)
 		desc = "";	/* assume empty description */
 
@@ -377,6 +667,10 @@ upnp_redirect(const char * rhost, unsigned short eport,
 				lease_file_add(eport, iaddr, iport, proto, desc, timestamp);
 			}
 #endif /* ENABLE_LEASEFILE */
+#ifdef ENABLE_PCP
+			if(r == 0)
+				PCPMappingAdded(eport, iaddr, iport, proto, desc, timestamp);
+#endif /* ENABLE_PCP */
 			return r;
 		} else {
 			syslog(LOG_INFO, "port %hu %s (rhost '%s') already redirected to %s:%hu",
@@ -406,8 +700,13 @@ upnp_redirect_internal(const char * rhost, unsigned short eport,
 {
 	/*syslog(LOG_INFO, "redirecting port %hu to %s:%hu protocol %s for: %s",
 		eport, iaddr, iport, protocol, desc);			*/
+	struct in_addr address;
+
 	if(disable_port_forwarding)
 		return -1;
+	if(inet_pton(AF_INET, iaddr, &address) > 0 &&
+	   !quota_check(address, eport, proto))
+		return -5;
 	if(add_redirect_rule2(ext_if_name, rhost, eport, iaddr, iport, proto,
 	                      desc, timestamp) < 0) {
 		return -1;
@@ -429,6 +728,11 @@ upnp_redirect_internal(const char * rhost, unsigned short eport,
 		if(!nextruletoclean_timestamp || (timestamp < nextruletoclean_timestamp))
 			nextruletoclean_timestamp = timestamp;
 	}
+	if(quota_add(iaddr, eport, proto) < 0)
+		quota_skipped_count++;
+#ifdef ENABLE_PCP
+	PCPMappingAdded(eport, iaddr, iport, proto, desc, timestamp);
+#endif /* ENABLE_PCP */
 #ifdef ENABLE_EVENTS
 	/* the number of port mappings changed, we must
 	 * inform the subscribers */
@@ -527,6 +831,15 @@ _upnp_delete_redir(unsigned short eport, int proto)
 #ifdef ENABLE_LEASEFILE
 	lease_file_remove( eport, proto);
 #endif
+	if(r >= 0) {
+		quota_remove(eport, proto);
+#ifdef ENABLE_PCP
+		PCPMappingRemoved(eport, proto);
+#endif /* ENABLE_PCP */
+		/* the deleted rule may be one quota_add() skipped : count again */
+		if(quota_skipped_count > 0)
+			quota_resync();
+	}
 
 #ifdef ENABLE_EVENTS
 	upnp_event_var_change_notify(EWanIPC);
@@ -541,28 +854,13 @@ upnp_delete_redirection(unsigned short eport, const char * protocol)
 	return _upnp_delete_redir(eport, proto_atoi(protocol));
 }
 
-/* upnp_get_portmapping_number_of_entries() */
+/* upnp_get_portmapping_number_of_entries()
+ * maintained by quota_add() and quota_remove(), the ruleset
+ * is not read */
 int
 upnp_get_portmapping_number_of_entries(void)
 {
-#if defined(USE_PF) || defined(USE_NFTABLES)
-	return get_redirect_rule_count(ext_if_name);
-#else
-	int n = 0, r = 0;
-	unsigned short eport, iport;
-	char protocol[8], iaddr[32], desc[64], rhost[32];
-	unsigned int leaseduration;
-	do {
-		protocol[0] = '\0'; iaddr[0] = '\0'; desc[0] = '\0';
-		r = upnp_get_redirection_infos_by_index(n, &eport, protocol, &iport,
-		                                        iaddr, sizeof(iaddr),
-		                                        desc, sizeof(desc),
-		                                        rhost, sizeof(rhost),
-		                                        &leaseduration);
-		n++;
-	} while(r==0);
-	return (n-1);
-#endif
+	return (int)(quota_mapping_count + quota_skipped_count);
 }
 
 /* functions used to remove unused rules
@@ -609,6 +907,12 @@ get_upnp_rules_state_list(int max_rules_number_target)
 		if(!tmp)
 			break;
 	}
+	/* the rules may have been modified by something else than us */
+	if(tmp != NULL && (unsigned int)i != quota_mapping_count + quota_skipped_count) {
+		syslog(LOG_NOTICE, "%d port mappings in the ruleset, %u expected. resync",
+		       i, quota_mapping_count + quota_skipped_count);
+		quota_resync();
+	}
 #ifdef PCP_PEER
 	i=0;
 	while(get_peer_rule_by_index(i, /*ifname*/0, &tmp->eport, 0, 0,
@@ -749,4 +1053,25 @@ write_ruleset_details(int s)
 		i++;
 	}
 }
+
+void
+write_mapping_quotas(int s)
+{
+	struct quota_client * c;
+	int i;
+	char buffer[128];
+	int n;
+
+	n = snprintf(buffer, sizeof(buffer),
+	             "Mapping quotas : %u/%u total, %u per client\n",
+	             quota_mapping_count, max_mappings, max_mappings_per_client);
+	write(s, buffer, n);
+	for(i = 0; i < QUOTA_CLIENT_HASH_SIZE; i++) {
+		for(c = quota_clients[i]; c != NULL; c = c->next) {
+			n = snprintf(buffer, sizeof(buffer), " %s %u\n",
+			             inet_ntoa(c->addr), c->count);
+			write(s, buffer, n);
+		}
+	}
+}
 #endif
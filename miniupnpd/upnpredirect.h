@@ -21,6 +21,16 @@ void lease_file_rewrite(void);
 #endif
 #endif
 
+/* init_mapping_quotas()
+ * account for the port mappings present at startup
+ * in the per client mapping counters */
+void
+init_mapping_quotas(void);
+
+/* free_mapping_quotas() */
+void
+free_mapping_quotas(void);
+
 /* upnp_redirect()
  * calls OS/fw dependent implementation of the redirection.
  * protocol should be the string "TCP" or "UDP"
@@ -28,6 +38,8 @@ void lease_file_rewrite(void);
  *          -1 failed to redirect
  *          -2 already redirected
  *          -3 permission check failed
+ *          -4 already redirected (other mechanism)
+ *          -5 port mapping quota exceeded
  */
 int
 upnp_redirect(const char * rhost, unsigned short eport,
@@ -36,7 +48,8 @@ upnp_redirect(const char * rhost, unsigned short eport,
               unsigned int leaseduration);
 
 /* upnp_redirect_internal()
- * same as upnp_redirect() without any check */
+ * same as upnp_redirect() without any check except the
+ * mapping quotas (returns -5 if exceeded) */
 int
 upnp_redirect_internal(const char * rhost, unsigned short eport,
                        const char * iaddr, unsigned short iport,
@@ -116,6 +129,9 @@ upnp_get_portmappings_in_range(unsigned short startport,
 #ifdef USE_MINIUPNPDCTL
 void
 write_ruleset_details(int s);
+
+void
+write_mapping_quotas(int s);
 #endif
 
 #endif
@@ -166,6 +166,175 @@ GetValueFromNameValueList(struct NameValueParserData * pdata,
     return p;
 }
 
+/* state of the zero-copy parser */
+struct NameValueSliceParser {
+	struct NameValueSlices * slices;
+	/* current element name, pointing inside the parsed buffer */
+	const char * curelt;
+	int curelt_len;
+	int topelt;
+	const char * cdata;
+	int cdatalen;
+};
+
+/* FNV-1a hash of the argument name */
+static unsigned int
+NameValueHash(const char * name, int len, unsigned int seed)
+{
+	unsigned int h = 2166136261U ^ seed;
+	while(len-- > 0)
+	{
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return (h ^ (h >> 16)) & (NAMEVALUE_HASH_SIZE - 1);
+}
+
+/* look for a seed without collision between the argument names */
+static int
+BuildNameValueArgs(struct NameValueArgs * args)
+{
+	unsigned int seed;
+	unsigned int i;
+	size_t l;
+
+	for(i = 0; args->names[i] != NULL; i++)
+	{
+		if(i >= NAMEVALUE_MAX_ARGS)
+			return -1;
+		l = strlen(args->names[i]);
+		if(l > 255)
+			return -1;
+		args->namelen[i] = (unsigned char)l;
+	}
+	args->count = (unsigned char)i;
+	for(seed = 1; seed < 65536; seed++)
+	{
+		memset(args->slots, 0, sizeof(args->slots));
+		for(i = 0; i < args->count; i++)
+		{
+			unsigned int slot = NameValueHash(args->names[i], args->namelen[i], seed);
+			if(args->slots[slot] != 0)
+				break;	/* collision */
+			args->slots[slot] = (unsigned char)(i + 1);
+		}
+		if(i == args->count)
+		{
+			args->seed = seed;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* return the index of the argument, or -1 */
+static int
+NameValueArgIndex(const struct NameValueArgs * args, const char * name, int len)
+{
+	int i = args->slots[NameValueHash(name, len, args->seed)] - 1;
+	if(i < 0 || args->namelen[i] != len
+	   || memcmp(args->names[i], name, len) != 0)
+		return -1;
+	return i;
+}
+
+static void
+NameValueSliceStartElt(void * d, const char * name, int l)
+{
+	struct NameValueSliceParser * p = (struct NameValueSliceParser *)d;
+	p->topelt = 1;
+	p->curelt = name;
+	p->curelt_len = l;
+	p->cdata = NULL;
+	p->cdatalen = 0;
+}
+
+static void
+NameValueSliceEndElt(void * d, const char * name, int namelen)
+{
+	struct NameValueSliceParser * p = (struct NameValueSliceParser *)d;
+	struct NameValueSlices * slices = p->slices;
+	int i;
+	(void)name;
+	(void)namelen;
+	if(!p->topelt)
+		return;
+	i = NameValueArgIndex(slices->args, p->curelt, p->curelt_len);
+	if(i >= 0)
+	{
+		if(p->cdata != NULL)
+		{
+			slices->off[i] = p->cdata - slices->buffer;
+			slices->len[i] = p->cdatalen;
+		}
+		else
+		{
+			/* empty value : the character following the element name
+			 * in the start tag will be overwritten by the terminating NUL */
+			slices->off[i] = p->curelt + p->curelt_len - slices->buffer;
+			slices->len[i] = 0;
+		}
+	}
+	p->cdata = NULL;
+	p->cdatalen = 0;
+	p->topelt = 0;
+}
+
+static void
+NameValueSliceGetData(void * d, const char * datas, int l)
+{
+	struct NameValueSliceParser * p = (struct NameValueSliceParser *)d;
+	p->cdata = datas;
+	p->cdatalen = l;
+}
+
+int
+ParseNameValueSlices(char * buffer, int bufsize,
+                     struct NameValueArgs * args,
+                     struct NameValueSlices * data)
+{
+	struct xmlparser parser;
+	struct NameValueSliceParser p;
+	int i;
+
+	data->buffer = buffer;
+	data->args = args;
+	for(i = 0; i < NAMEVALUE_MAX_ARGS; i++)
+		data->off[i] = -1;
+	if(args->seed == 0 && BuildNameValueArgs(args) < 0)
+		return -1;
+	memset(&p, 0, sizeof(p));
+	p.slices = data;
+	parser.xmlstart = buffer;
+	parser.xmlsize = bufsize;
+	parser.data = &p;
+	parser.starteltfunc = NameValueSliceStartElt;
+	parser.endeltfunc = NameValueSliceEndElt;
+	parser.datafunc = NameValueSliceGetData;
+	parser.attfunc = 0;
+	parsexml(&parser);
+	/* the parser is done with the buffer, the values can be
+	 * terminated in place. The terminating character is always
+	 * a '<' or ']' of the closing tag, or a character of the start
+	 * tag for empty elements, so no value is truncated. */
+	for(i = 0; i < args->count; i++)
+	{
+		if(data->off[i] >= 0)
+			buffer[data->off[i] + data->len[i]] = '\0';
+	}
+	return 0;
+}
+
+char *
+GetValueFromNameValueSlices(const struct NameValueSlices * data,
+                            const char * name)
+{
+	int i = NameValueArgIndex(data->args, name, (int)strlen(name));
+	if(i < 0 || data->off[i] < 0)
+		return NULL;
+	return data->buffer + data->off[i];
+}
+
 /* debug all-in-one function
  * do parsing then display to stdout */
 #ifdef DEBUG
@@ -69,6 +69,72 @@ char *
 GetValueFromNameValueList(struct NameValueParserData * pdata,
                           const char * name);
 
+/*! \brief maximum number of arguments of a SOAP action */
+#define NAMEVALUE_MAX_ARGS	16
+/*! \brief size of the per action argument hash table (power of 2) */
+#define NAMEVALUE_HASH_SIZE	32
+
+/*! \brief argument names of a SOAP action
+ *
+ * A perfect hash of the names is computed at first use, so that
+ * each argument is located with a single hash table probe */
+struct NameValueArgs {
+	/*! \brief NULL terminated list of argument names */
+	const char * const * names;
+	/*! \brief hash seed, 0 if the hash table is not yet computed */
+	unsigned int seed;
+	/*! \brief argument count */
+	unsigned char count;
+	/*! \brief argument name lengths */
+	unsigned char namelen[NAMEVALUE_MAX_ARGS];
+	/*! \brief hash slot => argument index + 1 (0 = empty slot) */
+	unsigned char slots[NAMEVALUE_HASH_SIZE];
+};
+
+/*! \brief static initializer for struct NameValueArgs */
+#define NAMEVALUE_ARGS(names)	{ (names), 0, 0, {0}, {0} }
+
+/*! \brief argument values, as slices of the parsed buffer */
+struct NameValueSlices {
+	/*! \brief parsed buffer */
+	char * buffer;
+	/*! \brief action arguments */
+	const struct NameValueArgs * args;
+	/*! \brief value offsets in buffer, -1 if the argument is absent */
+	int off[NAMEVALUE_MAX_ARGS];
+	/*! \brief value lengths */
+	int len[NAMEVALUE_MAX_ARGS];
+};
+
+/*!
+ * \brief Parse XML without any memory allocation
+ *
+ * Values of the elements listed in args are recorded as
+ * (offset, length) slices of buffer, then NUL terminated in place.
+ * The buffer is modified and must not be parsed again.
+ *
+ * \param[in,out] buffer XML data
+ * \param[in] bufsize buffer length
+ * \param[in,out] args argument names of the action
+ * \param[out] data structure to fill
+ * \return 0 on success, -1 if args cannot be hashed
+ */
+int
+ParseNameValueSlices(char * buffer, int bufsize,
+                     struct NameValueArgs * args,
+                     struct NameValueSlices * data);
+
+/*!
+ * \brief get a value from the slices
+ *
+ * \param[in] data structure filled by ParseNameValueSlices()
+ * \param[in] name argument name
+ * \return the NUL terminated value or NULL if not found
+ */
+char *
+GetValueFromNameValueSlices(const struct NameValueSlices * data,
+                            const char * name);
+
 /* DisplayNameValueList() */
 #ifdef DEBUG
 void
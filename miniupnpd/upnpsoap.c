@@ -259,13 +259,17 @@ GetCommonLinkProperties(struct upnphttp * h, const char * action, const char * n
 	                             * Initializing, Unavailable (Optional) */
 	const char * wan_access_type = "Cable"; /* DSL, POTS, Cable, Ethernet */
 	char ext_ip_addr[INET_ADDRSTRLEN];
+	unsigned long upstream = upstream_bitrate;
+	unsigned long downstream = downstream_bitrate;
 
-	if((downstream_bitrate == 0) || (upstream_bitrate == 0))
+	/* the bitrate reported by getifstats() may change over time
+	 * (link speed or measured bitrate) : it is not stored */
+	if((downstream == 0) || (upstream == 0))
 	{
 		if(getifstats(ext_if_name, &data) >= 0)
 		{
-			if(downstream_bitrate == 0) downstream_bitrate = data.baudrate;
-			if(upstream_bitrate == 0) upstream_bitrate = data.baudrate;
+			if(downstream == 0) downstream = data.baudrate;
+			if(upstream == 0) upstream = data.baudrate;
 		}
 	}
 	if(getifaddr(ext_if_name, ext_ip_addr, INET_ADDRSTRLEN, NULL, NULL) < 0) {
@@ -274,7 +278,7 @@ GetCommonLinkProperties(struct upnphttp * h, const char * action, const char * n
 	bodylen = snprintf(body, sizeof(body), resp,
 	    action, ns, /* was "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1" */
 	    wan_access_type,
-	    upstream_bitrate, downstream_bitrate,
+	    upstream, downstream,
 	    status, action);
 	BuildSendAndCloseSoapResp(h, body, bodylen);
 }
@@ -408,6 +412,13 @@ GetExternalIPAddress(struct upnphttp * h, const char * action, const char * ns)
 	BuildSendAndCloseSoapResp(h, body, bodylen);
 }
 
+static const char * const AddPortMappingArgNames[] = {
+	"NewInternalClient", "NewRemoteHost", "NewInternalPort",
+	"NewExternalPort", "NewProtocol", "NewPortMappingDescription",
+	"NewLeaseDuration", "NewEnabled", NULL
+};
+static struct NameValueArgs AddPortMappingArgs = NAMEVALUE_ARGS(AddPortMappingArgNames);
+
 /* AddPortMapping method of WANIPConnection Service
  * Ignored argument : NewEnabled */
 static void
@@ -424,7 +435,7 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	char * int_ip, * int_port, * ext_port, * protocol, * desc;
 	char * leaseduration_str;
 	unsigned int leaseduration;
@@ -435,8 +446,13 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 	char ** ptr; /* getbyhostname() */
 	struct in_addr result_ip;/*unsigned char result_ip[16];*/ /* inet_pton() */
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	int_ip = GetValueFromNameValueList(&data, "NewInternalClient");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &AddPortMappingArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	int_ip = GetValueFromNameValueSlices(&data, "NewInternalClient");
 	if (int_ip) {
 		/* trim */
 		while(int_ip[0] == ' ')
@@ -445,7 +461,6 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 #ifdef UPNP_STRICT
 	if (!int_ip || int_ip[0] == '\0')
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -453,12 +468,11 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 
 	/* IGD 2 MUST support both wildcard and specific IP address values
 	 * for RemoteHost (only the wildcard value was REQUIRED in release 1.0) */
-	r_host = GetValueFromNameValueList(&data, "NewRemoteHost");
+	r_host = GetValueFromNameValueSlices(&data, "NewRemoteHost");
 #ifndef SUPPORT_REMOTEHOST
 #ifdef UPNP_STRICT
 	if (r_host && (r_host[0] != '\0') && (0 != strcmp(r_host, "*")))
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 726, "RemoteHostOnlySupportsWildcard");
 		return;
 	}
@@ -492,7 +506,6 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 		else
 		{
 			syslog(LOG_ERR, "Failed to convert hostname '%s' to ip address", int_ip);
-			ClearNameValueList(&data);
 			SoapError(h, 402, "Invalid Args");
 			return;
 		}
@@ -505,7 +518,6 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 		{
 			syslog(LOG_INFO, "Client %s tried to redirect port to %s",
 			       inet_ntoa(h->clientaddr), int_ip);
-			ClearNameValueList(&data);
 #ifdef IGD_V2
 			SoapError(h, 606, "Action not authorized");
 #else
@@ -515,15 +527,14 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 		}
 	}
 
-	int_port = GetValueFromNameValueList(&data, "NewInternalPort");
-	ext_port = GetValueFromNameValueList(&data, "NewExternalPort");
-	protocol = GetValueFromNameValueList(&data, "NewProtocol");
-	desc = GetValueFromNameValueList(&data, "NewPortMappingDescription");
-	leaseduration_str = GetValueFromNameValueList(&data, "NewLeaseDuration");
+	int_port = GetValueFromNameValueSlices(&data, "NewInternalPort");
+	ext_port = GetValueFromNameValueSlices(&data, "NewExternalPort");
+	protocol = GetValueFromNameValueSlices(&data, "NewProtocol");
+	desc = GetValueFromNameValueSlices(&data, "NewPortMappingDescription");
+	leaseduration_str = GetValueFromNameValueSlices(&data, "NewLeaseDuration");
 
 	if (!int_port || !ext_port || !protocol)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -533,7 +544,6 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 
 	if (strcmp(ext_port, "*") == 0 || eport == 0)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 716, "WildCardNotPermittedInExtPort");
 		return;
 	}
@@ -558,8 +568,6 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 
 	r = upnp_redirect(r_host, eport, int_ip, iport, protocol, desc, leaseduration);
 
-	ClearNameValueList(&data);
-
 	/* possible error codes for AddPortMapping :
 	 * 402 - Invalid Args
 	 * 501 - Action Failed
@@ -602,11 +610,26 @@ AddPortMapping(struct upnphttp * h, const char * action, const char * ns)
 	case -2:	/* already redirected */
 		SoapError(h, 718, "ConflictInMappingEntry");
 		break;
+	case -5:	/* quota exceeded */
+#ifdef IGD_V2
+		SoapError(h, 728, "NoPortMapsAvailable");
+		break;
+#else
+		/* IGD v1 has no error code for this case */
+		FALL_THROUGH;
+#endif /* IGD_V2 */
 	default:
 		SoapError(h, 501, "Action Failed");
 	}
 }
 
+static const char * const AddAnyPortMappingArgNames[] = {
+	"NewRemoteHost", "NewExternalPort", "NewProtocol", "NewInternalPort",
+	"NewInternalClient", "NewPortMappingDescription", "NewLeaseDuration",
+	"NewEnabled", NULL
+};
+static struct NameValueArgs AddAnyPortMappingArgs = NAMEVALUE_ARGS(AddAnyPortMappingArgNames);
+
 /* AddAnyPortMapping was added in WANIPConnection v2 */
 static void
 AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
@@ -621,7 +644,7 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 	char body[512];
 	int bodylen;
 
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * int_ip, * int_port, * ext_port, * protocol, * desc;
 	const char * r_host;
 	unsigned short iport, eport;
@@ -632,15 +655,20 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 	char ** ptr; /* getbyhostname() */
 	struct in_addr result_ip;/*unsigned char result_ip[16];*/ /* inet_pton() */
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	r_host = GetValueFromNameValueList(&data, "NewRemoteHost");
-	ext_port = GetValueFromNameValueList(&data, "NewExternalPort");
-	protocol = GetValueFromNameValueList(&data, "NewProtocol");
-	int_port = GetValueFromNameValueList(&data, "NewInternalPort");
-	int_ip = GetValueFromNameValueList(&data, "NewInternalClient");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &AddAnyPortMappingArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	r_host = GetValueFromNameValueSlices(&data, "NewRemoteHost");
+	ext_port = GetValueFromNameValueSlices(&data, "NewExternalPort");
+	protocol = GetValueFromNameValueSlices(&data, "NewProtocol");
+	int_port = GetValueFromNameValueSlices(&data, "NewInternalPort");
+	int_ip = GetValueFromNameValueSlices(&data, "NewInternalClient");
 	/* NewEnabled */
-	desc = GetValueFromNameValueList(&data, "NewPortMappingDescription");
-	leaseduration_str = GetValueFromNameValueList(&data, "NewLeaseDuration");
+	desc = GetValueFromNameValueSlices(&data, "NewPortMappingDescription");
+	leaseduration_str = GetValueFromNameValueSlices(&data, "NewLeaseDuration");
 
 	leaseduration = leaseduration_str ? atoi(leaseduration_str) : 0;
 	if(leaseduration == 0)
@@ -648,7 +676,6 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 
 	if (!int_ip || !ext_port || !int_port || !protocol)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -659,7 +686,6 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 	}
 	iport = (unsigned short)atoi(int_port);
 	if(iport == 0 || (!is_numeric(ext_port) && 0 != strcmp(ext_port, "*"))) {
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -667,7 +693,6 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 #ifdef UPNP_STRICT
 	if (r_host && (r_host[0] != '\0') && (0 != strcmp(r_host, "*")))
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 726, "RemoteHostOnlySupportsWildcard");
 		return;
 	}
@@ -691,7 +716,6 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 		else
 		{
 			syslog(LOG_ERR, "Failed to convert hostname '%s' to ip address", int_ip);
-			ClearNameValueList(&data);
 			SoapError(h, 402, "Invalid Args");
 			return;
 		}
@@ -704,7 +728,6 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 		{
 			syslog(LOG_INFO, "Client %s tried to redirect port to %s",
 			       inet_ntoa(h->clientaddr), int_ip);
-			ClearNameValueList(&data);
 			SoapError(h, 606, "Action not authorized");
 			return;
 		}
@@ -713,7 +736,7 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 	/* first try the port asked in request, then
 	 * try +1, -1, +2, -2, etc. */
 	r = upnp_redirect(r_host, eport, int_ip, iport, protocol, desc, leaseduration);
-	if (r != 0 && r != -1) {
+	if (r != 0 && r != -1 && r != -5) {
 		unsigned short eport_below, eport_above;
 		struct in_addr address;
 		uint32_t allowed_eports[65536 / 32];
@@ -740,8 +763,8 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 			if (!(allowed_eports[eport / 32] & ((uint32_t)1U << (eport % 32))))
 				continue;	/* not allowed */
 			r = upnp_redirect(r_host, eport, int_ip, iport, protocol, desc, leaseduration);
-			if (r == 0 || r == -1) {
-				/* OK or failure : Stop */
+			if (r == 0 || r == -1 || r == -5) {
+				/* OK, failure or quota exceeded : Stop */
 				break;
 			}
 			/* r : -2 / -4 already redirected or -3 permission check failed :
@@ -749,11 +772,10 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 		}
 	}
 
-	ClearNameValueList(&data);
-
 	switch(r)
 	{
 	case 1:	/* exhausted possible mappings */
+	case -5:	/* quota exceeded */
 		SoapError(h, 728, "NoPortMapsAvailable");
 		break;
 	case 0:	/* success */
@@ -773,6 +795,11 @@ AddAnyPortMapping(struct upnphttp * h, const char * action, const char * ns)
 	}
 }
 
+static const char * const GetSpecificPortMappingEntryArgNames[] = {
+	"NewRemoteHost", "NewExternalPort", "NewProtocol", NULL
+};
+static struct NameValueArgs GetSpecificPortMappingEntryArgs = NAMEVALUE_ARGS(GetSpecificPortMappingEntryArgNames);
+
 static void
 GetSpecificPortMappingEntry(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -790,17 +817,22 @@ GetSpecificPortMappingEntry(struct upnphttp * h, const char * action, const char
 
 	char body[1024];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * r_host, * ext_port, * protocol;
 	unsigned short eport, iport;
 	char int_ip[32];
 	char desc[64];
 	unsigned int leaseduration = 0;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	r_host = GetValueFromNameValueList(&data, "NewRemoteHost");
-	ext_port = GetValueFromNameValueList(&data, "NewExternalPort");
-	protocol = GetValueFromNameValueList(&data, "NewProtocol");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &GetSpecificPortMappingEntryArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	r_host = GetValueFromNameValueSlices(&data, "NewRemoteHost");
+	ext_port = GetValueFromNameValueSlices(&data, "NewExternalPort");
+	protocol = GetValueFromNameValueSlices(&data, "NewProtocol");
 
 #ifdef UPNP_STRICT
 	if(!ext_port || !protocol || !r_host)
@@ -808,7 +840,6 @@ GetSpecificPortMappingEntry(struct upnphttp * h, const char * action, const char
 	if(!ext_port || !protocol)
 #endif
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -816,7 +847,6 @@ GetSpecificPortMappingEntry(struct upnphttp * h, const char * action, const char
 #ifdef UPNP_STRICT
 	if (r_host && (r_host[0] != '\0') && (0 != strcmp(r_host, "*")))
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 726, "RemoteHostOnlySupportsWildcard");
 		return;
 	}
@@ -826,7 +856,6 @@ GetSpecificPortMappingEntry(struct upnphttp * h, const char * action, const char
 	eport = (unsigned short)atoi(ext_port);
 	if(eport == 0)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -860,10 +889,13 @@ GetSpecificPortMappingEntry(struct upnphttp * h, const char * action, const char
 				action);
 		BuildSendAndCloseSoapResp(h, body, bodylen);
 	}
-
-	ClearNameValueList(&data);
 }
 
+static const char * const DeletePortMappingArgNames[] = {
+	"NewExternalPort", "NewProtocol", "NewRemoteHost", NULL
+};
+static struct NameValueArgs DeletePortMappingArgs = NAMEVALUE_ARGS(DeletePortMappingArgNames);
+
 static void
 DeletePortMapping(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -880,18 +912,23 @@ DeletePortMapping(struct upnphttp * h, const char * action, const char * ns)
 
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * ext_port, * protocol;
 	unsigned short eport;
 #ifdef UPNP_STRICT
 	const char * r_host;
 #endif /* UPNP_STRICT */
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	ext_port = GetValueFromNameValueList(&data, "NewExternalPort");
-	protocol = GetValueFromNameValueList(&data, "NewProtocol");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &DeletePortMappingArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	ext_port = GetValueFromNameValueSlices(&data, "NewExternalPort");
+	protocol = GetValueFromNameValueSlices(&data, "NewProtocol");
 #ifdef UPNP_STRICT
-	r_host = GetValueFromNameValueList(&data, "NewRemoteHost");
+	r_host = GetValueFromNameValueSlices(&data, "NewRemoteHost");
 #endif /* UPNP_STRICT */
 
 #ifdef UPNP_STRICT
@@ -900,7 +937,6 @@ DeletePortMapping(struct upnphttp * h, const char * action, const char * ns)
 	if(!ext_port || !protocol)
 #endif /* UPNP_STRICT */
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -908,7 +944,6 @@ DeletePortMapping(struct upnphttp * h, const char * action, const char * ns)
 #ifdef UPNP_STRICT
 	if (r_host && (r_host[0] != '\0') && (0 != strcmp(r_host, "*")))
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 726, "RemoteHostOnlySupportsWildcard");
 		return;
 	}
@@ -918,7 +953,6 @@ DeletePortMapping(struct upnphttp * h, const char * action, const char * ns)
 	eport = (unsigned short)atoi(ext_port);
 	if(eport == 0)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -951,7 +985,6 @@ DeletePortMapping(struct upnphttp * h, const char * action, const char * ns)
 #else
 					SoapError(h, 714, "NoSuchEntryInArray");
 #endif
-					ClearNameValueList(&data);
 					return;
 				}
 			}
@@ -970,10 +1003,13 @@ DeletePortMapping(struct upnphttp * h, const char * action, const char * ns)
 		                   action, ns, action);
 		BuildSendAndCloseSoapResp(h, body, bodylen);
 	}
-
-	ClearNameValueList(&data);
 }
 
+static const char * const DeletePortMappingRangeArgNames[] = {
+	"NewStartPort", "NewEndPort", "NewProtocol", "NewManage", NULL
+};
+static struct NameValueArgs DeletePortMappingRangeArgs = NAMEVALUE_ARGS(DeletePortMappingRangeArgNames);
+
 /* DeletePortMappingRange was added in IGD spec v2 */
 static void
 DeletePortMappingRange(struct upnphttp * h, const char * action, const char * ns)
@@ -989,7 +1025,7 @@ DeletePortMappingRange(struct upnphttp * h, const char * action, const char * ns
 		"</u:%sResponse>";
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * protocol;
 	const char * startport_s, * endport_s;
 	unsigned short startport, endport;
@@ -997,15 +1033,19 @@ DeletePortMappingRange(struct upnphttp * h, const char * action, const char * ns
 	unsigned short * port_list;
 	unsigned int i, number = 0;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	startport_s = GetValueFromNameValueList(&data, "NewStartPort");
-	endport_s = GetValueFromNameValueList(&data, "NewEndPort");
-	protocol = GetValueFromNameValueList(&data, "NewProtocol");
-	/*manage = atoi(GetValueFromNameValueList(&data, "NewManage"));*/
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &DeletePortMappingRangeArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	startport_s = GetValueFromNameValueSlices(&data, "NewStartPort");
+	endport_s = GetValueFromNameValueSlices(&data, "NewEndPort");
+	protocol = GetValueFromNameValueSlices(&data, "NewProtocol");
+	/*manage = atoi(GetValueFromNameValueSlices(&data, "NewManage"));*/
 	if(startport_s == NULL || endport_s == NULL || protocol == NULL ||
 	   !is_numeric(startport_s) || !is_numeric(endport_s)) {
 		SoapError(h, 402, "Invalid Args");
-		ClearNameValueList(&data);
 		return;
 	}
 	startport = (unsigned short)atoi(startport_s);
@@ -1019,7 +1059,6 @@ DeletePortMappingRange(struct upnphttp * h, const char * action, const char * ns
 	if(startport > endport)
 	{
 		SoapError(h, 733, "InconsistentParameter");
-		ClearNameValueList(&data);
 		return;
 	}
 
@@ -1031,7 +1070,6 @@ DeletePortMappingRange(struct upnphttp * h, const char * action, const char * ns
 	if(number == 0)
 	{
 		SoapError(h, 730, "PortMappingNotFound");
-		ClearNameValueList(&data);
 		free(port_list);
 		return;
 	}
@@ -1046,10 +1084,13 @@ DeletePortMappingRange(struct upnphttp * h, const char * action, const char * ns
 	bodylen = snprintf(body, sizeof(body), resp,
 	                   action, ns, action);
 	BuildSendAndCloseSoapResp(h, body, bodylen);
-
-	ClearNameValueList(&data);
 }
 
+static const char * const GetGenericPortMappingEntryArgNames[] = {
+	"NewPortMappingIndex", NULL
+};
+static struct NameValueArgs GetGenericPortMappingEntryArgs = NAMEVALUE_ARGS(GetGenericPortMappingEntryArgNames);
+
 static void
 GetGenericPortMappingEntry(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -1076,14 +1117,18 @@ GetGenericPortMappingEntry(struct upnphttp * h, const char * action, const char
 	char desc[64];
 	char rhost[40];
 	unsigned int leaseduration = 0;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	m_index = GetValueFromNameValueList(&data, "NewPortMappingIndex");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &GetGenericPortMappingEntryArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	m_index = GetValueFromNameValueSlices(&data, "NewPortMappingIndex");
 
 	if(!m_index)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -1099,7 +1144,6 @@ GetGenericPortMappingEntry(struct upnphttp * h, const char * action, const char
 		else
 			syslog(LOG_WARNING, "%s: strtol('%s'): %m",
 			       "GetGenericPortMappingEntry", m_index);
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -1130,10 +1174,14 @@ GetGenericPortMappingEntry(struct upnphttp * h, const char * action, const char
 		    leaseduration, action);
 		BuildSendAndCloseSoapResp(h, body, bodylen);
 	}
-
-	ClearNameValueList(&data);
 }
 
+static const char * const GetListOfPortMappingsArgNames[] = {
+	"NewStartPort", "NewEndPort", "NewProtocol", "NewNumberOfPorts",
+	"NewManage", NULL
+};
+static struct NameValueArgs GetListOfPortMappingsArgs = NAMEVALUE_ARGS(GetListOfPortMappingsArgNames);
+
 /* GetListOfPortMappings was added in the IGD v2 specification */
 static void
 GetListOfPortMappings(struct upnphttp * h, const char * action, const char * ns)
@@ -1177,7 +1225,7 @@ GetListOfPortMappings(struct upnphttp * h, const char * action, const char * ns)
 	char rhost[64];
 	unsigned int leaseduration = 0;
 
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * startport_s, * endport_s;
 	unsigned short startport, endport;
 	const char * protocol;
@@ -1187,17 +1235,21 @@ GetListOfPortMappings(struct upnphttp * h, const char * action, const char * ns)
 	unsigned short * port_list;
 	unsigned int i, list_size = 0;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	startport_s = GetValueFromNameValueList(&data, "NewStartPort");
-	endport_s = GetValueFromNameValueList(&data, "NewEndPort");
-	protocol = GetValueFromNameValueList(&data, "NewProtocol");
-	/*manage_s = GetValueFromNameValueList(&data, "NewManage");*/
-	number_s = GetValueFromNameValueList(&data, "NewNumberOfPorts");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &GetListOfPortMappingsArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	startport_s = GetValueFromNameValueSlices(&data, "NewStartPort");
+	endport_s = GetValueFromNameValueSlices(&data, "NewEndPort");
+	protocol = GetValueFromNameValueSlices(&data, "NewProtocol");
+	/*manage_s = GetValueFromNameValueSlices(&data, "NewManage");*/
+	number_s = GetValueFromNameValueSlices(&data, "NewNumberOfPorts");
 	if(startport_s == NULL || endport_s == NULL || protocol == NULL ||
 	   number_s == NULL || !is_numeric(number_s) ||
 	   !is_numeric(startport_s) || !is_numeric(endport_s)) {
 		SoapError(h, 402, "Invalid Args");
-		ClearNameValueList(&data);
 		return;
 	}
 
@@ -1210,7 +1262,6 @@ GetListOfPortMappings(struct upnphttp * h, const char * action, const char * ns)
 	if(startport > endport)
 	{
 		SoapError(h, 733, "InconsistentParameter");
-		ClearNameValueList(&data);
 		return;
 	}
 /*
@@ -1236,7 +1287,6 @@ http://www.upnp.org/schemas/gw/WANIPConnection-v2.xsd">
 	body = malloc(bodyalloc);
 	if(!body)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 501, "Action Failed");
 		return;
 	}
@@ -1265,7 +1315,6 @@ http://www.upnp.org/schemas/gw/WANIPConnection-v2.xsd">
 			if(!body)
 			{
 				syslog(LOG_CRIT, "realloc(%p, %u) FAILED", body_sav, (unsigned)bodyalloc);
-				ClearNameValueList(&data);
 				SoapError(h, 501, "Action Failed");
 				free(body_sav);
 				free(port_list);
@@ -1300,7 +1349,6 @@ http://www.upnp.org/schemas/gw/WANIPConnection-v2.xsd">
 		if(!body)
 		{
 			syslog(LOG_CRIT, "realloc(%p, %u) FAILED", body_sav, (unsigned)bodyalloc);
-			ClearNameValueList(&data);
 			SoapError(h, 501, "Action Failed");
 			free(body_sav);
 			return;
@@ -1312,11 +1360,14 @@ http://www.upnp.org/schemas/gw/WANIPConnection-v2.xsd">
 	                    action);
 	BuildSendAndCloseSoapResp(h, body, bodylen);
 	free(body);
-
-	ClearNameValueList(&data);
 }
 
 #ifdef ENABLE_L3F_SERVICE
+static const char * const SetDefaultConnectionServiceArgNames[] = {
+	"NewDefaultConnectionService", NULL
+};
+static struct NameValueArgs SetDefaultConnectionServiceArgs = NAMEVALUE_ARGS(SetDefaultConnectionServiceArgNames);
+
 static void
 SetDefaultConnectionService(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -1330,10 +1381,15 @@ SetDefaultConnectionService(struct upnphttp * h, const char * action, const char
 		"</u:%sResponse>";
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	char * p;
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	p = GetValueFromNameValueList(&data, "NewDefaultConnectionService");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &SetDefaultConnectionServiceArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	p = GetValueFromNameValueSlices(&data, "NewDefaultConnectionService");
 	if(p) {
 		/* 720 InvalidDeviceUUID
 		 * 721 InvalidServiceID
@@ -1357,7 +1413,6 @@ SetDefaultConnectionService(struct upnphttp * h, const char * action, const char
 		/* missing argument */
 		SoapError(h, 402, "Invalid Args");
 	}
-	ClearNameValueList(&data);
 }
 
 static void
@@ -1386,6 +1441,11 @@ GetDefaultConnectionService(struct upnphttp * h, const char * action, const char
 }
 #endif
 
+static const char * const SetConnectionTypeArgNames[] = {
+	"NewConnectionType", NULL
+};
+static struct NameValueArgs SetConnectionTypeArgs = NAMEVALUE_ARGS(SetConnectionTypeArgNames);
+
 /* Added for compliance with WANIPConnection v2 */
 static void
 SetConnectionType(struct upnphttp * h, const char * action, const char * ns)
@@ -1393,21 +1453,24 @@ SetConnectionType(struct upnphttp * h, const char * action, const char * ns)
 #ifdef UPNP_STRICT
 	const char * connection_type;
 #endif /* UPNP_STRICT */
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	UNUSED(action);
 	UNUSED(ns);
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &SetConnectionTypeArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
 #ifdef UPNP_STRICT
-	connection_type = GetValueFromNameValueList(&data, "NewConnectionType");
+	connection_type = GetValueFromNameValueSlices(&data, "NewConnectionType");
 	if(!connection_type) {
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
 #endif /* UPNP_STRICT */
 	/* Unconfigured, IP_Routed, IP_Bridged */
-	ClearNameValueList(&data);
 	/* always return a ReadOnly error */
 	SoapError(h, 731, "ReadOnly");
 }
@@ -1430,6 +1493,11 @@ ForceTermination(struct upnphttp * h, const char * action, const char * ns)
 	SoapError(h, 606, "Action not authorized");
 }
 
+static const char * const QueryStateVariableArgNames[] = {
+	"varName", NULL
+};
+static struct NameValueArgs QueryStateVariableArgs = NAMEVALUE_ARGS(QueryStateVariableArgNames);
+
 /*
 If a control point calls QueryStateVariable on a state variable that is not
 buffered in memory within (or otherwise available from) the service,
@@ -1449,13 +1517,18 @@ QueryStateVariable(struct upnphttp * h, const char * action, const char * ns)
 
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * var_name;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	/*var_name = GetValueFromNameValueList(&data, "QueryStateVariable"); */
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &QueryStateVariableArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	/*var_name = GetValueFromNameValueSlices(&data, "QueryStateVariable"); */
 	/*var_name = GetValueFromNameValueListIgnoreNS(&data, "varName");*/
-	var_name = GetValueFromNameValueList(&data, "varName");
+	var_name = GetValueFromNameValueSlices(&data, "varName");
 
 	/*syslog(LOG_INFO, "QueryStateVariable(%.40s)", var_name); */
 
@@ -1501,8 +1574,6 @@ QueryStateVariable(struct upnphttp * h, const char * action, const char * ns)
 		syslog(LOG_NOTICE, "%s: Unknown: %s", action, var_name?var_name:"");
 		SoapError(h, 404, "Invalid Var");
 	}
-
-	ClearNameValueList(&data);
 }
 
 #ifdef ENABLE_6FC_SERVICE
@@ -1703,6 +1774,12 @@ PinholeVerification(struct upnphttp * h, char * int_ip, unsigned short int_port)
 	return 1;
 }
 
+static const char * const AddPinholeArgNames[] = {
+	"RemoteHost", "RemotePort", "InternalClient", "InternalPort",
+	"Protocol", "LeaseTime", NULL
+};
+static struct NameValueArgs AddPinholeArgs = NAMEVALUE_ARGS(AddPinholeArgNames);
+
 static void
 AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -1714,7 +1791,7 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 		"</u:%sResponse>";
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	char * rem_host, * rem_port, * int_ip, * int_port, * protocol, * leaseTime;
 	int uid = 0;
 	unsigned short iport, rport;
@@ -1725,18 +1802,22 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 	if(CheckStatus(h)==0)
 		return;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	rem_host = GetValueFromNameValueList(&data, "RemoteHost");
-	rem_port = GetValueFromNameValueList(&data, "RemotePort");
-	int_ip = GetValueFromNameValueList(&data, "InternalClient");
-	int_port = GetValueFromNameValueList(&data, "InternalPort");
-	protocol = GetValueFromNameValueList(&data, "Protocol");
-	leaseTime = GetValueFromNameValueList(&data, "LeaseTime");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &AddPinholeArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	rem_host = GetValueFromNameValueSlices(&data, "RemoteHost");
+	rem_port = GetValueFromNameValueSlices(&data, "RemotePort");
+	int_ip = GetValueFromNameValueSlices(&data, "InternalClient");
+	int_port = GetValueFromNameValueSlices(&data, "InternalPort");
+	protocol = GetValueFromNameValueSlices(&data, "Protocol");
+	leaseTime = GetValueFromNameValueSlices(&data, "LeaseTime");
 
 #ifdef UPNP_STRICT
 	if (rem_port == NULL || rem_port[0] == '\0' || int_port == NULL || int_port[0] == '\0' )
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -1749,12 +1830,12 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 	if(errno != 0 || proto > 65535 || proto < 0)
 	{
 		SoapError(h, 402, "Invalid Args");
-		goto clear_and_exit;
+		return;
 	}
 	if(iport == 0)
 	{
 		SoapError(h, 706, "InternalPortWilcardingNotAllowed");
-		goto clear_and_exit;
+		return;
 	}
 
 	/* In particular, [IGD2] RECOMMENDS that unauthenticated and
@@ -1767,7 +1848,7 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 	if(!int_ip || int_ip[0] == '\0' || 0 == strcmp(int_ip, "*"))
 	{
 		SoapError(h, 708, "WildCardNotPermittedInSrcIP");
-		goto clear_and_exit;
+		return;
 	}
 	/* I guess it is useless to convert int_ip to literal ipv6 address */
 	if(rem_host)
@@ -1810,7 +1891,7 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 			       rem_host, gai_strerror(err));
 #if 0
 			SoapError(h, 402, "Invalid Args");
-			goto clear_and_exit;
+			return;
 #endif
 		}
 	}
@@ -1818,7 +1899,7 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 	if(proto == 65535)
 	{
 		SoapError(h, 707, "ProtocolWilcardingNotAllowed");
-		goto clear_and_exit;
+		return;
 	}
 	if(proto != IPPROTO_UDP && proto != IPPROTO_TCP
 #ifdef IPPROTO_UDPITE
@@ -1827,18 +1908,18 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 	  )
 	{
 		SoapError(h, 705, "ProtocolNotSupported");
-		goto clear_and_exit;
+		return;
 	}
 	if(ltime < 1 || ltime > 86400)
 	{
 		syslog(LOG_WARNING, "%s: LeaseTime=%d not supported, (ip=%s)",
 		       action, ltime, int_ip);
 		SoapError(h, 402, "Invalid Args");
-		goto clear_and_exit;
+		return;
 	}
 
 	if(PinholeVerification(h, int_ip, iport) <= 0)
-		goto clear_and_exit;
+		return;
 
 	syslog(LOG_INFO, "%s: (inbound) from [%s]:%hu to [%s]:%hu with proto %ld during %d sec",
 	       action, rem_host?rem_host:"any",
@@ -1875,10 +1956,13 @@ AddPinhole(struct upnphttp * h, const char * action, const char * ns)
 	 * 706 InternalPortWildcardingNotAllowed
 	 * 707 ProtocolWildcardingNotAllowed
 	 * 708 WildCardNotPermittedInSrcIP */
-clear_and_exit:
-	ClearNameValueList(&data);
 }
 
+static const char * const UpdatePinholeArgNames[] = {
+	"UniqueID", "NewLeaseTime", NULL
+};
+static struct NameValueArgs UpdatePinholeArgs = NAMEVALUE_ARGS(UpdatePinholeArgNames);
+
 static void
 UpdatePinhole(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -1894,7 +1978,7 @@ UpdatePinhole(struct upnphttp * h, const char * action, const char * ns)
 		"</u:%sResponse>";
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * uid_str, * leaseTime;
 	char iaddr[INET6_ADDRSTRLEN];
 	unsigned short iport;
@@ -1905,12 +1989,16 @@ UpdatePinhole(struct upnphttp * h, const char * action, const char * ns)
 	if(CheckStatus(h)==0)
 		return;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	uid_str = GetValueFromNameValueList(&data, "UniqueID");
-	leaseTime = GetValueFromNameValueList(&data, "NewLeaseTime");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &UpdatePinholeArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	uid_str = GetValueFromNameValueSlices(&data, "UniqueID");
+	leaseTime = GetValueFromNameValueSlices(&data, "NewLeaseTime");
 	uid = uid_str ? atoi(uid_str) : -1;
 	ltime = leaseTime ? atoi(leaseTime) : -1;
-	ClearNameValueList(&data);
 
 	if(uid < 0 || uid > 65535 || ltime <= 0 || ltime > 86400)
 	{
@@ -1956,6 +2044,12 @@ UpdatePinhole(struct upnphttp * h, const char * action, const char * ns)
 	}
 }
 
+static const char * const GetOutboundPinholeTimeoutArgNames[] = {
+	"InternalClient", "InternalPort", "RemoteHost", "RemotePort",
+	"Protocol", NULL
+};
+static struct NameValueArgs GetOutboundPinholeTimeoutArgs = NAMEVALUE_ARGS(GetOutboundPinholeTimeoutArgNames);
+
 static void
 GetOutboundPinholeTimeout(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -1969,7 +2063,7 @@ GetOutboundPinholeTimeout(struct upnphttp * h, const char * action, const char *
 
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	char * int_ip, * int_port, * rem_host, * rem_port, * protocol;
 	int opt=0;
 	/*int proto=0;*/
@@ -1981,16 +2075,20 @@ GetOutboundPinholeTimeout(struct upnphttp * h, const char * action, const char *
 		return;
 	}
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	int_ip = GetValueFromNameValueList(&data, "InternalClient");
-	int_port = GetValueFromNameValueList(&data, "InternalPort");
-	rem_host = GetValueFromNameValueList(&data, "RemoteHost");
-	rem_port = GetValueFromNameValueList(&data, "RemotePort");
-	protocol = GetValueFromNameValueList(&data, "Protocol");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &GetOutboundPinholeTimeoutArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	int_ip = GetValueFromNameValueSlices(&data, "InternalClient");
+	int_port = GetValueFromNameValueSlices(&data, "InternalPort");
+	rem_host = GetValueFromNameValueSlices(&data, "RemoteHost");
+	rem_port = GetValueFromNameValueSlices(&data, "RemotePort");
+	protocol = GetValueFromNameValueSlices(&data, "Protocol");
 
 	if (!int_port || !rem_port || !protocol)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
@@ -2018,9 +2116,13 @@ GetOutboundPinholeTimeout(struct upnphttp * h, const char * action, const char *
 		default:
 			SoapError(h, 501, "Action Failed");
 	}
-	ClearNameValueList(&data);
 }
 
+static const char * const DeletePinholeArgNames[] = {
+	"UniqueID", NULL
+};
+static struct NameValueArgs DeletePinholeArgs = NAMEVALUE_ARGS(DeletePinholeArgNames);
+
 static void
 DeletePinhole(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -2038,7 +2140,7 @@ DeletePinhole(struct upnphttp * h, const char * action, const char * ns)
 	char body[512];
 	int bodylen;
 
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * uid_str;
 	char iaddr[INET6_ADDRSTRLEN];
 	int proto;
@@ -2049,10 +2151,14 @@ DeletePinhole(struct upnphttp * h, const char * action, const char * ns)
 	if(CheckStatus(h)==0)
 		return;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	uid_str = GetValueFromNameValueList(&data, "UniqueID");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &DeletePinholeArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	uid_str = GetValueFromNameValueSlices(&data, "UniqueID");
 	uid = uid_str ? atoi(uid_str) : -1;
-	ClearNameValueList(&data);
 
 	if(uid < 0 || uid > 65535)
 	{
@@ -2098,6 +2204,11 @@ DeletePinhole(struct upnphttp * h, const char * action, const char * ns)
 	BuildSendAndCloseSoapResp(h, body, bodylen);
 }
 
+static const char * const CheckPinholeWorkingArgNames[] = {
+	"UniqueID", NULL
+};
+static struct NameValueArgs CheckPinholeWorkingArgs = NAMEVALUE_ARGS(CheckPinholeWorkingArgNames);
+
 static void
 CheckPinholeWorking(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -2109,7 +2220,7 @@ CheckPinholeWorking(struct upnphttp * h, const char * action, const char * ns)
 	char body[512];
 	int bodylen;
 	int r;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * uid_str;
 	int uid;
 	char iaddr[INET6_ADDRSTRLEN];
@@ -2119,10 +2230,14 @@ CheckPinholeWorking(struct upnphttp * h, const char * action, const char * ns)
 	if(CheckStatus(h)==0)
 		return;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	uid_str = GetValueFromNameValueList(&data, "UniqueID");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &CheckPinholeWorkingArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	uid_str = GetValueFromNameValueSlices(&data, "UniqueID");
 	uid = uid_str ? atoi(uid_str) : -1;
-	ClearNameValueList(&data);
 
 	if(uid < 0 || uid > 65535)
 	{
@@ -2158,6 +2273,11 @@ CheckPinholeWorking(struct upnphttp * h, const char * action, const char * ns)
 		SoapError(h, 501, "Action Failed");
 }
 
+static const char * const GetPinholePacketsArgNames[] = {
+	"UniqueID", NULL
+};
+static struct NameValueArgs GetPinholePacketsArgs = NAMEVALUE_ARGS(GetPinholePacketsArgNames);
+
 static void
 GetPinholePackets(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -2168,7 +2288,7 @@ GetPinholePackets(struct upnphttp * h, const char * action, const char * ns)
 		"</u:%sResponse>";
 	char body[512];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * uid_str;
 	int n;
 	char iaddr[INET6_ADDRSTRLEN];
@@ -2181,10 +2301,14 @@ GetPinholePackets(struct upnphttp * h, const char * action, const char * ns)
 	if(CheckStatus(h)==0)
 		return;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	uid_str = GetValueFromNameValueList(&data, "UniqueID");
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &GetPinholePacketsArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	uid_str = GetValueFromNameValueSlices(&data, "UniqueID");
 	uid = uid_str ? atoi(uid_str) : -1;
-	ClearNameValueList(&data);
 
 	if(uid < 0 || uid > 65535)
 	{
@@ -2219,6 +2343,11 @@ GetPinholePackets(struct upnphttp * h, const char * action, const char * ns)
 #endif
 
 #ifdef ENABLE_DP_SERVICE
+static const char * const SendSetupMessageArgNames[] = {
+	"ProtocolType", "InMessage", NULL
+};
+static struct NameValueArgs SendSetupMessageArgs = NAMEVALUE_ARGS(SendSetupMessageArgNames);
+
 static void
 SendSetupMessage(struct upnphttp * h, const char * action, const char * ns)
 {
@@ -2229,25 +2358,28 @@ SendSetupMessage(struct upnphttp * h, const char * action, const char * ns)
 		"</u:%sResponse>";
 	char body[1024];
 	int bodylen;
-	struct NameValueParserData data;
+	struct NameValueSlices data;
 	const char * ProtocolType;	/* string */
 	const char * InMessage;		/* base64 */
 	const char * OutMessage = "";	/* base64 */
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data);
-	ProtocolType = GetValueFromNameValueList(&data, "ProtocolType");	/* string */
-	InMessage = GetValueFromNameValueList(&data, "InMessage");	/* base64 */
+	if(ParseNameValueSlices(h->req_buf + h->req_contentoff, h->req_contentlen,
+	                        &SendSetupMessageArgs, &data) < 0)
+	{
+		SoapError(h, 402, "Invalid Args");
+		return;
+	}
+	ProtocolType = GetValueFromNameValueSlices(&data, "ProtocolType");	/* string */
+	InMessage = GetValueFromNameValueSlices(&data, "InMessage");	/* base64 */
 
 	if(ProtocolType == NULL || InMessage == NULL)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 402, "Invalid Args");
 		return;
 	}
 	/*if(strcmp(ProtocolType, "DeviceProtection:1") != 0)*/
 	if(strcmp(ProtocolType, "WPS") != 0)
 	{
-		ClearNameValueList(&data);
 		SoapError(h, 600, "Argument Value Invalid"); /* 703 ? */
 		return;
 	}
@@ -2257,7 +2389,6 @@ SendSetupMessage(struct upnphttp * h, const char * action, const char * ns)
 	                   action, ns/*"urn:schemas-upnp-org:service:DeviceProtection:1"*/,
 	                   OutMessage, action);
 	BuildSendAndCloseSoapResp(h, body, bodylen);
-	ClearNameValueList(&data);
 }
 
 static void
@@ -2441,26 +2572,28 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
  * 800-899 	TBD 			Action-specific errors for non-standard actions.
  * 							Defined by UPnP vendor.
 */
+#define SOAP_FAULT(errCode, errDesc) \
+		"<s:Envelope " \
+		"xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" " \
+		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">" \
+		"<s:Body>" \
+		"<s:Fault>" \
+		"<faultcode>s:Client</faultcode>" \
+		"<faultstring>UPnPError</faultstring>" \
+		"<detail>" \
+		"<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">" \
+		"<errorCode>" errCode "</errorCode>" \
+		"<errorDescription>" errDesc "</errorDescription>" \
+		"</UPnPError>" \
+		"</detail>" \
+		"</s:Fault>" \
+		"</s:Body>" \
+		"</s:Envelope>"
+
 void
 SoapError(struct upnphttp * h, int errCode, const char * errDesc)
 {
-	static const char resp[] =
-		"<s:Envelope "
-		"xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-		"<s:Body>"
-		"<s:Fault>"
-		"<faultcode>s:Client</faultcode>"
-		"<faultstring>UPnPError</faultstring>"
-		"<detail>"
-		"<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">"
-		"<errorCode>%d</errorCode>"
-		"<errorDescription>%s</errorDescription>"
-		"</UPnPError>"
-		"</detail>"
-		"</s:Fault>"
-		"</s:Body>"
-		"</s:Envelope>";
+	static const char resp[] = SOAP_FAULT("%d", "%s");
 
 	char body[2048];
 	int bodylen;
@@ -2471,3 +2604,14 @@ SoapError(struct upnphttp * h, int errCode, const char * errDesc)
 	SendRespAndClose_upnphttp(h);
 }
 
+/* SoapErrorRateLimited():
+ * the response body is built at compile time and nothing is
+ * logged, so rejecting a request costs as little as possible */
+void
+SoapErrorRateLimited(struct upnphttp * h)
+{
+	static const char body[] = SOAP_FAULT("501", "Action Failed");
+
+	BuildResp2_upnphttp(h, 500, "Internal Server Error", body, sizeof(body) - 1);
+	SendRespAndClose_upnphttp(h);
+}
@@ -19,5 +19,11 @@ ExecuteSoapAction(struct upnphttp *, const char *, int);
 void
 SoapError(struct upnphttp * h, int errCode, const char * errDesc);
 
+/* SoapErrorRateLimited():
+ * sends a 501 Action Failed SOAP error to a client
+ * which exceeded its request rate */
+void
+SoapErrorRateLimited(struct upnphttp * h);
+
 #endif
 
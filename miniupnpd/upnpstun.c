@@ -242,64 +242,6 @@ static size_t receive_stun_response(int fd, unsigned char *buffer, unsigned char
 	return len;
 }
 
-/*! \brief Wait for STUN response messages and try to receive them
- * \param[in] fds
- * \param[in] transaction_ids
- * \param[out] buffers
- * \param[in] buffer_lens
- * \param[out] peer_addrs
- * \param[out] lens
- * \return -1 for error, 0 for success */
-static int wait_for_stun_responses(int fds[4], unsigned char *transaction_ids[4], unsigned char *buffers[4], size_t buffers_lens[4], struct sockaddr_in peer_addrs[4], size_t lens[4])
-{
-	fd_set fdset;
-	struct timeval timeout;
-	int max_fd;
-	int ret;
-	int i;
-
-	max_fd = fds[0];
-	for (i = 1; i < 4; i++) {
-		if (fds[i] > max_fd)
-			max_fd = fds[i];
-	}
-
-	timeout.tv_sec = 3;
-	timeout.tv_usec = 0;
-
-	while (timeout.tv_sec > 0 || timeout.tv_usec > 0) {
-
-		FD_ZERO(&fdset);
-		for (i = 0; i < 4; i++) {
-			FD_SET(fds[i], &fdset);
-		}
-
-		syslog(LOG_DEBUG, "%s: waiting %ld secs and %ld usecs", "wait_for_stun_responses", (long)timeout.tv_sec, (long)timeout.tv_usec);
-		ret = select(max_fd+1, &fdset, NULL, NULL, &timeout);
-		if (ret < 0) {
-			if (errno == EINTR)
-				continue;
-			syslog(LOG_ERR, "%s: select(): %m", "wait_for_stun_responses");
-			return -1;
-		}
-		if (ret == 0) {
-			syslog(LOG_DEBUG, "%s: select(): no more responses", "wait_for_stun_responses");
-			return 0;
-		}
-
-		for (i = 0; i < 4; ++i)
-			if (FD_ISSET(fds[i], &fdset))
-				lens[i] = receive_stun_response(fds[i], buffers[i], transaction_ids[i], buffers_lens[i], &peer_addrs[i]);
-
-		syslog(LOG_DEBUG, "%s: received responses: %u", "wait_for_stun_responses", (unsigned)(!!lens[0] + !!lens[1] + !!lens[2] + !!lens[3]));
-
-		if (lens[0] && lens[1] && lens[2] && lens[3])
-			return 0;
-	}
-
-	return 0;
-}
-
 /*! \brief Convert STUN Attribute type to name
  * see :
  * - RFC 3489 11.2 Message Attributes
@@ -490,96 +432,88 @@ static int parse_stun_response(unsigned char *buffer, size_t len, struct sockadd
 	return (have_address && have_other_address) ? 0 : -1;
 }
 
-/* Perform main STUN operation, return external IP address and check
- * if host is behind restrictive, symmetric NAT or behind firewall.
- * Restrictive NAT means any NAT which do some filtering and
- * which is not static full-cone NAT 1:1, basically NAT which is not usable
- * for port forwarding */
-int perform_stun(const char *if_name, const char *if_addr, const char *stun_host, unsigned short stun_port, struct in_addr *ext_addr, int *restrictive_nat)
-{
+/* state of the STUN probe : four requests are sent, then sent again
+ * for the missing responses every STUN_RETRANSMIT_DELAY seconds, up
+ * to STUN_TRANSMISSIONS times. */
+#define STUN_TRANSMISSIONS	(3)
+#define STUN_RETRANSMIT_DELAY	(3)
+
+static struct {
+	int active;
+	const char *if_name;
+	char if_addr[INET_ADDRSTRLEN];
 	int fds[4];
-	size_t responses_lens[4];
-	unsigned char responses_bufs[4][1024];
-	unsigned char *responses[4];
-	size_t responses_sizes[4];
-	unsigned char requests[4][28];
-	unsigned char *transaction_ids[4];
-	int have_mapped_addr, mapped_addrs_count;
-	struct sockaddr_in remote_addr, peer_addrs[4], mapped_addrs[4];
 	unsigned short local_ports[4];
-	int have_ext_addr;
-	int i, j;
-
-	if (resolve_stun_host(stun_host, stun_port, &remote_addr) != 0)
-		return -1;
+	unsigned char requests[4][28];
+	unsigned char responses[4][1024];
+	size_t responses_lens[4];
+	struct sockaddr_in remote_addr, peer_addrs[4];
+	int transmissions;
+	struct timeval deadline;	/* next retransmission or end of the probe */
+} probe;
+
+/* the STUN server address is only resolved again when the host
+ * changes or when a probe failed */
+static struct {
+	int valid;
+	const char *host;
+	unsigned short port;
+	struct sockaddr_in addr;
+} stun_server;
+
+/*! \brief send the requests which have not been answered yet
+ * \return -1 for error, 0 for success */
+static int send_stun_requests(void)
+{
+	int i;
 
-	/* Prepare four different STUN requests */
 	for (i = 0; i < 4; ++i) {
-
-		responses_lens[i] = 0;
-		responses[i] = responses_bufs[i];
-		responses_sizes[i] = sizeof(responses_bufs[i]);
-
-		fds[i] = stun_socket(&local_ports[i]);
-		if (fds[i] < 0) {
-			for (j = 0; j < i; ++j)
-				close(fds[j]);
+		ssize_t n;
+		if (probe.responses_lens[i])
+			continue;
+		n = sendto(probe.fds[i], probe.requests[i], sizeof(probe.requests[i]), 0, (struct sockaddr *)&probe.remote_addr, sizeof(probe.remote_addr));
+		if (n != sizeof(probe.requests[i])) {
+			syslog(LOG_ERR, "%s: #%d,%d sendto(): %m", "send_stun_requests", probe.transmissions, i);
 			return -1;
 		}
-
-		/* Determine unrestricted endpoint-independent (1:1) CGNAT in two STUN requests per RFC 5780 4.4 test I/II */
-		/* 1. Connectivity (binding, detect public IPv4), 2. CHANGE-REQUEST with change-IP and change-port set */
-		/* https://datatracker.ietf.org/doc/html/rfc5780#section-4.4 */
-		fill_request(requests[i], i, i);
-		transaction_ids[i] = requests[i]+8;
 	}
+	probe.transmissions++;
+	if (upnp_gettimeofday(&probe.deadline) < 0)
+		return -1;
+	probe.deadline.tv_sec += STUN_RETRANSMIT_DELAY;
+	return 0;
+}
 
-	syslog(LOG_INFO, "%s: local ports %hu %hu %hu %hu",
-	       "perform_stun", local_ports[0], local_ports[1],
-	       local_ports[2], local_ports[3]);
+/*! \brief close the sockets and remove the firewall rules of the probe */
+static void close_stun_probe(void)
+{
+	int i;
 
-	/* Unblock local ports */
 	for (i = 0; i < 4; ++i) {
-		if (add_filter_rule2(if_name, NULL, if_addr, local_ports[i], local_ports[i], IPPROTO_UDP, "stun test") < 0) {
-			syslog(LOG_ERR, "%s: add_filter_rule2(..., %hu, ...) FAILED",
-			       "perform_stun", local_ports[i]);
-		}
-	}
-
-	/* Send STUN requests and wait for responses */
-	for (j = 0; j < 3; ++j) {
-
-		for (i = 0; i < 4; ++i) {
-			ssize_t n;
-			if (responses_lens[i])
-				continue;
-			n = sendto(fds[i], requests[i], sizeof(requests[i]), 0, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
-			if (n != sizeof(requests[i])) {
-				syslog(LOG_ERR, "%s: #%d,%d sendto(): %m", "perform_stun", j, i);
-				break;
-			}
-		}
-
-		if (wait_for_stun_responses(fds, transaction_ids, responses, responses_sizes, peer_addrs, responses_lens) != 0)
-			break;
-
-		if (responses_lens[0] && responses_lens[1] && responses_lens[2] && responses_lens[3])
-			break;
-
+		delete_filter_rule(probe.if_name, probe.local_ports[i], IPPROTO_UDP);
+		close(probe.fds[i]);
+		probe.fds[i] = -1;
 	}
+	probe.active = 0;
+}
 
-	/* Remove unblock for local ports */
-	for (i = 0; i < 4; ++i) {
-		delete_filter_rule(if_name, local_ports[i], IPPROTO_UDP);
-		close(fds[i]);
-	}
+/*! \brief Analyse the received STUN responses
+ * \param[out] ext_addr
+ * \param[out] restrictive_nat
+ * \return -1 for error, 0 for success */
+static int get_stun_probe_result(struct in_addr *ext_addr, int *restrictive_nat)
+{
+	int have_mapped_addr, mapped_addrs_count;
+	struct sockaddr_in mapped_addrs[4];
+	int have_ext_addr;
+	int i;
 
 	/* Parse received STUN messages */
 	have_ext_addr = 0;
 	have_mapped_addr = 0;
 	mapped_addrs_count = 0;
 	for (i = 0; i < 4; ++i) {
-		if (parse_stun_response(responses[i], responses_lens[i], &mapped_addrs[i]) == 0) {
+		if (parse_stun_response(probe.responses[i], probe.responses_lens[i], &mapped_addrs[i]) == 0) {
 			mapped_addrs_count++;
 			have_mapped_addr |= (1 << i);
 			if (!have_ext_addr) {
@@ -605,7 +539,7 @@ int perform_stun(const char *if_name, const char *if_addr, const char *stun_host
 		*restrictive_nat = 1;
 	}
 
-	if (memcmp(&remote_addr, &peer_addrs[0], sizeof(peer_addrs[0])) != 0) {
+	if (memcmp(&probe.remote_addr, &probe.peer_addrs[0], sizeof(probe.peer_addrs[0])) != 0) {
 		/* We received STUN response from different address
 		 * even we did not asked for it, so some strange NAT is active */
 		syslog(LOG_NOTICE, "%s: address changed",
@@ -616,13 +550,13 @@ int perform_stun(const char *if_name, const char *if_addr, const char *stun_host
 	for (i = 0; i < 4; ++i) {
 		if (!(have_mapped_addr & (1 << i)))
 			continue;
-		if (ntohs(mapped_addrs[i].sin_port) != local_ports[i] || memcmp(&mapped_addrs[i].sin_addr, ext_addr, sizeof(*ext_addr)) != 0) {
+		if (ntohs(mapped_addrs[i].sin_port) != probe.local_ports[i] || memcmp(&mapped_addrs[i].sin_addr, ext_addr, sizeof(*ext_addr)) != 0) {
 			char mapped_addr_str[32];
 			sockaddr_to_string((struct sockaddr *)&mapped_addrs[i], mapped_addr_str, sizeof(mapped_addr_str));
 			/* External IP address or port was changed,
 			 * therefore symmetric NAT is active */
 			syslog(LOG_NOTICE, "%s: #%d external address or port changed : %s:%hu => %s",
-			       "perform_stun", i, inet_ntoa(*ext_addr), local_ports[i], mapped_addr_str);
+			       "perform_stun", i, inet_ntoa(*ext_addr), probe.local_ports[i], mapped_addr_str);
 			*restrictive_nat = 1;
 		}
 	}
@@ -631,3 +565,197 @@ int perform_stun(const char *if_name, const char *if_addr, const char *stun_host
 	/* There is no filtering, so port forwarding would work fine */
 	return 0;
 }
+
+int stun_probe_start(const char *if_name, const char *if_addr, const char *stun_host, unsigned short stun_port)
+{
+	int i, j;
+
+	if (probe.active) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	if (!stun_server.valid || stun_server.host != stun_host || stun_server.port != stun_port) {
+		if (resolve_stun_host(stun_host, stun_port, &stun_server.addr) != 0)
+			return -1;
+		stun_server.host = stun_host;
+		stun_server.port = stun_port;
+		stun_server.valid = 1;
+	}
+	memcpy(&probe.remote_addr, &stun_server.addr, sizeof(probe.remote_addr));
+	probe.if_name = if_name;
+	strncpy(probe.if_addr, if_addr, sizeof(probe.if_addr) - 1);
+	probe.if_addr[sizeof(probe.if_addr) - 1] = '\0';
+
+	/* Prepare four different STUN requests */
+	for (i = 0; i < 4; ++i) {
+
+		probe.responses_lens[i] = 0;
+
+		probe.fds[i] = stun_socket(&probe.local_ports[i]);
+		if (probe.fds[i] < 0) {
+			for (j = 0; j < i; ++j)
+				close(probe.fds[j]);
+			return -1;
+		}
+		if (!set_non_blocking(probe.fds[i])) {
+			syslog(LOG_WARNING, "%s: set_non_blocking(): %m",
+			       "stun_probe_start");
+		}
+
+		/* Determine unrestricted endpoint-independent (1:1) CGNAT in two STUN requests per RFC 5780 4.4 test I/II */
+		/* 1. Connectivity (binding, detect public IPv4), 2. CHANGE-REQUEST with change-IP and change-port set */
+		/* https://datatracker.ietf.org/doc/html/rfc5780#section-4.4 */
+		fill_request(probe.requests[i], i, i);
+	}
+
+	syslog(LOG_INFO, "%s: local ports %hu %hu %hu %hu",
+	       "perform_stun", probe.local_ports[0], probe.local_ports[1],
+	       probe.local_ports[2], probe.local_ports[3]);
+
+	/* Unblock local ports */
+	for (i = 0; i < 4; ++i) {
+		if (add_filter_rule2(if_name, NULL, probe.if_addr, probe.local_ports[i], probe.local_ports[i], IPPROTO_UDP, "stun test") < 0) {
+			syslog(LOG_ERR, "%s: add_filter_rule2(..., %hu, ...) FAILED",
+			       "perform_stun", probe.local_ports[i]);
+		}
+	}
+	probe.active = 1;
+
+	/* Send STUN requests, the responses are received
+	 * by stun_probe_process() */
+	probe.transmissions = 0;
+	if (send_stun_requests() < 0) {
+		close_stun_probe();
+		stun_server.valid = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int stun_probe_active(void)
+{
+	return probe.active;
+}
+
+void stun_probe_selectfds(fd_set *readset, int *max_fd)
+{
+	int i;
+
+	if (!probe.active)
+		return;
+	for (i = 0; i < 4; i++) {
+		if (probe.responses_lens[i])
+			continue;
+		FD_SET(probe.fds[i], readset);
+		if (probe.fds[i] > *max_fd)
+			*max_fd = probe.fds[i];
+	}
+}
+
+void stun_probe_gettimeout(struct timeval *timeout)
+{
+	struct timeval now;
+	struct timeval t;
+
+	if (!probe.active)
+		return;
+	if (upnp_gettimeofday(&now) < 0)
+		return;
+	t.tv_sec = probe.deadline.tv_sec - now.tv_sec;
+	t.tv_usec = probe.deadline.tv_usec - now.tv_usec;
+	if (t.tv_usec < 0) {
+		t.tv_sec--;
+		t.tv_usec += 1000000;
+	}
+	if (t.tv_sec < 0) {
+		t.tv_sec = 0;
+		t.tv_usec = 0;
+	}
+	if (t.tv_sec < timeout->tv_sec ||
+	    (t.tv_sec == timeout->tv_sec && t.tv_usec < timeout->tv_usec))
+		*timeout = t;
+}
+
+int stun_probe_process(const fd_set *readset, struct in_addr *ext_addr, int *restrictive_nat)
+{
+	struct timeval now;
+	int i, r;
+
+	if (!probe.active) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < 4; ++i) {
+		if (!probe.responses_lens[i] && FD_ISSET(probe.fds[i], readset))
+			probe.responses_lens[i] = receive_stun_response(probe.fds[i], probe.responses[i], probe.requests[i]+8, sizeof(probe.responses[i]), &probe.peer_addrs[i]);
+	}
+	syslog(LOG_DEBUG, "%s: received responses: %u", "stun_probe_process", (unsigned)(!!probe.responses_lens[0] + !!probe.responses_lens[1] + !!probe.responses_lens[2] + !!probe.responses_lens[3]));
+
+	if (!(probe.responses_lens[0] && probe.responses_lens[1] && probe.responses_lens[2] && probe.responses_lens[3])) {
+		if (upnp_gettimeofday(&now) < 0)
+			return 0;
+		if (now.tv_sec < probe.deadline.tv_sec ||
+		    (now.tv_sec == probe.deadline.tv_sec && now.tv_usec < probe.deadline.tv_usec))
+			return 0;	/* wait for more responses */
+		if (probe.transmissions < STUN_TRANSMISSIONS) {
+			syslog(LOG_DEBUG, "%s: no more responses, sending requests again", "stun_probe_process");
+			if (send_stun_requests() == 0)
+				return 0;
+		}
+	}
+
+	/* Remove unblock for local ports */
+	close_stun_probe();
+
+	r = get_stun_probe_result(ext_addr, restrictive_nat);
+	if (r < 0) {
+		/* maybe the STUN server address changed */
+		stun_server.valid = 0;
+		return -1;
+	}
+	return 1;
+}
+
+void stun_probe_cancel(void)
+{
+	if (probe.active)
+		close_stun_probe();
+}
+
+/* Perform main STUN operation, return external IP address and check
+ * if host is behind restrictive, symmetric NAT or behind firewall.
+ * Restrictive NAT means any NAT which do some filtering and
+ * which is not static full-cone NAT 1:1, basically NAT which is not usable
+ * for port forwarding */
+int perform_stun(const char *if_name, const char *if_addr, const char *stun_host, unsigned short stun_port, struct in_addr *ext_addr, int *restrictive_nat)
+{
+	fd_set fdset;
+	struct timeval timeout;
+	int max_fd;
+	int r;
+
+	if (stun_probe_start(if_name, if_addr, stun_host, stun_port) < 0)
+		return -1;
+
+	do {
+		FD_ZERO(&fdset);
+		max_fd = -1;
+		stun_probe_selectfds(&fdset, &max_fd);
+		timeout.tv_sec = STUN_RETRANSMIT_DELAY;
+		timeout.tv_usec = 0;
+		stun_probe_gettimeout(&timeout);
+		syslog(LOG_DEBUG, "%s: waiting %ld secs and %ld usecs", "perform_stun", (long)timeout.tv_sec, (long)timeout.tv_usec);
+		if (select(max_fd+1, &fdset, NULL, NULL, &timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "%s: select(): %m", "perform_stun");
+			stun_probe_cancel();
+			return -1;
+		}
+		r = stun_probe_process(&fdset, ext_addr, restrictive_nat);
+	} while (r == 0);
+
+	return (r > 0) ? 0 : -1;
+}
@@ -10,6 +10,8 @@
 /*! \file upnpstun.h
  * \brief STUN client implementation */
 
+#include <sys/select.h>
+
 /*! \brief Perform main STUN operation
  *
  * return external IP address and check
@@ -26,4 +28,37 @@
  * \return 0 on success, -1 on error */
 int perform_stun(const char *if_name, const char *if_addr, const char *stun_host, unsigned short stun_port, struct in_addr *ext_addr, int *restrictive_nat);
 
+/*! \brief Start a STUN probe without waiting for the responses
+ *
+ * The probe is driven by the main loop with stun_probe_selectfds(),
+ * stun_probe_gettimeout() and stun_probe_process().
+ * Only one probe can be active at once.
+ * \param[in] if_name WAN network interface name, must stay valid
+ * until the end of the probe
+ * \param[in] if_addr ip v4 address for WAN interface
+ * \param[in] stun_host STUN server hostname
+ * \param[in] stun_port STUN server port
+ * \return 0 on success, -1 on error */
+int stun_probe_start(const char *if_name, const char *if_addr, const char *stun_host, unsigned short stun_port);
+
+/*! \brief is a STUN probe in progress ? */
+int stun_probe_active(void);
+
+/*! \brief add the sockets of the STUN probe to the select() set */
+void stun_probe_selectfds(fd_set *readset, int *max_fd);
+
+/*! \brief reduce timeout to the next retransmission or end of the probe */
+void stun_probe_gettimeout(struct timeval *timeout);
+
+/*! \brief receive the STUN responses and retransmit the requests
+ * \param[in] readset set returned by select()
+ * \param[out] ext_addr detected address
+ * \param[out] restrictive_nat 0=unrestricted, 1=some restriction
+ * \return 0 while the probe is in progress, 1 when it is finished and
+ * the result is available, -1 when it failed */
+int stun_probe_process(const fd_set *readset, struct in_addr *ext_addr, int *restrictive_nat);
+
+/*! \brief stop the STUN probe in progress */
+void stun_probe_cancel(void);
+
 #endif
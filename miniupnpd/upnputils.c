@@ -27,6 +27,7 @@
 #include "upnputils.h"
 #include "upnpglobalvars.h"
 #ifdef ENABLE_IPV6
+#include <ifaddrs.h>
 #include "getroute.h"
 #endif
 
@@ -106,6 +107,264 @@ set_non_blocking(int fd)
 	return 1;
 }
 
+/* Longest prefix match index of the LAN addresses used by
+ * get_lan_for_peer(). It is a multibit trie (4 bits per level) stored
+ * in an array : an IPv4 lookup visits at most 8 nodes, an IPv6 lookup
+ * at most 32. The prefixes not ending on a 4 bits boundary are expanded.
+ * It is built from lan_addrs at the first lookup and must be
+ * invalidated when lan_addrs or the LAN interface addresses change.
+ * The interface watcher invalidates it on changes, it is then kept
+ * LAN_INDEX_WATCHED_TTL seconds. Without the interface watcher it is
+ * built again every LAN_INDEX_TTL seconds. */
+#define LAN_INDEX_TTL	(2)
+#define LAN_INDEX_WATCHED_TTL	(300)
+#define LAN_TRIE_STRIDE	4
+#define LAN_TRIE_FANOUT	(1 << LAN_TRIE_STRIDE)
+
+struct lan_trie_node {
+	unsigned int child[LAN_TRIE_FANOUT];	/* 0 = no child (0 is the root) */
+	struct lan_addr_s * lan[LAN_TRIE_FANOUT];
+	unsigned char prefixlen[LAN_TRIE_FANOUT];	/* of the prefix in lan[] */
+};
+
+struct lan_trie {
+	struct lan_trie_node * nodes;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+static struct lan_trie lan_trie4;
+#ifdef ENABLE_IPV6
+static struct lan_trie lan_trie6;
+/* LAN by interface index */
+static struct lan_addr_s * * lan_by_index = NULL;
+static unsigned int lan_by_index_size = 0;
+#endif /* ENABLE_IPV6 */
+static time_t lan_index_time = 0;	/* 0 = not built */
+static time_t lan_index_ttl = LAN_INDEX_TTL;
+
+#define LAN_TRIE_NIBBLE(key, i)	(((key)[(i) >> 1] >> (((i) & 1) ? 0 : 4)) & 0x0f)
+
+static void
+lan_trie_free(struct lan_trie * trie)
+{
+	free(trie->nodes);
+	memset(trie, 0, sizeof(struct lan_trie));
+}
+
+/* return the index of the new node, 0 on memory allocation failure */
+static unsigned int
+lan_trie_new_node(struct lan_trie * trie)
+{
+	if(trie->count >= trie->alloc) {
+		struct lan_trie_node * tmp;
+		unsigned int alloc = trie->alloc ? trie->alloc * 2 : 16;
+		tmp = realloc(trie->nodes, alloc * sizeof(struct lan_trie_node));
+		if(tmp == NULL)
+			return 0;
+		memset(tmp + trie->alloc, 0,
+		       (alloc - trie->alloc) * sizeof(struct lan_trie_node));
+		trie->nodes = tmp;
+		trie->alloc = alloc;
+	}
+	return trie->count++;
+}
+
+/* insert the prefix. When the same prefix is inserted twice,
+ * the first one is kept.
+ * return -1 on memory allocation failure */
+static int
+lan_trie_insert(struct lan_trie * trie, const unsigned char * key,
+                unsigned int prefixlen, struct lan_addr_s * lan)
+{
+	unsigned int n = 0;
+	unsigned int i = 0;	/* bits */
+	unsigned int first, last, c;
+	struct lan_trie_node * node;
+
+	if(trie->count == 0) {
+		lan_trie_new_node(trie);	/* root */
+		if(trie->count == 0)
+			return -1;
+	}
+	while(prefixlen - i > LAN_TRIE_STRIDE) {
+		c = LAN_TRIE_NIBBLE(key, i / LAN_TRIE_STRIDE);
+		if(trie->nodes[n].child[c] == 0) {
+			unsigned int child = lan_trie_new_node(trie);
+			if(child == 0)
+				return -1;
+			trie->nodes[n].child[c] = child;
+		}
+		n = trie->nodes[n].child[c];
+		i += LAN_TRIE_STRIDE;
+	}
+	/* the prefix ends in this node : fill all the slots it covers */
+	node = &trie->nodes[n];
+	if(prefixlen == i) {
+		first = 0;	/* only for a zero length prefix */
+		last = LAN_TRIE_FANOUT - 1;
+	} else {
+		first = LAN_TRIE_NIBBLE(key, i / LAN_TRIE_STRIDE)
+		        & ~((1u << (LAN_TRIE_STRIDE - (prefixlen - i))) - 1);
+		last = first + (1u << (LAN_TRIE_STRIDE - (prefixlen - i))) - 1;
+	}
+	for(c = first; c <= last; c++) {
+		if(node->lan[c] == NULL || node->prefixlen[c] < prefixlen) {
+			node->lan[c] = lan;
+			node->prefixlen[c] = (unsigned char)prefixlen;
+		}
+	}
+	return 0;
+}
+
+static struct lan_addr_s *
+lan_trie_lookup(const struct lan_trie * trie, const unsigned char * key,
+                unsigned int bits)
+{
+	struct lan_addr_s * lan = NULL;
+	const struct lan_trie_node * node;
+	unsigned int n = 0;
+	unsigned int i, c;
+
+	if(trie->count == 0)
+		return NULL;
+	for(i = 0; i < bits / LAN_TRIE_STRIDE; i++) {
+		node = &trie->nodes[n];
+		c = LAN_TRIE_NIBBLE(key, i);
+		if(node->lan[c] != NULL)
+			lan = node->lan[c];
+		n = node->child[c];
+		if(n == 0)
+			break;
+	}
+	return lan;
+}
+
+/* number of leading 1 bits */
+static unsigned int
+mask_to_prefixlen(const unsigned char * mask, unsigned int len)
+{
+	unsigned int i, n = 0;
+
+	for(i = 0; i < len; i++) {
+		unsigned char m = mask[i];
+		while(m & 0x80) {
+			n++;
+			m <<= 1;
+		}
+		if(mask[i] != 0xff)
+			break;
+	}
+	return n;
+}
+
+#ifdef ENABLE_IPV6
+/* add the global and ULA IPv6 prefixes of the LAN interfaces.
+ * link local addresses are looked up by scope id */
+static int
+build_lan_index6(void)
+{
+	struct ifaddrs * ifap;
+	struct ifaddrs * ife;
+	struct lan_addr_s * lan_addr;
+	const struct in6_addr * addr6;
+	struct in6_addr prefix;
+	unsigned int prefixlen, i;
+	int r = 0;
+
+	for(lan_addr = lan_addrs.lh_first; lan_addr != NULL; lan_addr = lan_addr->list.le_next) {
+		if(lan_addr->index >= lan_by_index_size)
+			lan_by_index_size = lan_addr->index + 1;
+	}
+	if(lan_by_index_size > 0) {
+		lan_by_index = calloc(lan_by_index_size, sizeof(struct lan_addr_s *));
+		if(lan_by_index == NULL) {
+			lan_by_index_size = 0;
+			return -1;
+		}
+	}
+	for(lan_addr = lan_addrs.lh_first; lan_addr != NULL; lan_addr = lan_addr->list.le_next) {
+		if(lan_addr->index > 0 && lan_by_index[lan_addr->index] == NULL)
+			lan_by_index[lan_addr->index] = lan_addr;
+	}
+
+	if(getifaddrs(&ifap) < 0) {
+		syslog(LOG_ERR, "getifaddrs: %m");
+		return 0;	/* use the routing table */
+	}
+	for(lan_addr = lan_addrs.lh_first; lan_addr != NULL && r >= 0; lan_addr = lan_addr->list.le_next) {
+		if(lan_addr->ifname[0] == '\0')
+			continue;
+		for(ife = ifap; ife != NULL; ife = ife->ifa_next) {
+			if(ife->ifa_addr == NULL || ife->ifa_netmask == NULL
+			   || ife->ifa_addr->sa_family != AF_INET6
+			   || strcmp(ife->ifa_name, lan_addr->ifname) != 0)
+				continue;
+			addr6 = &((struct sockaddr_in6 *)ife->ifa_addr)->sin6_addr;
+			if(IN6_IS_ADDR_LINKLOCAL(addr6) || IN6_IS_ADDR_LOOPBACK(addr6))
+				continue;
+			prefixlen = mask_to_prefixlen(
+			    ((struct sockaddr_in6 *)ife->ifa_netmask)->sin6_addr.s6_addr, 16);
+			memset(&prefix, 0, sizeof(prefix));
+			for(i = 0; i < 16; i++)
+				prefix.s6_addr[i] = addr6->s6_addr[i]
+				  & ((struct sockaddr_in6 *)ife->ifa_netmask)->sin6_addr.s6_addr[i];
+			if(lan_trie_insert(&lan_trie6, prefix.s6_addr, prefixlen, lan_addr) < 0) {
+				r = -1;
+				break;
+			}
+		}
+	}
+	freeifaddrs(ifap);
+	return r;
+}
+#endif /* ENABLE_IPV6 */
+
+static int
+build_lan_index(void)
+{
+	struct lan_addr_s * lan_addr;
+	struct in_addr prefix;
+
+	for(lan_addr = lan_addrs.lh_first; lan_addr != NULL; lan_addr = lan_addr->list.le_next) {
+		prefix.s_addr = lan_addr->addr.s_addr & lan_addr->mask.s_addr;
+		if(lan_trie_insert(&lan_trie4, (const unsigned char *)&prefix.s_addr,
+		                   mask_to_prefixlen((const unsigned char *)&lan_addr->mask.s_addr, 4),
+		                   lan_addr) < 0)
+			goto error;
+	}
+#ifdef ENABLE_IPV6
+	if(build_lan_index6() < 0)
+		goto error;
+#endif /* ENABLE_IPV6 */
+	lan_index_time = upnp_time();
+	return 0;
+error:
+	syslog(LOG_ERR, "%s: failed to build the LAN index", "get_lan_for_peer()");
+	invalidate_lan_index();
+	return -1;
+}
+
+void
+invalidate_lan_index(void)
+{
+	lan_trie_free(&lan_trie4);
+#ifdef ENABLE_IPV6
+	lan_trie_free(&lan_trie6);
+	free(lan_by_index);
+	lan_by_index = NULL;
+	lan_by_index_size = 0;
+#endif /* ENABLE_IPV6 */
+	lan_index_time = 0;
+}
+
+void
+lan_index_set_watched(int watched)
+{
+	lan_index_ttl = watched ? LAN_INDEX_WATCHED_TTL : LAN_INDEX_TTL;
+	invalidate_lan_index();
+}
+
 struct lan_addr_s *
 get_lan_for_peer(const struct sockaddr * peer)
 {
@@ -114,22 +373,21 @@ get_lan_for_peer(const struct sockaddr * peer)
 	char dbg_str[64];
 #endif /* DEBUG */
 
+	if(lan_index_time != 0) {
+		time_t now = upnp_time();
+		/* the clock may go backward */
+		if(now < lan_index_time || now - lan_index_time >= lan_index_ttl)
+			invalidate_lan_index();
+	}
+	if(lan_index_time == 0 && build_lan_index() < 0)
+		return NULL;
 #ifdef ENABLE_IPV6
 	if(peer->sa_family == AF_INET6)
 	{
-		struct sockaddr_in6 * peer6 = (struct sockaddr_in6 *)peer;
+		const struct sockaddr_in6 * peer6 = (const struct sockaddr_in6 *)peer;
 		if(IN6_IS_ADDR_V4MAPPED(&peer6->sin6_addr))
 		{
-			struct in_addr peer_addr;
-			memcpy(&peer_addr, &peer6->sin6_addr.s6_addr[12], 4);
-			for(lan_addr = lan_addrs.lh_first;
-			    lan_addr != NULL;
-			    lan_addr = lan_addr->list.le_next)
-			{
-				if( (peer_addr.s_addr & lan_addr->mask.s_addr)
-				   == (lan_addr->addr.s_addr & lan_addr->mask.s_addr))
-					break;
-			}
+			lan_addr = lan_trie_lookup(&lan_trie4, &peer6->sin6_addr.s6_addr[12], 32);
 		}
 		else
 		{
@@ -138,37 +396,26 @@ get_lan_for_peer(const struct sockaddr * peer)
 				index = (int)peer6->sin6_scope_id;
 			else
 			{
-				if(get_src_for_route_to(peer, NULL, NULL, &index) < 0)
+				lan_addr = lan_trie_lookup(&lan_trie6, peer6->sin6_addr.s6_addr, 128);
+				/* not in the prefix of a LAN interface :
+				 * use the routing table */
+				if(lan_addr == NULL
+				   && get_src_for_route_to(peer, NULL, NULL, &index) < 0)
 					return NULL;
 			}
-			syslog(LOG_DEBUG, "%s looking for LAN interface index=%d",
-			       "get_lan_for_peer()", index);
-			for(lan_addr = lan_addrs.lh_first;
-			    lan_addr != NULL;
-			    lan_addr = lan_addr->list.le_next)
-			{
-				syslog(LOG_DEBUG,
-				       "ifname=%s index=%u str=%s addr=%08x mask=%08x",
-				       lan_addr->ifname, lan_addr->index,
-				       lan_addr->str,
-				       ntohl(lan_addr->addr.s_addr),
-				       ntohl(lan_addr->mask.s_addr));
-				if(index == (int)lan_addr->index)
-					break;
+			if(lan_addr == NULL) {
+				syslog(LOG_DEBUG, "%s looking for LAN interface index=%d",
+				       "get_lan_for_peer()", index);
+				if(index > 0 && (unsigned int)index < lan_by_index_size)
+					lan_addr = lan_by_index[index];
 			}
 		}
 	}
 	else if(peer->sa_family == AF_INET)
 	{
 #endif /* ENABLE_IPV6 */
-		for(lan_addr = lan_addrs.lh_first;
-		    lan_addr != NULL;
-		    lan_addr = lan_addr->list.le_next)
-		{
-			if( (((const struct sockaddr_in *)peer)->sin_addr.s_addr & lan_addr->mask.s_addr)
-			   == (lan_addr->addr.s_addr & lan_addr->mask.s_addr))
-				break;
-		}
+		lan_addr = lan_trie_lookup(&lan_trie4,
+		    (const unsigned char *)&((const struct sockaddr_in *)peer)->sin_addr.s_addr, 32);
 #ifdef ENABLE_IPV6
 	}
 #endif /* ENABLE_IPV6 */
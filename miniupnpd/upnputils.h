@@ -36,6 +36,21 @@ set_non_blocking(int fd);
 struct lan_addr_s *
 get_lan_for_peer(const struct sockaddr * peer);
 
+/*! \brief forget the index used by get_lan_for_peer()
+ *
+ * The index is built again at the next get_lan_for_peer() call.
+ * To be called when lan_addrs or the LAN interface addresses change. */
+void
+invalidate_lan_index(void);
+
+/*! \brief set if the network interfaces are watched
+ *
+ * When the interfaces are watched (see ifacewatcher.h) the index is
+ * kept longer as invalidate_lan_index() is called on changes.
+ * \param[in] watched 1 if invalidate_lan_index() is called on changes */
+void
+lan_index_set_watched(int watched);
+
 /**
  * get the time for upnp (release expiration, etc.)
  * Similar to a monotonic time(NULL)